@@ -82,6 +82,9 @@ show_counters(array<unsigned,VYSMAW_MESSAGE_END + 1> &counters)
 	names[VYSMAW_MESSAGE_SIGNAL_BUFFER_STARVATION] = "signal-buffer-starvation";
 	names[VYSMAW_MESSAGE_SIGNAL_RECEIVE_FAILURE] = "signal-receive-failure";
 	names[VYSMAW_MESSAGE_RDMA_READ_FAILURE] = "rdma-read-failure";
+	names[VYSMAW_MESSAGE_BUFFER_POOL_PRESSURE] = "buffer-pool-pressure";
+	names[VYSMAW_MESSAGE_EXPIRED] = "expired";
+	names[VYSMAW_MESSAGE_SPECTRA_BATCH] = "spectra-batch";
 	names[VYSMAW_MESSAGE_END] = "end";
 
 	size_t max_name_len = 0;
@@ -96,6 +99,9 @@ show_counters(array<unsigned,VYSMAW_MESSAGE_END + 1> &counters)
 		VYSMAW_MESSAGE_SIGNAL_BUFFER_STARVATION,
 		VYSMAW_MESSAGE_SIGNAL_RECEIVE_FAILURE,
 		VYSMAW_MESSAGE_RDMA_READ_FAILURE,
+		VYSMAW_MESSAGE_BUFFER_POOL_PRESSURE,
+		VYSMAW_MESSAGE_EXPIRED,
+		VYSMAW_MESSAGE_SPECTRA_BATCH,
 		VYSMAW_MESSAGE_END
 	};
 
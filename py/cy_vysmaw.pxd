@@ -24,7 +24,28 @@ cdef class Configuration:
 
     cdef tuple start(self, unsigned num_filters,
                      vysmaw_spectrum_filter *filters,
-                     void **user_data)
+                     void **user_data,
+                     vysmaw_overflow_policy overflow_policy=*,
+                     unsigned overflow_sample_interval=*,
+                     uint64_t max_message_age=*,
+                     vysmaw_message_age_reference message_age_reference=*)
+
+    cdef tuple start_sharded(self, vysmaw_spectrum_filter filter,
+                             void *user_data, unsigned num_shards,
+                             vysmaw_shard_distribution distribution,
+                             vysmaw_overflow_policy overflow_policy=*,
+                             unsigned overflow_sample_interval=*,
+                             uint64_t max_message_age=*,
+                             vysmaw_message_age_reference
+                                 message_age_reference=*)
+
+    cdef tuple attach(self, unsigned num_filters,
+                      vysmaw_spectrum_filter *filters,
+                      void **user_data,
+                      vysmaw_overflow_policy overflow_policy=*,
+                      unsigned overflow_sample_interval=*,
+                      uint64_t max_message_age=*,
+                      vysmaw_message_age_reference message_age_reference=*)
 
 cdef class Handle:
     cdef vysmaw_handle _c_handle
@@ -32,20 +53,44 @@ cdef class Handle:
     @staticmethod
     cdef Handle wrap(vysmaw_handle h)
 
+cdef class SpectrumSelection:
+    cdef vysmaw_spectrum_selection *_c_selection
+
 cdef class Consumer:
     cdef vysmaw_consumer *_c_consumer
+    cdef vysmaw_message **_c_batch
+    cdef unsigned _c_batch_capacity
+    cdef SpectrumSelection _selection
 
     cpdef clear(self)
 
     cdef void set_filter(self, vysmaw_spectrum_filter spectrum_filter,
                          void *user_data)
 
+    cdef void set_batch_filter(self,
+                               vysmaw_spectrum_batch_filter spectrum_filter,
+                               void *user_data)
+
+    cdef void set_overflow_policy(self, vysmaw_overflow_policy policy,
+                                  unsigned sample_interval)
+
+    cdef void set_max_message_age(self, uint64_t max_age,
+                                  vysmaw_message_age_reference reference)
+
+    cdef void set_callback(self, vysmaw_message_callback callback,
+                           void *callback_data, uint64_t time_limit)
+
     cpdef pop(self)
 
     cpdef timeout_pop(self, uint64_t timeout)
 
     cpdef try_pop(self)
 
+    cpdef unsigned pop_batch(self, list msgs, uint64_t timeout)
+
+    cdef unsigned pop_batch_c(self, vysmaw_message **msgs, unsigned max,
+                              uint64_t timeout) nogil
+
     cdef vysmaw_message_queue queue(self)
 
 cdef class DataInfo:
@@ -106,6 +106,108 @@ cdef class Configuration:
         self._c_configuration.signal_multicast_address[avalue_len] = b'\0'
         return
 
+    @property
+    def shm_name(self):
+        return (<bytes>self._c_configuration.shm_name).decode()
+
+    @shm_name.setter
+    def shm_name(self, value):
+        avalue = _ustring(value).encode('ascii')
+        avalue_len = len(avalue)
+        max_len = sizeof(self._c_configuration.shm_name)
+        if avalue_len >= max_len:
+            raise ValueError("Shared memory object name string too long")
+        strncpy(self._c_configuration.shm_name, avalue, avalue_len)
+        self._c_configuration.shm_name[avalue_len] = b'\0'
+        return
+
+    @property
+    def selection_baselines(self):
+        return (<bytes>self._c_configuration.selection_baselines).decode()
+
+    @selection_baselines.setter
+    def selection_baselines(self, value):
+        avalue = _ustring(value).encode('ascii')
+        avalue_len = len(avalue)
+        max_len = sizeof(self._c_configuration.selection_baselines)
+        if avalue_len >= max_len:
+            raise ValueError("Baseline selection string too long")
+        strncpy(self._c_configuration.selection_baselines, avalue, avalue_len)
+        self._c_configuration.selection_baselines[avalue_len] = b'\0'
+        return
+
+    @property
+    def selection_spectral_windows(self):
+        return (<bytes>self._c_configuration.selection_spectral_windows)\
+            .decode()
+
+    @selection_spectral_windows.setter
+    def selection_spectral_windows(self, value):
+        avalue = _ustring(value).encode('ascii')
+        avalue_len = len(avalue)
+        max_len = sizeof(self._c_configuration.selection_spectral_windows)
+        if avalue_len >= max_len:
+            raise ValueError("Spectral window selection string too long")
+        strncpy(self._c_configuration.selection_spectral_windows, avalue,
+                avalue_len)
+        self._c_configuration.selection_spectral_windows[avalue_len] = b'\0'
+        return
+
+    @property
+    def selection_stokes(self):
+        return (<bytes>self._c_configuration.selection_stokes).decode()
+
+    @selection_stokes.setter
+    def selection_stokes(self, value):
+        avalue = _ustring(value).encode('ascii')
+        avalue_len = len(avalue)
+        max_len = sizeof(self._c_configuration.selection_stokes)
+        if avalue_len >= max_len:
+            raise ValueError("Stokes selection string too long")
+        strncpy(self._c_configuration.selection_stokes, avalue, avalue_len)
+        self._c_configuration.selection_stokes[avalue_len] = b'\0'
+        return
+
+    @property
+    def selection_start_time(self):
+        return self._c_configuration.selection_start_time
+
+    @selection_start_time.setter
+    def selection_start_time(self, uint64_t value):
+        self._c_configuration.selection_start_time = value
+
+    @property
+    def selection_end_time(self):
+        return self._c_configuration.selection_end_time
+
+    @selection_end_time.setter
+    def selection_end_time(self, uint64_t value):
+        self._c_configuration.selection_end_time = value
+
+    @property
+    def shm_buffer_pool_size(self):
+        return self._c_configuration.shm_buffer_pool_size
+
+    @shm_buffer_pool_size.setter
+    def shm_buffer_pool_size(self, size_t value):
+        self._c_configuration.shm_buffer_pool_size = value
+
+    @property
+    def shm_max_clients(self):
+        return self._c_configuration.shm_max_clients
+
+    @shm_max_clients.setter
+    def shm_max_clients(self, unsigned value):
+        self._c_configuration.shm_max_clients = value
+
+    @property
+    def shm_client_queue_length(self):
+        return self._c_configuration.shm_client_queue_length
+
+    @shm_client_queue_length.setter
+    def shm_client_queue_length(self, unsigned value):
+        self._c_configuration.shm_client_queue_length = value
+
     @property
     def spectrum_buffer_pool_size(self):
         return self._c_configuration.spectrum_buffer_pool_size
@@ -114,6 +216,22 @@ cdef class Configuration:
     def spectrum_buffer_pool_size(self, unsigned value):
         self._c_configuration.spectrum_buffer_pool_size = value
 
+    @property
+    def spectrum_buffer_pool_max_size(self):
+        return self._c_configuration.spectrum_buffer_pool_max_size
+
+    @spectrum_buffer_pool_max_size.setter
+    def spectrum_buffer_pool_max_size(self, unsigned value):
+        self._c_configuration.spectrum_buffer_pool_max_size = value
+
+    @property
+    def spectrum_buffer_pool_idle_release_sec(self):
+        return self._c_configuration.spectrum_buffer_pool_idle_release_sec
+
+    @spectrum_buffer_pool_idle_release_sec.setter
+    def spectrum_buffer_pool_idle_release_sec(self, double value):
+        self._c_configuration.spectrum_buffer_pool_idle_release_sec = value
+
     @property
     def single_spectrum_buffer_pool(self):
         return self._c_configuration.single_spectrum_buffer_pool
@@ -130,6 +248,22 @@ cdef class Configuration:
     def max_spectrum_buffer_size(self, unsigned value):
         self._c_configuration.max_spectrum_buffer_size = value
 
+    @property
+    def spectrum_buffer_magazine_size(self):
+        return self._c_configuration.spectrum_buffer_magazine_size
+
+    @spectrum_buffer_magazine_size.setter
+    def spectrum_buffer_magazine_size(self, unsigned value):
+        self._c_configuration.spectrum_buffer_magazine_size = value
+
+    @property
+    def spectrum_buffer_alignment(self):
+        return self._c_configuration.spectrum_buffer_alignment
+
+    @spectrum_buffer_alignment.setter
+    def spectrum_buffer_alignment(self, unsigned value):
+        self._c_configuration.spectrum_buffer_alignment = value
+
     @property
     def signal_message_pool_size(self):
         return self._c_configuration.signal_message_pool_size
@@ -138,6 +272,22 @@ cdef class Configuration:
     def signal_message_pool_size(self, unsigned value):
         self._c_configuration.signal_message_pool_size = value
 
+    @property
+    def buffer_pool_huge_page_size(self):
+        return self._c_configuration.buffer_pool_huge_page_size
+
+    @buffer_pool_huge_page_size.setter
+    def buffer_pool_huge_page_size(self, unsigned value):
+        self._c_configuration.buffer_pool_huge_page_size = value
+
+    @property
+    def numa_node(self):
+        return self._c_configuration.numa_node
+
+    @numa_node.setter
+    def numa_node(self, int value):
+        self._c_configuration.numa_node = value
+
     @property
     def eager_connect(self):
         return self._c_configuration.eager_connect
@@ -186,6 +336,22 @@ cdef class Configuration:
     def max_starvation_latency(self, unsigned value):
         self._c_configuration.max_starvation_latency = value
 
+    @property
+    def spectrum_buffer_pool_pressure_threshold(self):
+        return self._c_configuration.spectrum_buffer_pool_pressure_threshold
+
+    @spectrum_buffer_pool_pressure_threshold.setter
+    def spectrum_buffer_pool_pressure_threshold(self, double value):
+        self._c_configuration.spectrum_buffer_pool_pressure_threshold = value
+
+    @property
+    def spectrum_buffer_pool_pressure_hysteresis(self):
+        return self._c_configuration.spectrum_buffer_pool_pressure_hysteresis
+
+    @spectrum_buffer_pool_pressure_hysteresis.setter
+    def spectrum_buffer_pool_pressure_hysteresis(self, double value):
+        self._c_configuration.spectrum_buffer_pool_pressure_hysteresis = value
+
     @property
     def resolve_route_timeout_ms(self):
         return self._c_configuration.resolve_route_timeout_ms
@@ -252,27 +418,96 @@ cdef class Configuration:
 
     cdef tuple start(self, unsigned num_filters,
                      vysmaw_spectrum_filter *filters,
-                     void **user_data):
+                     void **user_data,
+                     vysmaw_overflow_policy overflow_policy=
+                         VYSMAW_OVERFLOW_DROP_NEWEST,
+                     unsigned overflow_sample_interval=0,
+                     uint64_t max_message_age=0,
+                     vysmaw_message_age_reference message_age_reference=
+                         VYSMAW_AGE_FROM_TIMESTAMP):
         if filters is NULL or num_filters == 0:
             raise ValueError("At least one filter is required to start vysmaw")
-        consumers = [Consumer() for i in range(num_filters)]
-        cdef vysmaw_consumer **cp_array = <vysmaw_consumer **>malloc(
-            num_filters * sizeof(vysmaw_consumer *))
-        cdef void *udata
-        cdef Consumer c
-        for i in range(num_filters):
-            if user_data is not NULL:
-                udata = user_data[i]
-            else:
-                udata = NULL
-            c = consumers[i]
-            c.set_filter(filters[i], udata)
-            cp_array[i] = c._c_consumer
+        consumers = new_consumers(num_filters, filters, user_data,
+                                  overflow_policy, overflow_sample_interval,
+                                  max_message_age, message_age_reference)
+        cdef vysmaw_consumer **cp_array = consumer_array(consumers)
         handle = Handle.wrap(vysmaw_start(
             self._c_configuration, num_filters, cp_array))
         free(cp_array)
         return (handle, consumers)
 
+    # attach to an exporting vysmaw instance (see export()), rather than
+    # receiving spectra directly
+    cdef tuple attach(self, unsigned num_filters,
+                      vysmaw_spectrum_filter *filters,
+                      void **user_data,
+                      vysmaw_overflow_policy overflow_policy=
+                          VYSMAW_OVERFLOW_DROP_NEWEST,
+                      unsigned overflow_sample_interval=0,
+                      uint64_t max_message_age=0,
+                      vysmaw_message_age_reference message_age_reference=
+                          VYSMAW_AGE_FROM_TIMESTAMP):
+        if filters is NULL or num_filters == 0:
+            raise ValueError("At least one filter is required to attach "
+                             "to vysmaw")
+        consumers = new_consumers(num_filters, filters, user_data,
+                                  overflow_policy, overflow_sample_interval,
+                                  max_message_age, message_age_reference)
+        cdef vysmaw_consumer **cp_array = consumer_array(consumers)
+        handle = Handle.wrap(vysmaw_attach(
+            self._c_configuration, num_filters, cp_array))
+        free(cp_array)
+        return (handle, consumers)
+
+    # export the spectra delivered to 'consumer', which must belong to a
+    # handle started with this configuration, to attached processes; returns
+    # (code, syserr_desc) once the consumer's end message has been received,
+    # or immediately, with the consumer's queue untouched, if the shared memory
+    # object could not be created
+    def export(self, Consumer consumer):
+        cdef vysmaw_result result
+        cdef vysmaw_message_queue queue = consumer.queue()
+        with nogil:
+            result = vysmaw_export(self._c_configuration, queue)
+        desc = None
+        if result.syserr_desc is not NULL:
+            desc = (<bytes>result.syserr_desc).decode()
+            free(result.syserr_desc)
+        return (result.code, desc)
+
+    # start a single sharded consumer; returns a Consumer for every shard
+    cdef tuple start_sharded(self, vysmaw_spectrum_filter filter,
+                             void *user_data, unsigned num_shards,
+                             vysmaw_shard_distribution distribution,
+                             vysmaw_overflow_policy overflow_policy=
+                                 VYSMAW_OVERFLOW_DROP_NEWEST,
+                             unsigned overflow_sample_interval=0,
+                             uint64_t max_message_age=0,
+                             vysmaw_message_age_reference
+                                 message_age_reference=
+                                 VYSMAW_AGE_FROM_TIMESTAMP):
+        if filter is NULL or num_shards == 0:
+            raise ValueError("A filter and at least one shard are required "
+                             "to start vysmaw")
+        consumers = [Consumer() for i in range(num_shards)]
+        cdef vysmaw_message_queue *queues = <vysmaw_message_queue *>malloc(
+            num_shards * sizeof(vysmaw_message_queue))
+        cdef Consumer c = consumers[0]
+        c.set_filter(filter, user_data)
+        c.set_overflow_policy(overflow_policy, overflow_sample_interval)
+        c.set_max_message_age(max_message_age, message_age_reference)
+        c._c_consumer.num_shards = num_shards
+        c._c_consumer.shard_distribution = distribution
+        c._c_consumer.shard_queues = queues
+        handle = Handle.wrap(vysmaw_start(self._c_configuration, 1,
+                                          &c._c_consumer))
+        c._c_consumer.shard_queues = NULL
+        for i in range(num_shards):
+            c = consumers[i]
+            c._c_consumer.queue = queues[i]
+        free(queues)
+        return (handle, consumers)
+
     def start_py(self, filters):
         __logger.warning("'start_py' function is for testing only, "
                          "and should not be used in production code")
@@ -290,6 +525,59 @@ cdef class Configuration:
         free(cp_array)
         return (handle, consumers)
 
+    # start a consumer for every SpectrumSelection in 'selections'; spectra are
+    # selected by vysmaw itself, with no filter function
+    def start_selections(self, selections):
+        if len(selections) == 0:
+            raise ValueError("At least one selection is required to start "
+                             "vysmaw")
+        consumers = [Consumer() for s in selections]
+        for c, s in zip(consumers, selections):
+            c.set_selection(s)
+        cdef vysmaw_consumer **cp_array = consumer_array(consumers)
+        handle = Handle.wrap(vysmaw_start(
+            self._c_configuration, len(consumers), cp_array))
+        free(cp_array)
+        return (handle, consumers)
+
+cdef list new_consumers(unsigned num_filters, vysmaw_spectrum_filter *filters,
+                        void **user_data,
+                        vysmaw_overflow_policy overflow_policy,
+                        unsigned overflow_sample_interval,
+                        uint64_t max_message_age,
+                        vysmaw_message_age_reference message_age_reference):
+    consumers = [Consumer() for i in range(num_filters)]
+    cdef void *udata
+    cdef Consumer c
+    for i in range(num_filters):
+        if user_data is not NULL:
+            udata = user_data[i]
+        else:
+            udata = NULL
+        c = consumers[i]
+        c.set_filter(filters[i], udata)
+        c.set_overflow_policy(overflow_policy, overflow_sample_interval)
+        c.set_max_message_age(max_message_age, message_age_reference)
+    return consumers
+
+# the caller must free() the result
+cdef vysmaw_consumer **consumer_array(list consumers):
+    cdef vysmaw_consumer **result = <vysmaw_consumer **>malloc(
+        len(consumers) * sizeof(vysmaw_consumer *))
+    cdef Consumer c
+    for i in range(len(consumers)):
+        c = consumers[i]
+        result[i] = c._c_consumer
+    return result
+
+cdef dict buffer_pool_status_dict(vysmaw_buffer_pool_status *status):
+    return dict(
+        buffer_size=status[0].buffer_size,
+        num_buffers=status[0].num_buffers,
+        num_free=status[0].num_free,
+        num_in_use=status[0].num_in_use,
+        max_in_use=status[0].max_in_use)
+
 cdef class Handle:
 
     def __cinit__(self):
@@ -312,12 +600,105 @@ cdef class Handle:
             self._c_handle = NULL
         return
 
+    def spectrum_buffer_pool_status(self):
+        assert self._c_handle is not NULL
+        cdef vysmaw_buffer_pool_status status[32]
+        cdef unsigned n = vysmaw_spectrum_buffer_pool_status(
+            self._c_handle, status, 32)
+        return [buffer_pool_status_dict(&status[i]) for i in range(min(n, 32))]
+
+    def signal_buffer_pool_status(self):
+        assert self._c_handle is not NULL
+        cdef vysmaw_buffer_pool_status status
+        if vysmaw_signal_buffer_pool_status(self._c_handle, &status):
+            return buffer_pool_status_dict(&status)
+        return None
+
+# declarative spectrum selection, evaluated by vysmaw without calling back into
+# Python (see vysmaw_spectrum_selection in vysmaw.h); selects every spectrum,
+# unless 'config' is given, in which case it is set from the 'selection_*'
+# properties of 'config'
+cdef class SpectrumSelection:
+
+    def __cinit__(self, Configuration config=None):
+        if config is None:
+            self._c_selection = vysmaw_spectrum_selection_new(NULL)
+        else:
+            self._c_selection = \
+                vysmaw_spectrum_selection_new(config._c_configuration)
+        if self._c_selection is NULL:
+            raise ValueError("Invalid spectrum selection configuration")
+        return
+
+    def __dealloc__(self):
+        if self._c_selection is not NULL:
+            vysmaw_spectrum_selection_free(self._c_selection)
+            self._c_selection = NULL
+        return
+
+    # 'baselines' is a sequence of station pairs
+    def set_baselines(self, baselines):
+        cdef unsigned n = len(baselines)
+        cdef uint8_t (*stations)[2] = \
+            <uint8_t (*)[2]>malloc(max(n, 1) * sizeof(uint8_t[2]))
+        for i, (s0, s1) in enumerate(baselines):
+            stations[i][0] = s0
+            stations[i][1] = s1
+        vysmaw_spectrum_selection_set_baselines(self._c_selection, stations, n)
+        free(stations)
+        return
+
+    def set_spectral_windows(self, indexes):
+        cdef bytes c_indexes = bytes(bytearray(indexes))
+        vysmaw_spectrum_selection_set_spectral_windows(
+            self._c_selection, <const uint8_t *><char *>c_indexes,
+            len(c_indexes))
+        return
+
+    def set_stokes(self, indexes):
+        cdef bytes c_indexes = bytes(bytearray(indexes))
+        vysmaw_spectrum_selection_set_stokes(
+            self._c_selection, <const uint8_t *><char *>c_indexes,
+            len(c_indexes))
+        return
+
+    @property
+    def start_time(self):
+        return self._c_selection[0].start_time
+
+    @start_time.setter
+    def start_time(self, uint64_t value):
+        self._c_selection[0].start_time = value
+
+    @property
+    def end_time(self):
+        return self._c_selection[0].end_time
+
+    @end_time.setter
+    def end_time(self, uint64_t value):
+        self._c_selection[0].end_time = value
+
 cdef class Consumer:
 
     def __cinit__(self):
         self._c_consumer = <vysmaw_consumer *>malloc(sizeof(vysmaw_consumer))
         self._c_consumer.filter = NULL
         self._c_consumer.filter_data = NULL
+        self._c_consumer.batch_filter = NULL
+        self._c_consumer.selection = NULL
+        self._c_consumer.num_shards = 0
+        self._c_consumer.shard_distribution = VYSMAW_SHARD_ROUND_ROBIN
+        self._c_consumer.shard_queues = NULL
+        self._c_consumer.overflow_policy = VYSMAW_OVERFLOW_DROP_NEWEST
+        self._c_consumer.overflow_sample_interval = 0
+        self._c_consumer.max_message_age = 0
+        self._c_consumer.message_age_reference = VYSMAW_AGE_FROM_TIMESTAMP
+        self._c_consumer.callback = NULL
+        self._c_consumer.callback_data = NULL
+        self._c_consumer.callback_time_limit = 0
+        self._c_consumer.batch_spectra = False
+        self._c_batch = NULL
+        self._c_batch_capacity = 0
         return
 
     def __dealloc__(self):
@@ -328,6 +709,10 @@ cdef class Consumer:
         if self._c_consumer is not NULL:
             free(self._c_consumer)
             self._c_consumer = NULL
+        if self._c_batch is not NULL:
+            free(self._c_batch)
+            self._c_batch = NULL
+            self._c_batch_capacity = 0
         return
 
     def set_py_filter(self, spectrum_filter):
@@ -343,6 +728,70 @@ cdef class Consumer:
             self._c_consumer[0].filter_data = user_data
         return
 
+    # filter the spectra of many signal messages per call (see
+    # vysmaw_spectrum_batch_filter in vysmaw.h); used instead of any filter
+    # set by set_filter() or set_py_filter()
+    cdef void set_batch_filter(self,
+                               vysmaw_spectrum_batch_filter spectrum_filter,
+                               void *user_data):
+        if spectrum_filter is not NULL:
+            self._c_consumer[0].batch_filter = spectrum_filter
+            self._c_consumer[0].filter_data = user_data
+        return
+
+
+    # select spectra with 'selection' (a SpectrumSelection), in addition to any
+    # filter; with no filter, only 'selection' applies. The selection is
+    # copied when the consumer is started.
+    def set_selection(self, SpectrumSelection selection):
+        self._selection = selection
+        if selection is not None:
+            self._c_consumer[0].selection = selection._c_selection
+        else:
+            self._c_consumer[0].selection = NULL
+        return
+
+    cdef void set_overflow_policy(self, vysmaw_overflow_policy policy,
+                                  unsigned sample_interval):
+        self._c_consumer[0].overflow_policy = policy
+        self._c_consumer[0].overflow_sample_interval = sample_interval
+        return
+
+    cdef void set_max_message_age(self, uint64_t max_age,
+                                  vysmaw_message_age_reference reference):
+        self._c_consumer[0].max_message_age = max_age
+        self._c_consumer[0].message_age_reference = reference
+        return
+
+    # deliver spectrum messages to 'callback' on a vysmaw thread, rather than
+    # through the queue; 'callback' must be a nogil C function (see
+    # vysmaw_message_callback in vysmaw.h), and must be set before the
+    # consumer is started
+    cdef void set_callback(self, vysmaw_message_callback callback,
+                           void *callback_data, uint64_t time_limit):
+        self._c_consumer[0].callback = callback
+        self._c_consumer[0].callback_data = callback_data
+        self._c_consumer[0].callback_time_limit = time_limit
+        return
+
+    # receive the spectra selected from each signal message in a single
+    # SpectraBatchMessage; must be set before the consumer is started
+    def set_batch_spectra(self, bool batch_spectra):
+        self._c_consumer[0].batch_spectra = batch_spectra
+        return
+
+    def status(self):
+        assert self._c_consumer is not NULL
+        cdef vysmaw_message_queue_status status
+        vysmaw_message_queue_status(self._c_consumer[0].queue, &status)
+        return dict(
+            depth=status.depth,
+            num_dropped_newest=status.num_dropped_newest,
+            num_dropped_oldest=status.num_dropped_oldest,
+            num_sampled_out=status.num_sampled_out,
+            num_expired=status.num_expired,
+            num_callback_overruns=status.num_callback_overruns,
+            max_callback_time=status.max_callback_time)
 
     def test_end(self, message):
         if isinstance(message, EndMessage):
@@ -382,6 +831,45 @@ cdef class Consumer:
         self.test_end(result)
         return result
 
+    # fill 'msgs' with up to len(msgs) messages, waiting at most 'timeout'
+    # microseconds for the first; returns the number of messages
+    cpdef unsigned pop_batch(self, list msgs, uint64_t timeout):
+        assert self._c_consumer is not NULL
+        cdef unsigned max = len(msgs)
+        cdef unsigned n
+        cdef vysmaw_message **batch
+        if max > self._c_batch_capacity:
+            # on failure, the old array remains owned by, and is freed with,
+            # this Consumer
+            batch = <vysmaw_message **>realloc(
+                self._c_batch, max * sizeof(vysmaw_message *))
+            if batch is NULL:
+                raise MemoryError()
+            self._c_batch = batch
+            self._c_batch_capacity = max
+        with nogil:
+            n = self.pop_batch_c(self._c_batch, max, timeout)
+        for i in range(n):
+            msgs[i] = Message.wrap(self._c_batch[i])
+        if n > 0:
+            self.test_end(msgs[n - 1])
+        return n
+
+    cdef unsigned pop_batch_c(self, vysmaw_message **msgs, unsigned max,
+                              uint64_t timeout) nogil:
+        return vysmaw_message_queue_pop_batch(
+            self._c_consumer[0].queue, msgs, max, timeout)
+
+    # file descriptor that becomes readable when messages are pending, for use
+    # with select, selectors and asyncio; pop messages until none remain after
+    # every notification
+    def fileno(self):
+        assert self._c_consumer is not NULL
+        cdef int fd = vysmaw_message_queue_fd(self._c_consumer[0].queue)
+        if fd < 0:
+            raise OSError("Failed to create message queue file descriptor")
+        return fd
+
     cdef vysmaw_message_queue queue(self):
         return self._c_consumer[0].queue
 
@@ -467,6 +955,12 @@ cdef class Message:
             result = SignalBufferStarvationMessage()
         elif msgtype == VYSMAW_MESSAGE_RDMA_READ_FAILURE:
             result = RDMAReceiveFailureMessage()
+        elif msgtype == VYSMAW_MESSAGE_BUFFER_POOL_PRESSURE:
+            result = BufferPoolPressureMessage()
+        elif msgtype == VYSMAW_MESSAGE_EXPIRED:
+            result = ExpiredMessage()
+        elif msgtype == VYSMAW_MESSAGE_SPECTRA_BATCH:
+            result = SpectraBatchMessage()
         else: # msgtype == VYSMAW_MESSAGE_END
             result = EndMessage()
         result._c_message = msg
@@ -478,6 +972,25 @@ cdef class Message:
             self._c_message = NULL
         return
 
+    # unref all messages in 'msgs' (e.g, those filled by Consumer.pop_batch())
+    # at once
+    @staticmethod
+    def unref_batch(list msgs):
+        cdef vysmaw_message **c_msgs = <vysmaw_message **>malloc(
+            len(msgs) * sizeof(vysmaw_message *))
+        cdef unsigned n = 0
+        cdef Message m
+        for msg in msgs:
+            m = msg
+            if m is not None and m._c_message is not NULL:
+                c_msgs[n] = m._c_message
+                m._c_message = NULL
+                n += 1
+        with nogil:
+            vysmaw_message_unref_batch(c_msgs, n)
+        free(c_msgs)
+        return
+
 cdef class ValidBufferMessage(Message):
 
     def __cinit__(self):
@@ -554,6 +1067,61 @@ cdef class RDMAReceiveFailureMessage(Message):
     def rdma_read_status(self):
         return (<bytes>self._c_message[0].content.rdma_read_status)
 
+cdef class BufferPoolPressureMessage(Message):
+
+    def __str__(self):
+        return show_properties(self, BufferPoolPressureMessage)
+
+    @property
+    def high(self):
+        return self._c_message[0].content.pool_pressure.high
+
+    @property
+    def status(self):
+        return buffer_pool_status_dict(
+            &self._c_message[0].content.pool_pressure.status)
+
+cdef class ExpiredMessage(Message):
+
+    def __str__(self):
+        return show_properties(self, ExpiredMessage)
+
+    @property
+    def num_expired(self):
+        return self._c_message[0].content.num_expired
+
+cdef class SpectraBatchMessage(Message):
+
+    def __str__(self):
+        return show_properties(self, SpectraBatchMessage)
+
+    @property
+    def num_spectra(self):
+        return self._c_message[0].content.spectra_batch.num_spectra
+
+    @property
+    def infos(self):
+        cdef message_spectra_batch *batch = \
+            &self._c_message[0].content.spectra_batch
+        return [DataInfo.wrap(<vysmaw_data_info *>&batch.infos[i])
+                for i in range(batch.num_spectra)]
+
+    @property
+    def buffer_size(self):
+        return self._c_message[0].content.spectra_batch.buffer_size
+
+    @property
+    def spectra(self):
+        cdef message_spectra_batch *batch = \
+            &self._c_message[0].content.spectra_batch
+        cdef float *spectrum
+        result = []
+        for i in range(batch.num_spectra):
+            spectrum = <float *>(<char *>batch.buffer + batch.offsets[i])
+            result.append(
+                <float[:2 * batch.infos[i].num_channels]>spectrum)
+        return result
+
 cdef class EndMessage(Message):
 
     def __str__(self):
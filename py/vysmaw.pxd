@@ -28,18 +28,39 @@ cdef extern from "vysmaw.h":
 
     DEF VYSMAW_RECEIVE_STATUS_LENGTH = 64
 
+    DEF VYSMAW_SHM_NAME_SIZE = 64
+
+    DEF VYSMAW_SELECTION_SPEC_SIZE = 1024
+
     struct vysmaw_configuration:
         char signal_multicast_address[VYS_MULTICAST_ADDRESS_SIZE]
         stddef.size_t spectrum_buffer_pool_size
+        stddef.size_t spectrum_buffer_pool_max_size
+        double spectrum_buffer_pool_idle_release_sec
         bool single_spectrum_buffer_pool
         unsigned max_spectrum_buffer_size
+        unsigned spectrum_buffer_magazine_size
+        stddef.size_t spectrum_buffer_alignment
         stddef.size_t signal_message_pool_size
+        stddef.size_t buffer_pool_huge_page_size
+        int numa_node
         bool eager_connect
         double eager_connect_idle_sec
         bool preconnect_backlog
         unsigned max_depth_message_queue
         unsigned queue_resume_overhead
         unsigned max_starvation_latency
+        double spectrum_buffer_pool_pressure_threshold
+        double spectrum_buffer_pool_pressure_hysteresis
+        char shm_name[VYSMAW_SHM_NAME_SIZE]
+        stddef.size_t shm_buffer_pool_size
+        unsigned shm_max_clients
+        unsigned shm_client_queue_length
+        char selection_baselines[VYSMAW_SELECTION_SPEC_SIZE]
+        char selection_spectral_windows[VYSMAW_SELECTION_SPEC_SIZE]
+        char selection_stokes[VYSMAW_SELECTION_SPEC_SIZE]
+        uint64_t selection_start_time
+        uint64_t selection_end_time
         unsigned resolve_route_timeout_ms
         unsigned resolve_addr_timeout_ms
         unsigned inactive_server_timeout_sec
@@ -84,13 +105,34 @@ cdef extern from "vysmaw.h":
         VYSMAW_MESSAGE_SIGNAL_BUFFER_STARVATION,
         VYSMAW_MESSAGE_SIGNAL_RECEIVE_FAILURE,
         VYSMAW_MESSAGE_RDMA_READ_FAILURE,
+        VYSMAW_MESSAGE_BUFFER_POOL_PRESSURE,
+        VYSMAW_MESSAGE_EXPIRED,
+        VYSMAW_MESSAGE_SPECTRA_BATCH,
         VYSMAW_MESSAGE_END
 
+    struct vysmaw_buffer_pool_status:
+        stddef.size_t buffer_size
+        stddef.size_t num_buffers
+        stddef.size_t num_free
+        stddef.size_t num_in_use
+        stddef.size_t max_in_use
+
+    struct message_pool_pressure:
+        bool high
+        vysmaw_buffer_pool_status status
+
     struct message_valid_buffer:
         vysmaw_data_info info
         stddef.size_t buffer_size
         float *buffer
 
+    struct message_spectra_batch:
+        unsigned num_spectra
+        const vysmaw_data_info *infos
+        const stddef.size_t *offsets
+        stddef.size_t buffer_size
+        float *buffer
+
     union message_content:
         message_valid_buffer valid_buffer
         vysmaw_data_info digest_failure
@@ -99,6 +141,9 @@ cdef extern from "vysmaw.h":
         unsigned num_signal_buffers_unavailable
         char signal_receive_status[VYSMAW_RECEIVE_STATUS_LENGTH]
         char rdma_read_status[VYSMAW_RECEIVE_STATUS_LENGTH]
+        message_pool_pressure pool_pressure
+        unsigned num_expired
+        message_spectra_batch spectra_batch
         vysmaw_result result
 
     struct vysmaw_message:
@@ -117,23 +162,114 @@ cdef extern from "vysmaw.h":
         uint8_t stokes_index, const vys_spectrum_info *infos,
         uint8_t num_infos, void *user_data, bool *pass_filter) nogil
 
+    struct vysmaw_spectrum_batch:
+        unsigned num_spectra
+        const uint8_t *station0
+        const uint8_t *station1
+        const uint8_t *spectral_window_index
+        const uint8_t *stokes_index
+        const uint64_t *timestamp
+
+    struct vysmaw_spectrum_selection:
+        uint64_t baselines[256 * 256 / 64]
+        uint64_t spectral_windows[256 / 64]
+        uint64_t stokes[256 / 64]
+        uint64_t start_time
+        uint64_t end_time
+
+    ctypedef void (*vysmaw_spectrum_batch_filter)(
+        const vysmaw_spectrum_batch *batch, void *user_data,
+        uint64_t *pass_filter) nogil
+
+    ctypedef void (*vysmaw_message_callback)(
+        vysmaw_message *message, void *user_data) nogil
+
+    enum vysmaw_shard_distribution:
+        VYSMAW_SHARD_ROUND_ROBIN,
+        VYSMAW_SHARD_BY_PRODUCT
+
+    enum vysmaw_overflow_policy:
+        VYSMAW_OVERFLOW_DROP_NEWEST,
+        VYSMAW_OVERFLOW_DROP_OLDEST,
+        VYSMAW_OVERFLOW_SAMPLE
+
+    struct vysmaw_message_queue_status:
+        stddef.size_t depth
+        uint64_t num_dropped_newest
+        uint64_t num_dropped_oldest
+        uint64_t num_sampled_out
+        uint64_t num_expired
+        uint64_t num_callback_overruns
+        uint64_t max_callback_time
+
+    enum vysmaw_message_age_reference:
+        VYSMAW_AGE_FROM_TIMESTAMP,
+        VYSMAW_AGE_FROM_DELIVERY
+
     struct vysmaw_consumer:
         vysmaw_spectrum_filter filter
         void *filter_data
         vysmaw_message_queue queue
+        unsigned num_shards
+        vysmaw_shard_distribution shard_distribution
+        vysmaw_message_queue *shard_queues
+        vysmaw_overflow_policy overflow_policy
+        unsigned overflow_sample_interval
+        uint64_t max_message_age
+        vysmaw_message_age_reference message_age_reference
+        vysmaw_message_callback callback
+        void *callback_data
+        uint64_t callback_time_limit
+        bool batch_spectra
+        vysmaw_spectrum_batch_filter batch_filter
+        const vysmaw_spectrum_selection *selection
 
     vysmaw_handle vysmaw_start(vysmaw_configuration *config,
                                unsigned num_consumers,
                                vysmaw_consumer **consumers) nogil
 
+    vysmaw_handle vysmaw_attach(vysmaw_configuration *config,
+                                unsigned num_consumers,
+                                vysmaw_consumer **consumers) nogil
+
+    vysmaw_result vysmaw_export(vysmaw_configuration *config,
+                                vysmaw_message_queue queue) nogil
+
     vysmaw_configuration *vysmaw_configuration_new(char *path) nogil
 
     void vysmaw_configuration_free(vysmaw_configuration *config)
 
+    vysmaw_spectrum_selection *vysmaw_spectrum_selection_new(
+        const vysmaw_configuration *config)
+
+    void vysmaw_spectrum_selection_set_baselines(
+        vysmaw_spectrum_selection *selection, const uint8_t (*stations)[2],
+        unsigned num_baselines)
+
+    void vysmaw_spectrum_selection_set_spectral_windows(
+        vysmaw_spectrum_selection *selection, const uint8_t *indexes,
+        unsigned num_indexes)
+
+    void vysmaw_spectrum_selection_set_stokes(
+        vysmaw_spectrum_selection *selection, const uint8_t *indexes,
+        unsigned num_indexes)
+
+    void vysmaw_spectrum_selection_free(vysmaw_spectrum_selection *selection)
+
     void vysmaw_shutdown(vysmaw_handle handle)
 
+    unsigned vysmaw_spectrum_buffer_pool_status(
+        vysmaw_handle handle, vysmaw_buffer_pool_status *status,
+        unsigned max_pools) nogil
+
+    bool vysmaw_signal_buffer_pool_status(
+        vysmaw_handle handle, vysmaw_buffer_pool_status *status) nogil
+
     void vysmaw_message_unref(vysmaw_message *message)
 
+    void vysmaw_message_unref_batch(vysmaw_message **messages,
+                                    unsigned n) nogil
+
     vysmaw_message *vysmaw_message_queue_pop(vysmaw_message_queue queue) nogil
 
     vysmaw_message *vysmaw_message_queue_timeout_pop(
@@ -141,3 +277,13 @@ cdef extern from "vysmaw.h":
         uint64_t timeout) nogil
 
     vysmaw_message *vysmaw_message_queue_try_pop(vysmaw_message_queue queue)
+
+    int vysmaw_message_queue_fd(vysmaw_message_queue queue) nogil
+
+    void vysmaw_message_queue_status(
+        vysmaw_message_queue queue,
+        vysmaw_message_queue_status *status) nogil
+
+    unsigned vysmaw_message_queue_pop_batch(
+        vysmaw_message_queue queue, vysmaw_message **msgs, unsigned max,
+        uint64_t timeout) nogil
@@ -17,56 +17,62 @@
 //
 #include <unistd.h>
 #include <errno.h>
-#ifndef _GNU_SOURCE
-# include <fcntl.h>
-#endif
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <string.h>
 #include <async_queue.h>
 
-#define POP_FD(q) ((q)->fds[0])
-#define PUSH_FD(q) ((q)->fds[1])
+struct async_queue *
+async_queue_new()
+{
+	return async_queue_new_sized(ASYNC_QUEUE_DEFAULT_CAPACITY);
+}
 
 struct async_queue *
-new_no_queue()
+async_queue_new_full(GDestroyNotify destroy)
 {
-	struct async_queue *result = g_try_new(struct async_queue, 1);
-	if (G_LIKELY(result != NULL)) {
-		result->refcount = 1;
-		int rc;
-#ifdef _GNU_SOURCE
-		rc = pipe2(result->fds, O_NONBLOCK);
-#else
-		rc = pipe(result->fds);
-		if (G_LIKELY(rc == 0))
-			rc = fcntl(result->fds[0], F_SETFL, O_NONBLOCK);
-		if (G_LIKELY(rc == 0))
-			rc = fcntl(result->fds[1], F_SETFL, O_NONBLOCK);
-#endif
-		if (G_UNLIKELY(rc != 0)) {
-			g_free(result);
-			result = NULL;
-		}
-	} else {
-		errno = ENOMEM;
-	}
-	return result;
+	return async_queue_new_sized_full(ASYNC_QUEUE_DEFAULT_CAPACITY, destroy);
 }
 
 struct async_queue *
-async_queue_new()
+async_queue_new_sized(unsigned capacity)
 {
-	struct async_queue *result = new_no_queue();
-	if (G_LIKELY(result != NULL))
-		result->q = g_async_queue_new();
+	struct async_queue *result = g_try_new0(struct async_queue, 1);
+	if (G_UNLIKELY(result == NULL)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	unsigned num_cells = 2;
+	while (num_cells < capacity) num_cells <<= 1;
+	result->cells = g_try_new(struct async_queue_cell, num_cells);
+	if (G_UNLIKELY(result->cells == NULL)) {
+		g_free(result);
+		errno = ENOMEM;
+		return NULL;
+	}
+	result->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (G_UNLIKELY(result->fd < 0)) {
+		g_free(result->cells);
+		g_free(result);
+		return NULL;
+	}
+	for (unsigned i = 0; i < num_cells; ++i)
+		result->cells[i].seq = i;
+	result->mask = num_cells - 1;
+	result->refcount = 1;
+	/* consumer starts out parked, so that the first push signals it */
+	result->parked = true;
 	return result;
 }
 
 struct async_queue *
-async_queue_new_full(GDestroyNotify destroy)
+async_queue_new_sized_full(unsigned capacity, GDestroyNotify destroy)
 {
-	struct async_queue *result = new_no_queue();
+	struct async_queue *result = async_queue_new_sized(capacity);
 	if (G_LIKELY(result != NULL))
-		result->q = g_async_queue_new_full(destroy);
+		result->destroy = destroy;
 	return result;
 }
 
@@ -81,56 +87,154 @@ void
 async_queue_unref(struct async_queue *queue)
 {
 	if (g_atomic_int_dec_and_test(&queue->refcount)) {
-		g_async_queue_unref(queue->q);
-		int rc1 = close(queue->fds[0]);
-		int errno1 = errno;
-		int rc = close(queue->fds[1]);
-		if (G_UNLIKELY(rc == 0 && rc1 != 0))
-			errno = errno1;
+		if (queue->destroy != NULL) {
+			void *item;
+			while ((item = async_queue_try_pop(queue)) != NULL)
+				queue->destroy(item);
+		}
+		close(queue->fd);
+		g_free(queue->cells);
 		g_free(queue);
 	}
 }
 
-void
-async_queue_push(struct async_queue *queue, void *item)
+static void
+signal_consumer(struct async_queue *queue)
 {
-	g_async_queue_push(queue->q, item);
-	unsigned u;
-	size_t w = 0;
+	eventfd_t u = 1;
 	ssize_t n;
 	do {
-		errno = 0;
-		n = write(PUSH_FD(queue), (void *)&u + w, sizeof(u) - w);
-		if (G_LIKELY(n >= 0)) w += n;
-	} while (errno == EINTR || w != sizeof(u));
-	if (G_UNLIKELY(errno != 0))
+		n = write(queue->fd, &u, sizeof(u));
+	} while (n < 0 && errno == EINTR);
+	/* EAGAIN only occurs when the counter is saturated, in which case the
+	 * consumer is certain to wake anyway */
+	if (G_UNLIKELY(n < 0 && errno != EAGAIN))
 		g_error("async_queue_push write failed: %s", strerror(errno));
 }
 
+/* Block until the consumer frees 'cell', which is full at position 'pos'. */
+static void
+wait_for_space(struct async_queue *queue, struct async_queue_cell *cell,
+               guint64 pos)
+{
+	guint32 space = __atomic_load_n(&queue->space, __ATOMIC_ACQUIRE);
+	__atomic_add_fetch(&queue->num_blocked, 1, __ATOMIC_RELAXED);
+	/* pairs with the fence in dequeue(): either the consumer sees us blocked,
+	 * and changes 'space', or we see the cell it freed */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	guint64 seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+	if ((gint64)(seq - pos) < 0) {
+		long rc = syscall(SYS_futex, &queue->space, FUTEX_WAIT_PRIVATE, space,
+		                  NULL, NULL, 0);
+		if (G_UNLIKELY(rc < 0 && errno != EAGAIN && errno != EINTR))
+			g_error("async_queue_push futex wait failed: %s",
+			        strerror(errno));
+	}
+	__atomic_sub_fetch(&queue->num_blocked, 1, __ATOMIC_RELAXED);
+}
+
+void
+async_queue_push(struct async_queue *queue, void *item)
+{
+	struct async_queue_cell *cell;
+	guint64 pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+	for (;;) {
+		cell = &queue->cells[pos & queue->mask];
+		guint64 seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		gint64 diff = (gint64)(seq - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(
+				    &queue->enqueue_pos, &pos, pos + 1, true,
+				    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			wait_for_space(queue, cell, pos);
+			pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+		} else {
+			pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+	cell->item = item;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+	/* pairs with the fence in async_queue_try_pop(): either the consumer sees
+	 * this item after parking, or we see that it has parked */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&queue->parked, __ATOMIC_RELAXED)
+	    && __atomic_exchange_n(&queue->parked, false, __ATOMIC_ACQ_REL))
+		signal_consumer(queue);
+}
+
+static void *
+dequeue(struct async_queue *queue)
+{
+	guint64 pos = queue->dequeue_pos;
+	struct async_queue_cell *cell = &queue->cells[pos & queue->mask];
+	guint64 seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+	if (seq != pos + 1)
+		return NULL;
+	void *result = cell->item;
+	__atomic_store_n(&cell->seq, pos + queue->mask + 1, __ATOMIC_RELEASE);
+	queue->dequeue_pos = pos + 1;
+
+	/* wake producers blocked on a full ring once it is half empty, so that
+	 * they are not woken, and blocked again, for every item */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (G_UNLIKELY(__atomic_load_n(&queue->num_blocked, __ATOMIC_RELAXED) > 0)
+	    && (__atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED) - (pos + 1)
+	        <= queue->mask / 2)) {
+		__atomic_add_fetch(&queue->space, 1, __ATOMIC_RELEASE);
+		syscall(SYS_futex, &queue->space, FUTEX_WAKE_PRIVATE, G_MAXINT,
+		        NULL, NULL, 0);
+	}
+	return result;
+}
+
 void *
-async_queue_pop(struct async_queue *queue)
+async_queue_try_pop(struct async_queue *queue)
 {
-	unsigned u;
-	size_t r = 0;
+	void *result = dequeue(queue);
+	if (G_LIKELY(result != NULL))
+		return result;
+
+	/* ring is empty: clear any pending wakeup, park, and look again to close
+	 * the race with a producer that pushed before seeing us parked */
+	eventfd_t u;
 	ssize_t n;
 	do {
-		errno = 0;
-		n = read(POP_FD(queue), (void *)&u + r, sizeof(u) - r);
-		if (G_LIKELY(n >= 0)) r += n;
-	} while (errno == EINTR || r != sizeof(u));
-	if (G_UNLIKELY(errno != 0))
+		n = read(queue->fd, &u, sizeof(u));
+	} while (n < 0 && errno == EINTR);
+	if (G_UNLIKELY(n < 0 && errno != EAGAIN))
 		g_error("async_queue_pop read failed: %s", strerror(errno));
-	return g_async_queue_pop(queue->q);
+	__atomic_store_n(&queue->parked, true, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	result = dequeue(queue);
+	if (result != NULL)
+		__atomic_store_n(&queue->parked, false, __ATOMIC_RELAXED);
+	return result;
+}
+
+void *
+async_queue_pop(struct async_queue *queue)
+{
+	void *result;
+	while ((result = async_queue_try_pop(queue)) == NULL) {
+		struct pollfd pfd = { .fd = queue->fd, .events = POLLIN };
+		int rc = poll(&pfd, 1, -1);
+		if (G_UNLIKELY(rc < 0 && errno != EINTR))
+			g_error("async_queue_pop poll failed: %s", strerror(errno));
+	}
+	return result;
 }
 
 int
 async_queue_pop_fd(struct async_queue *queue)
 {
-	return POP_FD(queue);
+	return queue->fd;
 }
 
 int
 async_queue_push_fd(struct async_queue *queue)
 {
-	return PUSH_FD(queue);
+	return queue->fd;
 }
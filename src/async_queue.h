@@ -20,16 +20,53 @@
 
 #include <glib.h>
 
+/* Bounded, lock-free, multiple producer/single consumer queue. Items are held
+ * in a ring of sequence-numbered cells; the queue's eventfd is written only
+ * when the consumer has parked itself after finding the ring empty, so that a
+ * busy consumer costs producers no system calls. A consumer that polls on
+ * async_queue_pop_fd() must drain the queue with async_queue_try_pop() until
+ * it returns NULL, as that is what parks the consumer and re-arms the
+ * eventfd. A producer that finds the queue full blocks on a futex, which the
+ * consumer wakes once the queue is half empty; the consumer makes that check
+ * only while some producer is blocked.
+ *
+ * async_queue_new() and async_queue_new_full() create a queue of
+ * ASYNC_QUEUE_DEFAULT_CAPACITY items; unlike the queue they once created,
+ * which was unbounded, it blocks producers when full. Use
+ * async_queue_new_sized() and async_queue_new_sized_full() to choose the
+ * capacity.
+ */
+#define ASYNC_QUEUE_DEFAULT_CAPACITY 1024
+
+struct async_queue_cell {
+	guint64 seq;
+	void *item;
+};
+
 struct async_queue {
 	int refcount;
-	int fds[2];
-	GAsyncQueue *q;
+	int fd;
+	int parked;
+	unsigned mask;
+	GDestroyNotify destroy;
+	struct async_queue_cell *cells;
+	guint64 enqueue_pos __attribute__((aligned(64)));
+	guint64 dequeue_pos __attribute__((aligned(64)));
+	/* futex on which producers wait for room, and the number of them
+	 * waiting */
+	guint32 space __attribute__((aligned(64)));
+	int num_blocked;
 };
 
 extern struct async_queue *async_queue_new()
 	__attribute__((malloc));
 extern struct async_queue *async_queue_new_full(GDestroyNotify destroy)
 	__attribute__((nonnull,malloc));
+extern struct async_queue *async_queue_new_sized(unsigned capacity)
+	__attribute__((malloc));
+extern struct async_queue *async_queue_new_sized_full(
+	unsigned capacity, GDestroyNotify destroy)
+	__attribute__((nonnull,malloc));
 extern struct async_queue *async_queue_ref(struct async_queue *queue)
 	__attribute__((nonnull,returns_nonnull));
 extern void async_queue_unref(struct async_queue *queue)
@@ -38,8 +75,12 @@ extern void async_queue_push(struct async_queue *queue, void *item)
 	__attribute__((nonnull));
 extern void *async_queue_pop(struct async_queue *queue)
 	__attribute__((nonnull,returns_nonnull));
+extern void *async_queue_try_pop(struct async_queue *queue)
+	__attribute__((nonnull));
 extern int async_queue_pop_fd(struct async_queue *queue)
 	__attribute__((nonnull));
+/* the queue's eventfd, as async_queue_pop_fd(); there is no separate file
+ * descriptor for producers, which never need to poll */
 extern int async_queue_push_fd(struct async_queue *queue)
 	__attribute__((nonnull));
 
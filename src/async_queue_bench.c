@@ -0,0 +1,189 @@
+//
+// Copyright © 2016 Associated Universities, Inc. Washington DC, USA.
+//
+// This file is part of vysmaw.
+//
+// vysmaw is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// vysmaw is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// vysmaw.  If not, see <http://www.gnu.org/licenses/>.
+//
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <async_queue.h>
+
+/* Producer/consumer throughput of async_queue, compared with the
+ * pipe-signalled GAsyncQueue that it replaced. Every producer thread pushes
+ * 'num_items' items, and a single consumer thread pops them all, polling the
+ * queue's file descriptor when it is empty, as the spectrum_reader does with
+ * the read request queue. */
+
+/* the pipe-signalled queue, as it was before async_queue: every push writes a
+ * token to a pipe, and every pop reads one */
+struct pipe_queue {
+	int fds[2];
+	GAsyncQueue *q;
+};
+
+static struct pipe_queue *
+pipe_queue_new(void)
+{
+	struct pipe_queue *result = g_new(struct pipe_queue, 1);
+	if (pipe2(result->fds, O_NONBLOCK) != 0)
+		g_error("pipe2 failed: %s", strerror(errno));
+	result->q = g_async_queue_new();
+	return result;
+}
+
+static void
+pipe_queue_free(struct pipe_queue *queue)
+{
+	g_async_queue_unref(queue->q);
+	close(queue->fds[0]);
+	close(queue->fds[1]);
+	g_free(queue);
+}
+
+static void
+pipe_queue_push(struct pipe_queue *queue, void *item)
+{
+	g_async_queue_push(queue->q, item);
+	unsigned u;
+	size_t w = 0;
+	ssize_t n;
+	do {
+		errno = 0;
+		n = write(queue->fds[1], (void *)&u + w, sizeof(u) - w);
+		if (G_LIKELY(n >= 0)) w += n;
+	} while (errno == EINTR || errno == EAGAIN || w != sizeof(u));
+}
+
+static void *
+pipe_queue_pop(struct pipe_queue *queue)
+{
+	unsigned u;
+	size_t r = 0;
+	ssize_t n;
+	do {
+		if (r == 0) {
+			struct pollfd pfd = { .fd = queue->fds[0], .events = POLLIN };
+			poll(&pfd, 1, -1);
+		}
+		errno = 0;
+		n = read(queue->fds[0], (void *)&u + r, sizeof(u) - r);
+		if (G_LIKELY(n >= 0)) r += n;
+	} while (errno == EINTR || errno == EAGAIN || r != sizeof(u));
+	return g_async_queue_pop(queue->q);
+}
+
+struct producer {
+	void *queue;
+	void (*push)(void *queue, void *item);
+	unsigned num_items;
+};
+
+static void *
+produce(struct producer *producer)
+{
+	for (unsigned i = 1; i <= producer->num_items; ++i)
+		producer->push(producer->queue, GUINT_TO_POINTER(i));
+	return NULL;
+}
+
+/* time, in seconds, for 'num_producers' threads to pass 'num_items' items each
+ * to a consumer */
+static double
+run(void *queue, void (*push)(void *, void *), void *(*pop)(void *),
+    unsigned num_producers, unsigned num_items)
+{
+	struct producer producer = {
+		.queue = queue,
+		.push = push,
+		.num_items = num_items
+	};
+	GThread **threads = g_new(GThread *, num_producers);
+	gint64 start = g_get_monotonic_time();
+	for (unsigned i = 0; i < num_producers; ++i)
+		threads[i] = g_thread_new("producer", (GThreadFunc)produce, &producer);
+	for (guint64 n = (guint64)num_producers * num_items; n > 0; --n)
+		pop(queue);
+	gint64 end = g_get_monotonic_time();
+	for (unsigned i = 0; i < num_producers; ++i)
+		g_thread_join(threads[i]);
+	g_free(threads);
+	return (end - start) / 1e6;
+}
+
+static void
+report(const char *name, double sec, unsigned num_producers,
+       unsigned num_items)
+{
+	double total = (double)num_producers * num_items;
+	printf("%-14s %2u producer(s): %8.1f ns/item, %7.2f Mitem/s\n",
+	       name, num_producers, 1e9 * sec / total, total / sec / 1e6);
+}
+
+int
+main(int argc, char *argv[])
+{
+	gint num_producers = 1;
+	gint num_items = 1000000;
+	gint capacity = 1024;
+	GOptionEntry entries[] = {
+		{"producers", 'p', 0, G_OPTION_ARG_INT, &num_producers,
+		 "Number of producer threads", "N"},
+		{"items", 'n', 0, G_OPTION_ARG_INT, &num_items,
+		 "Number of items pushed by each producer", "N"},
+		{"capacity", 'c', 0, G_OPTION_ARG_INT, &capacity,
+		 "Capacity of async_queue", "N"},
+		{NULL}
+	};
+	GOptionContext *context = g_option_context_new(NULL);
+	g_option_context_set_summary(
+		context, "Compare async_queue with a pipe-signalled GAsyncQueue");
+	g_option_context_add_main_entries(context, entries, NULL);
+	GError *error = NULL;
+	bool ok = g_option_context_parse(context, &argc, &argv, &error);
+	g_option_context_free(context);
+	if (!ok || num_producers < 1 || num_items < 1 || capacity < 1) {
+		fprintf(stderr, "%s\n",
+		        (error != NULL) ? error->message : "Invalid arguments");
+		if (error != NULL) g_error_free(error);
+		return EXIT_FAILURE;
+	}
+
+	struct pipe_queue *pq = pipe_queue_new();
+	double sec = run(pq, (void (*)(void *, void *))pipe_queue_push,
+	                 (void *(*)(void *))pipe_queue_pop, num_producers,
+	                 num_items);
+	pipe_queue_free(pq);
+	report("pipe_queue", sec, num_producers, num_items);
+
+	struct async_queue *aq = async_queue_new_sized(capacity);
+	if (aq == NULL) {
+		fprintf(stderr, "async_queue_new_sized failed: %s\n",
+		        strerror(errno));
+		return EXIT_FAILURE;
+	}
+	sec = run(aq, (void (*)(void *, void *))async_queue_push,
+	          (void *(*)(void *))async_queue_pop, num_producers, num_items);
+	async_queue_unref(aq);
+	report("async_queue", sec, num_producers, num_items);
+
+	return EXIT_SUCCESS;
+}
@@ -17,34 +17,225 @@
 //
 #include <buffer_pool.h>
 #include <glib.h>
+#include <sys/mman.h>
+
+#ifndef MAP_HUGE_SHIFT
+# define MAP_HUGE_SHIFT 26
+#endif
+
+static void *
+map_huge_pages(size_t size, size_t huge_page_size, size_t *mapped_size)
+{
+#ifdef MAP_HUGETLB
+	if (huge_page_size == 0 || (huge_page_size & (huge_page_size - 1)) != 0)
+		return NULL;
+	*mapped_size =
+		((size + huge_page_size - 1) / huge_page_size) * huge_page_size;
+	if (*mapped_size == 0) return NULL;
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB
+		| ((g_bit_nth_lsf(huge_page_size, -1)) << MAP_HUGE_SHIFT);
+	void *result =
+		mmap(NULL, *mapped_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	return ((result != MAP_FAILED) ? result : NULL);
+#else
+	return NULL;
+#endif
+}
 
 struct buffer_pool *
 buffer_pool_new(size_t num_buffers, size_t buffer_size)
+{
+	return buffer_pool_new_full(num_buffers, buffer_size, 0);
+}
+
+struct buffer_pool *
+buffer_pool_new_full(size_t num_buffers, size_t buffer_size,
+                     size_t huge_page_size)
+{
+	return buffer_pool_new_elastic(
+		num_buffers, buffer_size, 0, 1, huge_page_size);
+}
+
+static void *
+reserve_chunks(size_t size, size_t huge_page_size, size_t *mapped_size)
+{
+#ifdef MAP_NORESERVE
+	if (size == 0) return NULL;
+	void *result = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (result == MAP_FAILED) return NULL;
+# ifdef MADV_HUGEPAGE
+	if (huge_page_size > 0) madvise(result, size, MADV_HUGEPAGE);
+# endif
+	*mapped_size = size;
+	return result;
+#else
+	return NULL;
+#endif
+}
+
+struct buffer_pool *
+buffer_pool_new_elastic(size_t chunk_num_buffers, size_t buffer_size,
+                        size_t alignment, unsigned max_chunks,
+                        size_t huge_page_size)
 {
 	g_assert(buffer_size >= sizeof(struct buffer_stack));
+	g_assert((alignment & (alignment - 1)) == 0);
+	if (alignment > 1)
+		buffer_size = (buffer_size + alignment - 1) & ~(alignment - 1);
 	struct buffer_pool *result = g_new(struct buffer_pool, 1);
 	result->buffer_size = buffer_size;
-	result->pool = g_malloc_n(num_buffers, buffer_size);
-	result->pool_size = num_buffers * buffer_size;
-	result->root = (struct buffer_stack *)result->pool;
-	struct buffer_stack *buff = result->root;
-	struct buffer_stack *next_buff = (void *)buff + buffer_size;
-	for (size_t i = num_buffers; i > 1; --i) {
+	result->chunk_num_buffers = chunk_num_buffers;
+	result->chunk_size = chunk_num_buffers * buffer_size;
+	result->huge_page_size = 0;
+	result->mapped_size = 0;
+	result->allocation = NULL;
+	result->pool = NULL;
+	if (max_chunks > 1)
+		result->pool = reserve_chunks(
+			max_chunks * result->chunk_size, huge_page_size,
+			&result->mapped_size);
+	if (result->pool == NULL) {
+		max_chunks = 1;
+		result->pool = map_huge_pages(
+			result->chunk_size, huge_page_size, &result->mapped_size);
+		if (result->pool != NULL) {
+			result->huge_page_size = huge_page_size;
+		} else if (alignment > 1 && result->chunk_size > 0) {
+			result->mapped_size = 0;
+			result->allocation = g_malloc(result->chunk_size + alignment - 1);
+			result->pool = (void *)(((guintptr)result->allocation + alignment - 1)
+			                        & ~(guintptr)(alignment - 1));
+		} else {
+			result->mapped_size = 0;
+			result->allocation = g_malloc_n(chunk_num_buffers, buffer_size);
+			result->pool = result->allocation;
+		}
+	}
+	result->max_chunks = max_chunks;
+	result->num_chunks = 0;
+	result->num_buffers = max_chunks * chunk_num_buffers;
+	result->pool_size = 0;
+	result->num_in_use = 0;
+	result->max_in_use = 0;
+	result->num_published = 0;
+#if BUFFER_POOL_LOCK
+	result->root = NULL;
+	g_mutex_init(&result->lock);
+#else
+	g_assert(result->num_buffers < G_MAXUINT32);
+	result->root = BUFFER_POOL_ROOT(0, 0);
+#endif
+	buffer_pool_publish_chunk(result, buffer_pool_commit_chunk(result));
+	return result;
+}
+
+int
+buffer_pool_commit_chunk(struct buffer_pool *buffer_pool)
+{
+	if (buffer_pool->num_chunks == buffer_pool->max_chunks)
+		return -1;
+	/* memory in the reserved address space is committed on first use */
+	buffer_pool->pool_size += buffer_pool->chunk_size;
+	return buffer_pool->num_chunks++;
+}
+
+void
+buffer_pool_publish_chunk(struct buffer_pool *buffer_pool, unsigned chunk)
+{
+	size_t n = buffer_pool->chunk_num_buffers;
+	if (n == 0) return;
+	void *first = buffer_pool_chunk(buffer_pool, chunk);
+	struct buffer_stack *buff = first;
+	for (size_t i = n; i > 1; --i) {
+		struct buffer_stack *next_buff = (void *)buff + buffer_pool->buffer_size;
+#if BUFFER_POOL_LOCK
 		buff->next = next_buff;
+#else
+		buff->next = buffer_pool_index(buffer_pool, next_buff);
+#endif
 		buff = next_buff;
-		next_buff = (void *)buff + buffer_size;
 	}
-	buff->next = NULL;
+	buffer_pool_push_chain(buffer_pool, first, buff);
+	__atomic_add_fetch(&buffer_pool->num_published, n, __ATOMIC_RELAXED);
+}
+
+bool
+buffer_pool_withdraw_chunk(struct buffer_pool *buffer_pool)
+{
+	if (buffer_pool->num_chunks <= 1) return false;
+	unsigned last_chunk = buffer_pool->num_chunks - 1;
+
+	/* take the entire stack */
+	struct buffer_stack *buff;
 #if BUFFER_POOL_LOCK
-	g_mutex_init(&result->lock);
+	g_mutex_lock(&buffer_pool->lock);
+	buff = buffer_pool->root;
+	buffer_pool->root = NULL;
+	g_mutex_unlock(&buffer_pool->lock);
+# define NEXT_BUFFER(b) ((b)->next)
+#else
+	buffer_pool_root_t root =
+		__atomic_load_n(&buffer_pool->root, __ATOMIC_ACQUIRE);
+	while (!__atomic_compare_exchange_n(
+		       &buffer_pool->root, &root,
+		       BUFFER_POOL_ROOT(0, BUFFER_POOL_ROOT_TAG(root) + 1),
+		       true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+	buff = buffer_pool_buffer(buffer_pool, BUFFER_POOL_ROOT_INDEX(root));
+# define NEXT_BUFFER(b) (buffer_pool_buffer(buffer_pool, (b)->next))
+#endif
+
+	/* partition the stack into buffers in, and not in, the last chunk */
+	struct buffer_stack *chains[2][2] = {{NULL, NULL}, {NULL, NULL}};
+	size_t num_in_last_chunk = 0;
+	while (buff != NULL) {
+		struct buffer_stack *next = NEXT_BUFFER(buff);
+		int c = (buffer_pool_chunk_index(buffer_pool, buff) == last_chunk);
+		if (chains[c][0] == NULL)
+			chains[c][0] = buff;
+		else
+#if BUFFER_POOL_LOCK
+			chains[c][1]->next = buff;
+#else
+			chains[c][1]->next = buffer_pool_index(buffer_pool, buff);
 #endif
+		chains[c][1] = buff;
+		num_in_last_chunk += c;
+		buff = next;
+	}
+#undef NEXT_BUFFER
+
+	/* return the stack, less the last chunk if all of its buffers are free */
+	bool result = (num_in_last_chunk == buffer_pool->chunk_num_buffers);
+	if (result)
+		__atomic_sub_fetch(&buffer_pool->num_published, num_in_last_chunk,
+		                   __ATOMIC_RELAXED);
+	if (!result && chains[1][0] != NULL)
+		buffer_pool_push_chain(buffer_pool, chains[1][0], chains[1][1]);
+	if (chains[0][0] != NULL)
+		buffer_pool_push_chain(buffer_pool, chains[0][0], chains[0][1]);
 	return result;
 }
 
+void
+buffer_pool_decommit_chunk(struct buffer_pool *buffer_pool)
+{
+	g_assert(buffer_pool->num_chunks > 1);
+	--buffer_pool->num_chunks;
+	buffer_pool->pool_size -= buffer_pool->chunk_size;
+	/* the address space remains mapped (and readable), which is needed by
+	 * concurrent pops that may follow stale links */
+	madvise(buffer_pool_chunk(buffer_pool, buffer_pool->num_chunks),
+	        buffer_pool->chunk_size, MADV_DONTNEED);
+}
+
 void
 buffer_pool_free(struct buffer_pool *buffer_pool)
 {
-	g_free(buffer_pool->pool);
+	if (buffer_pool->mapped_size > 0)
+		munmap(buffer_pool->pool, buffer_pool->mapped_size);
+	else
+		g_free(buffer_pool->allocation);
 #if BUFFER_POOL_LOCK
 	g_mutex_clear(&buffer_pool->lock);
 #endif
@@ -23,26 +23,81 @@ extern "C" {
 #endif
 
 #include <stdio.h>
+#include <stdbool.h>
 #include <glib.h>
 
+/* define BUFFER_POOL_LOCK as 1 (e.g, on the compiler command line) for an
+ * implementation using a mutex lock, instead of the default lockless
+ * implementation */
+#ifndef BUFFER_POOL_LOCK
+# define BUFFER_POOL_LOCK 0
+#endif
+
 struct buffer_stack;
 
+#if BUFFER_POOL_LOCK
+
 struct buffer_stack {
 	struct buffer_stack *next;
 };
 
-/* define BUFFER_POOL_LOCK for an implementation using a mutex lock, instead of
- * the default lockless implementation */
-#undef BUFFER_POOL_LOCK
+#else
+
+/* The lockless implementation is a Treiber stack, the root of which is a
+ * tagged reference to the top buffer: the (one-based) index of the buffer in
+ * the pool packed with a generation count that is incremented by every push and
+ * pop. Because the generation count changes whenever the stack changes, a
+ * compare-and-exchange on the root cannot succeed after the top buffer has been
+ * popped and pushed back by other threads in the meantime (the ABA problem). The
+ * link to the next buffer in the stack is also an index, so that following a
+ * stale link can never leave the pool memory. */
+struct buffer_stack {
+	guint32 next; // index of next buffer plus one, or zero at bottom of stack
+};
+
+typedef guint64 buffer_pool_root_t;
+
+#define BUFFER_POOL_ROOT(index, tag)                                  \
+	(((buffer_pool_root_t)(tag) << 32) | (buffer_pool_root_t)(index))
+#define BUFFER_POOL_ROOT_INDEX(root) ((guint32)(root))
+#define BUFFER_POOL_ROOT_TAG(root) ((guint32)((root) >> 32))
+
+#endif
 
+/* The buffers of a pool are divided into one or more equally sized chunks. An
+ * elastic pool (one with 'max_chunks' greater than one) reserves address space
+ * for all of its chunks, but commits memory only to the first 'num_chunks' of
+ * them. In all pools, 'num_buffers' is the number of buffers in the reserved
+ * address space, and 'pool_size' the size of the committed memory. */
 struct buffer_pool {
 	size_t buffer_size;
+	size_t num_buffers;
 	size_t pool_size;
 	void *pool;
-	struct buffer_stack *root;
+	void *allocation; // heap block containing pool, or NULL if pool is mapped
+	size_t huge_page_size; // size of pages backing pool, or 0 for normal pages
+	size_t mapped_size; // size of pool mapping, or 0 if not mapped
+	size_t chunk_num_buffers;
+	size_t chunk_size;
+	unsigned max_chunks;
+	unsigned num_chunks;
 #if BUFFER_POOL_LOCK
+	struct buffer_stack *root;
 	GMutex lock;
+#else
+	/* keep the root, which is written by every thread using the pool, off the
+	 * cache line holding the (read-only) fields above */
+	char padding[64];
+	buffer_pool_root_t root;
 #endif
+
+	/* occupancy counters, which may be read at any time; 'num_in_use' and
+	 * 'max_in_use' are maintained by the users of the pool, not by the push
+	 * and pop functions (see buffer_pool_count_popped()), and
+	 * 'num_published' by chunk management */
+	long num_in_use;
+	long max_in_use;
+	size_t num_published; // number of buffers in published chunks
 };
 
 #define BUFFER_POOL_MIN_BUFFER_SIZE (sizeof(struct buffer_stack))
@@ -50,9 +105,152 @@ struct buffer_pool {
 struct buffer_pool *buffer_pool_new(size_t num_buffers, size_t buffer_size)
 	__attribute__((returns_nonnull,malloc));
 
+/* Create a buffer pool backed by huge pages of size 'huge_page_size' (a power
+ * of two, typically 2 MB or 1 GB), if possible. When 'huge_page_size' is zero,
+ * or the system cannot provide enough huge pages of the requested size, the
+ * pool is backed by normal pages. The 'huge_page_size' field of the result
+ * records the outcome. */
+struct buffer_pool *buffer_pool_new_full(
+	size_t num_buffers, size_t buffer_size, size_t huge_page_size)
+	__attribute__((returns_nonnull,malloc));
+
+/* Create an elastic buffer pool, with a single chunk of 'chunk_num_buffers'
+ * buffers initially available, which may grow to 'max_chunks' chunks. If the
+ * address space for all chunks cannot be reserved, the pool will have a single
+ * chunk. Because huge pages cannot be committed incrementally, elastic pools
+ * only request that the kernel use transparent huge pages when
+ * 'huge_page_size' is non-zero.
+ *
+ * Buffers are aligned to 'alignment' bytes (a power of two no greater than the
+ * page size, or 0 for no particular alignment), and the stride between buffers,
+ * recorded in the 'buffer_size' field of the result, is 'buffer_size' rounded
+ * up to a multiple of 'alignment'.
+ *
+ * The functions that follow, which change the number of chunks in an elastic
+ * pool, must only be called by a single thread. */
+struct buffer_pool *buffer_pool_new_elastic(
+	size_t chunk_num_buffers, size_t buffer_size, size_t alignment,
+	unsigned max_chunks, size_t huge_page_size)
+	__attribute__((returns_nonnull,malloc));
+
+/* Commit memory to a new chunk, returning its index, or -1 if the pool already
+ * has 'max_chunks' chunks. The new chunk's buffers are not available from the
+ * pool until buffer_pool_publish_chunk() is called, which allows the caller to
+ * prepare the chunk (e.g, register it for RDMA) in the meantime. */
+int buffer_pool_commit_chunk(struct buffer_pool *buffer_pool)
+	__attribute__((nonnull));
+
+void buffer_pool_publish_chunk(struct buffer_pool *buffer_pool, unsigned chunk)
+	__attribute__((nonnull));
+
+/* Remove the buffers of the last chunk from the pool, which succeeds only if
+ * all of those buffers are free. Other threads may find the pool empty while
+ * this function runs. After this function returns true, the caller must call
+ * buffer_pool_decommit_chunk(). */
+bool buffer_pool_withdraw_chunk(struct buffer_pool *buffer_pool)
+	__attribute__((nonnull));
+
+void buffer_pool_decommit_chunk(struct buffer_pool *buffer_pool)
+	__attribute__((nonnull));
+
 void buffer_pool_free(struct buffer_pool *buffer_pool)
 	__attribute__((nonnull));
 
+#if !BUFFER_POOL_LOCK
+
+static inline struct buffer_stack *
+buffer_pool_buffer(const struct buffer_pool *buffer_pool, guint32 index)
+{
+	return ((index == 0)
+	        ? NULL
+	        : (buffer_pool->pool + (index - 1) * buffer_pool->buffer_size));
+}
+
+static inline guint32
+buffer_pool_index(const struct buffer_pool *buffer_pool, const void *data_p)
+{
+	return (data_p - buffer_pool->pool) / buffer_pool->buffer_size + 1;
+}
+
+#endif
+
+static inline void *
+buffer_pool_chunk(const struct buffer_pool *buffer_pool, unsigned chunk)
+{
+	return buffer_pool->pool + chunk * buffer_pool->chunk_size;
+}
+
+static inline unsigned
+buffer_pool_chunk_index(const struct buffer_pool *buffer_pool,
+                        const void *data_p)
+{
+	return (data_p - buffer_pool->pool) / buffer_pool->chunk_size;
+}
+
+/* true iff data_p is in the (committed or reserved) memory of buffer_pool */
+static inline bool
+buffer_pool_contains(const struct buffer_pool *buffer_pool, const void *data_p)
+{
+	return (data_p >= buffer_pool->pool
+	        && data_p < (buffer_pool->pool
+	                     + buffer_pool->num_buffers * buffer_pool->buffer_size));
+}
+
+/* Record that 'n' buffers have been taken from, or are about to be returned
+ * to, the pool. The push and pop functions do not count buffers themselves, so
+ * that pools whose occupancy is never reported, such as slabs of fixed size
+ * objects, pay nothing for it. As the counters are shared by all threads using
+ * the pool, callers should count buffers in batches where they can, for
+ * example when a per-thread cache is refilled or flushed, in which case
+ * buffers held in those caches are counted as in use. */
+static inline void
+buffer_pool_count_popped(struct buffer_pool *buffer_pool, unsigned n)
+{
+	long num_in_use =
+		__atomic_add_fetch(&buffer_pool->num_in_use, n, __ATOMIC_RELAXED);
+	long max_in_use = __atomic_load_n(&buffer_pool->max_in_use, __ATOMIC_RELAXED);
+	while (G_UNLIKELY(num_in_use > max_in_use)
+	       && !__atomic_compare_exchange_n(
+		       &buffer_pool->max_in_use, &max_in_use, num_in_use, true,
+		       __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static inline void
+buffer_pool_count_pushed(struct buffer_pool *buffer_pool, unsigned n)
+{
+	__atomic_sub_fetch(&buffer_pool->num_in_use, n, __ATOMIC_RELAXED);
+}
+
+/* Number of buffers taken from the pool and not yet returned. The counter is
+ * decremented before buffers are returned to the pool, and incremented after
+ * they are taken, so that it never exceeds the true value (which bounds the
+ * high-water mark), but the values returned by the following functions are
+ * otherwise approximate while other threads are using the pool. */
+static inline size_t
+buffer_pool_num_in_use(const struct buffer_pool *buffer_pool)
+{
+	long num_in_use =
+		__atomic_load_n(&buffer_pool->num_in_use, __ATOMIC_RELAXED);
+	return MAX(num_in_use, 0);
+}
+
+/* Maximum number of buffers in use at any time since pool creation */
+static inline size_t
+buffer_pool_max_in_use(const struct buffer_pool *buffer_pool)
+{
+	return __atomic_load_n(&buffer_pool->max_in_use, __ATOMIC_RELAXED);
+}
+
+/* Number of buffers available to be taken from the pool */
+static inline size_t
+buffer_pool_num_free(const struct buffer_pool *buffer_pool)
+{
+	size_t num_published =
+		__atomic_load_n(&buffer_pool->num_published, __ATOMIC_RELAXED);
+	size_t num_in_use = buffer_pool_num_in_use(buffer_pool);
+	return ((num_published > num_in_use) ? (num_published - num_in_use) : 0);
+}
+
 static inline void
 buffer_pool_push(struct buffer_pool *buffer_pool, void *data_p)
 {
@@ -63,12 +261,15 @@ buffer_pool_push(struct buffer_pool *buffer_pool, void *data_p)
 	buffer_pool->root = new_root;
 	g_mutex_unlock(&buffer_pool->lock);
 #else
-	struct buffer_stack *root;
+	guint32 index = buffer_pool_index(buffer_pool, data_p);
+	buffer_pool_root_t root =
+		__atomic_load_n(&buffer_pool->root, __ATOMIC_RELAXED);
 	do {
-		root = g_atomic_pointer_get(&buffer_pool->root);
-		new_root->next = root;
-	} while (!g_atomic_pointer_compare_and_exchange(
-		         (void **)&buffer_pool->root, root, new_root));
+		new_root->next = BUFFER_POOL_ROOT_INDEX(root);
+	} while (!__atomic_compare_exchange_n(
+		         &buffer_pool->root, &root,
+		         BUFFER_POOL_ROOT(index, BUFFER_POOL_ROOT_TAG(root) + 1),
+		         true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
 #endif
 }
 
@@ -81,16 +282,25 @@ buffer_pool_pop(struct buffer_pool *buffer_pool)
 	root = buffer_pool->root;
 	buffer_pool->root = (root ? root->next : root);
 	g_mutex_unlock(&buffer_pool->lock);
+	if (root) root->next = NULL;
 #else
-	struct buffer_stack *new_root;
+	/* the value of root->next may be read after another thread has popped the
+	 * buffer, but in that case the generation count in the pool root will have
+	 * changed, and the exchange will fail */
+	buffer_pool_root_t tagged_root =
+		__atomic_load_n(&buffer_pool->root, __ATOMIC_ACQUIRE);
 	do {
-		root = g_atomic_pointer_get(&buffer_pool->root);
-		new_root = (root ? root->next : root);
+		root = buffer_pool_buffer(
+			buffer_pool, BUFFER_POOL_ROOT_INDEX(tagged_root));
 	} while (root != NULL &&
-	         !g_atomic_pointer_compare_and_exchange(
-		         (void **)&buffer_pool->root, root, new_root));
+	         !__atomic_compare_exchange_n(
+		         &buffer_pool->root, &tagged_root,
+		         BUFFER_POOL_ROOT(
+			         __atomic_load_n(&root->next, __ATOMIC_RELAXED),
+			         BUFFER_POOL_ROOT_TAG(tagged_root) + 1),
+		         true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+	if (root) root->next = 0;
 #endif
-	if (root) root->next = NULL;
 	return root;
 }
 
@@ -104,6 +314,94 @@ buffer_pool_pop_nonnull(struct buffer_pool *buffer_pool)
 	return result;
 }
 
+/* Push a chain of buffers, already linked from 'first' to 'last', onto the
+ * pool stack in a single operation. */
+static inline void
+buffer_pool_push_chain(struct buffer_pool *buffer_pool, void *first,
+                       struct buffer_stack *last)
+{
+#if BUFFER_POOL_LOCK
+	g_mutex_lock(&buffer_pool->lock);
+	last->next = buffer_pool->root;
+	buffer_pool->root = first;
+	g_mutex_unlock(&buffer_pool->lock);
+#else
+	guint32 index = buffer_pool_index(buffer_pool, first);
+	buffer_pool_root_t root =
+		__atomic_load_n(&buffer_pool->root, __ATOMIC_RELAXED);
+	do {
+		last->next = BUFFER_POOL_ROOT_INDEX(root);
+	} while (!__atomic_compare_exchange_n(
+		         &buffer_pool->root, &root,
+		         BUFFER_POOL_ROOT(index, BUFFER_POOL_ROOT_TAG(root) + 1),
+		         true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+#endif
+}
+
+/* Push the 'num_buffers' buffers in 'buffers' onto the pool stack in a single
+ * operation. */
+static inline void
+buffer_pool_push_n(struct buffer_pool *buffer_pool, void **buffers,
+                   unsigned num_buffers)
+{
+	if (num_buffers == 0) return;
+	for (unsigned i = 0; i < num_buffers - 1; ++i)
+#if BUFFER_POOL_LOCK
+		((struct buffer_stack *)buffers[i])->next = buffers[i + 1];
+#else
+		((struct buffer_stack *)buffers[i])->next =
+			buffer_pool_index(buffer_pool, buffers[i + 1]);
+#endif
+	buffer_pool_push_chain(buffer_pool, buffers[0], buffers[num_buffers - 1]);
+}
+
+/* Pop up to 'max_buffers' buffers from the pool stack in a single operation,
+ * storing them in 'buffers'. Returns the number of buffers popped, which is
+ * less than 'max_buffers' only when the pool has fewer free buffers. */
+static inline unsigned
+buffer_pool_pop_n(struct buffer_pool *buffer_pool, void **buffers,
+                  unsigned max_buffers)
+{
+	unsigned n = 0;
+#if BUFFER_POOL_LOCK
+	g_mutex_lock(&buffer_pool->lock);
+	struct buffer_stack *root = buffer_pool->root;
+	while (root != NULL && n < max_buffers) {
+		buffers[n++] = root;
+		root = root->next;
+	}
+	buffer_pool->root = root;
+	g_mutex_unlock(&buffer_pool->lock);
+	for (unsigned i = 0; i < n; ++i)
+		((struct buffer_stack *)buffers[i])->next = NULL;
+#else
+	/* As in buffer_pool_pop(), the links followed here may be stale, and even
+	 * hold arbitrary values written by the current owners of the buffers, but
+	 * only when the exchange is bound to fail. Links beyond the end of the pool
+	 * are never followed. */
+	buffer_pool_root_t tagged_root =
+		__atomic_load_n(&buffer_pool->root, __ATOMIC_ACQUIRE);
+	guint32 next;
+	do {
+		n = 0;
+		next = BUFFER_POOL_ROOT_INDEX(tagged_root);
+		while (next != 0 && next <= buffer_pool->num_buffers
+		       && n < max_buffers) {
+			struct buffer_stack *buff = buffer_pool_buffer(buffer_pool, next);
+			buffers[n++] = buff;
+			next = __atomic_load_n(&buff->next, __ATOMIC_RELAXED);
+		}
+	} while (n > 0 &&
+	         !__atomic_compare_exchange_n(
+		         &buffer_pool->root, &tagged_root,
+		         BUFFER_POOL_ROOT(next, BUFFER_POOL_ROOT_TAG(tagged_root) + 1),
+		         true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+	for (unsigned i = 0; i < n; ++i)
+		((struct buffer_stack *)buffers[i])->next = 0;
+#endif
+	return n;
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,141 @@
+//
+// Copyright © 2016 Associated Universities, Inc. Washington DC, USA.
+//
+// This file is part of vysmaw.
+//
+// vysmaw is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// vysmaw is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// vysmaw.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vysmaw_private.h>
+
+/* Test that every buffer of an aligned pool is aligned, in all chunks of an
+ * elastic pool, and when taken through the per-thread magazines of a spectrum
+ * buffer pool, whose refills span chunk boundaries. */
+
+#define CHUNK_NUM_BUFFERS 7
+#define MAX_CHUNKS 4
+#define MAGAZINE_SIZE 5
+
+static const size_t alignments[] = { 8, 64, 512, 4096 };
+static const size_t buffer_sizes[] = { 24, 100, 1000, 4097 };
+
+static unsigned num_failures = 0;
+
+static void
+check_aligned(const char *what, const void *buffer, size_t buffer_size,
+              size_t alignment)
+{
+	if (((uintptr_t)buffer % alignment) != 0) {
+		fprintf(stderr, "%s: buffer %p (size %zu) not aligned to %zu\n",
+		        what, buffer, buffer_size, alignment);
+		num_failures++;
+	}
+}
+
+static void
+check_count(const char *what, unsigned count, unsigned expected,
+            size_t buffer_size, size_t alignment)
+{
+	if (count != expected) {
+		fprintf(stderr, "%s: took %u buffers (size %zu, alignment %zu), "
+		        "expected %u\n",
+		        what, count, buffer_size, alignment, expected);
+		num_failures++;
+	}
+}
+
+/* commit and publish every remaining chunk of an elastic pool, as the
+ * spectrum_reader does when the pool is starved */
+static void
+grow_fully(struct buffer_pool *pool)
+{
+	int chunk;
+	while ((chunk = buffer_pool_commit_chunk(pool)) >= 0)
+		buffer_pool_publish_chunk(pool, chunk);
+}
+
+static void
+test_buffer_pool(size_t buffer_size, size_t alignment, unsigned max_chunks)
+{
+	const char *what = ((max_chunks > 1)
+	                    ? "elastic buffer_pool"
+	                    : "buffer_pool");
+	struct buffer_pool *pool = buffer_pool_new_elastic(
+		CHUNK_NUM_BUFFERS, buffer_size, alignment, max_chunks, 0);
+	if (pool->buffer_size % alignment != 0) {
+		fprintf(stderr, "%s: stride %zu not a multiple of alignment %zu\n",
+		        what, pool->buffer_size, alignment);
+		num_failures++;
+	}
+	grow_fully(pool);
+
+	unsigned count = 0;
+	void *buffers[CHUNK_NUM_BUFFERS * MAX_CHUNKS];
+	void *buffer;
+	while (count < G_N_ELEMENTS(buffers)
+	       && (buffer = buffer_pool_pop(pool)) != NULL) {
+		check_aligned(what, buffer, buffer_size, alignment);
+		buffers[count++] = buffer;
+	}
+	check_count(what, count, CHUNK_NUM_BUFFERS * pool->max_chunks,
+	            buffer_size, alignment);
+	buffer_pool_push_n(pool, buffers, count);
+	buffer_pool_free(pool);
+}
+
+static void
+test_spectrum_buffer_pool(size_t buffer_size, size_t alignment)
+{
+	const char *what = "spectrum_buffer_pool";
+	struct spectrum_buffer_pool *sb_pool = spectrum_buffer_pool_new(
+		buffer_size, alignment, CHUNK_NUM_BUFFERS, MAX_CHUNKS, MAGAZINE_SIZE,
+		0);
+	grow_fully(sb_pool->pool);
+	unsigned expected = CHUNK_NUM_BUFFERS * sb_pool->pool->max_chunks;
+
+	/* take everything twice, so that the second round comes from magazines
+	 * that were flushed back to the pool in a different order */
+	void *buffers[CHUNK_NUM_BUFFERS * MAX_CHUNKS];
+	for (unsigned round = 0; round < 2; ++round) {
+		unsigned count = 0;
+		void *buffer;
+		while (count < G_N_ELEMENTS(buffers)
+		       && (buffer = spectrum_buffer_pool_pop(sb_pool)) != NULL) {
+			check_aligned(what, buffer, buffer_size, alignment);
+			buffers[count++] = buffer;
+		}
+		check_count(what, count, expected, buffer_size, alignment);
+		for (unsigned i = 0; i < count; ++i)
+			spectrum_buffer_pool_push(sb_pool, buffers[i]);
+	}
+	spectrum_buffer_pool_retire(sb_pool);
+}
+
+int
+main(int argc, char *argv[])
+{
+	for (unsigned a = 0; a < G_N_ELEMENTS(alignments); ++a) {
+		for (unsigned s = 0; s < G_N_ELEMENTS(buffer_sizes); ++s) {
+			test_buffer_pool(buffer_sizes[s], alignments[a], 1);
+			test_buffer_pool(buffer_sizes[s], alignments[a], MAX_CHUNKS);
+			test_spectrum_buffer_pool(buffer_sizes[s], alignments[a]);
+		}
+	}
+	if (num_failures > 0) {
+		fprintf(stderr, "%u failures\n", num_failures);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,190 @@
+//
+// Copyright © 2016 Associated Universities, Inc. Washington DC, USA.
+//
+// This file is part of vysmaw.
+//
+// vysmaw is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// vysmaw is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// vysmaw.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <glib.h>
+#include <buffer_pool.h>
+
+/* Multiple producer/multiple consumer stress test and throughput benchmark of
+ * buffer_pool. Every thread repeatedly takes buffers from a shared pool, stamps
+ * them with its own tag, and returns them after checking that the tags are
+ * intact, which would not be the case had any buffer been handed to two threads
+ * at once. The pool is then checked to hold every buffer exactly once. The same
+ * source is built with the lockless implementation (buffer_pool_bench) and with
+ * BUFFER_POOL_LOCK (buffer_pool_bench_lock), for comparison. */
+
+#if BUFFER_POOL_LOCK
+# define IMPLEMENTATION "lock"
+#else
+# define IMPLEMENTATION "lockless"
+#endif
+
+/* the stamp follows the stack link, which is reset by the pop functions */
+struct stamped_buffer {
+	guint64 link;
+	guint64 tag;
+};
+
+struct worker {
+	struct buffer_pool *pool;
+	unsigned id;
+	unsigned num_ops;
+	unsigned batch_size;
+	guint64 num_empty;
+	guint64 num_corrupt;
+	GThread *thread;
+};
+
+static unsigned
+take(struct worker *worker, void **buffers)
+{
+	if (worker->batch_size == 0) {
+		buffers[0] = buffer_pool_pop(worker->pool);
+		return (buffers[0] != NULL) ? 1 : 0;
+	}
+	return buffer_pool_pop_n(worker->pool, buffers, worker->batch_size);
+}
+
+static void
+give(struct worker *worker, void **buffers, unsigned n)
+{
+	if (worker->batch_size == 0)
+		buffer_pool_push(worker->pool, buffers[0]);
+	else
+		buffer_pool_push_n(worker->pool, buffers, n);
+}
+
+static void *
+work(struct worker *worker)
+{
+	void **buffers = g_new(void *, MAX(worker->batch_size, 1));
+	for (unsigned op = 0; op < worker->num_ops; ++op) {
+		unsigned n = take(worker, buffers);
+		if (G_UNLIKELY(n == 0)) {
+			worker->num_empty++;
+			g_thread_yield();
+			continue;
+		}
+		guint64 tag = ((guint64)worker->id << 32) | op;
+		for (unsigned i = 0; i < n; ++i)
+			__atomic_store_n(&((struct stamped_buffer *)buffers[i])->tag, tag,
+			                 __ATOMIC_RELAXED);
+		for (unsigned i = 0; i < n; ++i)
+			if (__atomic_load_n(&((struct stamped_buffer *)buffers[i])->tag,
+			                    __ATOMIC_RELAXED) != tag)
+				worker->num_corrupt++;
+		give(worker, buffers, n);
+	}
+	g_free(buffers);
+	return NULL;
+}
+
+/* take every buffer from the pool, returning the number of buffers that are
+ * missing or were found more than once */
+static size_t
+check_pool(struct buffer_pool *pool)
+{
+	size_t num_buffers = pool->pool_size / pool->buffer_size;
+	guint8 *seen = g_new0(guint8, num_buffers);
+	size_t result = 0;
+	size_t num_seen = 0;
+	void *buffer;
+	while ((buffer = buffer_pool_pop(pool)) != NULL) {
+		size_t i = (buffer - pool->pool) / pool->buffer_size;
+		if (i >= num_buffers || seen[i]++ > 0) ++result;
+		else ++num_seen;
+	}
+	g_free(seen);
+	return result + (num_buffers - num_seen);
+}
+
+int
+main(int argc, char *argv[])
+{
+	gint num_threads = 4;
+	gint num_ops = 1000000;
+	gint num_buffers = 64;
+	gint batch_size = 0;
+	GOptionEntry entries[] = {
+		{"threads", 't', 0, G_OPTION_ARG_INT, &num_threads,
+		 "Number of threads", "N"},
+		{"ops", 'n', 0, G_OPTION_ARG_INT, &num_ops,
+		 "Number of take/return operations by each thread", "N"},
+		{"buffers", 'b', 0, G_OPTION_ARG_INT, &num_buffers,
+		 "Number of buffers in pool", "N"},
+		{"batch", 'k', 0, G_OPTION_ARG_INT, &batch_size,
+		 "Buffers per operation, using buffer_pool_pop_n() and "
+		 "buffer_pool_push_n(); 0 to use buffer_pool_pop() and "
+		 "buffer_pool_push()", "N"},
+		{NULL}
+	};
+	GOptionContext *context = g_option_context_new(NULL);
+	g_option_context_set_summary(
+		context, "Stress test and benchmark of buffer_pool (" IMPLEMENTATION
+		" implementation)");
+	g_option_context_add_main_entries(context, entries, NULL);
+	GError *error = NULL;
+	bool ok = g_option_context_parse(context, &argc, &argv, &error);
+	g_option_context_free(context);
+	if (!ok || num_threads < 1 || num_ops < 1 || num_buffers < 1
+	    || batch_size < 0) {
+		fprintf(stderr, "%s\n",
+		        (error != NULL) ? error->message : "Invalid arguments");
+		if (error != NULL) g_error_free(error);
+		return EXIT_FAILURE;
+	}
+
+	struct buffer_pool *pool =
+		buffer_pool_new(num_buffers, sizeof(struct stamped_buffer));
+	struct worker *workers = g_new0(struct worker, num_threads);
+	gint64 start = g_get_monotonic_time();
+	for (unsigned i = 0; i < num_threads; ++i) {
+		workers[i].pool = pool;
+		workers[i].id = i;
+		workers[i].num_ops = num_ops;
+		workers[i].batch_size = batch_size;
+		workers[i].thread =
+			g_thread_new("worker", (GThreadFunc)work, &workers[i]);
+	}
+	guint64 num_empty = 0;
+	guint64 num_corrupt = 0;
+	for (unsigned i = 0; i < num_threads; ++i) {
+		g_thread_join(workers[i].thread);
+		num_empty += workers[i].num_empty;
+		num_corrupt += workers[i].num_corrupt;
+	}
+	gint64 end = g_get_monotonic_time();
+	g_free(workers);
+
+	size_t num_lost = check_pool(pool);
+	buffer_pool_free(pool);
+
+	double sec = (end - start) / 1e6;
+	double total = (double)num_threads * num_ops;
+	printf("%-8s %2d thread(s), batch %2d: %8.1f ns/op, %7.2f Mop/s, "
+	       "%" G_GUINT64_FORMAT " empty\n",
+	       IMPLEMENTATION, num_threads, batch_size, 1e9 * sec / total,
+	       total / sec / 1e6, num_empty);
+	if (num_corrupt > 0 || num_lost > 0) {
+		fprintf(stderr, "%" G_GUINT64_FORMAT " buffers shared by threads, "
+		        "%zu buffers lost or duplicated\n", num_corrupt, num_lost);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,300 @@
+//
+// Copyright © 2016 Associated Universities, Inc. Washington DC, USA.
+//
+// This file is part of vysmaw.
+//
+// vysmaw is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// vysmaw is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// vysmaw.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vysmaw_private.h>
+
+/* Test the overflow policies, maximum message age and callback time limit of
+ * consumer message queues, by pushing messages to the queues of a handle with
+ * only what the queues use, as the service threads do, and popping them with
+ * vysmaw_message_queue_pop_batch() and releasing them with
+ * vysmaw_message_unref_batch(), as clients do. */
+
+#define MAX_DEPTH 8
+#define NUM_PUSHED 20
+#define MAX_MESSAGES (NUM_PUSHED + 2)
+
+static unsigned num_failures = 0;
+
+#define CHECK(cond, ...) G_STMT_START {                   \
+		if (!(cond)) { \
+			fprintf(stderr, "%s: ", name); \
+			fprintf(stderr, __VA_ARGS__); \
+			fprintf(stderr, "\n"); \
+			num_failures++; \
+		} \
+	} G_STMT_END
+
+static vysmaw_handle
+handle_new(struct vysmaw_consumer *consumer)
+{
+	struct vysmaw_configuration config = {
+		.spectrum_buffer_pool_size = 1 << 16,
+		.max_spectrum_buffer_size = 1 << 12,
+		.rdma_read_max_posted = 10,
+		.max_depth_message_queue = MAX_DEPTH,
+		.queue_resume_overhead = 0
+	};
+	vysmaw_handle result = g_new0(struct _vysmaw_handle, 1);
+	result->refcount = 1;
+	memcpy((void *)&result->config, &config, sizeof(config));
+	result->message_slab =
+		hot_path_slab_new(&result->config, sizeof(struct vysmaw_message));
+	GArray *consumers = g_array_new(FALSE, FALSE, sizeof(struct consumer));
+	init_consumer(result, consumer, consumers);
+	result->num_consumers = consumers->len;
+	result->consumers = (struct consumer *)g_array_free(consumers, false);
+	return result;
+}
+
+/* check that every message, and every reference to the queue that it held,
+ * has been released, and free the handle */
+static void
+handle_free(const char *name, vysmaw_handle handle)
+{
+	CHECK(handle->refcount == 1, "handle refcount %d", handle->refcount);
+	CHECK(handle->consumers[0].queue.refcount == 1, "queue refcount %d",
+	      handle->consumers[0].queue.refcount);
+	message_queue_unref(&handle->consumers[0].queue);
+	g_array_free(handle->consumers[0].pass_filter_array, true);
+	g_free(handle->consumers);
+	buffer_pool_free(handle->message_slab);
+	g_free(handle);
+}
+
+/* a spectrum message, without a buffer, with timestamp 't' (ns) */
+static struct vysmaw_message *
+spectrum_message_new(vysmaw_handle handle, guint64 t)
+{
+	struct vysmaw_message *result =
+		message_new(handle, VYSMAW_MESSAGE_VALID_BUFFER);
+	memset(&result->content.valid_buffer, 0,
+	       sizeof(result->content.valid_buffer));
+	result->content.valid_buffer.info.timestamp = t;
+	return result;
+}
+
+static void
+push(vysmaw_handle handle, unsigned n, guint64 t0)
+{
+	for (unsigned i = 0; i < n; ++i)
+		message_queues_push(spectrum_message_new(handle, t0 + i), 1);
+}
+
+/* pop all messages, and check their types and the timestamps of spectrum
+ * messages, given by 'expected': an overflow (or expiry) report with count 'n'
+ * is written as "O<n>" ("E<n>"), and a spectrum with timestamp 't' as "<t>" */
+static void
+pop(const char *name, vysmaw_handle handle, const char *expected)
+{
+	struct vysmaw_message *msgs[MAX_MESSAGES];
+	unsigned n = vysmaw_message_queue_pop_batch(
+		&handle->consumers[0].queue, msgs, MAX_MESSAGES, 0);
+	GString *popped = g_string_new(NULL);
+	for (unsigned i = 0; i < n; ++i) {
+		if (i > 0) g_string_append_c(popped, ' ');
+		switch (msgs[i]->typ) {
+		case VYSMAW_MESSAGE_QUEUE_OVERFLOW:
+			g_string_append_printf(popped, "O%u", msgs[i]->content.num_overflow);
+			break;
+		case VYSMAW_MESSAGE_EXPIRED:
+			g_string_append_printf(popped, "E%u", msgs[i]->content.num_expired);
+			break;
+		case VYSMAW_MESSAGE_VALID_BUFFER:
+			g_string_append_printf(
+				popped, "%" G_GUINT64_FORMAT,
+				(guint64)msgs[i]->content.valid_buffer.info.timestamp);
+			break;
+		default:
+			g_string_append_printf(popped, "?%d", msgs[i]->typ);
+			break;
+		}
+	}
+	CHECK(strcmp(popped->str, expected) == 0, "popped \"%s\", expected \"%s\"",
+	      popped->str, expected);
+	g_string_free(popped, true);
+	vysmaw_message_unref_batch(msgs, n);
+}
+
+static void
+check_status(const char *name, vysmaw_handle handle,
+             const struct vysmaw_message_queue_status *expected)
+{
+	struct vysmaw_message_queue_status status;
+	vysmaw_message_queue_status(&handle->consumers[0].queue, &status);
+	CHECK(status.depth == expected->depth, "depth %zu, expected %zu",
+	      status.depth, expected->depth);
+	CHECK(status.num_dropped_newest == expected->num_dropped_newest,
+	      "%" G_GUINT64_FORMAT " dropped newest, expected %" G_GUINT64_FORMAT,
+	      status.num_dropped_newest, expected->num_dropped_newest);
+	CHECK(status.num_dropped_oldest == expected->num_dropped_oldest,
+	      "%" G_GUINT64_FORMAT " dropped oldest, expected %" G_GUINT64_FORMAT,
+	      status.num_dropped_oldest, expected->num_dropped_oldest);
+	CHECK(status.num_sampled_out == expected->num_sampled_out,
+	      "%" G_GUINT64_FORMAT " sampled out, expected %" G_GUINT64_FORMAT,
+	      status.num_sampled_out, expected->num_sampled_out);
+	CHECK(status.num_expired == expected->num_expired,
+	      "%" G_GUINT64_FORMAT " expired, expected %" G_GUINT64_FORMAT,
+	      status.num_expired, expected->num_expired);
+	CHECK(status.num_callback_overruns == expected->num_callback_overruns,
+	      "%" G_GUINT64_FORMAT " callback overruns, expected %" G_GUINT64_FORMAT,
+	      status.num_callback_overruns, expected->num_callback_overruns);
+}
+
+static void
+test_drop_newest(void)
+{
+	const char *name = "drop newest";
+	struct vysmaw_consumer consumer = {
+		.overflow_policy = VYSMAW_OVERFLOW_DROP_NEWEST
+	};
+	vysmaw_handle handle = handle_new(&consumer);
+	push(handle, NUM_PUSHED, 0);
+	check_status(name, handle, &(struct vysmaw_message_queue_status){
+			.depth = MAX_DEPTH,
+			.num_dropped_newest = NUM_PUSHED - MAX_DEPTH});
+	pop(name, handle, "0 1 2 3 4 5 6 7");
+	/* the next message is preceded by the overflow report */
+	push(handle, 1, 100);
+	pop(name, handle, "O12 100");
+	handle_free(name, handle);
+}
+
+static void
+test_drop_oldest(void)
+{
+	const char *name = "drop oldest";
+	struct vysmaw_consumer consumer = {
+		.overflow_policy = VYSMAW_OVERFLOW_DROP_OLDEST
+	};
+	vysmaw_handle handle = handle_new(&consumer);
+	push(handle, NUM_PUSHED, 0);
+	check_status(name, handle, &(struct vysmaw_message_queue_status){
+			.depth = MAX_DEPTH,
+			.num_dropped_oldest = NUM_PUSHED - MAX_DEPTH});
+	pop(name, handle, "12 13 14 15 16 17 18 19");
+	push(handle, 1, 100);
+	pop(name, handle, "O12 100");
+	handle_free(name, handle);
+}
+
+static void
+test_sample(void)
+{
+	const char *name = "sample";
+	struct vysmaw_consumer consumer = {
+		.overflow_policy = VYSMAW_OVERFLOW_SAMPLE,
+		.overflow_sample_interval = 4
+	};
+	vysmaw_handle handle = handle_new(&consumer);
+	/* once the queue is within the resumption overhead (of one message) of
+	 * its maximum depth, only every fourth message is queued, until it is
+	 * full */
+	push(handle, NUM_PUSHED, 0);
+	check_status(name, handle, &(struct vysmaw_message_queue_status){
+			.depth = MAX_DEPTH,
+			.num_sampled_out = 3,
+			.num_dropped_newest = NUM_PUSHED - MAX_DEPTH - 3});
+	pop(name, handle, "0 1 2 3 4 5 6 10");
+	push(handle, 1, 100);
+	pop(name, handle, "O12 100");
+	handle_free(name, handle);
+}
+
+static void
+test_expiry(void)
+{
+	const char *name = "expiry";
+	struct vysmaw_consumer consumer = {
+		.overflow_policy = VYSMAW_OVERFLOW_DROP_NEWEST,
+		.max_message_age = 1000000,
+		.message_age_reference = VYSMAW_AGE_FROM_TIMESTAMP
+	};
+	vysmaw_handle handle = handle_new(&consumer);
+	guint64 now = 1000 * (guint64)g_get_real_time();
+	guint64 old = now - 10000000000ULL;
+
+	/* expired messages are discarded, and reported, by the consumer */
+	push(handle, 3, old);
+	push(handle, 2, now);
+	char expected[100];
+	sprintf(expected, "E3 %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT,
+	        now, now + 1);
+	pop(name, handle, expected);
+
+	/* and by the producer, once the queue is within the resumption overhead
+	 * of its maximum depth, before any message is dropped for lack of room */
+	push(handle, MAX_DEPTH - 1, old);
+	push(handle, 1, now);
+	check_status(name, handle, &(struct vysmaw_message_queue_status){
+			.depth = 1,
+			.num_expired = 3 + MAX_DEPTH - 1});
+	sprintf(expected, "E%u %" G_GUINT64_FORMAT, MAX_DEPTH - 1, now);
+	pop(name, handle, expected);
+	handle_free(name, handle);
+}
+
+static void
+sleeping_callback(struct vysmaw_message *message, unsigned *sleep_usec)
+{
+	g_usleep(*sleep_usec);
+	vysmaw_message_unref(message);
+}
+
+static void
+test_callback_time_limit(void)
+{
+	const char *name = "callback time limit";
+	unsigned sleep_usec = 0;
+	struct vysmaw_consumer consumer = {
+		.callback = (vysmaw_message_callback)sleeping_callback,
+		.callback_data = &sleep_usec,
+		.callback_time_limit = 10000
+	};
+	vysmaw_handle handle = handle_new(&consumer);
+	/* spectrum messages go to the callback, not the queue */
+	push(handle, 2, 0);
+	sleep_usec = 20000;
+	push(handle, 1, 0);
+	check_status(name, handle, &(struct vysmaw_message_queue_status){
+			.depth = 0,
+			.num_callback_overruns = 1});
+	struct vysmaw_message_queue_status status;
+	vysmaw_message_queue_status(&handle->consumers[0].queue, &status);
+	CHECK(status.max_callback_time >= sleep_usec,
+	      "maximum callback time %" G_GUINT64_FORMAT " us, expected at least "
+	      "%u us", status.max_callback_time, sleep_usec);
+	handle_free(name, handle);
+}
+
+int
+main(int argc, char *argv[])
+{
+	test_drop_newest();
+	test_drop_oldest();
+	test_sample();
+	test_expiry();
+	test_callback_time_limit();
+
+	if (num_failures > 0) {
+		fprintf(stderr, "%u failures\n", num_failures);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
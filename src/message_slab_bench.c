@@ -0,0 +1,124 @@
+//
+// Copyright © 2016 Associated Universities, Inc. Washington DC, USA.
+//
+// This file is part of vysmaw.
+//
+// vysmaw is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// vysmaw is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// vysmaw.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vysmaw_private.h>
+
+/* Benchmark of vysmaw_message allocation while every buffer of the spectrum
+ * buffer pools is held by a message, the worst case for the message slab. The
+ * handle's slab is sized first as it was before hot-path slabs could grow (for
+ * the buffers of one chunk of a single pool, plus the posted reads of one
+ * connection), and then by hot_path_slab_new(). For each, the number of
+ * messages allocated from the heap, rather than the slab, and the time per
+ * allocation are reported. */
+
+static void
+run(const char *name, vysmaw_handle handle, struct buffer_pool *slab,
+    size_t num_live, unsigned num_rounds)
+{
+	handle->message_slab = slab;
+	struct vysmaw_message **msgs = g_new(struct vysmaw_message *, num_live);
+	guint64 num_heap = 0;
+	gint64 start = g_get_monotonic_time();
+	for (unsigned round = 0; round < num_rounds; ++round) {
+		for (size_t i = 0; i < num_live; ++i) {
+			msgs[i] = message_new(handle, VYSMAW_MESSAGE_QUEUE_OVERFLOW);
+			msgs[i]->content.num_overflow = 0;
+			if (!buffer_pool_contains(slab, msgs[i]))
+				++num_heap;
+		}
+		vysmaw_message_unref_batch(msgs, num_live);
+	}
+	gint64 end = g_get_monotonic_time();
+	g_free(msgs);
+	printf("%-8s slab of %8zu: %10" G_GUINT64_FORMAT " of %10" G_GUINT64_FORMAT
+	       " messages from heap, %6.1f ns/message\n",
+	       name, slab->num_buffers, num_heap,
+	       (guint64)num_rounds * num_live,
+	       1e3 * (end - start) / ((double)num_rounds * num_live));
+	buffer_pool_free(slab);
+}
+
+int
+main(int argc, char *argv[])
+{
+	gint pool_size = 10485760;
+	gint pool_max_size = 0;
+	gint max_buffer_size = 8192;
+	gint max_posted = 1000;
+	gboolean single_pool = false;
+	gint num_rounds = 10;
+	GOptionEntry entries[] = {
+		{"pool-size", 's', 0, G_OPTION_ARG_INT, &pool_size,
+		 "Spectrum buffer pool size", "BYTES"},
+		{"pool-max-size", 'm', 0, G_OPTION_ARG_INT, &pool_max_size,
+		 "Spectrum buffer pool maximum size", "BYTES"},
+		{"buffer-size", 'b', 0, G_OPTION_ARG_INT, &max_buffer_size,
+		 "Maximum spectrum buffer size", "BYTES"},
+		{"posted", 'p', 0, G_OPTION_ARG_INT, &max_posted,
+		 "Maximum number of posted reads per connection", "N"},
+		{"single", '1', 0, G_OPTION_ARG_NONE, &single_pool,
+		 "Use a single spectrum buffer pool", NULL},
+		{"rounds", 'n', 0, G_OPTION_ARG_INT, &num_rounds,
+		 "Number of times every buffer is held by a message", "N"},
+		{NULL}
+	};
+	GOptionContext *context = g_option_context_new(NULL);
+	g_option_context_set_summary(
+		context, "Benchmark of vysmaw_message allocation from the message slab");
+	g_option_context_add_main_entries(context, entries, NULL);
+	GError *error = NULL;
+	bool ok = g_option_context_parse(context, &argc, &argv, &error);
+	g_option_context_free(context);
+	if (!ok || pool_size < 1 || pool_max_size < 0 || max_buffer_size < 1
+	    || max_posted < 0 || num_rounds < 1) {
+		fprintf(stderr, "%s\n",
+		        (error != NULL) ? error->message : "Invalid arguments");
+		if (error != NULL) g_error_free(error);
+		return EXIT_FAILURE;
+	}
+
+	struct vysmaw_configuration config = {
+		.spectrum_buffer_pool_size = pool_size,
+		.spectrum_buffer_pool_max_size = pool_max_size,
+		.single_spectrum_buffer_pool = single_pool,
+		.max_spectrum_buffer_size = max_buffer_size,
+		.rdma_read_max_posted = max_posted
+	};
+	/* a handle with only what message_new() and message_free() use, as in
+	 * message_slab_test */
+	vysmaw_handle handle = g_new0(struct _vysmaw_handle, 1);
+	handle->refcount = 1;
+	memcpy((void *)&handle->config, &config, sizeof(config));
+	size_t num_live = spectrum_buffer_pools_chunk_num_buffers(&config)
+		* spectrum_buffer_pool_max_chunks(&config);
+
+	run("before", handle,
+	    buffer_pool_new(
+		    config.spectrum_buffer_pool_size / config.max_spectrum_buffer_size
+		    + config.rdma_read_max_posted,
+		    sizeof(struct vysmaw_message)),
+	    num_live, num_rounds);
+	run("after", handle,
+	    hot_path_slab_new(&config, sizeof(struct vysmaw_message)),
+	    num_live, num_rounds);
+	g_free(handle);
+	return EXIT_SUCCESS;
+}
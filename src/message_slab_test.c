@@ -0,0 +1,190 @@
+//
+// Copyright © 2016 Associated Universities, Inc. Washington DC, USA.
+//
+// This file is part of vysmaw.
+//
+// vysmaw is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// vysmaw is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// vysmaw.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vysmaw_private.h>
+
+/* Test that message_new() takes every message from the handle's slab, rather
+ * than the heap, as long as no more than hot_path_slab_capacity() messages are
+ * live, that the slab grows only as messages are needed, and that released
+ * messages, whether singly or in batches, are returned to the slab. Then test
+ * that several threads taking objects from a hot-path slab at once, as the
+ * users of the message slab do, get every object of the slab exactly once,
+ * which also covers growth of the (single threaded) rdma_req slab. */
+
+#define NUM_ROUNDS 3
+#define NUM_THREADS 4
+
+static unsigned num_failures = 0;
+
+/* allocate 'n' messages, returning the number not taken from the slab */
+static unsigned
+allocate(vysmaw_handle handle, struct vysmaw_message **msgs, size_t n)
+{
+	unsigned result = 0;
+	for (size_t i = 0; i < n; ++i) {
+		msgs[i] = message_new(handle, VYSMAW_MESSAGE_QUEUE_OVERFLOW);
+		msgs[i]->content.num_overflow = 0;
+		if (!buffer_pool_contains(handle->message_slab, msgs[i]))
+			++result;
+	}
+	return result;
+}
+
+static void
+test_message_slab(const struct vysmaw_configuration *config)
+{
+	/* a handle with only what message_new() and message_free() use; the
+	 * reference held here keeps messages from ever releasing it */
+	vysmaw_handle handle = g_new0(struct _vysmaw_handle, 1);
+	handle->refcount = 1;
+	memcpy((void *)&handle->config, config, sizeof(*config));
+	handle->message_slab =
+		hot_path_slab_new(&handle->config, sizeof(struct vysmaw_message));
+	size_t capacity = handle->message_slab->num_buffers;
+	if (capacity < hot_path_slab_capacity(&handle->config)) {
+		fprintf(stderr, "slab capacity %zu less than %zu\n",
+		        capacity, hot_path_slab_capacity(&handle->config));
+		num_failures++;
+	}
+	if (handle->message_slab->num_chunks != 1) {
+		fprintf(stderr, "slab created with %u chunks\n",
+		        handle->message_slab->num_chunks);
+		num_failures++;
+	}
+
+	struct vysmaw_message **msgs =
+		g_new(struct vysmaw_message *, capacity + 1);
+	for (unsigned round = 0; round < NUM_ROUNDS; ++round) {
+		unsigned num_heap = allocate(handle, msgs, capacity);
+		if (num_heap > 0) {
+			fprintf(stderr, "round %u: %u of %zu messages allocated from "
+			        "the heap\n", round, num_heap, capacity);
+			num_failures++;
+		}
+
+		/* beyond the capacity, messages come from the heap */
+		num_heap = allocate(handle, msgs + capacity, 1);
+		if (num_heap != 1) {
+			fprintf(stderr, "round %u: message beyond slab capacity "
+			        "allocated from the slab\n", round);
+			num_failures++;
+		}
+
+		/* alternate between single and batched release */
+		if (round % 2 == 0) {
+			for (size_t i = 0; i <= capacity; ++i)
+				vysmaw_message_unref(msgs[i]);
+		} else {
+			vysmaw_message_unref_batch(msgs, capacity + 1);
+		}
+		if (handle->refcount != 1) {
+			fprintf(stderr, "round %u: handle refcount %d after release\n",
+			        round, handle->refcount);
+			num_failures++;
+		}
+	}
+	g_free(msgs);
+	buffer_pool_free(handle->message_slab);
+	g_free(handle);
+}
+
+/* the stamp follows the stack link, which is reset by the pop functions */
+struct object {
+	guint64 link;
+	guint64 owner;
+};
+
+struct taker {
+	struct buffer_pool *slab;
+	guint64 id;
+	size_t num_taken;
+};
+
+static void *
+take_all(struct taker *taker)
+{
+	struct object *object;
+	while ((object = hot_path_slab_pop(taker->slab)) != NULL) {
+		object->owner = taker->id;
+		taker->num_taken++;
+	}
+	return NULL;
+}
+
+static void
+test_concurrent_growth(const struct vysmaw_configuration *config)
+{
+	struct buffer_pool *slab = hot_path_slab_new(config, sizeof(struct object));
+	struct taker takers[NUM_THREADS];
+	GThread *threads[NUM_THREADS];
+	for (unsigned i = 0; i < NUM_THREADS; ++i) {
+		takers[i].slab = slab;
+		takers[i].id = i + 1;
+		takers[i].num_taken = 0;
+		threads[i] = g_thread_new("taker", (GThreadFunc)take_all, &takers[i]);
+	}
+	size_t num_taken = 0;
+	for (unsigned i = 0; i < NUM_THREADS; ++i) {
+		g_thread_join(threads[i]);
+		num_taken += takers[i].num_taken;
+	}
+	if (num_taken != slab->num_buffers || slab->num_chunks != slab->max_chunks) {
+		fprintf(stderr, "%zu of %zu objects taken from %u of %u chunks\n",
+		        num_taken, slab->num_buffers, slab->num_chunks,
+		        slab->max_chunks);
+		num_failures++;
+	}
+
+	/* every object has been stamped by a single taker, and counted once */
+	size_t num_taken_by[NUM_THREADS] = {0};
+	for (size_t i = 0; i < slab->num_buffers; ++i) {
+		struct object *object = slab->pool + i * slab->buffer_size;
+		if (object->owner >= 1 && object->owner <= NUM_THREADS)
+			num_taken_by[object->owner - 1]++;
+	}
+	for (unsigned i = 0; i < NUM_THREADS; ++i) {
+		if (num_taken_by[i] != takers[i].num_taken) {
+			fprintf(stderr, "taker %u took %zu objects, %zu stamped\n",
+			        i + 1, takers[i].num_taken, num_taken_by[i]);
+			num_failures++;
+		}
+	}
+	buffer_pool_free(slab);
+}
+
+int
+main(int argc, char *argv[])
+{
+	/* a pool for each size class, each of which may grow to four chunks */
+	struct vysmaw_configuration config = {
+		.spectrum_buffer_pool_size = 1 << 16,
+		.spectrum_buffer_pool_max_size = 1 << 18,
+		.max_spectrum_buffer_size = 1 << 12,
+		.rdma_read_max_posted = 10
+	};
+	test_message_slab(&config);
+	test_concurrent_growth(&config);
+
+	if (num_failures > 0) {
+		fprintf(stderr, "%u failures\n", num_failures);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,118 @@
+//
+// Copyright © 2016 Associated Universities, Inc. Washington DC, USA.
+//
+// This file is part of vysmaw.
+//
+// vysmaw is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// vysmaw is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// vysmaw.  If not, see <http://www.gnu.org/licenses/>.
+//
+#define _GNU_SOURCE
+#include <numa_placement.h>
+#include <glib.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#define MAX_NUMA_NODES 1024
+
+static int
+read_sysfs_string(const char *path, gchar **contents)
+{
+	if (!g_file_get_contents(path, contents, NULL, NULL)) {
+		errno = ENOENT;
+		return -1;
+	}
+	return 0;
+}
+
+int
+numa_node_of_rdma_device(struct ibv_context *verbs)
+{
+	gchar *path =
+		g_build_filename(verbs->device->ibdev_path, "device", "numa_node", NULL);
+	gchar *contents = NULL;
+	int result = read_sysfs_string(path, &contents);
+	g_free(path);
+	if (result == 0) {
+		result = (int)strtol(contents, NULL, 10);
+		g_free(contents);
+		if (result < 0) {
+			errno = ENOENT;
+			result = -1;
+		}
+	}
+	return result;
+}
+
+int
+numa_bind_memory(void *addr, size_t len, int node)
+{
+	if (node < 0 || node >= MAX_NUMA_NODES) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (len == 0) return 0;
+
+	/* mbind() requires a page aligned region */
+	long page_size = sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t)addr & ~(page_size - 1);
+	uintptr_t end =
+		((uintptr_t)addr + len + page_size - 1) & ~(page_size - 1);
+
+	unsigned long nodemask[MAX_NUMA_NODES / (8 * sizeof(unsigned long))] = {0};
+	nodemask[node / (8 * sizeof(unsigned long))] =
+		1UL << (node % (8 * sizeof(unsigned long)));
+	/* MPOL_PREFERRED, rather than MPOL_BIND, so that allocation never fails
+	 * because the node is out of memory */
+	return (int)syscall(SYS_mbind, start, end - start, MPOL_PREFERRED, nodemask,
+	                    MAX_NUMA_NODES + 1, MPOL_MF_MOVE);
+}
+
+int
+numa_bind_thread(int node)
+{
+	if (node < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	gchar *path =
+		g_strdup_printf("/sys/devices/system/node/node%d/cpulist", node);
+	gchar *cpulist = NULL;
+	int rc = read_sysfs_string(path, &cpulist);
+	g_free(path);
+	if (rc != 0) return rc;
+
+	/* cpulist format is a comma-separated list of CPU numbers and ranges,
+	 * e.g. "0-13,28-41" */
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	gchar **ranges = g_strsplit(g_strstrip(cpulist), ",", -1);
+	for (gchar **range = ranges; *range != NULL; ++range) {
+		char *end;
+		long first = strtol(*range, &end, 10);
+		long last = ((*end == '-') ? strtol(end + 1, NULL, 10) : first);
+		for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+			if (cpu >= 0) CPU_SET(cpu, &cpus);
+	}
+	g_strfreev(ranges);
+	g_free(cpulist);
+
+	if (CPU_COUNT(&cpus) == 0) {
+		errno = ENOENT;
+		return -1;
+	}
+	return sched_setaffinity(0, sizeof(cpus), &cpus);
+}
@@ -0,0 +1,40 @@
+//
+// Copyright © 2016 Associated Universities, Inc. Washington DC, USA.
+//
+// This file is part of vysmaw.
+//
+// vysmaw is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// vysmaw is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// vysmaw.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef NUMA_PLACEMENT_H_
+#define NUMA_PLACEMENT_H_
+
+#include <infiniband/verbs.h>
+#include <stddef.h>
+
+/* Best-effort placement of memory and threads on a NUMA node. All functions
+ * return -1 and set errno when the placement could not be made, which callers
+ * are free to ignore, as placement affects only performance. */
+
+/* NUMA node of the device behind 'verbs', or -1 when unknown (as on hosts with
+ * a single node) */
+extern int numa_node_of_rdma_device(struct ibv_context *verbs)
+	__attribute__((nonnull));
+
+/* Bind the pages spanning the region [addr, addr + len) to 'node', moving
+ * pages that are already allocated elsewhere. */
+extern int numa_bind_memory(void *addr, size_t len, int node);
+
+/* Restrict the calling thread to the CPUs of 'node'. */
+extern int numa_bind_thread(int node);
+
+#endif /* NUMA_PLACEMENT_H_ */
@@ -0,0 +1,836 @@
+//
+// Copyright © 2016 Associated Universities, Inc. Washington DC, USA.
+//
+// This file is part of vysmaw.
+//
+// vysmaw is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// vysmaw is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// vysmaw.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <spectrum_selector.h>
+#include <shm_fanout.h>
+
+/* "vysmaw" followed by layout version */
+#define SHM_SEGMENT_MAGIC 0x7679736d61770002ULL
+
+#define SHM_EXPORT_BATCH_SIZE 256
+
+/* number of buffers that a client may hold beyond those in its ring, subject
+ * to the client's share of the pool */
+#define SHM_CLIENT_HELD_BUFFERS 256
+
+/* end of the list of released slots */
+#define SHM_SLOT_NONE G_MAXUINT32
+
+/* cache line size, for separation of fields written by different processes */
+#define SHM_LINE_SIZE 64
+
+enum shm_client_state {
+	SHM_CLIENT_FREE,
+	SHM_CLIENT_ATTACHING,
+	SHM_CLIENT_ACTIVE,
+	SHM_CLIENT_DETACHED
+};
+
+/* Shared memory object header. All fields but 'closed', 'end_code' and
+ * 'released' are constant once 'magic' has been set. */
+struct shm_segment {
+	guint64 magic;
+	guint64 size;
+	pid_t exporter_pid;
+	guint32 max_clients;
+	guint32 ring_length; // power of two
+	guint32 num_buffers;
+	guint32 buffer_stride;
+	guint64 rings_offset;
+	guint64 entries_offset;
+	guint64 slots_offset;
+	guint64 buffers_offset;
+	int closed; // set by exporter when it ends
+	int end_code;
+
+	/* list of slots released by clients, linked through 'next_released', and
+	 * taken as a whole by the exporter */
+	guint32 released __attribute__((aligned(SHM_LINE_SIZE)));
+};
+
+/* Per-client ring of buffer indexes. The exporter claims a free ring for a
+ * client only in the sense that it delivers to it once the client has set
+ * 'state' to SHM_CLIENT_ACTIVE; a client that has set SHM_CLIENT_DETACHED (or
+ * whose process has exited) has its buffers released, and its ring freed, by
+ * the exporter. */
+struct shm_client_ring {
+	int state;
+	pid_t pid;
+	guint32 num_lost; // spectra not delivered to client, not yet reported
+	int parked; // client is (about to be) waiting on 'tail'
+
+	/* exporter state; also the futex on which a parked client waits */
+	guint32 tail __attribute__((aligned(SHM_LINE_SIZE)));
+
+	/* client state */
+	guint32 head __attribute__((aligned(SHM_LINE_SIZE)));
+	guint32 num_released; // buffers released by client since attachment
+};
+
+struct shm_slot {
+	guint64 holders; // mask of clients holding the buffer
+	struct vysmaw_data_info info;
+	guint32 typ; // VYSMAW_MESSAGE_VALID_BUFFER or VYSMAW_MESSAGE_DIGEST_FAILURE
+	guint32 buffer_size;
+	guint32 next_released;
+};
+
+struct shm_layout {
+	struct shm_segment *segment;
+	struct shm_client_ring *rings;
+	guint32 *entries;
+	struct shm_slot *slots;
+	guint8 *buffers;
+};
+
+struct shm_export {
+	int fd;
+	struct shm_layout layout;
+	guint32 ring_mask;
+	guint64 active; // clients to which spectra are being delivered
+	guint64 pending; // clients with staged, but unpublished, entries
+	guint64 lost; // clients that have lost spectra since last publication
+	guint32 tails[VYSMAW_SHM_MAX_CLIENTS]; // including staged entries
+	guint32 delivered[VYSMAW_SHM_MAX_CLIENTS]; // buffers, since attachment
+	guint32 quota; // of buffers held by each client
+	guint32 *free_slots; // stack of slots that no client holds
+	guint32 num_free;
+	gint64 next_liveness_check;
+};
+
+struct shm_attachment {
+	size_t size;
+	struct shm_layout layout;
+	unsigned index; // of client ring
+	struct shm_client_ring *ring;
+	guint32 *entries; // of client ring
+	guint32 ring_mask;
+	guint32 num_buffers;
+	guint32 buffer_stride;
+};
+
+static int futex_wait(guint32 *addr, guint32 val, gint64 timeout)
+	__attribute__((nonnull));
+static void futex_wake(guint32 *addr)
+	__attribute__((nonnull));
+static bool process_exists(pid_t pid);
+static void shm_layout_init(
+	struct shm_layout *layout, struct shm_segment *segment)
+	__attribute__((nonnull));
+static struct shm_export *shm_export_new(
+	const struct vysmaw_configuration *config,
+	struct vys_error_record **error_record)
+	__attribute__((nonnull,malloc));
+static void shm_export_free(
+	struct shm_export *export, const struct vysmaw_configuration *config,
+	int end_code)
+	__attribute__((nonnull));
+static void shm_export_update_clients(struct shm_export *export, bool check)
+	__attribute__((nonnull));
+static void shm_export_lose(struct shm_export *export, guint64 clients)
+	__attribute__((nonnull));
+static void shm_export_collect_released(struct shm_export *export)
+	__attribute__((nonnull));
+static void shm_export_stage(
+	struct shm_export *export, const struct vysmaw_message *msg)
+	__attribute__((nonnull));
+static void shm_export_publish(struct shm_export *export)
+	__attribute__((nonnull));
+static void shm_release_slot(struct shm_attachment *shm, guint32 index)
+	__attribute__((nonnull));
+static struct vysmaw_message *shm_message_new(
+	vysmaw_handle handle, guint32 index)
+	__attribute__((nonnull,returns_nonnull,malloc));
+static guint32 shm_client_deliver(
+	vysmaw_handle handle, guint32 head, guint32 tail,
+	struct vys_signal_msg_payload *payload, consumer_mask_t *selections)
+	__attribute__((nonnull));
+
+static int
+futex_wait(guint32 *addr, guint32 val, gint64 timeout)
+{
+	struct timespec ts = {
+		.tv_sec = timeout / G_USEC_PER_SEC,
+		.tv_nsec = 1000 * (timeout % G_USEC_PER_SEC)
+	};
+	return syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void
+futex_wake(guint32 *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static bool
+process_exists(pid_t pid)
+{
+	return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+static void
+shm_layout_init(struct shm_layout *layout, struct shm_segment *segment)
+{
+	layout->segment = segment;
+	layout->rings = (void *)((guint8 *)segment + segment->rings_offset);
+	layout->entries = (void *)((guint8 *)segment + segment->entries_offset);
+	layout->slots = (void *)((guint8 *)segment + segment->slots_offset);
+	layout->buffers = (void *)((guint8 *)segment + segment->buffers_offset);
+}
+
+static struct shm_export *
+shm_export_new(const struct vysmaw_configuration *config,
+               struct vys_error_record **error_record)
+{
+	size_t alignment = config->spectrum_buffer_alignment;
+	if (alignment == 0 || (alignment & (alignment - 1)) != 0
+	    || alignment > VYSMAW_MAX_SPECTRUM_BUFFER_ALIGNMENT) {
+		MSG_ERROR(error_record, -1,
+		          "Invalid spectrum buffer alignment (%zu)", alignment);
+		return NULL;
+	}
+	size_t stride =
+		(config->max_spectrum_buffer_size + alignment - 1) & ~(alignment - 1);
+	size_t num_buffers =
+		(stride > 0) ? config->shm_buffer_pool_size / stride : 0;
+	if (num_buffers == 0 || num_buffers > G_MAXUINT32 || stride > G_MAXUINT32) {
+		MSG_ERROR(error_record, -1, "%s",
+		          "Invalid shared memory buffer pool size");
+		return NULL;
+	}
+	unsigned max_clients = config->shm_max_clients;
+	if (max_clients == 0 || max_clients > VYSMAW_SHM_MAX_CLIENTS) {
+		MSG_ERROR(error_record, -1,
+		          "Invalid maximum number of shared memory clients (%u)",
+		          max_clients);
+		return NULL;
+	}
+	if (config->shm_client_queue_length == 0
+	    || config->shm_client_queue_length > (1U << 30)) {
+		MSG_ERROR(error_record, -1,
+		          "Invalid shared memory client queue length (%u)",
+		          config->shm_client_queue_length);
+		return NULL;
+	}
+	guint32 ring_length = 2;
+	while (ring_length < config->shm_client_queue_length)
+		ring_length <<= 1;
+
+	/* layout */
+	struct shm_segment header = {
+		.exporter_pid = getpid(),
+		.max_clients = max_clients,
+		.ring_length = ring_length,
+		.num_buffers = num_buffers,
+		.buffer_stride = stride,
+		.closed = false,
+		.end_code = VYSMAW_NO_ERROR,
+		.released = SHM_SLOT_NONE
+	};
+	guint64 offset = SHM_LINE_SIZE * ((sizeof(header) - 1) / SHM_LINE_SIZE + 1);
+	header.rings_offset = offset;
+	offset += max_clients * sizeof(struct shm_client_ring);
+	header.entries_offset = offset;
+	offset += (guint64)max_clients * ring_length * sizeof(guint32);
+	offset = (offset + SHM_LINE_SIZE - 1) & ~(guint64)(SHM_LINE_SIZE - 1);
+	header.slots_offset = offset;
+	offset += num_buffers * sizeof(struct shm_slot);
+	offset = ((offset + VYSMAW_MAX_SPECTRUM_BUFFER_ALIGNMENT - 1)
+	          & ~(guint64)(VYSMAW_MAX_SPECTRUM_BUFFER_ALIGNMENT - 1));
+	header.buffers_offset = offset;
+	header.size = offset + num_buffers * stride;
+
+	/* replace any object left behind by a previous exporter; its clients
+	 * keep their mappings */
+	if (shm_unlink(config->shm_name) != 0 && errno != ENOENT) {
+		VERB_ERR(error_record, errno, "shm_unlink");
+		return NULL;
+	}
+	int fd = shm_open(config->shm_name, O_RDWR | O_CREAT | O_EXCL,
+	                  S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+	if (fd < 0) {
+		VERB_ERR(error_record, errno, "shm_open");
+		return NULL;
+	}
+	if (ftruncate(fd, header.size) != 0) {
+		VERB_ERR(error_record, errno, "ftruncate");
+		close(fd);
+		shm_unlink(config->shm_name);
+		return NULL;
+	}
+	struct shm_segment *segment =
+		mmap(NULL, header.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (segment == MAP_FAILED) {
+		VERB_ERR(error_record, errno, "mmap");
+		close(fd);
+		shm_unlink(config->shm_name);
+		return NULL;
+	}
+
+	/* the object is zero-filled, so all rings are free, and all slots
+	 * unheld; clients accept the header once they see the magic number */
+	memcpy(segment, &header, sizeof(header));
+	__atomic_store_n(&segment->magic, SHM_SEGMENT_MAGIC, __ATOMIC_RELEASE);
+
+	struct shm_export *result = g_new0(struct shm_export, 1);
+	result->fd = fd;
+	shm_layout_init(&result->layout, segment);
+	result->ring_mask = ring_length - 1;
+
+	/* every client is limited to its share of the pool, so that a client
+	 * that does not release its buffers loses spectra only to itself */
+	result->quota = MAX(MIN(ring_length + SHM_CLIENT_HELD_BUFFERS,
+	                        num_buffers / max_clients),
+	                    1);
+	result->free_slots = g_new(guint32, num_buffers);
+	for (guint32 i = 0; i < num_buffers; ++i)
+		result->free_slots[i] = num_buffers - 1 - i;
+	result->num_free = num_buffers;
+	return result;
+}
+
+static void
+shm_export_free(struct shm_export *export,
+                const struct vysmaw_configuration *config,
+                int end_code)
+{
+	struct shm_segment *segment = export->layout.segment;
+	segment->end_code = end_code;
+	__atomic_store_n(&segment->closed, true, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (unsigned i = 0; i < segment->max_clients; ++i)
+		futex_wake(&export->layout.rings[i].tail);
+	munmap(segment, segment->size);
+	close(export->fd);
+	shm_unlink(config->shm_name);
+	g_free(export->free_slots);
+	g_free(export);
+}
+
+/* Track attachment and detachment of clients. Rings of detached clients, and
+ * (when 'check' is true) of clients whose process no longer exists, are
+ * freed after releasing all of their buffers. Must not be called with staged
+ * entries. */
+static void
+shm_export_update_clients(struct shm_export *export, bool check)
+{
+	struct shm_segment *segment = export->layout.segment;
+	g_assert(export->pending == 0);
+	for (unsigned i = 0; i < segment->max_clients; ++i) {
+		struct shm_client_ring *ring = &export->layout.rings[i];
+		guint64 bit = (guint64)1 << i;
+		int state = __atomic_load_n(&ring->state, __ATOMIC_ACQUIRE);
+		if (check
+		    && (state == SHM_CLIENT_ACTIVE || state == SHM_CLIENT_ATTACHING)
+		    && !process_exists(__atomic_load_n(&ring->pid, __ATOMIC_RELAXED)))
+			state = SHM_CLIENT_DETACHED;
+		switch (state) {
+		case SHM_CLIENT_ACTIVE:
+			export->active |= bit;
+			break;
+
+		case SHM_CLIENT_DETACHED:
+			export->active &= ~bit;
+			for (guint32 j = 0; j < segment->num_buffers; ++j) {
+				if (__atomic_fetch_and(&export->layout.slots[j].holders, ~bit,
+				                       __ATOMIC_ACQ_REL) == bit)
+					export->free_slots[export->num_free++] = j;
+			}
+			export->delivered[i] = 0;
+			__atomic_store_n(&ring->num_released, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&ring->state, SHM_CLIENT_FREE, __ATOMIC_RELEASE);
+			break;
+
+		default:
+			export->active &= ~bit;
+			break;
+		}
+	}
+}
+
+static void
+shm_export_lose(struct shm_export *export, guint64 clients)
+{
+	export->lost |= clients;
+	while (clients != 0) {
+		unsigned i = __builtin_ctzll(clients);
+		__atomic_add_fetch(&export->layout.rings[i].num_lost, 1,
+		                   __ATOMIC_RELAXED);
+		clients &= clients - 1;
+	}
+}
+
+/* Move the slots released by clients onto the stack of free slots. */
+static void
+shm_export_collect_released(struct shm_export *export)
+{
+	struct shm_segment *segment = export->layout.segment;
+	guint32 index = __atomic_exchange_n(&segment->released, SHM_SLOT_NONE,
+	                                    __ATOMIC_ACQUIRE);
+	while (index < segment->num_buffers
+	       && export->num_free < segment->num_buffers) {
+		export->free_slots[export->num_free++] = index;
+		index = export->layout.slots[index].next_released;
+	}
+}
+
+/* Copy a message into a free buffer, and stage the buffer's index on the
+ * rings of all active clients with room for it, and that hold fewer buffers
+ * than the quota; spectra are lost only to the other clients. */
+static void
+shm_export_stage(struct shm_export *export, const struct vysmaw_message *msg)
+{
+	if (export->active == 0) return;
+
+	struct shm_segment *segment = export->layout.segment;
+	const struct vysmaw_data_info *info;
+	size_t buffer_size;
+	if (msg->typ == VYSMAW_MESSAGE_VALID_BUFFER) {
+		info = &msg->content.valid_buffer.info;
+		buffer_size = msg->content.valid_buffer.buffer_size;
+		if (G_UNLIKELY(buffer_size > segment->buffer_stride)) {
+			shm_export_lose(export, export->active);
+			return;
+		}
+	} else {
+		info = &msg->content.digest_failure;
+		buffer_size = 0;
+	}
+
+	/* take a buffer that no client holds */
+	if (export->num_free == 0) {
+		shm_export_collect_released(export);
+		if (G_UNLIKELY(export->num_free == 0)) {
+			shm_export_lose(export, export->active);
+			return;
+		}
+	}
+	guint32 index = export->free_slots[--export->num_free];
+	struct shm_slot *slot = &export->layout.slots[index];
+	slot->typ = msg->typ;
+	slot->info = *info;
+	slot->buffer_size = buffer_size;
+	if (buffer_size > 0)
+		memcpy(export->layout.buffers + (size_t)index * segment->buffer_stride,
+		       msg->content.valid_buffer.buffer, buffer_size);
+
+	guint64 holders = 0;
+	guint64 full = 0;
+	guint64 clients = export->active;
+	while (clients != 0) {
+		unsigned i = __builtin_ctzll(clients);
+		guint64 bit = (guint64)1 << i;
+		struct shm_client_ring *ring = &export->layout.rings[i];
+		guint32 tail = export->tails[i];
+		if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)
+		    < segment->ring_length
+		    && (export->delivered[i]
+		        - __atomic_load_n(&ring->num_released, __ATOMIC_RELAXED))
+		    < export->quota) {
+			export->layout.entries[i * segment->ring_length
+			                       + (tail & export->ring_mask)] = index;
+			export->tails[i] = tail + 1;
+			export->delivered[i]++;
+			holders |= bit;
+		} else {
+			full |= bit;
+		}
+		clients &= clients - 1;
+	}
+	if (full != 0) shm_export_lose(export, full);
+	if (holders != 0) {
+		/* the buffer must be held before any client can see its index */
+		__atomic_store_n(&slot->holders, holders, __ATOMIC_RELEASE);
+		export->pending |= holders;
+	} else {
+		export->free_slots[export->num_free++] = index;
+	}
+}
+
+/* Make staged entries visible to clients, and wake any that are parked. */
+static void
+shm_export_publish(struct shm_export *export)
+{
+	guint64 clients = export->pending;
+	while (clients != 0) {
+		unsigned i = __builtin_ctzll(clients);
+		__atomic_store_n(&export->layout.rings[i].tail, export->tails[i],
+		                 __ATOMIC_RELEASE);
+		clients &= clients - 1;
+	}
+
+	/* pairs with the fence in shm_client(): either the client sees the new
+	 * tail after parking, or we see that it has parked */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	clients = export->pending | export->lost;
+	while (clients != 0) {
+		unsigned i = __builtin_ctzll(clients);
+		struct shm_client_ring *ring = &export->layout.rings[i];
+		if (__atomic_load_n(&ring->parked, __ATOMIC_RELAXED)
+		    && __atomic_exchange_n(&ring->parked, false, __ATOMIC_ACQ_REL))
+			futex_wake(&ring->tail);
+		clients &= clients - 1;
+	}
+	export->pending = 0;
+	export->lost = 0;
+}
+
+struct vysmaw_result
+shm_export(const struct vysmaw_configuration *config,
+           vysmaw_message_queue queue)
+{
+	struct vysmaw_result result = {
+		.code = VYSMAW_NO_ERROR,
+		.syserr_desc = NULL
+	};
+	struct vys_error_record *error_record = NULL;
+	struct shm_export *export = shm_export_new(config, &error_record);
+	if (export == NULL) {
+		/* the queue is left to the caller, whose handle is still running */
+		result.code = VYSMAW_SYSERR;
+		result.syserr_desc = vys_error_record_to_string(&error_record);
+		return result;
+	}
+	gint64 check_interval = 1000 * (gint64)config->shutdown_check_interval_ms;
+
+	struct vysmaw_message *msgs[SHM_EXPORT_BATCH_SIZE];
+	bool end = false;
+	while (!end) {
+		unsigned n = vysmaw_message_queue_pop_batch(
+			queue, msgs, SHM_EXPORT_BATCH_SIZE, check_interval);
+		for (unsigned i = 0; i < n; ++i) {
+			struct vysmaw_message *msg = msgs[i];
+			switch (msg->typ) {
+			case VYSMAW_MESSAGE_VALID_BUFFER:
+			case VYSMAW_MESSAGE_DIGEST_FAILURE:
+				shm_export_stage(export, msg);
+				break;
+
+			case VYSMAW_MESSAGE_END:
+				/* take ownership of the description */
+				result = msg->content.result;
+				msg->content.result.syserr_desc = NULL;
+				end = true;
+				break;
+
+			default:
+				break;
+			}
+			vysmaw_message_unref(msg);
+		}
+		shm_export_publish(export);
+		gint64 now = g_get_monotonic_time();
+		bool check = (now >= export->next_liveness_check);
+		if (check) export->next_liveness_check = now + check_interval;
+		shm_export_update_clients(export, check);
+	}
+
+	shm_export_free(export, config, result.code);
+	return result;
+}
+
+struct shm_attachment *
+shm_attach(const struct vysmaw_configuration *config,
+           struct vys_error_record **error_record)
+{
+	int fd = shm_open(config->shm_name, O_RDWR, 0);
+	if (fd < 0) {
+		VERB_ERR(error_record, errno, "shm_open");
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		VERB_ERR(error_record, errno, "fstat");
+		close(fd);
+		return NULL;
+	}
+	if (st.st_size < (off_t)sizeof(struct shm_segment)) {
+		MSG_ERROR(error_record, -1, "%s",
+		          "Shared memory object is not an exported vysmaw segment");
+		close(fd);
+		return NULL;
+	}
+	struct shm_segment *segment =
+		mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	int errnum = errno;
+	close(fd);
+	if (segment == MAP_FAILED) {
+		VERB_ERR(error_record, errnum, "mmap");
+		return NULL;
+	}
+	if (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) != SHM_SEGMENT_MAGIC
+	    || segment->size != (guint64)st.st_size) {
+		MSG_ERROR(error_record, -1, "%s",
+		          "Shared memory object is not an exported vysmaw segment");
+		munmap(segment, st.st_size);
+		return NULL;
+	}
+	if (__atomic_load_n(&segment->closed, __ATOMIC_ACQUIRE)) {
+		MSG_ERROR(error_record, -1, "%s", "Exporting vysmaw instance has ended");
+		munmap(segment, st.st_size);
+		return NULL;
+	}
+
+	struct shm_attachment *result = g_new0(struct shm_attachment, 1);
+	result->size = st.st_size;
+	shm_layout_init(&result->layout, segment);
+	result->ring_mask = segment->ring_length - 1;
+	result->num_buffers = segment->num_buffers;
+	result->buffer_stride = segment->buffer_stride;
+
+	/* claim a free ring */
+	for (unsigned i = 0; i < segment->max_clients; ++i) {
+		struct shm_client_ring *ring = &result->layout.rings[i];
+		int state = SHM_CLIENT_FREE;
+		if (__atomic_compare_exchange_n(
+			    &ring->state, &state, SHM_CLIENT_ATTACHING, false,
+			    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			result->index = i;
+			result->ring = ring;
+			result->entries =
+				&result->layout.entries[i * segment->ring_length];
+			__atomic_store_n(&ring->pid, getpid(), __ATOMIC_RELAXED);
+			__atomic_store_n(&ring->num_lost, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&ring->parked, false, __ATOMIC_RELAXED);
+			/* the exporter leaves a free ring empty */
+			__atomic_store_n(
+				&ring->head,
+				__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE),
+				__ATOMIC_RELAXED);
+			__atomic_store_n(&ring->state, SHM_CLIENT_ACTIVE,
+			                 __ATOMIC_RELEASE);
+			break;
+		}
+	}
+	if (result->ring == NULL) {
+		MSG_ERROR(error_record, -1, "%s",
+		          "Maximum number of shared memory clients already attached");
+		munmap(segment, result->size);
+		g_free(result);
+		return NULL;
+	}
+	return result;
+}
+
+/* Called only after every message delivered to the client has been
+ * released. */
+void
+shm_detach(struct shm_attachment *shm)
+{
+	__atomic_store_n(&shm->ring->state, SHM_CLIENT_DETACHED,
+	                 __ATOMIC_RELEASE);
+	munmap(shm->layout.segment, shm->size);
+	g_free(shm);
+}
+
+/* Release a slot, returning it to the exporter if no other client holds
+ * it. */
+static void
+shm_release_slot(struct shm_attachment *shm, guint32 index)
+{
+	struct shm_slot *slot = &shm->layout.slots[index];
+	guint64 bit = (guint64)1 << shm->index;
+	__atomic_add_fetch(&shm->ring->num_released, 1, __ATOMIC_RELAXED);
+	if (__atomic_fetch_and(&slot->holders, ~bit, __ATOMIC_ACQ_REL) == bit) {
+		struct shm_segment *segment = shm->layout.segment;
+		guint32 head = __atomic_load_n(&segment->released, __ATOMIC_RELAXED);
+		do {
+			slot->next_released = head;
+		} while (!__atomic_compare_exchange_n(
+			         &segment->released, &head, index, true,
+			         __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+}
+
+void
+shm_release_buffer(struct vysmaw_message *message)
+{
+	struct shm_attachment *shm = message->handle->shm;
+	size_t offset =
+		(guint8 *)message->content.valid_buffer.buffer - shm->layout.buffers;
+	shm_release_slot(shm, offset / shm->buffer_stride);
+}
+
+static struct vysmaw_message *
+shm_message_new(vysmaw_handle handle, guint32 index)
+{
+	struct shm_attachment *shm = handle->shm;
+	const struct shm_slot *slot = &shm->layout.slots[index];
+	struct vysmaw_message *result;
+	if (slot->typ == VYSMAW_MESSAGE_VALID_BUFFER) {
+		result = message_new(handle, VYSMAW_MESSAGE_VALID_BUFFER);
+		result->content.valid_buffer.info = slot->info;
+		result->content.valid_buffer.buffer_size = slot->buffer_size;
+		result->content.valid_buffer.buffer =
+			(float *)(shm->layout.buffers
+			          + (size_t)index * shm->buffer_stride);
+	} else {
+		result = digest_failure_message_new(handle, &slot->info);
+		shm_release_slot(shm, index);
+	}
+	return result;
+}
+
+static inline bool
+same_product(const struct vysmaw_data_info *a, const struct vysmaw_data_info *b)
+{
+	return (a->num_channels == b->num_channels
+	        && a->stations[0] == b->stations[0]
+	        && a->stations[1] == b->stations[1]
+	        && a->spectral_window_index == b->spectral_window_index
+	        && a->stokes_index == b->stokes_index);
+}
+
+/* Deliver the spectra of ring entries from 'head' to 'tail' to the selecting
+ * consumers, returning the new head. Runs of entries for the same product are
+ * passed to the consumers' filters as if they had arrived in a single signal
+ * message. */
+static guint32
+shm_client_deliver(vysmaw_handle handle, guint32 head, guint32 tail,
+                   struct vys_signal_msg_payload *payload,
+                   consumer_mask_t *selections)
+{
+	struct shm_attachment *shm = handle->shm;
+	consumer_mask_t staged = 0;
+	while (head != tail) {
+		guint32 index = shm->entries[head & shm->ring_mask];
+		if (G_UNLIKELY(index >= shm->num_buffers)) {
+			++head;
+			continue;
+		}
+		const struct vysmaw_data_info *first = &shm->layout.slots[index].info;
+		payload->num_channels = first->num_channels;
+		payload->stations[0] = first->stations[0];
+		payload->stations[1] = first->stations[1];
+		payload->spectral_window_index = first->spectral_window_index;
+		payload->stokes_index = first->stokes_index;
+		unsigned n = 0;
+		do {
+			index = shm->entries[(head + n) & shm->ring_mask];
+			if (G_UNLIKELY(index >= shm->num_buffers)) break;
+			const struct vysmaw_data_info *info =
+				&shm->layout.slots[index].info;
+			if (n > 0 && !same_product(info, first)) break;
+			payload->infos[n].data_addr = 0;
+			payload->infos[n].timestamp = info->timestamp;
+			memset(payload->infos[n].digest, 0,
+			       sizeof(payload->infos[n].digest));
+			++n;
+		} while (n < UINT8_MAX && head + n != tail);
+		payload->num_spectra = n;
+
+		select_spectra(handle->consumers, handle->num_consumers, payload,
+		               selections);
+		for (unsigned i = 0; i < n; ++i) {
+			index = shm->entries[(head + i) & shm->ring_mask];
+			if (selections[i] != 0)
+				message_queues_stage(
+					shm_message_new(handle, index), selections[i], &staged);
+			else
+				shm_release_slot(shm, index);
+		}
+		head += n;
+	}
+	message_queues_publish(handle, staged);
+	return head;
+}
+
+void *
+shm_client(vysmaw_handle handle)
+{
+	struct shm_attachment *shm = handle->shm;
+	struct shm_segment *segment = shm->layout.segment;
+	struct shm_client_ring *ring = shm->ring;
+	struct vys_signal_msg_payload *payload =
+		g_malloc(SIZEOF_VYS_SIGNAL_MSG_PAYLOAD(UINT8_MAX));
+	consumer_mask_t selections[UINT8_MAX];
+	struct vys_error_record *error_record = NULL;
+	gint64 check_interval =
+		1000 * (gint64)handle->config.shutdown_check_interval_ms;
+
+	guint32 head = ring->head;
+	bool quit = false;
+	while (!quit) {
+		guint32 tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		if (tail != head) {
+			head = shm_client_deliver(handle, head, tail, payload, selections);
+			__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+		}
+
+		unsigned num_lost =
+			__atomic_exchange_n(&ring->num_lost, 0, __ATOMIC_ACQ_REL);
+		if (num_lost > 0)
+			post_msg(handle, queue_overflow_message_new(handle, num_lost));
+
+		bool in_shutdown;
+		struct vysmaw_result *result;
+		get_shutdown_parameters(handle, &in_shutdown, &result);
+		if (G_UNLIKELY(in_shutdown)) {
+			if (result != NULL) {
+				if (result->code != VYSMAW_NO_ERROR
+				    && result->syserr_desc != NULL)
+					MSG_ERROR(&error_record, result->code, "%s",
+					          result->syserr_desc);
+				g_free(result->syserr_desc);
+				g_free(result);
+			}
+			quit = true;
+		} else if (tail == head) {
+			/* wait for more entries, or the end of the export */
+			__atomic_store_n(&ring->parked, true, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&segment->closed, __ATOMIC_ACQUIRE)) {
+				if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == head) {
+					if (segment->end_code != VYSMAW_NO_ERROR)
+						MSG_ERROR(&error_record, -1, "%s",
+						          "Exporting vysmaw instance failed");
+					quit = true;
+				}
+			} else if (futex_wait(&ring->tail, head, check_interval) != 0
+			           && errno == ETIMEDOUT
+			           && !process_exists(segment->exporter_pid)) {
+				MSG_ERROR(&error_record, -1, "%s",
+				          "Exporting vysmaw process has exited");
+				quit = true;
+			}
+			__atomic_store_n(&ring->parked, false, __ATOMIC_RELAXED);
+		}
+	}
+	g_free(payload);
+
+	struct vysmaw_result result;
+	if (error_record == NULL) {
+		result.code = VYSMAW_NO_ERROR;
+		result.syserr_desc = NULL;
+	} else {
+		result.code = VYSMAW_SYSERR;
+		result.syserr_desc = vys_error_record_to_string(&error_record);
+	}
+	post_msg(handle, end_message_new(handle, &result));
+	handle_unref(handle); // end message has been posted
+	return NULL;
+}
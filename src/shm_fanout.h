@@ -0,0 +1,50 @@
+//
+// Copyright © 2016 Associated Universities, Inc. Washington DC, USA.
+//
+// This file is part of vysmaw.
+//
+// vysmaw is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// vysmaw is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// vysmaw.  If not, see <http://www.gnu.org/licenses/>.
+//
+#ifndef SHM_FANOUT_H_
+#define SHM_FANOUT_H_
+
+#include <vysmaw_private.h>
+
+/* Shared memory fan-out of spectra from one exporting vysmaw instance to the
+ * client processes attached to it on the same host. The shared memory object
+ * holds a pool of spectrum buffers, and, for every client, a ring of indexes
+ * of the buffers exported to that client. Every buffer records the set of
+ * clients still holding it as a bit mask, which serves as a cross-process
+ * reference count: the client that empties the mask returns the buffer to the
+ * exporter for reuse. Every client may hold only a limited number of buffers,
+ * beyond which spectra are lost to that client alone. */
+
+/* process-local state of an attached client */
+struct shm_attachment;
+
+extern struct vysmaw_result shm_export(
+	const struct vysmaw_configuration *config, vysmaw_message_queue queue)
+	__attribute__((nonnull));
+
+extern struct shm_attachment *shm_attach(
+	const struct vysmaw_configuration *config,
+	struct vys_error_record **error_record)
+	__attribute__((nonnull,malloc));
+extern void shm_detach(struct shm_attachment *shm)
+	__attribute__((nonnull));
+extern void shm_release_buffer(struct vysmaw_message *message)
+	__attribute__((nonnull));
+
+void *shm_client(vysmaw_handle handle);
+
+#endif /* SHM_FANOUT_H_ */
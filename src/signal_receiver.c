@@ -17,6 +17,7 @@
 //
 #include <vysmaw.h>
 #include <signal_receiver.h>
+#include <numa_placement.h>
 #include <sys/timerfd.h>
 #include <poll.h>
 #include <unistd.h>
@@ -86,6 +87,8 @@ static int resolve_addr(
 static void set_max_posted_wr(
 	struct signal_receiver_context_ *context, unsigned max_posted_wr)
 	__attribute__((nonnull));
+static void new_signal_msg_queue(struct signal_receiver_context *shared)
+	__attribute__((nonnull));
 static int start_signal_receive(
 	struct signal_receiver_context_ *context,
 	struct vys_error_record **error_record)
@@ -286,6 +289,27 @@ set_max_posted_wr(struct signal_receiver_context_ *context,
 		/ context->shared->handle->config.signal_receive_min_ack_part;
 }
 
+/* Create the queue of data path messages to the spectrum_selector, if it
+ * doesn't yet exist, with room for a message from every slot of the data path
+ * message ring, plus the quit and end messages. Messages allocated from the
+ * heap when the ring is exhausted may find it full, in which case this thread
+ * blocks until the spectrum_selector makes room. There is no ring when
+ * initialization fails, and then only control messages are queued. */
+static void
+new_signal_msg_queue(struct signal_receiver_context *shared)
+{
+	if (shared->signal_msg_queue != NULL) return;
+	shared->signal_msg_queue = async_queue_new_sized(
+		((shared->data_path_msgs != NULL)
+		 ? shared->data_path_msgs->num_slots
+		 : 0) + 2);
+	if (G_UNLIKELY(shared->signal_msg_queue == NULL))
+		g_error("Failed to create signal message queue: %s",
+		        strerror(errno));
+	/* the reference for init_signal_receiver() */
+	async_queue_ref(shared->signal_msg_queue);
+}
+
 static int
 start_signal_receive(struct signal_receiver_context_ *context,
                      struct vys_error_record **error_record)
@@ -316,6 +340,9 @@ start_signal_receive(struct signal_receiver_context_ *context,
 	if (G_UNLIKELY(rc != 0))
 		return -1;
 
+	/* place buffer pools and service threads near the device */
+	init_numa_placement(context->shared->handle, context->id->verbs);
+
 	/* get MTU */
 	struct ibv_port_attr port_attr;
 	rc = ibv_query_port(context->id->verbs, context->id->port_num, &port_attr);
@@ -332,10 +359,22 @@ start_signal_receive(struct signal_receiver_context_ *context,
 
 	/* create signal message buffer pool */
 	context->shared->signal_msg_buffers =
-		buffer_pool_new(
+		buffer_pool_new_full(
 			(context->shared->handle->config.signal_message_pool_size
 			 / sizeof_signal_msg),
-			sizeof_signal_msg);
+			sizeof_signal_msg,
+			context->shared->handle->config.buffer_pool_huge_page_size);
+	if (context->shared->handle->numa_node >= 0)
+		numa_bind_memory(context->shared->signal_msg_buffers->pool,
+		                 context->shared->signal_msg_buffers->pool_size,
+		                 context->shared->handle->numa_node);
+
+	/* create data path message ring, with a slot for every signal message
+	 * buffer, and one more for a starvation notification */
+	context->shared->data_path_msgs = data_path_message_ring_new(
+		context->shared->signal_msg_buffers->num_buffers + 1,
+		context->shared->signal_msg_num_spectra);
+	new_signal_msg_queue(context->shared);
 
 	/* completion channel */
 	context->comp_channel = ibv_create_comp_channel(context->id->verbs);
@@ -519,6 +558,7 @@ new_wr(struct signal_receiver_context_ *context, struct recv_wr **wrs)
 	struct vys_signal_msg *buff =
 		buffer_pool_pop(context->shared->signal_msg_buffers);
 	if (buff != NULL) {
+		buffer_pool_count_popped(context->shared->signal_msg_buffers, 1);
 		*wrs = recv_wr_prepend_new(
 			*wrs,
 			(uint64_t)buff,
@@ -527,9 +567,9 @@ new_wr(struct signal_receiver_context_ *context, struct recv_wr **wrs)
 		result = true;
 	} else {
 		struct data_path_message *dp_msg =
-			data_path_message_new(context->shared->signal_msg_num_spectra);
+			data_path_message_ring_next(context->shared->data_path_msgs);
 		dp_msg->typ = DATA_PATH_BUFFER_STARVATION;
-		g_async_queue_push(context->shared->signal_msg_queue, dp_msg);
+		async_queue_push(context->shared->signal_msg_queue, dp_msg);
 		result = false;
 	}
 	return result;
@@ -562,23 +602,26 @@ poll_completions(struct signal_receiver_context_ *context,
 			for (int i = 0; i < nc; ++i) {
 				struct vys_signal_msg *s_msg =
 					(struct vys_signal_msg *)context->wcs[i].wr_id;
-				struct data_path_message *dp_msg = data_path_message_new(
-					context->shared->signal_msg_num_spectra);
+				struct data_path_message *dp_msg =
+					data_path_message_ring_next(context->shared->data_path_msgs);
 				if (G_LIKELY(context->wcs[i].status == IBV_WC_SUCCESS)) {
 					/* got a signal message */
 					dp_msg->typ = DATA_PATH_SIGNAL_MSG;
 					dp_msg->signal_msg = s_msg;
 				} else {
 					/* failed receive, put signal message buffer back into pool */
+					buffer_pool_count_pushed(
+						context->shared->signal_msg_buffers, 1);
 					buffer_pool_push(context->shared->signal_msg_buffers, s_msg);
 					/* notify downstream of receive failure */
 					dp_msg->typ = DATA_PATH_RECEIVE_FAIL;
 					dp_msg->wc_status = context->wcs[i].status;
 					}
 				/* send data_path_message downstream */
-				g_async_queue_push(context->shared->signal_msg_queue, dp_msg);
+				async_queue_push(context->shared->signal_msg_queue, dp_msg);
 			}
 		} else {
+			buffer_pool_count_pushed(context->shared->signal_msg_buffers, nc);
 			for (int i = 0; i < nc; ++i) {
 				struct vys_signal_msg *s_msg =
 					(struct vys_signal_msg *)context->wcs[i].wr_id;
@@ -688,7 +731,7 @@ to_quit_state(struct signal_receiver_context_ *context,
 			data_path_message_new(context->shared->signal_msg_num_spectra);
 		quit_msg->typ = DATA_PATH_QUIT;
 	}
-	g_async_queue_push(context->shared->signal_msg_queue, quit_msg);
+	async_queue_push(context->shared->signal_msg_queue, quit_msg);
 	int rc = 0;
 	if (context->state != STATE_QUIT)
 		rc = leave_multicast(context, error_record);
@@ -949,6 +992,7 @@ signal_receiver(struct signal_receiver_context *shared)
 	rc = signal_receiver_loop(&context, &error_record);
 
 signal_data_path_end_and_return:
+	new_signal_msg_queue(shared);
 	READY(&shared->handle->gate);
 
 	/* initialization failures may result in not being in STATE_DONE state */
@@ -969,9 +1013,9 @@ signal_data_path_end_and_return:
 	g_assert(context.end_msg != NULL && context.end_msg->typ == DATA_PATH_END);
 	context.end_msg->error_record =
 		vys_error_record_concat(error_record, context.end_msg->error_record);
-	g_async_queue_push(shared->signal_msg_queue, context.end_msg);
+	async_queue_push(shared->signal_msg_queue, context.end_msg);
 
-	g_async_queue_unref(shared->signal_msg_queue);
+	async_queue_unref(shared->signal_msg_queue);
 
 	g_free(shared);
 	return NULL;
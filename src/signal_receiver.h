@@ -19,14 +19,18 @@
 #define SIGNAL_RECEIVER_H_
 
 #include <vysmaw_private.h>
+#include <async_queue.h>
 
 struct signal_receiver_context {
 	vysmaw_handle handle;
 
-	GAsyncQueue *signal_msg_queue;
+	/* created by the signal_receiver thread before it signals readiness,
+	 * with a reference for init_signal_receiver() */
+	struct async_queue *signal_msg_queue;
 
 	unsigned signal_msg_num_spectra;
 	struct buffer_pool *signal_msg_buffers;
+	struct data_path_message_ring *data_path_msgs;
 
 	int loop_fd;
 };
@@ -0,0 +1,112 @@
+//
+// Copyright © 2016 Associated Universities, Inc. Washington DC, USA.
+//
+// This file is part of vysmaw.
+//
+// vysmaw is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// vysmaw is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// vysmaw.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <vysmaw_private.h>
+
+/* Test that retiring a spectrum buffer pool frees its memory while buffers
+ * remain cached in the magazine of another thread, and that the other thread
+ * drops those buffers, releasing the pool, at its next use of any pool. */
+
+#define NUM_BUFFERS 8
+#define MAGAZINE_SIZE 4
+#define NUM_CACHED 2
+
+static unsigned num_failures = 0;
+
+/* the retired flag in a pool's refcount, from vysmaw_private.c */
+#define REFCOUNT(pool) ((pool)->refcount & ~(1 << 30))
+
+static void
+check_refcount(const char *what, struct spectrum_buffer_pool *pool,
+               int expected)
+{
+	if (REFCOUNT(pool) != expected) {
+		fprintf(stderr, "%s: pool refcount %d, expected %d\n",
+		        what, REFCOUNT(pool), expected);
+		num_failures++;
+	}
+}
+
+struct client {
+	void *buffers[NUM_CACHED];
+	struct spectrum_buffer_pool *pool;
+	GAsyncQueue *go;
+	GAsyncQueue *done;
+};
+
+static void *
+client(struct client *client)
+{
+	/* cache the buffers in this thread's magazine */
+	g_async_queue_pop(client->go);
+	for (unsigned i = 0; i < NUM_CACHED; ++i)
+		spectrum_buffer_pool_push(client->pool, client->buffers[i]);
+	g_async_queue_push(client->done, client);
+
+	/* use another pool, while the first is retired */
+	g_async_queue_pop(client->go);
+	struct spectrum_buffer_pool *other = spectrum_buffer_pool_new(
+		64, 8, NUM_BUFFERS, 1, MAGAZINE_SIZE, 0);
+	void *buffer = spectrum_buffer_pool_pop(other);
+	spectrum_buffer_pool_push(other, buffer);
+	spectrum_buffer_pool_retire(other);
+	g_async_queue_push(client->done, client);
+	return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct client c;
+	c.pool = spectrum_buffer_pool_new(64, 8, NUM_BUFFERS, 1, MAGAZINE_SIZE, 0);
+	c.go = g_async_queue_new();
+	c.done = g_async_queue_new();
+	for (unsigned i = 0; i < NUM_CACHED; ++i)
+		c.buffers[i] = spectrum_buffer_pool_pop(c.pool);
+	GThread *thread = g_thread_new("client", (GThreadFunc)client, &c);
+
+	g_async_queue_push(c.go, &c);
+	g_async_queue_pop(c.done);
+	check_refcount("before retirement", c.pool, 1 + NUM_CACHED);
+
+	/* hold a reference, other than that of the owner, only to inspect the pool
+	 * after retirement */
+	struct spectrum_buffer_pool *pool = c.pool;
+	spectrum_buffer_pool_retire(pool);
+	if (pool->pool != NULL) {
+		fprintf(stderr, "pool memory not freed at retirement\n");
+		num_failures++;
+	}
+	check_refcount("after retirement", pool, NUM_CACHED);
+	spectrum_buffer_pool_ref(pool);
+
+	g_async_queue_push(c.go, &c);
+	g_async_queue_pop(c.done);
+	check_refcount("after client's next use of a pool", pool, 1);
+	spectrum_buffer_pool_unref(pool);
+
+	g_thread_join(thread);
+	g_async_queue_unref(c.go);
+	g_async_queue_unref(c.done);
+	if (num_failures > 0) {
+		fprintf(stderr, "%u failures\n", num_failures);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
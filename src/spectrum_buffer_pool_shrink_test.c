@@ -0,0 +1,111 @@
+//
+// Copyright © 2016 Associated Universities, Inc. Washington DC, USA.
+//
+// This file is part of vysmaw.
+//
+// vysmaw is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// vysmaw is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// vysmaw.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <vysmaw_private.h>
+
+/* Test that the last chunk of an elastic spectrum buffer pool can be released
+ * while another thread, which only returns buffers to the pool, has buffers of
+ * that chunk cached, once a shrink request has been made, as the
+ * spectrum_reader's pool timer does. */
+
+#define CHUNK_NUM_BUFFERS 4
+#define NUM_BUFFERS (2 * CHUNK_NUM_BUFFERS)
+#define MAGAZINE_SIZE NUM_BUFFERS
+
+struct client {
+	struct spectrum_buffer_pool *pool;
+	GAsyncQueue *buffers; // to return to pool
+	GAsyncQueue *done;
+};
+
+static void *
+client(struct client *client)
+{
+	void *buffer;
+	while ((buffer = g_async_queue_pop(client->buffers)) != client) {
+		spectrum_buffer_pool_push(client->pool, buffer);
+		g_async_queue_push(client->done, client);
+	}
+	return NULL;
+}
+
+static void
+return_buffer(struct client *client, void *buffer)
+{
+	g_async_queue_push(client->buffers, buffer);
+	g_async_queue_pop(client->done);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned num_failures = 0;
+	struct client c;
+	c.pool = spectrum_buffer_pool_new(
+		64, 8, CHUNK_NUM_BUFFERS, 2, MAGAZINE_SIZE, 0);
+	c.buffers = g_async_queue_new();
+	c.done = g_async_queue_new();
+	struct buffer_pool *pool = c.pool->pool;
+	buffer_pool_publish_chunk(pool, buffer_pool_commit_chunk(pool));
+
+	/* take every buffer, keeping one of the first chunk aside */
+	void *buffers[NUM_BUFFERS];
+	void *kept = NULL;
+	unsigned n = 0;
+	for (unsigned i = 0; i < NUM_BUFFERS; ++i) {
+		void *buffer = spectrum_buffer_pool_pop(c.pool);
+		if (kept == NULL && buffer_pool_chunk_index(pool, buffer) == 0)
+			kept = buffer;
+		else
+			buffers[n++] = buffer;
+	}
+
+	/* the client caches all others, among them the whole last chunk */
+	GThread *thread = g_thread_new("client", (GThreadFunc)client, &c);
+	for (unsigned i = 0; i < n; ++i)
+		return_buffer(&c, buffers[i]);
+	spectrum_buffer_cache_flush(c.pool);
+	if (buffer_pool_withdraw_chunk(pool)) {
+		fprintf(stderr, "last chunk withdrawn while its buffers are cached\n");
+		num_failures++;
+		buffer_pool_decommit_chunk(pool);
+	} else {
+		/* the client's next return of a buffer flushes its magazine */
+		__atomic_store_n(&c.pool->shrink_request, 1, __ATOMIC_RELAXED);
+		return_buffer(&c, kept);
+		if (buffer_pool_withdraw_chunk(pool)) {
+			buffer_pool_decommit_chunk(pool);
+		} else {
+			fprintf(stderr, "last chunk not withdrawn after shrink request\n");
+			num_failures++;
+		}
+		__atomic_store_n(&c.pool->shrink_request, 0, __ATOMIC_RELAXED);
+	}
+
+	g_async_queue_push(c.buffers, &c);
+	g_thread_join(thread);
+	spectrum_buffer_pool_retire(c.pool);
+	g_async_queue_unref(c.buffers);
+	g_async_queue_unref(c.done);
+	if (num_failures > 0) {
+		fprintf(stderr, "%u failures\n", num_failures);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
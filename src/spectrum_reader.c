@@ -35,7 +35,9 @@
 #define CM_EVENT_FD_INDEX 0
 #define INACTIVITY_TIMER_FD_INDEX 1
 #define READ_REQUEST_QUEUE_FD_INDEX 2
-#define NUM_FIXED_FDS 3
+#define POOL_TIMER_FD_INDEX 3
+#define CHUNK_JOB_QUEUE_FD_INDEX 4
+#define NUM_FIXED_FDS 5
 
 enum run_state {
 	STATE_INIT,
@@ -55,17 +57,29 @@ struct spectrum_reader_context_ {
 	GHashTable *connections;
 	GSequence *fd_connections;
 	GChecksum *checksum;
+	struct buffer_pool *req_slab; // preallocated rdma_req instances
+	consumer_mask_t batch_consumers; // consumers with 'batch_spectra' set
+
+	/* memory registration of elastic spectrum buffer pool chunks, and of
+	 * spectrum buffer pools created after connections are established, is
+	 * done by the chunk registrar thread, as it is too slow for this thread */
+	GThread *chunk_registrar;
+	GAsyncQueue *chunk_jobs; // to chunk registrar
+	struct async_queue *done_chunk_jobs; // from chunk registrar
+	unsigned num_chunk_jobs; // number in flight
+	unsigned num_deferred_reqs; // on all connections
 };
 
 struct server_connection_context {
 	struct rdma_cm_id *id;
 	struct ibv_wc *wcs;
-	GHashTable *mrs;
+	GHashTable *mrs; // spectrum_buffer_pool -> ibv_mr* array, by chunk
 	uint32_t *rkeys;
 	bool established;
 	unsigned max_posted_wr;
 	unsigned num_posted_wr;
 	GQueue *reqs;
+	GQueue *deferred_reqs; // awaiting registration of their pools
 
 	unsigned num_not_ack;
 	unsigned min_ack;
@@ -78,25 +92,93 @@ enum rdma_req_result {
 	RDMA_REQ_DIGEST_VERIFICATION_FAILURE
 };
 
+/* Reads of the spectra of one signal message into a single
+ * VYSMAW_MESSAGE_SPECTRA_BATCH message, which is allocated when the first read
+ * is posted, and delivered once every read has completed or been
+ * abandoned. */
+struct rdma_batch {
+	struct vysmaw_message *message;
+	pool_id_t pool_id;
+	bool failed; // no buffer was available for message
+	consumer_mask_t consumers;
+	unsigned num_spectra;
+	unsigned num_pending;
+	size_t stride;
+};
+
+/* Registration of a newly committed chunk of an elastic spectrum buffer pool
+ * on, or deregistration of a withdrawn chunk from, every connection that has
+ * registered the pool; or registration of all committed chunks of a pool on
+ * every connection that has not registered the pool, which is needed for
+ * pools created after a connection is established. The chunk registrar sets
+ * or clears the chunks' entries in each connection's memory region array; the
+ * array of a newly registered pool is added to its connection's table only
+ * when the job is completed. While any job is in flight, the spectrum_reader
+ * thread neither creates nor destroys memory registrations, so that those
+ * arrays and the connections remain valid, and it starts no other job for the
+ * same pool. */
+enum chunk_job_type {
+	CHUNK_JOB_ADD_CHUNK,
+	CHUNK_JOB_RELEASE_CHUNK,
+	CHUNK_JOB_ADD_POOL
+};
+
+struct chunk_registration {
+	struct server_connection_context *conn_ctx;
+	struct ibv_mr **mrs;
+};
+
+struct chunk_job {
+	struct spectrum_buffer_pool *sb_pool; // NULL for registrar to quit
+	enum chunk_job_type type;
+	unsigned chunk;
+	unsigned num_chunks;
+	bool failed;
+	GArray *registrations;
+	struct vys_error_record *error_record;
+};
+
 struct rdma_req {
 	struct vysmaw_data_info data_info;
 	struct vys_spectrum_info spectrum_info;
 	uint8_t mr_id;
 	enum rdma_req_result result;
 	enum ibv_wc_status status;
-	GSList *consumers;
+	consumer_mask_t consumers;
 	struct vysmaw_message *message;
+	struct rdma_batch *batch; // NULL for a read into its own message
+	unsigned batch_index;
+	pool_id_t pool_id; // of message buffer
+	void *buffer;
+	size_t buffer_size;
 };
 
 static bool verify_digest(
 	GChecksum *checksum, const float *buff, size_t buffer_size, uint8_t *digest)
 	__attribute__((nonnull));
 static struct rdma_req *new_rdma_req(
-	GSList *consumers, const struct server_connection_context *conn_ctx,
+	struct spectrum_reader_context_ *context, consumer_mask_t consumers,
+	const struct server_connection_context *conn_ctx,
 	const struct vys_signal_msg_payload *payload,
 	const struct vys_spectrum_info *spectrum_info)
 	__attribute__((nonnull,returns_nonnull,malloc));
-static void free_rdma_req(struct rdma_req *req)
+static void free_rdma_req(
+	struct spectrum_reader_context_ *context, struct rdma_req *req)
+	__attribute__((nonnull));
+static void abandon_rdma_req(
+	struct spectrum_reader_context_ *context, struct rdma_req *req)
+	__attribute__((nonnull));
+static void release_rdma_batch(
+	struct spectrum_reader_context_ *context, struct rdma_batch *batch,
+	consumer_mask_t *staged)
+	__attribute__((nonnull));
+static struct vysmaw_message *rdma_batch_message(
+	struct spectrum_reader_context_ *context, struct rdma_batch *batch,
+	pool_id_t *pool_id)
+	__attribute__((nonnull));
+static void complete_batch_read(
+	struct spectrum_reader_context_ *context, struct rdma_req *req,
+	consumer_mask_t *staged)
 	__attribute__((nonnull));
 static int compare_server_comp_ch_fd(
 	const struct server_connection_context *c1,
@@ -124,9 +206,15 @@ static int find_connection(
 	struct server_connection_context **conn_ctx, GQueue **req_queue,
 	struct vys_error_record **error_record)
 	__attribute__((nonnull));
+static void queue_spectra_batches(
+	struct spectrum_reader_context_ *context,
+	const struct server_connection_context *conn_ctx, GQueue *reqs,
+	const struct vys_signal_msg_payload *payload,
+	const consumer_mask_t *consumers, consumer_mask_t *singles)
+	__attribute__((nonnull));
 static int on_signal_message(
 	struct spectrum_reader_context_ *context, struct vys_signal_msg *msg,
-	GSList **consumers, struct vys_error_record **error_record)
+	const consumer_mask_t *consumers, struct vys_error_record **error_record)
 	__attribute__((nonnull));
 static int on_data_path_message(
 	struct spectrum_reader_context_ *context, struct data_path_message *msg,
@@ -142,11 +230,23 @@ static int on_server_route_resolved(
 	struct server_connection_context *conn_ctx,
 	struct vys_error_record **error_record)
 	__attribute__((nonnull));
+static void rdma_req_message_new(
+	struct spectrum_reader_context_ *context, struct rdma_req *req)
+	__attribute__((nonnull));
 static int post_server_reads(
 	struct spectrum_reader_context_ *context,
 	struct server_connection_context *conn_ctx,
 	struct vys_error_record **error_record)
 	__attribute__((nonnull));
+static void defer_server_read(
+	struct spectrum_reader_context_ *context,
+	struct server_connection_context *conn_ctx, struct rdma_req *req)
+	__attribute__((nonnull));
+static int resume_deferred_reads(
+	struct spectrum_reader_context_ *context,
+	struct spectrum_buffer_pool *sb_pool, bool abandon,
+	struct vys_error_record **error_record)
+	__attribute__((nonnull));
 static int on_server_established(
 	struct spectrum_reader_context_ *context,
 	struct server_connection_context *conn_ctx,
@@ -193,6 +293,31 @@ static int on_inactivity_timer_event(
 	struct spectrum_reader_context_ *context,
 	struct vys_error_record **error_record)
 	__attribute__((nonnull));
+static int on_pool_timer_event(
+	struct spectrum_reader_context_ *context,
+	struct vys_error_record **error_record)
+	__attribute__((nonnull));
+static int grow_spectrum_buffer_pools(
+	struct spectrum_reader_context_ *context,
+	struct vys_error_record **error_record)
+	__attribute__((nonnull));
+static void start_chunk_job(
+	struct spectrum_reader_context_ *context,
+	struct spectrum_buffer_pool *sb_pool, enum chunk_job_type type,
+	unsigned chunk)
+	__attribute__((nonnull));
+static void run_chunk_job(struct chunk_job *job)
+	__attribute__((nonnull));
+static int complete_chunk_job(
+	struct spectrum_reader_context_ *context, struct chunk_job *job,
+	struct vys_error_record **error_record)
+	__attribute__((nonnull));
+static void finish_chunk_jobs(
+	struct spectrum_reader_context_ *context,
+	struct vys_error_record **error_record)
+	__attribute__((nonnull));
+static void *chunk_registrar(struct spectrum_reader_context_ *context)
+	__attribute__((nonnull));
 static int on_poll_events(
 	struct spectrum_reader_context_ *context,
 	struct vys_error_record **error_record)
@@ -213,6 +338,22 @@ static int stop_inactivity_timer(
 	struct spectrum_reader_context_ *context,
 	struct vys_error_record **error_record)
 	__attribute__((nonnull));
+static int start_pool_timer(
+	struct spectrum_reader_context_ *context,
+	struct vys_error_record **error_record)
+	__attribute__((nonnull));
+static int stop_pool_timer(
+	struct spectrum_reader_context_ *context,
+	struct vys_error_record **error_record)
+	__attribute__((nonnull));
+static int start_chunk_registrar(
+	struct spectrum_reader_context_ *context,
+	struct vys_error_record **error_record)
+	__attribute__((nonnull));
+static int stop_chunk_registrar(
+	struct spectrum_reader_context_ *context,
+	struct vys_error_record **error_record)
+	__attribute__((nonnull));
 static int start_read_request_poll(
 	struct spectrum_reader_context_ *context,
 	struct vys_error_record **error_record)
@@ -239,11 +380,17 @@ verify_digest(GChecksum *checksum, const float *buff, size_t buffer_size,
 }
 
 static struct rdma_req *
-new_rdma_req(GSList *consumers, const struct server_connection_context *conn_ctx,
+new_rdma_req(struct spectrum_reader_context_ *context,
+             consumer_mask_t consumers,
+             const struct server_connection_context *conn_ctx,
              const struct vys_signal_msg_payload *payload,
              const struct vys_spectrum_info *spectrum_info)
 {
-	struct rdma_req *result = g_slice_new(struct rdma_req);
+	/* requests come from the slab, unless it's exhausted by a backlog of
+	 * queued requests */
+	struct rdma_req *result = hot_path_slab_pop(context->req_slab);
+	if (G_UNLIKELY(result == NULL))
+		result = g_slice_new(struct rdma_req);
 	memcpy(&(result->spectrum_info), spectrum_info,
 	       sizeof(result->spectrum_info));
 	result->mr_id = payload->mr_id;
@@ -254,14 +401,94 @@ new_rdma_req(GSList *consumers, const struct server_connection_context *conn_ctx
 	result->data_info.stokes_index = payload->stokes_index;
 	result->data_info.timestamp = spectrum_info->timestamp;
 	result->consumers = consumers;
+	result->message = NULL;
+	result->batch = NULL;
 	return result;
 }
 
 static void
-free_rdma_req(struct rdma_req *req)
+free_rdma_req(struct spectrum_reader_context_ *context, struct rdma_req *req)
+{
+	if (req->batch != NULL) {
+		/* the read was abandoned */
+		consumer_mask_t staged = 0;
+		release_rdma_batch(context, req->batch, &staged);
+		message_queues_publish(context->shared->handle, staged);
+	}
+	if (G_LIKELY(buffer_pool_contains(context->req_slab, req)))
+		buffer_pool_push(context->req_slab, req);
+	else
+		g_slice_free(struct rdma_req, req);
+}
+
+/* Free a request whose message was allocated, but whose read was never
+ * posted. */
+static void
+abandon_rdma_req(struct spectrum_reader_context_ *context, struct rdma_req *req)
+{
+	/* a batch message is released with its last read */
+	if (req->batch == NULL) vysmaw_message_unref(req->message);
+	free_rdma_req(context, req);
+}
+
+/* Release a batch read's hold on its batch, staging the batch message for its
+ * consumers once no reads remain. */
+static void
+release_rdma_batch(struct spectrum_reader_context_ *context,
+                   struct rdma_batch *batch, consumer_mask_t *staged)
+{
+	if (--batch->num_pending > 0) return;
+	if (batch->message != NULL) {
+		if (batch->message->content.spectra_batch.num_spectra > 0)
+			message_queues_stage(batch->message, batch->consumers, staged);
+		else
+			vysmaw_message_unref(batch->message);
+	}
+	g_slice_free(struct rdma_batch, batch);
+}
+
+/* The message into which a batch is read, allocated on first use, or NULL if
+ * no buffer is available. */
+static struct vysmaw_message *
+rdma_batch_message(struct spectrum_reader_context_ *context,
+                   struct rdma_batch *batch, pool_id_t *pool_id)
+{
+	if (batch->message == NULL && !batch->failed) {
+		batch->message = spectra_batch_message_new(
+			context->shared->handle, batch->num_spectra, batch->stride,
+			&batch->pool_id);
+		batch->failed = (batch->message == NULL);
+	}
+	*pool_id = batch->pool_id;
+	return batch->message;
+}
+
+/* Record the result of a batch read. Spectra that failed to be read are
+ * reported to the batch's consumers by their own messages. */
+static void
+complete_batch_read(struct spectrum_reader_context_ *context,
+                    struct rdma_req *req, consumer_mask_t *staged)
 {
-	g_slist_free(req->consumers);
-	g_slice_free(struct rdma_req, req);
+	struct rdma_batch *batch = req->batch;
+	vysmaw_handle handle = context->shared->handle;
+	switch (req->result) {
+	case RDMA_REQ_SUCCESS:
+		spectra_batch_message_append(batch->message, &req->data_info,
+		                             req->batch_index * batch->stride);
+		break;
+	case RDMA_REQ_DIGEST_VERIFICATION_FAILURE:
+		message_queues_stage(
+			digest_failure_message_new(handle, &req->data_info),
+			batch->consumers, staged);
+		break;
+	case RDMA_REQ_READ_FAILURE:
+		message_queues_stage(
+			rdma_read_failure_message_new(handle, req->status),
+			batch->consumers, staged);
+		break;
+	}
+	req->batch = NULL;
+	release_rdma_batch(context, batch, staged);
 }
 
 static int
@@ -358,6 +585,7 @@ initiate_server_connection(struct spectrum_reader_context_ *context,
 	result->rkeys = NULL;
 	result->established = false;
 	result->reqs = g_queue_new();
+	result->deferred_reqs = g_queue_new();
 	set_max_posted_wr(context, result,
 	                  context->shared->handle->config.rdma_read_max_posted);
 	result->num_posted_wr = 0;
@@ -390,9 +618,75 @@ find_connection(struct spectrum_reader_context_ *context,
 	return 0;
 }
 
+/* Queue the reads of the spectra selected by consumers with 'batch_spectra'
+ * set. The spectra selected by each such consumer are read into a single
+ * batch, which is shared by all consumers selecting exactly the same spectra.
+ * Set 'singles' to the consumers of every spectrum that are to receive it by
+ * itself: those without 'batch_spectra', and those whose batch would not fit
+ * in a spectrum buffer. */
+static void
+queue_spectra_batches(struct spectrum_reader_context_ *context,
+                      const struct server_connection_context *conn_ctx,
+                      GQueue *reqs, const struct vys_signal_msg_payload *payload,
+                      const consumer_mask_t *consumers, consumer_mask_t *singles)
+{
+	vysmaw_handle handle = context->shared->handle;
+	unsigned n = payload->num_spectra;
+	consumer_mask_t batching = 0;
+	for (unsigned i = 0; i < n; ++i) {
+		singles[i] = consumers[i] & ~context->batch_consumers;
+		batching |= consumers[i] & context->batch_consumers;
+	}
+
+	/* all spectra in a signal message are of the same size */
+	size_t alignment = handle->config.spectrum_buffer_alignment;
+	size_t stride = (2 * payload->num_channels * sizeof(float) + alignment - 1)
+		& ~(alignment - 1);
+
+	while (batching != 0) {
+		consumer_mask_t c = (consumer_mask_t)1 << __builtin_ctzll(batching);
+		consumer_mask_t batch_consumers = batching;
+		unsigned num_spectra = 0;
+		for (unsigned i = 0; i < n; ++i) {
+			if (consumers[i] & c) {
+				batch_consumers &= consumers[i];
+				++num_spectra;
+			} else {
+				batch_consumers &= ~consumers[i];
+			}
+		}
+		batching &= ~batch_consumers;
+
+		if (spectra_batch_buffer_size(num_spectra, stride)
+		    > max_spectrum_buffer_size(handle)) {
+			for (unsigned i = 0; i < n; ++i)
+				if (consumers[i] & c) singles[i] |= batch_consumers;
+			continue;
+		}
+		struct rdma_batch *batch = g_slice_new(struct rdma_batch);
+		batch->message = NULL;
+		batch->pool_id = NULL;
+		batch->failed = false;
+		batch->consumers = batch_consumers;
+		batch->num_spectra = num_spectra;
+		batch->num_pending = num_spectra;
+		batch->stride = stride;
+		unsigned k = 0;
+		for (unsigned i = 0; i < n; ++i) {
+			if (consumers[i] & c) {
+				struct rdma_req *req = new_rdma_req(
+					context, 0, conn_ctx, payload, &payload->infos[i]);
+				req->batch = batch;
+				req->batch_index = k++;
+				g_queue_push_tail(reqs, req);
+			}
+		}
+	}
+}
+
 static int
 on_signal_message(struct spectrum_reader_context_ *context,
-                  struct vys_signal_msg *msg, GSList **consumers,
+                  struct vys_signal_msg *msg, const consumer_mask_t *consumers,
                   struct vys_error_record **error_record)
 {
 	struct vys_signal_msg_payload *payload = &(msg->payload);
@@ -403,13 +697,18 @@ on_signal_message(struct spectrum_reader_context_ *context,
 	                         error_record);
 
 	if (G_LIKELY(rc == 0 && reqs != NULL)) {
+		consumer_mask_t singles[UINT8_MAX];
+		if (G_UNLIKELY(context->batch_consumers != 0)) {
+			queue_spectra_batches(context, conn_ctx, reqs, payload, consumers,
+			                      singles);
+			consumers = singles;
+		}
 		struct vys_spectrum_info *info = payload->infos;
 		for (unsigned i = payload->num_spectra; i > 0; --i) {
-			if (*consumers != NULL)
+			if (*consumers != 0)
 				g_queue_push_tail(
 					reqs,
-					new_rdma_req(*consumers, conn_ctx, payload, info));
-			*consumers = NULL; //rdma req takes list
+					new_rdma_req(context, *consumers, conn_ctx, payload, info));
 			++consumers;
 			++info;
 		}
@@ -431,6 +730,7 @@ on_data_path_message(struct spectrum_reader_context_ *context,
 		if (G_LIKELY(context->state == STATE_RUN))
 			rc = on_signal_message(
 				context, msg->signal_msg, msg->consumers, error_record);
+		buffer_pool_count_pushed(context->shared->signal_msg_buffers, 1);
 		buffer_pool_push(context->shared->signal_msg_buffers, msg->signal_msg);
 		data_path_message_free(msg);
 		break;
@@ -534,6 +834,7 @@ on_server_route_resolved(struct spectrum_reader_context_ *context,
                          struct vys_error_record **error_record)
 {
 	/* register memory for receiving spectra */
+	finish_chunk_jobs(context, error_record);
 	conn_ctx->mrs = register_spectrum_buffer_pools(
 		context->shared->handle, conn_ctx->id, error_record);
 	if (G_UNLIKELY(conn_ctx->mrs == NULL))
@@ -568,41 +869,122 @@ on_server_route_resolved(struct spectrum_reader_context_ *context,
 	return rc;
 }
 
+static void
+rdma_req_message_new(struct spectrum_reader_context_ *context,
+                     struct rdma_req *req)
+{
+	if (req->batch == NULL) {
+		req->message = valid_buffer_message_new(
+			context->shared->handle, &req->data_info, &req->pool_id);
+		if (req->message != NULL) {
+			req->buffer = req->message->content.valid_buffer.buffer;
+			req->buffer_size = req->message->content.valid_buffer.buffer_size;
+		}
+	} else {
+		req->message = rdma_batch_message(context, req->batch, &req->pool_id);
+		if (req->message != NULL) {
+			req->buffer =
+				(void *)req->message->content.spectra_batch.buffer
+				+ req->batch_index * req->batch->stride;
+			req->buffer_size = spectrum_size(&req->data_info);
+		}
+	}
+}
+
 static int
 post_server_reads(struct spectrum_reader_context_ *context,
                   struct server_connection_context *conn_ctx,
                   struct vys_error_record **error_record)
 {
 	int rc = 0;
-	struct ibv_mr *mr = NULL;
+	struct ibv_mr **mrs = NULL;
 	pool_id_t pool_id = NULL;
 	while (rc == 0
 	       && conn_ctx->num_posted_wr < conn_ctx->max_posted_wr
 	       && !g_queue_is_empty(conn_ctx->reqs)) {
 		struct rdma_req *req = g_queue_pop_head(conn_ctx->reqs);
-		pool_id_t buff_pool_id;
-		req->message = valid_buffer_message_new(
-			context->shared->handle, &req->data_info, &buff_pool_id);
+		/* a resumed deferred read already has its message */
+		if (req->message == NULL)
+			rdma_req_message_new(context, req);
 		if (req->message != NULL) {
-			if (G_UNLIKELY(mr == NULL || buff_pool_id != pool_id)) {
-				pool_id = buff_pool_id;
-				mr = g_hash_table_lookup(conn_ctx->mrs, pool_id);
+			if (G_UNLIKELY(mrs == NULL || req->pool_id != pool_id)) {
+				pool_id = req->pool_id;
+				mrs = g_hash_table_lookup(conn_ctx->mrs, pool_id);
+			}
+			if (G_LIKELY(mrs != NULL)) {
+				struct spectrum_buffer_pool *sb_pool = pool_id;
+				rc = rdma_post_read(
+					conn_ctx->id, req, req->buffer, req->buffer_size,
+					mrs[buffer_pool_chunk_index(sb_pool->pool, req->buffer)], 0,
+					req->spectrum_info.data_addr, conn_ctx->rkeys[req->mr_id]);
+				if (G_LIKELY(rc == 0))
+					conn_ctx->num_posted_wr++;
+				else
+					VERB_ERR(error_record, errno, "rdma_post_read");
+			} else {
+				/* pools created after this connection was established are
+				 * registered by the chunk registrar, and reads into them wait
+				 * until that is done */
+				defer_server_read(context, conn_ctx, req);
 			}
-			rc = rdma_post_read(
-				conn_ctx->id, req, req->message->content.valid_buffer.buffer,
-				req->message->content.valid_buffer.buffer_size, mr, 0,
-				req->spectrum_info.data_addr, conn_ctx->rkeys[req->mr_id]);
-			if (G_LIKELY(rc == 0))
-				conn_ctx->num_posted_wr++;
-			else
-				VERB_ERR(error_record, errno, "rdma_post_read");
 		} else {
-			free_rdma_req(req);
+			free_rdma_req(context, req);
 		}
 	}
 	return rc;
 }
 
+static void
+defer_server_read(struct spectrum_reader_context_ *context,
+                  struct server_connection_context *conn_ctx,
+                  struct rdma_req *req)
+{
+	struct spectrum_buffer_pool *sb_pool = req->pool_id;
+	g_queue_push_tail(conn_ctx->deferred_reqs, req);
+	context->num_deferred_reqs++;
+	/* a pool with a job in flight is registered once that job is complete,
+	 * when the read is resumed */
+	if (!sb_pool->chunk_job_pending)
+		start_chunk_job(context, sb_pool, CHUNK_JOB_ADD_POOL, 0);
+}
+
+/* Return the deferred reads into a pool to the request queues of their
+ * connections, and post them; or, if registration of the pool failed, abandon
+ * them. */
+static int
+resume_deferred_reads(struct spectrum_reader_context_ *context,
+                      struct spectrum_buffer_pool *sb_pool, bool abandon,
+                      struct vys_error_record **error_record)
+{
+	int result = 0;
+	void resume(struct sockaddr_in *unused,
+	            struct server_connection_context *conn_ctx, void *unused1) {
+		bool resumed = false;
+		GList *node = conn_ctx->deferred_reqs->tail;
+		while (node != NULL) {
+			GList *prev = node->prev;
+			struct rdma_req *req = node->data;
+			if (req->pool_id == sb_pool) {
+				g_queue_delete_link(conn_ctx->deferred_reqs, node);
+				context->num_deferred_reqs--;
+				if (abandon) {
+					abandon_rdma_req(context, req);
+				} else {
+					g_queue_push_head(conn_ctx->reqs, req);
+					resumed = true;
+				}
+			}
+			node = prev;
+		}
+		if (resumed && conn_ctx->established) {
+			int rc = post_server_reads(context, conn_ctx, error_record);
+			if (result == 0) result = rc;
+		}
+	}
+	g_hash_table_foreach(context->connections, (GHFunc)resume, NULL);
+	return result;
+}
+
 static int
 on_server_established(struct spectrum_reader_context_ *context,
                       struct server_connection_context *conn_ctx,
@@ -655,8 +1037,18 @@ begin_server_disconnect(struct spectrum_reader_context_ *context,
                         struct vys_error_record **error_record)
 {
 	int rc = 0;
-	while (!g_queue_is_empty(conn_ctx->reqs))
-		free_rdma_req(g_queue_pop_head(conn_ctx->reqs));
+	while (!g_queue_is_empty(conn_ctx->reqs)) {
+		/* resumed deferred reads have messages */
+		struct rdma_req *req = g_queue_pop_head(conn_ctx->reqs);
+		if (req->message != NULL)
+			abandon_rdma_req(context, req);
+		else
+			free_rdma_req(context, req);
+	}
+	while (!g_queue_is_empty(conn_ctx->deferred_reqs)) {
+		abandon_rdma_req(context, g_queue_pop_head(conn_ctx->deferred_reqs));
+		context->num_deferred_reqs--;
+	}
 
 	if (conn_ctx->established) {
 		conn_ctx->established = false;
@@ -674,6 +1066,8 @@ complete_server_disconnect(struct spectrum_reader_context_ *context,
 {
 	if (conn_ctx->reqs != NULL)
 		g_queue_free(conn_ctx->reqs);
+	if (conn_ctx->deferred_reqs != NULL)
+		g_queue_free(conn_ctx->deferred_reqs);
 
 	if (conn_ctx->rkeys != NULL)
 		g_free(conn_ctx->rkeys);
@@ -706,11 +1100,10 @@ complete_server_disconnect(struct spectrum_reader_context_ *context,
 	//rdma_destroy_qp(conn_ctx->id);
 
 	if (conn_ctx->mrs != NULL) {
-		void dereg_mr(struct spectrum_buffer_pool *unused, struct ibv_mr *mr,
-		              void *unused1) {
-			int rc = rdma_dereg_mr(mr);
-			if (G_UNLIKELY(rc != 0))
-				VERB_ERR(error_record, errno, "rdma_dereg_mr");
+		finish_chunk_jobs(context, error_record);
+		void dereg_mr(struct spectrum_buffer_pool *sb_pool, struct ibv_mr **mrs,
+		              void *unused) {
+			deregister_spectrum_buffer_pool(sb_pool, mrs, error_record);
 		}
 		g_hash_table_foreach(conn_ctx->mrs, (GHFunc)dereg_mr, NULL);
 		g_hash_table_destroy(conn_ctx->mrs);
@@ -837,9 +1230,7 @@ poll_completions(GChecksum *checksum, struct server_connection_context *conn_ctx
 			req->status = conn_ctx->wcs[i].status;
 			if (G_LIKELY(req->status == IBV_WC_SUCCESS)) {
 				if (verify_digest(
-					    checksum,
-					    req->message->content.valid_buffer.buffer,
-					    req->message->content.valid_buffer.buffer_size,
+					    checksum, req->buffer, req->buffer_size,
 					    req->spectrum_info.digest))
 					req->result = RDMA_REQ_SUCCESS;
 				else
@@ -916,22 +1307,30 @@ on_read_completion(struct spectrum_reader_context_ *context, unsigned pfd,
 	rc = post_server_reads(context, conn_ctx, error_record);
 	if (G_UNLIKELY(rc != 0)) return rc;
 
+	/* messages are delivered to each consumer queue as a batch, once all
+	 * completions from this poll have been staged */
+	consumer_mask_t staged = 0;
 	while (reqs != NULL) {
 		struct rdma_req *req = reqs->data;
-		switch (req->result) {
-		case RDMA_REQ_DIGEST_VERIFICATION_FAILURE:
-			convert_valid_to_digest_failure(req->message);
-			break;
-		case RDMA_REQ_READ_FAILURE:
-			convert_valid_to_rdma_read_failure(req->message, req->status);
-			break;
-		default:
-			break;
+		if (req->batch != NULL) {
+			complete_batch_read(context, req, &staged);
+		} else {
+			switch (req->result) {
+			case RDMA_REQ_DIGEST_VERIFICATION_FAILURE:
+				convert_valid_to_digest_failure(req->message);
+				break;
+			case RDMA_REQ_READ_FAILURE:
+				convert_valid_to_rdma_read_failure(req->message, req->status);
+				break;
+			default:
+				break;
+			}
+			message_queues_stage(req->message, req->consumers, &staged);
 		}
-		message_queues_push(req->message, req->consumers);
-		free_rdma_req(req);
+		free_rdma_req(context, req);
 		reqs = g_slist_delete_link(reqs, reqs);
 	}
+	message_queues_publish(context->shared->handle, staged);
 
 	if (!conn_ctx->established && conn_ctx->num_posted_wr == 0)
 		rc = complete_server_disconnect(context, conn_ctx, error_record);
@@ -967,6 +1366,252 @@ on_inactivity_timer_event(struct spectrum_reader_context_ *context,
 	return 0;
 }
 
+static int
+on_pool_timer_event(struct spectrum_reader_context_ *context,
+                    struct vys_error_record **error_record)
+{
+	struct pollfd *pollfd = &g_array_index(
+		context->pollfds, struct pollfd, POOL_TIMER_FD_INDEX);
+
+	uint64_t n;
+	if (G_UNLIKELY(read(pollfd->fd, &n, sizeof(n)) < 0)) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
+		MSG_ERROR(error_record, errno, "Failed to read pool timer: %s",
+		          strerror(errno));
+		return -1;
+	}
+
+	/* release the last chunk of every pool that has not been starved for the
+	 * idle release time, provided all of the chunk's buffers are free; the
+	 * chunk is decommitted once the chunk registrar has deregistered it. Until
+	 * then, a new shrink request on every tick makes threads returning
+	 * buffers to the pool flush the buffers they have cached. */
+	vysmaw_handle handle = context->shared->handle;
+	gint64 idle_usec = (gint64)(
+		handle->config.spectrum_buffer_pool_idle_release_sec * 1000000);
+	gint64 now = g_get_monotonic_time();
+	GSList *sb_pool_node = handle->list_buffer_pools_fn(handle);
+	while (sb_pool_node != NULL) {
+		struct spectrum_buffer_pool *sb_pool = sb_pool_node->data;
+		unsigned shrink_request = 0;
+		if (!sb_pool->chunk_job_pending
+		    && sb_pool->pool->num_chunks > 1
+		    && now - sb_pool->last_starvation_time >= idle_usec) {
+			spectrum_buffer_cache_flush(sb_pool);
+			if (buffer_pool_withdraw_chunk(sb_pool->pool))
+				start_chunk_job(context, sb_pool, CHUNK_JOB_RELEASE_CHUNK,
+				                sb_pool->pool->num_chunks - 1);
+			else
+				shrink_request = MAX(sb_pool->shrink_request + 1, 1);
+		}
+		__atomic_store_n(&sb_pool->shrink_request, shrink_request,
+		                 __ATOMIC_RELAXED);
+		sb_pool_node = g_slist_delete_link(sb_pool_node, sb_pool_node);
+	}
+	return 0;
+}
+
+/* Add a chunk to every spectrum buffer pool that has been found empty. Each new
+ * chunk is registered by the chunk registrar on all connections that have
+ * registered the pool, and its buffers are made available only after that,
+ * so that no read is posted to unregistered memory. Every request refreshes
+ * the pool's starvation time, including requests for a pool that cannot
+ * grow, so that a starved pool is not shrunk by the pool timer. */
+static int
+grow_spectrum_buffer_pools(struct spectrum_reader_context_ *context,
+                           struct vys_error_record **error_record)
+{
+	vysmaw_handle handle = context->shared->handle;
+	gint64 now = g_get_monotonic_time();
+	GSList *sb_pool_node = handle->list_buffer_pools_fn(handle);
+	while (sb_pool_node != NULL) {
+		struct spectrum_buffer_pool *sb_pool = sb_pool_node->data;
+		/* a request for a pool with a chunk job in flight is left for
+		 * complete_chunk_job() */
+		if (!sb_pool->chunk_job_pending
+		    && __atomic_exchange_n(&sb_pool->grow_requested, false,
+		                           __ATOMIC_RELAXED)) {
+			sb_pool->last_starvation_time = now;
+			if (!__atomic_load_n(&sb_pool->grow_failed, __ATOMIC_RELAXED)) {
+				int chunk = buffer_pool_commit_chunk(sb_pool->pool);
+				if (chunk >= 0)
+					start_chunk_job(
+						context, sb_pool, CHUNK_JOB_ADD_CHUNK, chunk);
+				else
+					__atomic_store_n(&sb_pool->grow_failed, true,
+					                 __ATOMIC_RELAXED);
+			}
+		}
+		sb_pool_node = g_slist_delete_link(sb_pool_node, sb_pool_node);
+	}
+	return 0;
+}
+
+static void
+start_chunk_job(struct spectrum_reader_context_ *context,
+                struct spectrum_buffer_pool *sb_pool, enum chunk_job_type type,
+                unsigned chunk)
+{
+	struct chunk_job *job = g_slice_new0(struct chunk_job);
+	job->sb_pool = spectrum_buffer_pool_ref(sb_pool);
+	job->type = type;
+	job->chunk = chunk;
+	job->num_chunks =
+		((type == CHUNK_JOB_ADD_POOL) ? sb_pool->pool->num_chunks : 1);
+	job->registrations =
+		g_array_new(false, false, sizeof(struct chunk_registration));
+	void add_registration(struct sockaddr_in *unused,
+	                      struct server_connection_context *conn_ctx,
+	                      void *unused1) {
+		if (conn_ctx->mrs == NULL) return;
+		struct ibv_mr **mrs = g_hash_table_lookup(conn_ctx->mrs, sb_pool);
+		if (type == CHUNK_JOB_ADD_POOL) {
+			if (mrs != NULL) return;
+			mrs = g_new0(struct ibv_mr *, sb_pool->pool->max_chunks);
+		}
+		if (mrs != NULL) {
+			struct chunk_registration reg = {
+				.conn_ctx = conn_ctx,
+				.mrs = mrs
+			};
+			g_array_append_val(job->registrations, reg);
+		}
+	}
+	if (context->connections != NULL)
+		g_hash_table_foreach(
+			context->connections, (GHFunc)add_registration, NULL);
+	sb_pool->chunk_job_pending = true;
+	context->num_chunk_jobs++;
+	g_async_queue_push(context->chunk_jobs, job);
+}
+
+/* Executed by the chunk registrar thread. Failure to register a chunk on any
+ * connection is not fatal for a new chunk, which is simply not added to the
+ * pool. */
+static void
+run_chunk_job(struct chunk_job *job)
+{
+	unsigned end_chunk = job->chunk + job->num_chunks;
+	bool release = (job->type == CHUNK_JOB_RELEASE_CHUNK);
+	if (!release) {
+		for (unsigned i = 0; !job->failed && i < job->registrations->len; ++i) {
+			struct chunk_registration *reg = &g_array_index(
+				job->registrations, struct chunk_registration, i);
+			for (unsigned c = job->chunk; !job->failed && c < end_chunk; ++c) {
+				reg->mrs[c] = register_spectrum_buffer_pool_chunk(
+					job->sb_pool, c, reg->conn_ctx->id, &job->error_record);
+				job->failed = (reg->mrs[c] == NULL);
+			}
+		}
+	}
+	if (release || job->failed) {
+		for (unsigned i = 0; i < job->registrations->len; ++i) {
+			struct chunk_registration *reg = &g_array_index(
+				job->registrations, struct chunk_registration, i);
+			for (unsigned c = job->chunk; c < end_chunk; ++c) {
+				if (reg->mrs[c] != NULL) {
+					int rc = rdma_dereg_mr(reg->mrs[c]);
+					if (G_UNLIKELY(rc != 0 && release))
+						VERB_ERR(&job->error_record, errno, "rdma_dereg_mr");
+					reg->mrs[c] = NULL;
+				}
+			}
+		}
+	}
+}
+
+static int
+complete_chunk_job(struct spectrum_reader_context_ *context,
+                   struct chunk_job *job,
+                   struct vys_error_record **error_record)
+{
+	int result = 0;
+	struct spectrum_buffer_pool *sb_pool = job->sb_pool;
+	switch (job->type) {
+	case CHUNK_JOB_ADD_CHUNK:
+		if (G_LIKELY(!job->failed)) {
+			buffer_pool_publish_chunk(sb_pool->pool, job->chunk);
+		} else {
+			buffer_pool_decommit_chunk(sb_pool->pool);
+			vys_error_record_free(job->error_record);
+			__atomic_store_n(&sb_pool->grow_failed, true, __ATOMIC_RELAXED);
+		}
+		break;
+
+	case CHUNK_JOB_RELEASE_CHUNK:
+		if (G_UNLIKELY(job->error_record != NULL)) result = -1;
+		buffer_pool_decommit_chunk(sb_pool->pool);
+		sb_pool->last_starvation_time = g_get_monotonic_time();
+		__atomic_store_n(&sb_pool->grow_failed, false, __ATOMIC_RELAXED);
+		*error_record =
+			vys_error_record_concat(job->error_record, *error_record);
+		break;
+
+	case CHUNK_JOB_ADD_POOL:
+		for (unsigned i = 0; i < job->registrations->len; ++i) {
+			struct chunk_registration *reg = &g_array_index(
+				job->registrations, struct chunk_registration, i);
+			if (G_LIKELY(!job->failed))
+				g_hash_table_insert(reg->conn_ctx->mrs, sb_pool, reg->mrs);
+			else
+				g_free(reg->mrs);
+		}
+		if (G_UNLIKELY(job->failed)) {
+			result = -1;
+			*error_record =
+				vys_error_record_concat(job->error_record, *error_record);
+		}
+		break;
+	}
+	sb_pool->chunk_job_pending = false;
+	context->num_chunk_jobs--;
+
+	/* pick up a growth request made while the job was in flight */
+	if (__atomic_load_n(&sb_pool->grow_requested, __ATOMIC_RELAXED))
+		__atomic_store_n(
+			&context->shared->handle->spectrum_buffer_pool_grow_requested,
+			true, __ATOMIC_RELAXED);
+
+	/* resume reads that were deferred until the pool's registration, which
+	 * may have been waiting for this job to complete */
+	if (context->num_deferred_reqs > 0) {
+		int rc = resume_deferred_reads(
+			context, sb_pool, job->type == CHUNK_JOB_ADD_POOL && job->failed,
+			error_record);
+		if (result == 0) result = rc;
+	}
+
+	spectrum_buffer_pool_unref(sb_pool);
+	g_array_free(job->registrations, true);
+	g_slice_free(struct chunk_job, job);
+	return result;
+}
+
+/* Wait for all chunk jobs in flight to complete. This is needed before this
+ * thread creates or destroys memory registrations itself, which happens only
+ * when connections are made and closed. */
+static void
+finish_chunk_jobs(struct spectrum_reader_context_ *context,
+                  struct vys_error_record **error_record)
+{
+	while (context->num_chunk_jobs > 0)
+		complete_chunk_job(
+			context, async_queue_pop(context->done_chunk_jobs), error_record);
+}
+
+static void *
+chunk_registrar(struct spectrum_reader_context_ *context)
+{
+	struct chunk_job *job;
+	while ((job = g_async_queue_pop(context->chunk_jobs))->sb_pool != NULL) {
+		run_chunk_job(job);
+		async_queue_push(context->done_chunk_jobs, job);
+	}
+	g_slice_free(struct chunk_job, job);
+	return NULL;
+}
+
 static int
 on_poll_events(struct spectrum_reader_context_ *context,
                struct vys_error_record **error_record)
@@ -990,15 +1635,37 @@ on_poll_events(struct spectrum_reader_context_ *context,
 	if (tm_pollfd->revents & POLLIN)
 		rc2 = on_inactivity_timer_event(context, error_record);
 
+	/* pool timer events */
+	struct pollfd *pt_pollfd = &g_array_index(context->pollfds, struct pollfd,
+	                                          POOL_TIMER_FD_INDEX);
+	if (G_UNLIKELY(pt_pollfd->revents & POLLIN)) {
+		int rc = on_pool_timer_event(context, error_record);
+		if (rc2 == 0) rc2 = rc;
+	}
+
+	/* completed chunk jobs */
+	struct pollfd *cj_pollfd = &g_array_index(context->pollfds, struct pollfd,
+	                                          CHUNK_JOB_QUEUE_FD_INDEX);
+	if (G_UNLIKELY(cj_pollfd->revents & POLLIN)) {
+		struct chunk_job *job;
+		while ((job = async_queue_try_pop(context->done_chunk_jobs)) != NULL) {
+			int rc = complete_chunk_job(context, job, error_record);
+			if (G_UNLIKELY(rc2 == 0)) rc2 = rc;
+		}
+	}
+
 	/* read request events */
 	int rc3 = 0;
 	struct pollfd *rr_pollfd = &g_array_index(context->pollfds, struct pollfd,
 	                                          READ_REQUEST_QUEUE_FD_INDEX);
 	if (rr_pollfd->revents & POLLIN) {
-		struct data_path_message *msg =
-			async_queue_pop(context->shared->read_request_queue);
-		if (msg != NULL)
-			rc3 = on_data_path_message(context, msg, error_record);
+		/* the queue must be drained for its eventfd to be signalled again */
+		struct data_path_message *msg;
+		while ((msg = async_queue_try_pop(
+				        context->shared->read_request_queue)) != NULL) {
+			int rc = on_data_path_message(context, msg, error_record);
+			if (G_UNLIKELY(rc3 == 0 && rc != 0)) rc3 = rc;
+		}
 	}
 
 	/* read completion events */
@@ -1016,6 +1683,18 @@ on_poll_events(struct spectrum_reader_context_ *context,
 		}
 		if (G_UNLIKELY(rc4 == 0 && rc5 != 0)) rc4 = rc5;
 	}
+
+	/* requests for spectrum buffer pool growth */
+	if (G_UNLIKELY(
+		    __atomic_load_n(
+			    &context->shared->handle->spectrum_buffer_pool_grow_requested,
+			    __ATOMIC_ACQUIRE))) {
+		__atomic_store_n(
+			&context->shared->handle->spectrum_buffer_pool_grow_requested,
+			false, __ATOMIC_RELAXED);
+		grow_spectrum_buffer_pools(context, error_record);
+	}
+
 	if (context->new_pollfds->len > 0) {
 		GArray *tmp = context->pollfds;
 		context->pollfds = context->new_pollfds;
@@ -1136,6 +1815,118 @@ stop_inactivity_timer(struct spectrum_reader_context_ *context,
 	return rc;
 }
 
+static int
+start_pool_timer(struct spectrum_reader_context_ *context,
+                 struct vys_error_record **error_record)
+{
+	struct pollfd *pt_pollfd = &g_array_index(context->pollfds, struct pollfd,
+	                                          POOL_TIMER_FD_INDEX);
+
+	/* only elastic spectrum buffer pools need the timer */
+	const struct vysmaw_configuration *config =
+		&context->shared->handle->config;
+	if (spectrum_buffer_pool_max_chunks(config) <= 1) {
+		pt_pollfd->fd = -1;
+		return 0;
+	}
+
+	pt_pollfd->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	pt_pollfd->events = POLLIN;
+	if (pt_pollfd->fd >= 0) {
+		double period =
+			MAX(config->spectrum_buffer_pool_idle_release_sec / 4, 0.1);
+		time_t sec = (time_t)period;
+		long nsec = (long)((period - sec) * 1000000000);
+		struct itimerspec itimerspec = {
+			.it_interval = { .tv_sec = sec, .tv_nsec = nsec },
+			.it_value = { .tv_sec = sec, .tv_nsec = nsec }
+		};
+		int rc = timerfd_settime(pt_pollfd->fd, 0, &itimerspec, NULL);
+		if (rc < 0) {
+			MSG_ERROR(error_record, errno,
+			          "Failed to start pool timer: %s", strerror(errno));
+			stop_pool_timer(context, error_record);
+			return rc;
+		}
+	} else {
+		MSG_ERROR(error_record, errno, "Failed to create pool timer: %s",
+		          strerror(errno));
+	}
+	return pt_pollfd->fd;
+}
+
+static int
+stop_pool_timer(struct spectrum_reader_context_ *context,
+                struct vys_error_record **error_record)
+{
+	struct pollfd *pt_pollfd = &g_array_index(context->pollfds, struct pollfd,
+	                                          POOL_TIMER_FD_INDEX);
+	int rc = 0;
+	if (pt_pollfd->fd >= 0) {
+		rc = close(pt_pollfd->fd);
+		if (rc < 0)
+			MSG_ERROR(error_record, errno,
+			          "Failed to close pool timer: %s", strerror(errno));
+		pt_pollfd->fd = -1;
+	}
+	return rc;
+}
+
+static int
+start_chunk_registrar(struct spectrum_reader_context_ *context,
+                      struct vys_error_record **error_record)
+{
+	struct pollfd *cj_pollfd = &g_array_index(context->pollfds, struct pollfd,
+	                                          CHUNK_JOB_QUEUE_FD_INDEX);
+
+	/* only elastic spectrum buffer pools, and pools created on demand, need
+	 * the chunk registrar */
+	const struct vysmaw_configuration *config =
+		&context->shared->handle->config;
+	if (spectrum_buffer_pool_max_chunks(config) <= 1
+	    && config->single_spectrum_buffer_pool) {
+		cj_pollfd->fd = -1;
+		return 0;
+	}
+
+	/* there is at most one job in flight for each pool */
+	context->done_chunk_jobs = async_queue_new_sized(16);
+	if (G_UNLIKELY(context->done_chunk_jobs == NULL)) {
+		MSG_ERROR(error_record, errno,
+		          "Failed to create chunk job queue: %s", strerror(errno));
+		cj_pollfd->fd = -1;
+		return -1;
+	}
+	cj_pollfd->fd = async_queue_pop_fd(context->done_chunk_jobs);
+	cj_pollfd->events = POLLIN;
+	context->chunk_jobs = g_async_queue_new();
+	context->chunk_registrar = THREAD_NEW(
+		"chunk_registrar", (GThreadFunc)chunk_registrar, context);
+	return 0;
+}
+
+static int
+stop_chunk_registrar(struct spectrum_reader_context_ *context,
+                     struct vys_error_record **error_record)
+{
+	struct pollfd *cj_pollfd = &g_array_index(context->pollfds, struct pollfd,
+	                                          CHUNK_JOB_QUEUE_FD_INDEX);
+	if (context->chunk_registrar != NULL) {
+		finish_chunk_jobs(context, error_record);
+		g_async_queue_push(context->chunk_jobs, g_slice_new0(struct chunk_job));
+		g_thread_join(context->chunk_registrar);
+		context->chunk_registrar = NULL;
+		g_async_queue_unref(context->chunk_jobs);
+		context->chunk_jobs = NULL;
+	}
+	if (context->done_chunk_jobs != NULL) {
+		async_queue_unref(context->done_chunk_jobs);
+		context->done_chunk_jobs = NULL;
+	}
+	cj_pollfd->fd = -1;
+	return 0;
+}
+
 static int
 start_read_request_poll(struct spectrum_reader_context_ *context,
                         struct vys_error_record **error_record)
@@ -1191,6 +1982,11 @@ spectrum_reader(struct spectrum_reader_context *shared)
 	context.pollfds = g_array_new(false, false, sizeof(struct pollfd));
 	context.new_pollfds = g_array_new(false, false, sizeof(struct pollfd));
 	context.checksum = g_checksum_new(G_CHECKSUM_MD5);
+	context.req_slab =
+		hot_path_slab_new(&shared->handle->config, sizeof(struct rdma_req));
+	context.batch_consumers = batch_spectra_consumers(shared->handle);
+
+	numa_bind_service_thread(shared->handle);
 
 	g_array_set_size(context.pollfds, NUM_FIXED_FDS);
 	for (unsigned i = 0; i < NUM_FIXED_FDS; ++i) {
@@ -1208,6 +2004,14 @@ spectrum_reader(struct spectrum_reader_context *shared)
 	if (rc < 0)
 		goto cleanup_and_return;
 
+	rc = start_pool_timer(&context, &error_record);
+	if (rc < 0)
+		goto cleanup_and_return;
+
+	rc = start_chunk_registrar(&context, &error_record);
+	if (rc < 0)
+		goto cleanup_and_return;
+
 	rc = start_read_request_poll(&context, &error_record);
 	if (rc != 0)
 		goto cleanup_and_return;
@@ -1230,6 +2034,10 @@ spectrum_reader(struct spectrum_reader_context *shared)
 
 	stop_read_request_poll(&context, &error_record);
 
+	stop_chunk_registrar(&context, &error_record);
+
+	stop_pool_timer(&context, &error_record);
+
 	stop_inactivity_timer(&context, &error_record);
 
 	stop_rdma_cm(&context, &error_record);
@@ -1259,11 +2067,11 @@ spectrum_reader(struct spectrum_reader_context *shared)
 	post_msg(shared->handle, msg);
 	handle_unref(shared->handle); // end message has been posted
 	data_path_message_free(context.end_msg);
-
-	if (context.shared->signal_msg_buffers != NULL)
-		buffer_pool_free(context.shared->signal_msg_buffers);
+	if (context.shared->data_path_msgs != NULL)
+		data_path_message_ring_free(context.shared->data_path_msgs);
 
 	g_checksum_free(context.checksum);
+	buffer_pool_free(context.req_slab);
 	g_array_free(context.pollfds, TRUE);
 	g_array_free(context.new_pollfds, TRUE);
 	async_queue_unref(shared->read_request_queue);
@@ -26,6 +26,7 @@ struct spectrum_reader_context {
 
 	unsigned signal_msg_num_spectra;
 	struct buffer_pool *signal_msg_buffers;
+	struct data_path_message_ring *data_path_msgs;
 
 	struct async_queue *read_request_queue;
 
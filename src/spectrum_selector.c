@@ -17,49 +17,300 @@
 //
 #include <spectrum_selector.h>
 #include <glib.h>
+#include <string.h>
 
 #define MIN_EAGER_CONNECT_IDLE_SEC 0.1
 
-static bool select_spectra(
-	struct data_path_message *msg, struct consumer *consumers,
-	unsigned num_consumers)
-	__attribute__((nonnull));
+/* stable hash of a product to one of 'num_shards' shards */
+static unsigned
+product_shard(const struct vys_signal_msg_payload *payload, unsigned num_shards)
+{
+	guint32 product =
+		((guint32)payload->stations[0] << 24)
+		| ((guint32)payload->stations[1] << 16)
+		| ((guint32)payload->spectral_window_index << 8)
+		| payload->stokes_index;
+	/* Fibonacci hashing: the high bits of the product are the well mixed ones,
+	 * so scale the hash to the number of shards rather than taking it modulo
+	 * that number, which for a power of two would keep only the low bits, and
+	 * thus depend only on the low bits of the product */
+	return ((guint64)(guint32)(product * 2654435769U) * num_shards) >> 32;
+}
+
+#define PASS_FILTER_WORDS(n) (((n) + 63) / 64)
+
+#define TEST_BIT(set, k) (((set)[(k) / 64] >> ((k) % 64)) & 1)
 
-static bool
-select_spectra(struct data_path_message *msg, struct consumer *consumers,
-               unsigned num_consumers)
+void
+spectrum_batch_columns_init(struct spectrum_batch_columns *columns,
+                            unsigned max_spectra)
 {
-	g_assert(msg->typ == DATA_PATH_SIGNAL_MSG);
+	columns->max_spectra = max_spectra;
+	columns->station0 = g_new(uint8_t, max_spectra);
+	columns->station1 = g_new(uint8_t, max_spectra);
+	columns->spectral_window_index = g_new(uint8_t, max_spectra);
+	columns->stokes_index = g_new(uint8_t, max_spectra);
+	columns->timestamp = g_new(uint64_t, max_spectra);
+	columns->pass_filter = g_new(uint64_t, PASS_FILTER_WORDS(max_spectra));
+}
 
-	const struct vys_signal_msg_payload *payload = &msg->signal_msg->payload;
+void
+spectrum_batch_columns_clear(struct spectrum_batch_columns *columns)
+{
+	g_free(columns->station0);
+	g_free(columns->station1);
+	g_free(columns->spectral_window_index);
+	g_free(columns->stokes_index);
+	g_free(columns->timestamp);
+	g_free(columns->pass_filter);
+}
 
-	bool result = false;
-	for (unsigned i = 0; i < payload->num_spectra; ++i)
-		msg->consumers[i] = NULL;
+/* fill 'columns' with the metadata of the spectra of 'payloads' */
+static struct vysmaw_spectrum_batch
+fill_spectrum_batch(struct spectrum_batch_columns *columns,
+                    const struct vys_signal_msg_payload *const *payloads,
+                    unsigned num_payloads)
+{
+	unsigned k = 0;
+	for (unsigned j = 0; j < num_payloads; ++j) {
+		const struct vys_signal_msg_payload *payload = payloads[j];
+		g_assert(k + payload->num_spectra <= columns->max_spectra);
+		memset(&columns->station0[k], payload->stations[0],
+		       payload->num_spectra);
+		memset(&columns->station1[k], payload->stations[1],
+		       payload->num_spectra);
+		memset(&columns->spectral_window_index[k],
+		       payload->spectral_window_index, payload->num_spectra);
+		memset(&columns->stokes_index[k], payload->stokes_index,
+		       payload->num_spectra);
+		for (unsigned i = 0; i < payload->num_spectra; ++i)
+			columns->timestamp[k++] = payload->infos[i].timestamp;
+	}
+	struct vysmaw_spectrum_batch result = {
+		.num_spectra = k,
+		.station0 = columns->station0,
+		.station1 = columns->station1,
+		.spectral_window_index = columns->spectral_window_index,
+		.stokes_index = columns->stokes_index,
+		.timestamp = columns->timestamp
+	};
+	return result;
+}
 
+static inline bool
+selection_has_product(const struct vysmaw_spectrum_selection *selection,
+                      const struct vys_signal_msg_payload *payload)
+{
+	return (TEST_BIT(selection->baselines,
+	                 (UINT8_MAX + 1) * payload->stations[0]
+	                 + payload->stations[1])
+	        && TEST_BIT(selection->spectral_windows,
+	                    payload->spectral_window_index)
+	        && TEST_BIT(selection->stokes, payload->stokes_index));
+}
+
+static inline bool
+selection_has_time(const struct vysmaw_spectrum_selection *selection,
+                   uint64_t timestamp)
+{
+	return (timestamp >= selection->start_time
+	        && (selection->end_time == 0 || timestamp < selection->end_time));
+}
+
+/* distribute the spectra of 'payload' that passed the filter of consumer 'i',
+ * given by bits 'first' to 'first + payload->num_spectra - 1' of
+ * 'pass_filter' (all spectra, if NULL), and the consumer's selection, among
+ * the consumer's shards */
+static consumer_mask_t
+select_passed(struct consumer *consumer, unsigned i,
+              const struct vys_signal_msg_payload *payload,
+              const uint64_t *pass_filter, unsigned first,
+              consumer_mask_t *selections)
+{
+	const struct vysmaw_spectrum_selection *selection = consumer->selection;
+	if (selection != NULL && !selection_has_product(selection, payload))
+		return 0;
+	/* set of all spectra, for a NULL 'pass_filter' */
+	uint64_t all[PASS_FILTER_WORDS(UINT8_MAX)];
+	if (pass_filter == NULL) {
+		memset(all, 0xff, sizeof(all));
+		pass_filter = all;
+		first = 0;
+	}
+	consumer_mask_t selected = 0;
+	unsigned end = first + payload->num_spectra;
+	if (consumer->num_shards == 1
+	    || consumer->shard_distribution == VYSMAW_SHARD_BY_PRODUCT) {
+		/* all spectra in a signal message are of the same product */
+		consumer_mask_t mask =
+			(consumer_mask_t)1
+			<< (i + ((consumer->num_shards == 1)
+			         ? 0
+			         : product_shard(payload, consumer->num_shards)));
+		for (unsigned k = first; k < end; ++k)
+			if (TEST_BIT(pass_filter, k)
+			    && (selection == NULL
+			        || selection_has_time(
+				        selection, payload->infos[k - first].timestamp))) {
+				selections[k - first] |= mask;
+				selected = mask;
+			}
+	} else {
+		for (unsigned k = first; k < end; ++k)
+			if (TEST_BIT(pass_filter, k)
+			    && (selection == NULL
+			        || selection_has_time(
+				        selection, payload->infos[k - first].timestamp))) {
+				consumer_mask_t mask =
+					(consumer_mask_t)1 << (i + consumer->next_shard);
+				if (++consumer->next_shard == consumer->num_shards)
+					consumer->next_shard = 0;
+				selections[k - first] |= mask;
+				selected |= mask;
+			}
+	}
+	return selected;
+}
+
+/* Select the consumers of the spectra of a batch of signal messages. Consumers
+ * with a batch filter are called once for the entire batch, others once for
+ * every signal message. 'selections[j]' is set to the consumers of each
+ * spectrum of 'payloads[j]', and 'selected[j]' to their union. */
+void
+select_spectra_batch(struct consumer *consumers, unsigned num_consumers,
+                     struct spectrum_batch_columns *columns,
+                     const struct vys_signal_msg_payload *const *payloads,
+                     unsigned num_payloads, consumer_mask_t *const *selections,
+                     consumer_mask_t *selected)
+{
+	for (unsigned j = 0; j < num_payloads; ++j) {
+		memset(selections[j], 0,
+		       payloads[j]->num_spectra * sizeof(consumer_mask_t));
+		selected[j] = 0;
+	}
+
+	/* the columns are filled only for the first consumer with a batch filter */
+	bool have_batch = false;
+	struct vysmaw_spectrum_batch batch;
 	struct consumer *consumer = consumers;
-	while (num_consumers-- > 0) {
-		g_array_set_size(consumer->pass_filter_array, payload->num_spectra);
-		bool *pass_filter = (bool *)consumer->pass_filter_array->data;
-		consumer->spectrum_filter_fn(
-			payload->stations,
-			payload->spectral_window_index,
-			payload->stokes_index,
-			payload->infos,
-			payload->num_spectra,
-			consumer->user_data,
-			pass_filter);
-		for (unsigned j = 0; j < payload->num_spectra; ++j)
-			if (*pass_filter++) {
-				result = true;
-				msg->consumers[j] =
-					g_slist_prepend(msg->consumers[j], consumer);
+	unsigned i = 0;
+	while (i < num_consumers) {
+		g_assert(consumer->num_shards > 0);
+		if (consumer->spectrum_batch_filter_fn != NULL) {
+			if (!have_batch) {
+				batch = fill_spectrum_batch(columns, payloads, num_payloads);
+				have_batch = true;
+			}
+			memset(columns->pass_filter, 0,
+			       PASS_FILTER_WORDS(batch.num_spectra) * sizeof(uint64_t));
+			consumer->spectrum_batch_filter_fn(
+				&batch, consumer->user_data, columns->pass_filter);
+			unsigned first = 0;
+			for (unsigned j = 0; j < num_payloads; ++j) {
+				selected[j] |= select_passed(
+					consumer, i, payloads[j], columns->pass_filter, first,
+					selections[j]);
+				first += payloads[j]->num_spectra;
 			}
-		consumer++;
+		} else if (consumer->spectrum_filter_fn != NULL) {
+			uint64_t pass_bits[PASS_FILTER_WORDS(UINT8_MAX)];
+			for (unsigned j = 0; j < num_payloads; ++j) {
+				const struct vys_signal_msg_payload *payload = payloads[j];
+				/* no need to call the filter for unselected products */
+				if (consumer->selection != NULL
+				    && !selection_has_product(consumer->selection, payload))
+					continue;
+				g_array_set_size(consumer->pass_filter_array,
+				                 payload->num_spectra);
+				bool *pass_filter = (bool *)consumer->pass_filter_array->data;
+				consumer->spectrum_filter_fn(
+					payload->stations,
+					payload->spectral_window_index,
+					payload->stokes_index,
+					payload->infos,
+					payload->num_spectra,
+					consumer->user_data,
+					pass_filter);
+				memset(pass_bits, 0, sizeof(pass_bits));
+				for (unsigned k = 0; k < payload->num_spectra; ++k)
+					pass_bits[k / 64] |= (uint64_t)pass_filter[k] << (k % 64);
+				selected[j] |= select_passed(
+					consumer, i, payload, pass_bits, 0, selections[j]);
+			}
+		} else {
+			/* selection only (or everything) */
+			for (unsigned j = 0; j < num_payloads; ++j)
+				selected[j] |= select_passed(
+					consumer, i, payloads[j], NULL, 0, selections[j]);
+		}
+		i += consumer->num_shards;
+		consumer += consumer->num_shards;
 	}
+}
+
+consumer_mask_t
+select_spectra(struct consumer *consumers, unsigned num_consumers,
+               const struct vys_signal_msg_payload *payload,
+               consumer_mask_t *selections)
+{
+	/* columns for a single signal message */
+	uint8_t station0[UINT8_MAX];
+	uint8_t station1[UINT8_MAX];
+	uint8_t spectral_window_index[UINT8_MAX];
+	uint8_t stokes_index[UINT8_MAX];
+	uint64_t timestamp[UINT8_MAX];
+	uint64_t pass_filter[PASS_FILTER_WORDS(UINT8_MAX)];
+	struct spectrum_batch_columns columns = {
+		.max_spectra = UINT8_MAX,
+		.station0 = station0,
+		.station1 = station1,
+		.spectral_window_index = spectral_window_index,
+		.stokes_index = stokes_index,
+		.timestamp = timestamp,
+		.pass_filter = pass_filter
+	};
+	consumer_mask_t result;
+	select_spectra_batch(consumers, num_consumers, &columns, &payload, 1,
+	                     &selections, &result);
 	return result;
 }
 
+/* forward a signal message to the spectrum reader if any of its spectra were
+ * selected, or if an eager connection to its server is due; otherwise,
+ * release it */
+static void
+forward_signal_message(struct spectrum_selector_context *context,
+                       struct data_path_message *msg, bool selected,
+                       GHashTable *prev_eagerly_forwarded,
+                       double eager_connect_idle_sec)
+{
+	if (!selected && context->handle->config.eager_connect) {
+		/* may want to forward the signal message if eager connections
+		 * are configured */
+		GTimer *t = g_hash_table_lookup(
+			prev_eagerly_forwarded, &msg->signal_msg->payload.sockaddr);
+		if (t == NULL) {
+			t = g_timer_new();
+			g_hash_table_insert(
+				prev_eagerly_forwarded,
+				new_sockaddr_key(&msg->signal_msg->payload.sockaddr),
+				t);
+			selected = true;
+		} else {
+			if (g_timer_elapsed(t, NULL) >= eager_connect_idle_sec) {
+				selected = true;
+				g_timer_start(t);
+			}
+		}
+	}
+	if (selected) {
+		async_queue_push(context->read_request_queue, msg);
+	} else {
+		buffer_pool_count_pushed(context->signal_msg_buffers, 1);
+		buffer_pool_push(context->signal_msg_buffers, msg->signal_msg);
+		data_path_message_free(msg);
+	}
+}
 
 #define READY(gate) G_STMT_START {                                      \
 		MUTEX_LOCK((gate)->mtx); \
@@ -79,53 +330,57 @@ spectrum_selector(struct spectrum_selector_context *context)
 		                      (GDestroyNotify)free_sockaddr_key,
 		                      (GDestroyNotify)g_timer_destroy);
 
+	numa_bind_service_thread(context->handle);
+
 	READY(&context->handle->gate);
 
 	double eager_connect_idle_sec =
 		MIN(context->handle->config.eager_connect_idle_sec,
 		    MIN_EAGER_CONNECT_IDLE_SEC);
+	struct spectrum_batch_columns columns;
+	spectrum_batch_columns_init(
+		&columns, SPECTRUM_SELECTOR_MAX_BATCH_SIZE * UINT8_MAX);
+	struct data_path_message *batch[SPECTRUM_SELECTOR_MAX_BATCH_SIZE];
+	const struct vys_signal_msg_payload *
+		payloads[SPECTRUM_SELECTOR_MAX_BATCH_SIZE];
+	consumer_mask_t *selections[SPECTRUM_SELECTOR_MAX_BATCH_SIZE];
+	consumer_mask_t selected[SPECTRUM_SELECTOR_MAX_BATCH_SIZE];
+
 	bool quitting = false;
 	bool quit = false;
 	while (!quit) {
+		/* batch the signal messages that are already queued, without waiting
+		 * for more */
 		struct data_path_message *msg =
-			g_async_queue_pop(context->signal_msg_queue);
+			async_queue_pop(context->signal_msg_queue);
+		unsigned num_signals = 0;
+		while (msg != NULL && msg->typ == DATA_PATH_SIGNAL_MSG) {
+			batch[num_signals] = msg;
+			payloads[num_signals] = &msg->signal_msg->payload;
+			selections[num_signals] = msg->consumers;
+			++num_signals;
+			msg = ((num_signals < SPECTRUM_SELECTOR_MAX_BATCH_SIZE)
+			       ? async_queue_try_pop(context->signal_msg_queue)
+			       : NULL);
+		}
 
-		switch (msg->typ) {
-		case DATA_PATH_SIGNAL_MSG: {
-			bool selected =
-				!quitting
-				&& select_spectra(
-					msg,
+		if (num_signals > 0) {
+			if (!quitting)
+				select_spectra_batch(
 					context->handle->consumers,
-					context->handle->num_consumers);
-			if (!selected && context->handle->config.eager_connect) {
-				/* may want to forward the signal message if eager connections
-				 * are configured */
-				GTimer *t = g_hash_table_lookup(
-					prev_eagerly_forwarded,
-					&msg->signal_msg->payload.sockaddr);
-				if (t == NULL) {
-					t = g_timer_new();
-					g_hash_table_insert(
-						prev_eagerly_forwarded,
-						new_sockaddr_key(&msg->signal_msg->payload.sockaddr),
-						t);
-					selected = true;
-				} else {
-					if (g_timer_elapsed(t, NULL) >= eager_connect_idle_sec) {
-						selected = true;
-						g_timer_start(t);
-					}
-				}
-			}
-			if (selected) {
-				async_queue_push(context->read_request_queue, msg);
-			} else {
-				buffer_pool_push(context->signal_msg_buffers, msg->signal_msg);
-				data_path_message_free(msg);
-			}
-			break;
+					context->handle->num_consumers,
+					&columns, payloads, num_signals, selections, selected);
+			else
+				memset(selected, 0, num_signals * sizeof(consumer_mask_t));
+			for (unsigned j = 0; j < num_signals; ++j)
+				forward_signal_message(
+					context, batch[j], selected[j] != 0,
+					prev_eagerly_forwarded, eager_connect_idle_sec);
 		}
+
+		if (msg == NULL) continue;
+
+		switch (msg->typ) {
 		case DATA_PATH_QUIT:
 			quitting = true;
 			async_queue_push(context->read_request_queue, msg);
@@ -142,8 +397,9 @@ spectrum_selector(struct spectrum_selector_context *context)
 		}
 	}
 
+	spectrum_batch_columns_clear(&columns);
 	g_hash_table_destroy(prev_eagerly_forwarded);
-	g_async_queue_unref(context->signal_msg_queue);
+	async_queue_unref(context->signal_msg_queue);
 	async_queue_unref(context->read_request_queue);
 	g_free(context);
 	return NULL;
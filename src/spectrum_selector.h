@@ -24,12 +24,45 @@
 struct spectrum_selector_context {
 	vysmaw_handle handle;
 
-	GAsyncQueue *signal_msg_queue;
+	struct async_queue *signal_msg_queue;
 	struct async_queue *read_request_queue;
 	struct buffer_pool *signal_msg_buffers;
 	unsigned signal_msg_num_spectra;
 };
 
+/* maximum number of signal messages passed to a vysmaw_spectrum_batch_filter
+ * at once */
+#define SPECTRUM_SELECTOR_MAX_BATCH_SIZE 64
+
+/* storage for the metadata columns of a vysmaw_spectrum_batch, and its filter
+ * output */
+struct spectrum_batch_columns {
+	unsigned max_spectra;
+	uint8_t *station0;
+	uint8_t *station1;
+	uint8_t *spectral_window_index;
+	uint8_t *stokes_index;
+	uint64_t *timestamp;
+	uint64_t *pass_filter;
+};
+
 void *spectrum_selector(struct spectrum_selector_context *context);
 
+extern void spectrum_batch_columns_init(
+	struct spectrum_batch_columns *columns, unsigned max_spectra)
+	__attribute__((nonnull));
+extern void spectrum_batch_columns_clear(struct spectrum_batch_columns *columns)
+	__attribute__((nonnull));
+
+extern void select_spectra_batch(
+	struct consumer *consumers, unsigned num_consumers,
+	struct spectrum_batch_columns *columns,
+	const struct vys_signal_msg_payload *const *payloads, unsigned num_payloads,
+	consumer_mask_t *const *selections, consumer_mask_t *selected)
+	__attribute__((nonnull));
+extern consumer_mask_t select_spectra(
+	struct consumer *consumers, unsigned num_consumers,
+	const struct vys_signal_msg_payload *payload, consumer_mask_t *selections)
+	__attribute__((nonnull));
+
 #endif /* SPECTRUM_SELECTOR_H_ */
@@ -0,0 +1,264 @@
+//
+// Copyright © 2016 Associated Universities, Inc. Washington DC, USA.
+//
+// This file is part of vysmaw.
+//
+// vysmaw is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// vysmaw is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// vysmaw.  If not, see <http://www.gnu.org/licenses/>.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <spectrum_selector.h>
+
+/* Test the selection of consumers by select_spectra() and
+ * select_spectra_batch(), for consumers with a spectrum filter, a batch
+ * filter, a declarative selection, and none of these, some of which are
+ * sharded, using a hand-built array of consumers. Then test that a consumer
+ * sharded by product spreads the baselines of an array evenly over its shards,
+ * for shard counts that are powers of two. */
+
+#define NUM_STATIONS 27
+#define MAX_SHARDS 8
+#define MAX_SPECTRA 4
+
+static unsigned num_failures = 0;
+
+/* a payload with up to MAX_SPECTRA spectra */
+struct payload {
+	struct vys_signal_msg_payload payload;
+	struct vys_spectrum_info infos[MAX_SPECTRA];
+};
+
+static void
+payload_init(struct payload *p, uint8_t station0, uint8_t station1,
+             uint8_t spectral_window_index, uint8_t stokes_index,
+             const uint64_t *timestamps, unsigned num_spectra)
+{
+	memset(p, 0, sizeof(*p));
+	p->payload.stations[0] = station0;
+	p->payload.stations[1] = station1;
+	p->payload.spectral_window_index = spectral_window_index;
+	p->payload.stokes_index = stokes_index;
+	p->payload.num_spectra = num_spectra;
+	for (unsigned i = 0; i < num_spectra; ++i)
+		p->infos[i].timestamp = timestamps[i];
+}
+
+/* pass spectra with even timestamps */
+static void
+even_filter(const uint8_t stations[2], uint8_t spectral_window_index,
+            uint8_t stokes_index, const struct vys_spectrum_info *infos,
+            uint8_t num_infos, void *user_data, bool *pass_filter)
+{
+	for (unsigned i = 0; i < num_infos; ++i)
+		pass_filter[i] = (infos[i].timestamp % 2 == 0);
+}
+
+/* pass spectra with odd timestamps */
+static void
+odd_batch_filter(const struct vysmaw_spectrum_batch *batch, void *user_data,
+                 uint64_t *pass_filter)
+{
+	for (unsigned i = 0; i < batch->num_spectra; ++i)
+		if (batch->timestamp[i] % 2 == 1)
+			pass_filter[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+#define BIT(i) ((consumer_mask_t)1 << (i))
+
+/* queue indexes of the consumers made by consumers_init() */
+enum {
+	EVEN_FILTER,          // spectrum filter
+	ODD_BATCH_FILTER,     // batch filter
+	SELECTION,            // baseline 1-2, spectral window 3, time [10, 20)
+	ROUND_ROBIN,          // two shards, round robin
+	ROUND_ROBIN_1,
+	ALL,                  // no filter
+	BY_PRODUCT,           // two shards, by product
+	BY_PRODUCT_1,
+	NUM_QUEUES
+};
+
+static void
+consumers_init(struct consumer *consumers,
+               struct vysmaw_spectrum_selection *selection)
+{
+	memset(consumers, 0, NUM_QUEUES * sizeof(*consumers));
+	consumers[EVEN_FILTER].num_shards = 1;
+	consumers[EVEN_FILTER].spectrum_filter_fn = even_filter;
+	consumers[EVEN_FILTER].pass_filter_array =
+		g_array_new(FALSE, FALSE, sizeof(bool));
+	consumers[ODD_BATCH_FILTER].num_shards = 1;
+	consumers[ODD_BATCH_FILTER].spectrum_batch_filter_fn = odd_batch_filter;
+	consumers[SELECTION].num_shards = 1;
+	consumers[SELECTION].selection = selection;
+	consumers[ROUND_ROBIN].num_shards = 2;
+	consumers[ROUND_ROBIN].shard_distribution = VYSMAW_SHARD_ROUND_ROBIN;
+	consumers[ALL].num_shards = 1;
+	consumers[BY_PRODUCT].num_shards = 2;
+	consumers[BY_PRODUCT].shard_distribution = VYSMAW_SHARD_BY_PRODUCT;
+}
+
+static void
+check_selections(const char *what, const struct payload *p,
+                 const consumer_mask_t *selections,
+                 const consumer_mask_t *expected, consumer_mask_t selected)
+{
+	consumer_mask_t all = 0;
+	consumer_mask_t by_product = 0;
+	for (unsigned k = 0; k < p->payload.num_spectra; ++k) {
+		/* the shard of a consumer sharded by product is that of the product,
+		 * which is checked separately */
+		consumer_mask_t mask = selections[k] & (BIT(BY_PRODUCT) | BIT(BY_PRODUCT_1));
+		if (k == 0) by_product = mask;
+		if (mask == 0 || (mask & (mask - 1)) != 0 || mask != by_product) {
+			fprintf(stderr, "%s: spectrum %u selected for product shards "
+			        "%#llx\n", what, k, (unsigned long long)mask);
+			num_failures++;
+		}
+		if ((selections[k] & ~mask) != expected[k]) {
+			fprintf(stderr, "%s: spectrum %u selected for %#llx, expected "
+			        "%#llx\n", what, k,
+			        (unsigned long long)(selections[k] & ~mask),
+			        (unsigned long long)expected[k]);
+			num_failures++;
+		}
+		all |= selections[k];
+	}
+	if (selected != all) {
+		fprintf(stderr, "%s: selected %#llx, expected %#llx\n", what,
+		        (unsigned long long)selected, (unsigned long long)all);
+		num_failures++;
+	}
+}
+
+static void
+test_select(void)
+{
+	struct vysmaw_spectrum_selection *selection =
+		vysmaw_spectrum_selection_new(NULL);
+	const uint8_t baseline[1][2] = {{1, 2}};
+	vysmaw_spectrum_selection_set_baselines(selection, baseline, 1);
+	const uint8_t spectral_window = 3;
+	vysmaw_spectrum_selection_set_spectral_windows(
+		selection, &spectral_window, 1);
+	selection->start_time = 10;
+	selection->end_time = 20;
+
+	struct payload p[2];
+	const uint64_t timestamps0[] = {9, 10, 11, 20};
+	payload_init(&p[0], 2, 1, 3, 0, timestamps0, 4);
+	const consumer_mask_t expected0[] = {
+		BIT(ODD_BATCH_FILTER) | BIT(ROUND_ROBIN) | BIT(ALL),
+		BIT(EVEN_FILTER) | BIT(SELECTION) | BIT(ROUND_ROBIN_1) | BIT(ALL),
+		BIT(ODD_BATCH_FILTER) | BIT(SELECTION) | BIT(ROUND_ROBIN) | BIT(ALL),
+		BIT(EVEN_FILTER) | BIT(ROUND_ROBIN_1) | BIT(ALL)
+	};
+	/* a baseline that is not selected */
+	const uint64_t timestamps1[] = {12, 13};
+	payload_init(&p[1], 2, 3, 3, 1, timestamps1, 2);
+	const consumer_mask_t expected1[] = {
+		BIT(EVEN_FILTER) | BIT(ROUND_ROBIN) | BIT(ALL),
+		BIT(ODD_BATCH_FILTER) | BIT(ROUND_ROBIN_1) | BIT(ALL)
+	};
+
+	/* one signal message at a time */
+	struct consumer consumers[NUM_QUEUES];
+	consumers_init(consumers, selection);
+	consumer_mask_t selections[2][MAX_SPECTRA];
+	consumer_mask_t selected[2];
+	for (unsigned j = 0; j < 2; ++j)
+		selected[j] = select_spectra(
+			consumers, NUM_QUEUES, &p[j].payload, selections[j]);
+	check_selections("select_spectra 0", &p[0], selections[0], expected0,
+	                 selected[0]);
+	check_selections("select_spectra 1", &p[1], selections[1], expected1,
+	                 selected[1]);
+	g_array_free(consumers[EVEN_FILTER].pass_filter_array, true);
+
+	/* both signal messages in a batch */
+	consumers_init(consumers, selection);
+	struct spectrum_batch_columns columns;
+	spectrum_batch_columns_init(&columns, 2 * MAX_SPECTRA);
+	const struct vys_signal_msg_payload *payloads[2] = {
+		&p[0].payload, &p[1].payload
+	};
+	consumer_mask_t *const selections_p[2] = {selections[0], selections[1]};
+	select_spectra_batch(consumers, NUM_QUEUES, &columns, payloads, 2,
+	                     selections_p, selected);
+	check_selections("select_spectra_batch 0", &p[0], selections[0],
+	                 expected0, selected[0]);
+	check_selections("select_spectra_batch 1", &p[1], selections[1],
+	                 expected1, selected[1]);
+	spectrum_batch_columns_clear(&columns);
+	g_array_free(consumers[EVEN_FILTER].pass_filter_array, true);
+	vysmaw_spectrum_selection_free(selection);
+}
+
+static void
+test_shard_spread(unsigned num_shards)
+{
+	struct consumer consumers[MAX_SHARDS];
+	memset(consumers, 0, sizeof(consumers));
+	consumers[0].num_shards = num_shards;
+	consumers[0].shard_distribution = VYSMAW_SHARD_BY_PRODUCT;
+
+	struct payload p;
+	const uint64_t timestamp = 0;
+	payload_init(&p, 0, 0, 0, 0, &timestamp, 1);
+	unsigned counts[MAX_SHARDS] = {0};
+	unsigned num_baselines = 0;
+	for (unsigned s0 = 0; s0 < NUM_STATIONS; ++s0) {
+		for (unsigned s1 = s0; s1 < NUM_STATIONS; ++s1) {
+			p.payload.stations[0] = s0;
+			p.payload.stations[1] = s1;
+			consumer_mask_t selection;
+			consumer_mask_t selected =
+				select_spectra(consumers, num_shards, &p.payload, &selection);
+			if (selected == 0 || (selected & (selected - 1)) != 0
+			    || selected >= ((consumer_mask_t)1 << num_shards)) {
+				fprintf(stderr, "%u shards: baseline %u-%u selected by "
+				        "mask %#llx\n", num_shards, s0, s1,
+				        (unsigned long long)selected);
+				num_failures++;
+				continue;
+			}
+			counts[g_bit_nth_lsf(selected, -1)]++;
+			++num_baselines;
+		}
+	}
+
+	/* every shard holds its share of the baselines, to within a quarter */
+	unsigned share = num_baselines / num_shards;
+	for (unsigned i = 0; i < num_shards; ++i) {
+		if (4 * counts[i] < 3 * share || 4 * counts[i] > 5 * share) {
+			fprintf(stderr, "%u shards: shard %u has %u of %u baselines\n",
+			        num_shards, i, counts[i], num_baselines);
+			num_failures++;
+		}
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	test_select();
+	for (unsigned num_shards = 2; num_shards <= MAX_SHARDS; num_shards *= 2)
+		test_shard_spread(num_shards);
+
+	if (num_failures > 0) {
+		fprintf(stderr, "%u failures\n", num_failures);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
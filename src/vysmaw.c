@@ -16,16 +16,16 @@
 // vysmaw.  If not, see <http://www.gnu.org/licenses/>.
 //
 #include <vysmaw_private.h>
+#include <shm_fanout.h>
 #include <glib.h>
 #include <string.h>
 
 struct vysmaw_message *
 vysmaw_message_queue_pop(vysmaw_message_queue queue)
 {
-	g_async_queue_lock(queue->q);
-	struct vysmaw_message *result = g_async_queue_pop_unlocked(queue->q);
-	queue->depth--;
-	g_async_queue_unlock(queue->q);
+	struct vysmaw_message *result;
+	while ((result = message_queue_try_pop(queue)) == NULL)
+		message_queue_wait(queue, -1);
 	message_queue_unref(queue); // release message's queue reference
 	return result;
 }
@@ -33,20 +33,12 @@ vysmaw_message_queue_pop(vysmaw_message_queue queue)
 struct vysmaw_message *
 vysmaw_message_queue_timeout_pop(vysmaw_message_queue queue, uint64_t timeout)
 {
-	struct vysmaw_message *result;
-	g_async_queue_lock(queue->q);
-#if GLIB_CHECK_VERSION(2,32,0)
-	result = g_async_queue_timeout_pop_unlocked(queue->q, timeout);
-#else
-	GTimeVal end;
-	g_get_current_time(&end);
-	g_time_val_add(&end, timeout);
-	result = g_async_queue_timed_pop_unlocked(queue->q, &end);
-#endif
-	if (result != NULL)
-		queue->depth--;
-	g_assert(queue->depth >= 0);
-	g_async_queue_unlock(queue->q);
+	struct vysmaw_message *result = message_queue_try_pop(queue);
+	if (result == NULL) {
+		gint64 end = g_get_monotonic_time() + timeout;
+		while (result == NULL && message_queue_wait(queue, end))
+			result = message_queue_try_pop(queue);
+	}
 	/* release message's queue reference */
 	if (result != NULL) message_queue_unref(queue);
 	return result;
@@ -55,23 +47,60 @@ vysmaw_message_queue_timeout_pop(vysmaw_message_queue queue, uint64_t timeout)
 struct vysmaw_message *
 vysmaw_message_queue_try_pop(vysmaw_message_queue queue)
 {
-	g_async_queue_lock(queue->q);
-	struct vysmaw_message *result = g_async_queue_try_pop_unlocked(queue->q);
-	if (result != NULL)
-		queue->depth--;
-	g_assert(queue->depth >= 0);
-	g_async_queue_unlock(queue->q);
+	struct vysmaw_message *result = message_queue_try_pop(queue);
 	/* release message's queue reference */
 	if (result != NULL) message_queue_unref(queue);
 	return result;
 }
 
+unsigned
+vysmaw_message_queue_pop_batch(vysmaw_message_queue queue,
+                               struct vysmaw_message **msgs, unsigned max,
+                               uint64_t timeout)
+{
+	unsigned result = message_queue_try_pop_batch(queue, msgs, max);
+	if (result == 0 && max > 0 && timeout > 0) {
+		gint64 end = g_get_monotonic_time() + timeout;
+		while (result == 0 && message_queue_wait(queue, end))
+			result = message_queue_try_pop_batch(queue, msgs, max);
+	}
+	/* release messages' queue references */
+	if (result > 0) message_queue_unref_n(queue, result);
+	return result;
+}
+
+void
+vysmaw_message_queue_status(vysmaw_message_queue queue,
+                            struct vysmaw_message_queue_status *status)
+{
+	message_queue_get_status(queue, status);
+}
+
+int
+vysmaw_message_queue_fd(vysmaw_message_queue queue)
+{
+	return message_queue_fd(queue);
+}
+
 void
 vysmaw_message_unref(struct vysmaw_message *message)
 {
-	if (g_atomic_int_dec_and_test(&message->refcount)) {
-		vysmaw_message_free_resources(message);
-		g_slice_free(struct vysmaw_message, message);
+	if (g_atomic_int_dec_and_test(&message->refcount))
+		message_free(message);
+}
+
+void
+vysmaw_message_unref_batch(struct vysmaw_message **messages, unsigned n)
+{
+	struct vysmaw_message *dead[MESSAGE_FREE_BATCH_SIZE];
+	while (n > 0) {
+		unsigned num_dead = 0;
+		do {
+			struct vysmaw_message *message = *messages++;
+			if (g_atomic_int_dec_and_test(&message->refcount))
+				dead[num_dead++] = message;
+		} while (--n > 0 && num_dead < MESSAGE_FREE_BATCH_SIZE);
+		if (num_dead > 0) message_free_n(dead, num_dead);
 	}
 }
 
@@ -90,9 +119,20 @@ vysmaw_start_(const struct vysmaw_configuration *config,
 	return result;
 }
 
-vysmaw_handle
-vysmaw_start(const struct vysmaw_configuration *config,
-             unsigned num_consumers, struct vysmaw_consumer **consumers)
+static vysmaw_handle handle_new(
+	const struct vysmaw_configuration *config, unsigned num_consumers,
+	struct vysmaw_consumer **consumers, unsigned *num_queues)
+	__attribute__((nonnull,returns_nonnull,malloc));
+static void init_consumers(
+	vysmaw_handle handle, unsigned num_consumers,
+	struct vysmaw_consumer **consumers, unsigned num_queues)
+	__attribute__((nonnull));
+static void post_start_failure(vysmaw_handle handle)
+	__attribute__((nonnull));
+
+static vysmaw_handle
+handle_new(const struct vysmaw_configuration *config, unsigned num_consumers,
+           struct vysmaw_consumer **consumers, unsigned *num_queues)
 {
 	THREAD_INIT;
 
@@ -105,7 +145,69 @@ vysmaw_start(const struct vysmaw_configuration *config,
 	MUTEX_INIT(result->mtx);
 	result->in_shutdown = false;
 	result->result = NULL;
+	result->numa_node = -1;
 	memcpy((void *)&result->config, config, sizeof(*config));
+	*num_queues = 0;
+	for (unsigned i = 0; i < num_consumers; ++i) {
+		*num_queues += MAX(consumers[i]->num_shards, 1);
+		if (result->config.error_record == NULL
+		    && consumers[i]->callback != NULL && consumers[i]->num_shards > 1)
+			MSG_ERROR((struct vys_error_record **)&(result->config.error_record),
+			          -1, "%s", "Consumer with a callback may not be sharded");
+	}
+	if (result->config.error_record == NULL
+	    && *num_queues > VYSMAW_MAX_CONSUMERS)
+		MSG_ERROR((struct vys_error_record **)&(result->config.error_record),
+		          -1, "Number of consumer queues exceeds maximum (%d)",
+		          VYSMAW_MAX_CONSUMERS);
+	return result;
+}
+
+static void
+init_consumers(vysmaw_handle handle, unsigned num_consumers,
+               struct vysmaw_consumer **consumers, unsigned num_queues)
+{
+	handle->message_slab =
+		hot_path_slab_new(&handle->config, sizeof(struct vysmaw_message));
+
+	/* per consumer initialization */
+	GArray *priv_consumers =
+		g_array_sized_new(FALSE, FALSE, sizeof(struct consumer), num_queues);
+	for (unsigned i = num_consumers; i > 0; --i) {
+		init_consumer(handle, *consumers, priv_consumers);
+		++consumers;
+	}
+	handle->num_consumers = num_queues;
+	handle->consumers = (struct consumer *)g_array_free(priv_consumers, false);
+}
+
+static void
+post_start_failure(vysmaw_handle handle)
+{
+	handle->in_shutdown = true;
+	struct vysmaw_result rc = {
+		.code = VYSMAW_SYSERR,
+		.syserr_desc = vys_error_record_to_string(
+			(struct vys_error_record **)&(handle->config.error_record))
+	};
+	struct vysmaw_message *msg = end_message_new(handle, &rc);
+	post_msg(handle, msg);
+	handle_unref(handle); // end message has been posted
+}
+
+vysmaw_handle
+vysmaw_start(const struct vysmaw_configuration *config,
+             unsigned num_consumers, struct vysmaw_consumer **consumers)
+{
+	unsigned num_queues;
+	vysmaw_handle result =
+		handle_new(config, num_consumers, consumers, &num_queues);
+	size_t alignment = result->config.spectrum_buffer_alignment;
+	if (result->config.error_record == NULL
+	    && (alignment == 0 || (alignment & (alignment - 1)) != 0
+	        || alignment > VYSMAW_MAX_SPECTRUM_BUFFER_ALIGNMENT))
+		MSG_ERROR((struct vys_error_record **)&(result->config.error_record),
+		          -1, "Invalid spectrum buffer alignment (%zu)", alignment);
 	if (result->config.error_record == NULL) {
 		*(unsigned *)&result->config.max_spectrum_buffer_size =
 			MAX(result->config.max_spectrum_buffer_size,
@@ -113,9 +215,13 @@ vysmaw_start(const struct vysmaw_configuration *config,
 		if (result->config.single_spectrum_buffer_pool) {
 			size_t num_buffers =
 				result->config.spectrum_buffer_pool_size
-				/ result->config.max_spectrum_buffer_size;
+				/ ((result->config.max_spectrum_buffer_size + alignment - 1)
+				   & ~(alignment - 1));
 			result->pool = spectrum_buffer_pool_new(
-				result->config.max_spectrum_buffer_size, num_buffers);
+				result->config.max_spectrum_buffer_size, alignment, num_buffers,
+				spectrum_buffer_pool_max_chunks(&result->config),
+				result->config.spectrum_buffer_magazine_size,
+				result->config.buffer_pool_huge_page_size);
 			result->new_valid_buffer_fn = new_valid_buffer_from_pool;
 			result->lookup_buffer_pool_fn = lookup_buffer_pool_from_pool;
 			result->list_buffer_pools_fn = buffer_pool_list_from_pool;
@@ -126,18 +232,9 @@ vysmaw_start(const struct vysmaw_configuration *config,
 			result->lookup_buffer_pool_fn = lookup_buffer_pool_from_collection;
 			result->list_buffer_pools_fn = buffer_pool_list_from_collection;
 		}
+		result->release_valid_buffer_fn = release_valid_buffer_to_pool;
 	}
-
-	/* per consumer initialization */
-	GArray *priv_consumers =
-		g_array_new(FALSE, FALSE, sizeof(struct consumer));
-	for (unsigned i = num_consumers; i > 0; --i) {
-		init_consumer((*consumers)->filter, (*consumers)->filter_data,
-		              &(*consumers)->queue, priv_consumers);
-		++consumers;
-	}
-	result->num_consumers = num_consumers;
-	result->consumers = (struct consumer *)g_array_free(priv_consumers, false);
+	init_consumers(result, num_consumers, consumers, num_queues);
 
 	if (result->config.error_record == NULL) {
 		/* service threads initialization */
@@ -145,20 +242,41 @@ vysmaw_start(const struct vysmaw_configuration *config,
 		COND_INIT(result->gate.cond);
 		init_service_threads(result);
 	}
-	if (result->config.error_record != NULL) {
-		result->in_shutdown = true;
-		struct vysmaw_result rc = {
-			.code = VYSMAW_SYSERR,
-			.syserr_desc = vys_error_record_to_string(
-				(struct vys_error_record **)&(result->config.error_record))
-		};
-		struct vysmaw_message *msg = end_message_new(result, &rc);
-		post_msg(result, msg);
-		handle_unref(result); // end message has been posted
-	}
+	if (result->config.error_record != NULL)
+		post_start_failure(result);
+	return result;
+}
+
+vysmaw_handle
+vysmaw_attach(const struct vysmaw_configuration *config,
+              unsigned num_consumers, struct vysmaw_consumer **consumers)
+{
+	unsigned num_queues;
+	vysmaw_handle result =
+		handle_new(config, num_consumers, consumers, &num_queues);
+	/* spectrum buffers live in the exporter's shared memory object, and the
+	 * handle has no pools of its own; an empty pool collection keeps the pool
+	 * status functions and the handle's release uniform */
+	*(bool *)&result->config.single_spectrum_buffer_pool = false;
+	MUTEX_INIT(result->pool_collection_mtx);
+	result->pool_collection = spectrum_buffer_pool_collection_new();
+	result->release_valid_buffer_fn = shm_release_buffer;
+	init_consumers(result, num_consumers, consumers, num_queues);
+
+	if (result->config.error_record == NULL)
+		init_shm_client(result);
+	if (result->config.error_record != NULL)
+		post_start_failure(result);
 	return result;
 }
 
+struct vysmaw_result
+vysmaw_export(const struct vysmaw_configuration *config,
+              vysmaw_message_queue queue)
+{
+	return shm_export(config, queue);
+}
+
 void
 vysmaw_shutdown(vysmaw_handle handle)
 {
@@ -166,6 +284,43 @@ vysmaw_shutdown(vysmaw_handle handle)
 	handle_unref(handle); // release caller's ref
 }
 
+unsigned
+vysmaw_spectrum_buffer_pool_status(vysmaw_handle handle,
+                                   struct vysmaw_buffer_pool_status *status,
+                                   unsigned max_pools)
+{
+	if (handle->config.error_record != NULL) return 0;
+	if (handle->config.single_spectrum_buffer_pool) {
+		if (max_pools > 0)
+			buffer_pool_get_status(handle->pool->pool, status);
+		return 1;
+	}
+	/* pools in a collection are never removed before the handle is freed, so
+	 * a lock-free scan is safe */
+	unsigned result = 0;
+	for (unsigned i = 0; i < SPECTRUM_BUFFER_NUM_SIZE_CLASSES; ++i) {
+		struct spectrum_buffer_pool *pool =
+			__atomic_load_n(&handle->pool_collection[i], __ATOMIC_ACQUIRE);
+		if (pool != NULL) {
+			if (result < max_pools)
+				buffer_pool_get_status(pool->pool, status++);
+			++result;
+		}
+	}
+	return result;
+}
+
+bool
+vysmaw_signal_buffer_pool_status(vysmaw_handle handle,
+                                 struct vysmaw_buffer_pool_status *status)
+{
+	struct buffer_pool *pool =
+		__atomic_load_n(&handle->signal_msg_buffers, __ATOMIC_ACQUIRE);
+	if (pool == NULL) return false;
+	buffer_pool_get_status(pool, status);
+	return true;
+}
+
 struct vysmaw_configuration *
 vysmaw_configuration_new(const char *path)
 {
@@ -200,3 +355,51 @@ vysmaw_configuration_free(struct vysmaw_configuration *config)
 	vys_error_record_free(config->error_record);
 	g_free(config);
 }
+
+struct vysmaw_spectrum_selection *
+vysmaw_spectrum_selection_new(const struct vysmaw_configuration *config)
+{
+	struct vysmaw_spectrum_selection *result =
+		g_slice_new(struct vysmaw_spectrum_selection);
+	if (config == NULL) {
+		memset(result, 0xff, sizeof(*result));
+		result->start_time = 0;
+		result->end_time = 0;
+	} else if (!spectrum_selection_init(result, config)) {
+		g_slice_free(struct vysmaw_spectrum_selection, result);
+		result = NULL;
+	}
+	return result;
+}
+
+void
+vysmaw_spectrum_selection_set_baselines(
+	struct vysmaw_spectrum_selection *selection, const uint8_t (*stations)[2],
+	unsigned num_baselines)
+{
+	spectrum_selection_set_baselines(
+		selection->baselines, stations, num_baselines);
+}
+
+void
+vysmaw_spectrum_selection_set_spectral_windows(
+	struct vysmaw_spectrum_selection *selection, const uint8_t *indexes,
+	unsigned num_indexes)
+{
+	spectrum_selection_set_indexes(
+		selection->spectral_windows, indexes, num_indexes);
+}
+
+void
+vysmaw_spectrum_selection_set_stokes(
+	struct vysmaw_spectrum_selection *selection, const uint8_t *indexes,
+	unsigned num_indexes)
+{
+	spectrum_selection_set_indexes(selection->stokes, indexes, num_indexes);
+}
+
+void
+vysmaw_spectrum_selection_free(struct vysmaw_spectrum_selection *selection)
+{
+	g_slice_free(struct vysmaw_spectrum_selection, selection);
+}
@@ -27,6 +27,12 @@ extern "C" {
 #include <sys/types.h>
 #include <vys.h>
 
+/* Maximum value of 'spectrum_buffer_alignment' */
+#define VYSMAW_MAX_SPECTRUM_BUFFER_ALIGNMENT 4096
+
+#define VYSMAW_SHM_NAME_SIZE 64
+#define VYSMAW_SELECTION_SPEC_SIZE 1024
+
 struct vysmaw_configuration {
 	struct vys_error_record *error_record;
 
@@ -40,16 +46,32 @@ struct vysmaw_configuration {
 	 * pins physical memory in the virtual address space -- too large an
 	 * allocation may be detrimental to the application; too little, and the
 	 * library may be unable to copy the data from the CBE when it becomes
-	 * available, resulting in lost data. Note that one memory region of the
-	 * given size will be allocated for every size of spectrum that is received
-	 * by the client unless 'single_spectrum_buffer_pool' is true. */
+	 * available, resulting in lost data. Note that unless
+	 * 'single_spectrum_buffer_pool' is true, one memory region of the given
+	 * size will be allocated for every size class of spectrum that is received
+	 * by the client, where the size classes are powers of two. */
 	size_t spectrum_buffer_pool_size;
 
+	/* Maximum size of each spectrum buffer pool. When this value is at least
+	 * twice 'spectrum_buffer_pool_size', a pool that runs out of buffers grows
+	 * by adding memory regions of size 'spectrum_buffer_pool_size', up to this
+	 * limit. Added regions are registered for RDMA before their buffers are
+	 * used, and are released again once all of their buffers are free, and the
+	 * pool has not run out of buffers for
+	 * 'spectrum_buffer_pool_idle_release_sec' seconds. Smaller values disable
+	 * pool growth. */
+	size_t spectrum_buffer_pool_max_size;
+
+	/* Time without buffer starvation, in seconds, after which memory regions
+	 * added to a spectrum buffer pool are released (see
+	 * 'spectrum_buffer_pool_max_size') */
+	double spectrum_buffer_pool_idle_release_sec;
+
 	/* Maintain a single pool containing buffers sized to accommodate the
-	 * maximum expected size of a spectrum.
-	 *
-	 * WARNING: setting this parameter to 'false' is not recommended at this
-	 * time, as the implementation is incomplete. */
+	 * maximum expected size of a spectrum. When 'false', spectra are stored in
+	 * buffers taken from pools of power-of-two sized buffers, each spectrum in
+	 * the smallest buffer that accommodates it, which is more economical when
+	 * spectra of widely varying sizes are received. */
 	bool single_spectrum_buffer_pool;
 
 	/* The maximum expected size in bytes of a single spectrum that the client
@@ -59,6 +81,23 @@ struct vysmaw_configuration {
 	 * true. */
 	unsigned max_spectrum_buffer_size;
 
+	/* Number of spectrum buffers that each thread may hold in a local cache
+	 * (or "magazine") per buffer pool. Buffers are moved between a thread's
+	 * cache and the shared pool in batches of half this size, which reduces
+	 * contention on the pool when many threads release buffers
+	 * concurrently. Buffers held in a cache are unavailable to other threads,
+	 * so the value should be small relative to the number of buffers in a
+	 * pool. A value of 0 disables the caches. */
+	unsigned spectrum_buffer_magazine_size;
+
+	/* Alignment in bytes of spectrum buffers. Every 'valid_buffer.buffer'
+	 * delivered to a client starts on a multiple of this value, and no two
+	 * buffers share an aligned block of this size, so that, for example,
+	 * aligned vector loads may be used on spectra, and buffers processed by
+	 * different threads do not share cache lines. The value must be a power of
+	 * two no greater than VYSMAW_MAX_SPECTRUM_BUFFER_ALIGNMENT. */
+	size_t spectrum_buffer_alignment;
+
 	/* Size of memory region for storing signal messages carrying spectrum
 	 * metadata sent from all active CBE nodes. The memory region is allocated
 	 * and registered for InfiniBand messaging by the library. Setting the value
@@ -67,6 +106,23 @@ struct vysmaw_configuration {
 	 * messages sent from every CBE node. */
 	size_t signal_message_pool_size;
 
+	/* Size in bytes of the huge pages used to back the spectrum and signal
+	 * message buffer pools, which reduces both the time needed to register the
+	 * pools for RDMA and the number of TLB and HCA translation entries needed
+	 * to access them. The value must be a huge page size supported by the
+	 * system, typically 2097152 (2 MB) or 1073741824 (1 GB). When the system
+	 * has too few free huge pages of the given size (see
+	 * /sys/kernel/mm/hugepages), the pools are allocated with normal pages. A
+	 * value of 0 always selects normal pages. */
+	size_t buffer_pool_huge_page_size;
+
+	/* NUMA node on which to place the spectrum and signal message buffer
+	 * pools, and the library's service threads. A value of -1 selects the node
+	 * of the InfiniBand device used to receive signal messages (when the
+	 * system reports one); any other negative value disables NUMA
+	 * placement. */
+	int numa_node;
+
 	/* vysmaw clients can either connect to a (CBE) sending process (to read
 	 * spectral data) immediately upon receipt of any signal message from that
 	 * process, or wait until a signal message is received from the process
@@ -104,6 +160,65 @@ struct vysmaw_configuration {
 	 * TODO: distinguish latency for data and signal buffers? */
 	unsigned max_starvation_latency;
 
+	/* Fraction (between 0 and 1) of the buffers in a spectrum buffer pool that
+	 * may be in use before a VYSMAW_MESSAGE_BUFFER_POOL_PRESSURE message is
+	 * sent to all consumers, which allows clients to shed load before spectra
+	 * are lost to buffer starvation. Once sent, another such message is sent
+	 * when the fraction of buffers in use falls below this value less
+	 * 'spectrum_buffer_pool_pressure_hysteresis'. Buffers held in per-thread
+	 * caches count as in use (see struct vysmaw_buffer_pool_status). A value
+	 * of 0 disables these messages. */
+	double spectrum_buffer_pool_pressure_threshold;
+
+	/* Hysteresis of pool pressure notifications (see
+	 * 'spectrum_buffer_pool_pressure_threshold') */
+	double spectrum_buffer_pool_pressure_hysteresis;
+
+	/* Name of the POSIX shared memory object through which an exporting
+	 * vysmaw instance (see vysmaw_export()) shares spectra with the client
+	 * processes on the same host that attach to it (see vysmaw_attach()). The
+	 * name should begin with a slash, and contain no other slashes. */
+	char shm_name[VYSMAW_SHM_NAME_SIZE];
+
+	/* Size of the memory region holding exported spectra in shared
+	 * memory. The region is divided into buffers of size
+	 * 'max_spectrum_buffer_size', rounded up to a multiple of
+	 * 'spectrum_buffer_alignment'; larger spectra are not exported. Unlike the
+	 * spectrum buffer pools, this memory is not registered for RDMA. A buffer
+	 * is reused only after every client that received it has released it.
+	 * Each client may hold no more than its share of the buffers (the number
+	 * of buffers divided by 'shm_max_clients'), so that a slow client causes
+	 * spectra to be lost (reported as queue overflow) only to itself. Used
+	 * only by an exporting instance. */
+	size_t shm_buffer_pool_size;
+
+	/* Maximum number of client processes attached to an exporting instance
+	 * at one time, at most VYSMAW_SHM_MAX_CLIENTS. Used only by an exporting
+	 * instance. */
+	unsigned shm_max_clients;
+
+	/* Number of spectra that may be exported to, but not yet taken by, each
+	 * client process; spectra in excess of this number, or of the client's
+	 * share of 'shm_buffer_pool_size', are lost to the client, and reported as
+	 * queue overflow. Used only by an exporting instance. */
+	unsigned shm_client_queue_length;
+
+	/* Spectrum selection for vysmaw_spectrum_selection_new(). Baselines are
+	 * given as a list of station pairs, and spectral windows and stokes
+	 * parameters as lists of indexes, with list elements separated by commas
+	 * or whitespace. An index is a number, a range "M:N" (inclusive), or "*"
+	 * for all; a station pair is two such station indexes joined by "-", in
+	 * either order (e.g, "1-2, 3:5-*"). An empty list selects everything. */
+	char selection_baselines[VYSMAW_SELECTION_SPEC_SIZE];
+	char selection_spectral_windows[VYSMAW_SELECTION_SPEC_SIZE];
+	char selection_stokes[VYSMAW_SELECTION_SPEC_SIZE];
+
+	/* Time window of the spectrum selection, as nanoseconds since the Unix
+	 * epoch. Spectra with timestamps in [start, end) are selected; an end of
+	 * zero is unbounded. */
+	uint64_t selection_start_time;
+	uint64_t selection_end_time;
+
 	/*
 	 * The following are probably best left at their default values, but expert
 	 * users may find them useful.
@@ -199,9 +314,30 @@ enum vysmaw_message_type {
 	VYSMAW_MESSAGE_SIGNAL_RECEIVE_FAILURE, // failure in receiving signal
 										   // message
 	VYSMAW_MESSAGE_RDMA_READ_FAILURE, // failure of rdma read of spectral data
+	VYSMAW_MESSAGE_BUFFER_POOL_PRESSURE, // spectrum buffer pool occupancy
+										 // crossed threshold
+	VYSMAW_MESSAGE_EXPIRED, // valid buffer messages discarded for exceeding
+							// consumer's maximum message age
+	VYSMAW_MESSAGE_SPECTRA_BATCH, // valid spectra from one signal message, in
+								  // a single buffer
 	VYSMAW_MESSAGE_END // vysmaw_handle exited
 };
 
+/* Occupancy of a buffer pool. Since buffer pools are used concurrently by
+ * several threads, the values are approximate. Buffers held by vysmaw threads
+ * (e.g, in per-thread caches), as well as those held by clients, are counted
+ * as in use, as occupancy is only updated when buffers move between a cache and
+ * the pool. For a spectrum buffer pool, 'num_in_use' may therefore exceed the
+ * number of buffers actually in use by up to 'spectrum_buffer_magazine_size'
+ * for every thread that has released buffers of the pool. */
+struct vysmaw_buffer_pool_status {
+	size_t buffer_size; // size in bytes of each buffer
+	size_t num_buffers; // number of buffers currently in pool
+	size_t num_free; // number of buffers available
+	size_t num_in_use; // number of buffers in use
+	size_t max_in_use; // high-water mark of 'num_in_use'
+};
+
 #define RECEIVE_STATUS_LENGTH 64
 
 struct vysmaw_message {
@@ -213,7 +349,7 @@ struct vysmaw_message {
 		struct {
 			struct vysmaw_data_info info;
 			size_t buffer_size;
-			float *buffer;
+			float *buffer; // aligned to 'spectrum_buffer_alignment' bytes
 		} valid_buffer;
 
 		/* VYSMAW_MESSAGE_DIGEST_FAILURE */
@@ -234,6 +370,26 @@ struct vysmaw_message {
 		/* VYSMAW_MESSAGE_RDMA_READ_FAILURE */
 		char rdma_read_status[RECEIVE_STATUS_LENGTH];
 
+		/* VYSMAW_MESSAGE_BUFFER_POOL_PRESSURE */
+		struct {
+			bool high; // true iff threshold was exceeded
+			struct vysmaw_buffer_pool_status status;
+		} pool_pressure;
+
+		/* VYSMAW_MESSAGE_EXPIRED */
+		unsigned num_expired;
+
+		/* VYSMAW_MESSAGE_SPECTRA_BATCH; spectrum i is at 'offsets[i]' bytes
+		 * from 'buffer', aligned to 'spectrum_buffer_alignment' bytes, and
+		 * all spectra are of the same product */
+		struct {
+			unsigned num_spectra;
+			const struct vysmaw_data_info *infos;
+			const size_t *offsets;
+			size_t buffer_size;
+			float *buffer;
+		} spectra_batch;
+
 		/* VYSMAW_MESSAGE_END */
 		struct vysmaw_result result;
 	} content;
@@ -269,6 +425,78 @@ typedef void (*vysmaw_spectrum_filter)(
 	uint8_t stokes_index, const struct vys_spectrum_info *infos,
 	uint8_t num_infos, void *user_data, bool *pass_filter);
 
+/* Spectrum metadata of a batch of signal messages, in structure-of-arrays
+ * form
+ *
+ * Every array has 'num_spectra' elements, one per spectrum, and the spectra of
+ * each signal message occupy consecutive elements. Element i of every array
+ * describes the same spectrum.
+ */
+struct vysmaw_spectrum_batch {
+	unsigned num_spectra;
+	const uint8_t *station0;
+	const uint8_t *station1;
+	const uint8_t *spectral_window_index;
+	const uint8_t *stokes_index;
+	const uint64_t *timestamp;
+};
+
+/* Declarative spectrum selection
+ *
+ * A filter for the common case of selecting spectra by baseline, spectral
+ * window, stokes parameter and time window, which vysmaw evaluates itself by
+ * table lookup, without calling a client function. A spectrum is selected if
+ * its baseline, spectral window and stokes index are all in the respective
+ * sets, and its timestamp is in [start_time, end_time) (end_time zero being
+ * unbounded). Sets are bit masks: the baseline of stations (s0, s1) is bit
+ * (b % 64) of 'baselines[b / 64]', where b = 256 * s0 + s1; the baseline
+ * setting functions below set both (s0, s1) and (s1, s0). Index i of the
+ * other sets is bit (i % 64) of word i / 64.
+ */
+struct vysmaw_spectrum_selection {
+	uint64_t baselines[256 * 256 / 64];
+	uint64_t spectral_windows[256 / 64];
+	uint64_t stokes[256 / 64];
+	uint64_t start_time;
+	uint64_t end_time;
+};
+
+/* Batched spectrum filter predicate (callback)
+ *
+ * An alternative to vysmaw_spectrum_filter, for clients that want to examine
+ * spectrum metadata a column at a time (e.g, with SIMD instructions). The
+ * function is called with the metadata of all of the signal messages that
+ * have arrived since the previous call, up to an implementation-defined limit,
+ * which reduces the number of calls significantly when the CBE nodes send
+ * many small signal messages. No signal message is held back to fill a batch.
+ *
+ * 'pass_filter' is a bit mask of (batch->num_spectra + 63) / 64 words, all of
+ * which are zero on entry. Bit (i % 64) of 'pass_filter[i / 64]' should be set
+ * if and only if the client wishes to receive spectrum i of 'batch'.
+ */
+typedef void (*vysmaw_spectrum_batch_filter)(
+	const struct vysmaw_spectrum_batch *batch, void *user_data,
+	uint64_t *pass_filter);
+
+/* Direct delivery of spectral data to a client function
+ *
+ * A vysmaw_message_callback function receives the spectrum messages of a
+ * consumer on the vysmaw thread that completes them: the thread reading
+ * spectra by RDMA or, for a handle created by vysmaw_attach(), the thread
+ * receiving them from the exporting process. This avoids the latency of
+ * waking a client thread through the consumer's queue.
+ *
+ * The function receives a reference to 'message', which it must release by
+ * vysmaw_message_unref() (at any time, and from any thread). While the
+ * function runs, no spectra are read or delivered to any other consumer of
+ * the handle. The function must therefore return promptly. It must not block,
+ * whether on locks, I/O or the availability of memory. It must not call any
+ * vysmaw function other than vysmaw_message_unref() and
+ * vysmaw_message_unref_batch().
+ */
+typedef void (*vysmaw_message_callback)(
+	struct vysmaw_message *message, void *user_data);
+
 /* Message queue (FIFO) used to pass spectral data back to client.
  *
  * Clients must continue to pop elements from these queues until a message of
@@ -276,17 +504,134 @@ typedef void (*vysmaw_spectrum_filter)(
  * should no longer be used. Failure to get messages until the
  * VYSMAW_MESSAGE_END message will prevent a vysmaw "task" from releasing all
  * its resources.
+ *
+ * A queue has a single consumer: it must not be popped by more than one thread
+ * at a time.
  */
 struct _vysmaw_message_queue;
 
 typedef struct _vysmaw_message_queue *vysmaw_message_queue;
 
+/* Distribution of spectra among the queues of a sharded consumer
+ */
+enum vysmaw_shard_distribution {
+	VYSMAW_SHARD_ROUND_ROBIN, // successive spectra to successive queues
+	VYSMAW_SHARD_BY_PRODUCT   // by stable hash of (stations, spectral window,
+	                          // stokes), so that every product always goes to
+	                          // the same queue
+};
+
+/* Handling of messages that would exceed a consumer's queue depth limit
+ * ('max_depth_message_queue')
+ */
+enum vysmaw_overflow_policy {
+	VYSMAW_OVERFLOW_DROP_NEWEST, // drop new messages until the queue has room
+	                             // for 'queue_resume_overhead' messages
+	VYSMAW_OVERFLOW_DROP_OLDEST, // drop the oldest queued message, releasing
+	                             // its buffer immediately, to make room
+	VYSMAW_OVERFLOW_SAMPLE       // once the queue depth is within
+	                             // 'queue_resume_overhead' of the limit,
+	                             // queue only one of every
+	                             // 'overflow_sample_interval' messages; drop
+	                             // new messages at the limit
+};
+
+/* Message queue counters
+ *
+ * 'depth' is the number of messages on the queue; the other fields count
+ * messages lost to overflow since the consumer was started, by the policy
+ * that dropped them.
+ */
+struct vysmaw_message_queue_status {
+	size_t depth;
+	uint64_t num_dropped_newest;
+	uint64_t num_dropped_oldest;
+	uint64_t num_sampled_out;
+	uint64_t num_expired; // discarded for exceeding the maximum message age
+	uint64_t num_callback_overruns; // calls of the consumer's callback that
+	                                // exceeded 'callback_time_limit'
+	uint64_t max_callback_time; // longest call of the consumer's callback, in
+	                            // microseconds
+};
+
+/* Reference time for the age of a message. Spectrum timestamps are taken to
+ * be nanoseconds since the Unix epoch.
+ */
+enum vysmaw_message_age_reference {
+	VYSMAW_AGE_FROM_TIMESTAMP, // spectrum timestamp (compared to system clock)
+	VYSMAW_AGE_FROM_DELIVERY   // time the message was queued
+};
+
 /* Single client data stream
+ *
+ * A consumer with 'num_shards' greater than one is sharded: its filter is
+ * evaluated once for every spectrum, and the spectra that pass are distributed
+ * among 'num_shards' queues according to 'shard_distribution', allowing
+ * several worker threads to each pop their own queue. The queues are returned
+ * in 'shard_queues', which must point to an array of 'num_shards' elements
+ * supplied by the client; 'queue' is set to the first of them. Every shard
+ * queue counts toward VYSMAW_MAX_CONSUMERS, receives all messages other than
+ * VYSMAW_MESSAGE_VALID_BUFFER, VYSMAW_MESSAGE_SPECTRA_BATCH,
+ * VYSMAW_MESSAGE_DIGEST_FAILURE and VYSMAW_MESSAGE_RDMA_READ_FAILURE, and must
+ * be popped until VYSMAW_MESSAGE_END. A 'num_shards' value of zero or one (with
+ * 'shard_queues' unused) describes an ordinary consumer.
+ *
+ * 'overflow_policy' determines which messages are dropped when the queue (or
+ * every shard queue) is full; 'overflow_sample_interval' applies only to the
+ * VYSMAW_OVERFLOW_SAMPLE policy, and values less than two are taken as two.
+ * Under every policy, the number of messages lost is reported by a
+ * VYSMAW_MESSAGE_QUEUE_OVERFLOW message once the queue again has room.
+ *
+ * A non-zero 'max_message_age' (in microseconds) limits the age, measured
+ * according to 'message_age_reference', of VYSMAW_MESSAGE_VALID_BUFFER
+ * messages delivered to the client. Expired messages are discarded, and their
+ * buffers released, when they are popped from the queue, or earlier, by
+ * vysmaw, when the queue depth is within 'queue_resume_overhead' of its
+ * limit. Every run of discarded messages is summarized by a single
+ * VYSMAW_MESSAGE_EXPIRED message.
+ *
+ * A consumer with a non-NULL 'callback' receives its
+ * VYSMAW_MESSAGE_VALID_BUFFER, VYSMAW_MESSAGE_SPECTRA_BATCH,
+ * VYSMAW_MESSAGE_DIGEST_FAILURE and VYSMAW_MESSAGE_RDMA_READ_FAILURE messages
+ * by calls of 'callback', with 'callback_data' as the 'user_data' argument,
+ * rather than through its queue (see vysmaw_message_callback). The queue
+ * receives all other messages, and must still be popped until
+ * VYSMAW_MESSAGE_END. Every call of 'callback' that takes longer than
+ * 'callback_time_limit' microseconds (if non-zero) is counted as an overrun in
+ * the queue status. Overflow and age limits do not apply to messages passed to
+ * 'callback'. Such a consumer may not be sharded.
+ *
+ * A consumer with 'batch_spectra' set receives the spectra that it selects
+ * from each signal message in a single VYSMAW_MESSAGE_SPECTRA_BATCH message,
+ * which holds the spectra contiguously in one buffer, rather than in one
+ * VYSMAW_MESSAGE_VALID_BUFFER message per spectrum. Spectra that fail to be
+ * read, or to have their digest verified, are left out of the batch, and
+ * reported by their own messages. When the spectra selected from a signal
+ * message, together with their metadata, do not fit in a single spectrum
+ * buffer (see 'max_spectrum_buffer_size' and 'single_spectrum_buffer_pool'),
+ * or for a handle created by vysmaw_attach(), spectra are delivered singly.
  */
 struct vysmaw_consumer {
 	vysmaw_spectrum_filter filter;
 	void *filter_data;
 	vysmaw_message_queue queue;
+	unsigned num_shards;
+	enum vysmaw_shard_distribution shard_distribution;
+	vysmaw_message_queue *shard_queues;
+	enum vysmaw_overflow_policy overflow_policy;
+	unsigned overflow_sample_interval;
+	uint64_t max_message_age;
+	enum vysmaw_message_age_reference message_age_reference;
+	vysmaw_message_callback callback;
+	void *callback_data;
+	uint64_t callback_time_limit;
+	bool batch_spectra;
+	vysmaw_spectrum_batch_filter batch_filter; // used instead of 'filter' if
+	                                           // non-NULL
+	/* spectra must also pass 'selection', if non-NULL, which is copied by
+	 * vysmaw_start(); with no 'filter' or 'batch_filter', 'selection' alone
+	 * determines the selected spectra */
+	const struct vysmaw_spectrum_selection *selection;
 };
 
 /* Free resources allocated by, and associated with, a vysmaw_message.
@@ -298,6 +643,17 @@ struct vysmaw_consumer {
 extern void vysmaw_message_unref(struct vysmaw_message *message)
 	__attribute__((nonnull));
 
+/* Release a reference to each of 'n' messages, as vysmaw_message_unref() does.
+ *
+ * Clients that finish with messages in batches (e.g, those popped by
+ * vysmaw_message_queue_pop_batch()) should prefer this function, which returns
+ * the spectrum buffers of the messages to each buffer pool in a single
+ * operation, and releases the messages' references to the vysmaw_handle in
+ * bulk, rather than one at a time. */
+extern void vysmaw_message_unref_batch(struct vysmaw_message **messages,
+                                       unsigned n)
+	__attribute__((nonnull));
+
 /* Start vysmaw threads.
  *
  * The library will create a message queue for passing messages to the client,
@@ -309,11 +665,15 @@ extern void vysmaw_message_unref(struct vysmaw_message *message)
  * passed as an argument in all calls to the 'spectrum_filter' function.
  *
  * This function allows a single client to set up multiple filters and queues.
- * It is advisable for the distribution of messages from a single queue to
- * multiple threads, if desired, to be done by the client, and not by setting up
- * multiple queues with the same filter predicate, in order to prevent the
- * evaluation of the predicate multiple times for each argument query.
+ * To distribute spectra to multiple threads, use a sharded consumer (see
+ * 'struct vysmaw_consumer'), rather than multiple queues with the same filter
+ * predicate, in order to prevent the evaluation of the predicate multiple times
+ * for each argument query. At most VYSMAW_MAX_CONSUMERS queues (counting every
+ * shard of a sharded consumer) may be started on a single handle; beyond that,
+ * the only message delivered is a VYSMAW_MESSAGE_END with an error.
  */
+#define VYSMAW_MAX_CONSUMERS 64
+
 extern vysmaw_handle vysmaw_start_(const struct vysmaw_configuration *config,
                                    unsigned num_consumers,
                                    struct vysmaw_consumer *consumers)
@@ -326,6 +686,54 @@ extern vysmaw_handle vysmaw_start(const struct vysmaw_configuration *config,
                                   struct vysmaw_consumer **consumers)
 	__attribute__((nonnull(1,3),malloc,returns_nonnull));
 
+/* Maximum value of 'shm_max_clients' */
+#define VYSMAW_SHM_MAX_CLIENTS 64
+
+/* Export the messages of a message queue to client processes through shared
+ * memory.
+ *
+ * This function turns the calling process into the single reader of spectra
+ * on a host, on behalf of the client processes that attach to it with
+ * vysmaw_attach(), so that every spectrum is read by RDMA only once for the
+ * host. Typically, 'queue' is the queue of the only consumer of a
+ * vysmaw_handle, with a spectrum filter that selects the union of the spectra
+ * that all clients may require. Valid buffer and digest failure messages are
+ * copied into the shared memory object named by 'config->shm_name', which is
+ * created by this function (replacing any existing object of the same name),
+ * and removed when it returns; other messages are not exported. In
+ * particular, VYSMAW_MESSAGE_SPECTRA_BATCH messages are dropped, so the
+ * exported consumer should not set 'batch_spectra'. The calling thread
+ * becomes the queue's consumer until VYSMAW_MESSAGE_END is popped from the
+ * queue, upon which this function returns the result of that message, and
+ * attached clients receive their own VYSMAW_MESSAGE_END. Should the shared
+ * memory object not be created, this function returns an error immediately,
+ * without popping any message; the caller remains the queue's consumer, and
+ * should shut down the handle and pop the queue until VYSMAW_MESSAGE_END as
+ * usual. A non-NULL 'syserr_desc' in the returned value must be freed by the
+ * caller with free().
+ */
+extern struct vysmaw_result vysmaw_export(
+	const struct vysmaw_configuration *config, vysmaw_message_queue queue)
+	__attribute__((nonnull));
+
+/* Attach to an exporting vysmaw instance on the same host.
+ *
+ * This function is the counterpart of vysmaw_start() for a client of a
+ * process running vysmaw_export() with the same 'shm_name'. The returned
+ * handle and the consumers' queues are used exactly as those returned by
+ * vysmaw_start(), and the consumers' filters are applied to the exported
+ * spectra, but no spectra are read by this process, and its spectrum buffer
+ * pool configuration is ignored. In the vys_spectrum_info values passed to
+ * the filters, only 'timestamp' is valid. Delivered buffers are in shared
+ * memory, and are released to the exporting process by
+ * vysmaw_message_unref(). VYSMAW_MESSAGE_END is delivered when the handle is
+ * shut down, or the exporting process ends or exits.
+ */
+extern vysmaw_handle vysmaw_attach(const struct vysmaw_configuration *config,
+                                   unsigned num_consumers,
+                                   struct vysmaw_consumer **consumers)
+	__attribute__((nonnull(1,3),malloc,returns_nonnull));
+
 /* Shut down vysmaw threads.
  *
  * After calling this method, although the handle shall no longer be used by the
@@ -374,6 +782,71 @@ extern struct vysmaw_message *vysmaw_message_queue_try_pop(
 	vysmaw_message_queue queue)
 	__attribute__((nonnull));
 
+/* Get up to 'max' messages from a message queue, blocking for at most
+ * 'timeout' microseconds for the first message to become available.
+ *
+ * Returns the number of messages written to 'msgs', which is zero only if
+ * timeout occurs (or 'max' is zero.) A 'timeout' of zero does not block. A
+ * VYSMAW_MESSAGE_END message is always the last message in a batch. Every
+ * message must be released by vysmaw_message_unref().
+ *
+ * @see vysmaw_message_queue_pop()
+ * @see vysmaw_message_unref()
+ */
+extern unsigned vysmaw_message_queue_pop_batch(
+	vysmaw_message_queue queue, struct vysmaw_message **msgs, unsigned max,
+	uint64_t timeout)
+	__attribute__((nonnull));
+
+/* Get a file descriptor for a message queue, for use with poll(), epoll and
+ * the like.
+ *
+ * The descriptor becomes readable when messages may be available, and remains
+ * so until the queue is found to be empty by one of the functions that pop
+ * messages from the queue; a client should therefore pop messages until none
+ * remain after every readiness notification, which makes the descriptor
+ * suitable for edge-triggered use. The descriptor is signalled at most once
+ * for every batch of messages delivered to an empty queue. It must not be read
+ * or closed by the client, and it remains valid until VYSMAW_MESSAGE_END has
+ * been received. Returns -1 if the descriptor cannot be created, with errno
+ * set. Like the functions that pop messages, this must be called by the
+ * queue's consumer thread.
+ */
+extern int vysmaw_message_queue_fd(vysmaw_message_queue queue)
+	__attribute__((nonnull));
+
+/* Get depth and overflow counters of a message queue.
+ *
+ * This function does not block, and may be called from any thread until
+ * VYSMAW_MESSAGE_END has been received on the queue.
+ */
+extern void vysmaw_message_queue_status(
+	vysmaw_message_queue queue, struct vysmaw_message_queue_status *status)
+	__attribute__((nonnull));
+
+/* Get occupancy of spectrum buffer pools.
+ *
+ * Writes the status of at most 'max_pools' pools to 'status', and returns the
+ * number of spectrum buffer pools, which may exceed 'max_pools'. With
+ * 'single_spectrum_buffer_pool' set, there is exactly one pool; otherwise,
+ * pools are created as needed, and are ordered by buffer size. This function
+ * does not block, and may be called from any thread.
+ */
+extern unsigned vysmaw_spectrum_buffer_pool_status(
+	vysmaw_handle handle, struct vysmaw_buffer_pool_status *status,
+	unsigned max_pools)
+	__attribute__((nonnull));
+
+/* Get occupancy of the signal message buffer pool.
+ *
+ * Returns false if the pool has not (yet) been created, in which case 'status'
+ * is not modified. This function does not block, and may be called from any
+ * thread.
+ */
+extern bool vysmaw_signal_buffer_pool_status(
+	vysmaw_handle handle, struct vysmaw_buffer_pool_status *status)
+	__attribute__((nonnull));
+
 /* Get a configuration instance, filled with default values. Optionally provide
  * a path to a vysmaw configuration file.
  *
@@ -391,6 +864,46 @@ extern struct vysmaw_configuration *vysmaw_configuration_new(
 extern void vysmaw_configuration_free(struct vysmaw_configuration *config)
 	__attribute__((nonnull));
 
+/* Get a spectrum selection instance. With a NULL 'config', the selection
+ * selects every spectrum; otherwise, it is set from the 'selection_*' fields of
+ * 'config'. Returns NULL if those fields are invalid, which
+ * vysmaw_configuration_new() also reports in the configuration's error record.
+ *
+ * @see vysmaw_spectrum_selection_free()
+ */
+extern struct vysmaw_spectrum_selection *vysmaw_spectrum_selection_new(
+	const struct vysmaw_configuration *config)
+	__attribute__((malloc));
+
+/* Replace the baselines of a selection with those of the station pairs in
+ * 'stations'.
+ */
+extern void vysmaw_spectrum_selection_set_baselines(
+	struct vysmaw_spectrum_selection *selection, const uint8_t (*stations)[2],
+	unsigned num_baselines)
+	__attribute__((nonnull(1)));
+
+/* Replace the spectral windows of a selection with 'indexes'.
+ */
+extern void vysmaw_spectrum_selection_set_spectral_windows(
+	struct vysmaw_spectrum_selection *selection, const uint8_t *indexes,
+	unsigned num_indexes)
+	__attribute__((nonnull(1)));
+
+/* Replace the stokes parameters of a selection with 'indexes'.
+ */
+extern void vysmaw_spectrum_selection_set_stokes(
+	struct vysmaw_spectrum_selection *selection, const uint8_t *indexes,
+	unsigned num_indexes)
+	__attribute__((nonnull(1)));
+
+/* Free a spectrum selection instance that was allocated using
+ * vysmaw_spectrum_selection_new().
+ */
+extern void vysmaw_spectrum_selection_free(
+	struct vysmaw_spectrum_selection *selection)
+	__attribute__((nonnull));
+
 #ifdef __cplusplus
 }
 #endif
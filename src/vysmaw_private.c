@@ -19,22 +19,33 @@
 #include <signal_receiver.h>
 #include <spectrum_selector.h>
 #include <spectrum_reader.h>
+#include <numa_placement.h>
+#include <shm_fanout.h>
 #include <sys/types.h>
 #include <string.h>
 #include <stdarg.h>
 #include <limits.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 
 #define DEFAULT_SPECTRUM_BUFFER_POOL_SIZE (10 * (1 << 20))
+#define DEFAULT_SPECTRUM_BUFFER_POOL_MAX_SIZE 0
+#define DEFAULT_SPECTRUM_BUFFER_POOL_IDLE_RELEASE_SEC 10
 #define DEFAULT_SINGLE_SPECTRUM_BUFFER_POOL true
 #define DEFAULT_MAX_SPECTRUM_BUFFER_SIZE (8 * (1 << 10))
+#define DEFAULT_SPECTRUM_BUFFER_MAGAZINE_SIZE 32
+#define DEFAULT_SPECTRUM_BUFFER_ALIGNMENT 64
 #define DEFAULT_SIGNAL_MESSAGE_POOL_SIZE (10 * (1 << 20))
+#define DEFAULT_BUFFER_POOL_HUGE_PAGE_SIZE 0
+#define DEFAULT_NUMA_NODE -1
 #define DEFAULT_EAGER_CONNECT true
 #define DEFAULT_EAGER_CONNECT_IDLE_SEC 1
 #define DEFAULT_PRECONNECT_BACKLOG true
 #define DEFAULT_MAX_DEPTH_MESSAGE_QUEUE 1000
 #define DEFAULT_QUEUE_RESUME_OVERHEAD 100
 #define DEFAULT_MAX_STARVATION_LATENCY 100
+#define DEFAULT_SPECTRUM_BUFFER_POOL_PRESSURE_THRESHOLD 0.0
+#define DEFAULT_SPECTRUM_BUFFER_POOL_PRESSURE_HYSTERESIS 0.1
 #define DEFAULT_RESOLVE_ROUTE_TIMEOUT_MS 1000
 #define DEFAULT_RESOLVE_ADDR_TIMEOUT_MS 1000
 #define DEFAULT_INACTIVE_SERVER_TIMEOUT_SEC (60 * 60 * 12)
@@ -43,6 +54,15 @@
 #define DEFAULT_SIGNAL_RECEIVE_MIN_ACK_PART 10
 #define DEFAULT_RDMA_READ_MAX_POSTED 1000
 #define DEFAULT_RDMA_READ_MIN_ACK_PART 10
+#define DEFAULT_SHM_NAME "/vysmaw"
+#define DEFAULT_SHM_BUFFER_POOL_SIZE (64 * (1 << 20))
+#define DEFAULT_SHM_MAX_CLIENTS 8
+#define DEFAULT_SHM_CLIENT_QUEUE_LENGTH 4096
+#define DEFAULT_SELECTION_BASELINES ""
+#define DEFAULT_SELECTION_SPECTRAL_WINDOWS ""
+#define DEFAULT_SELECTION_STOKES ""
+#define DEFAULT_SELECTION_START_TIME 0
+#define DEFAULT_SELECTION_END_TIME 0
 
 static gchar *default_config_vysmaw()
 	__attribute__((returns_nonnull,malloc));
@@ -50,6 +70,10 @@ static guint64 parse_uint64(
 	GKeyFile *kf, const gchar *key,
 	struct vysmaw_configuration *config)
 	__attribute__((nonnull));
+static gint parse_integer(
+	GKeyFile *kf, const gchar *key,
+	struct vysmaw_configuration *config)
+	__attribute__((nonnull));
 static gboolean parse_boolean(
 	GKeyFile *kf, const gchar *key,
 	struct vysmaw_configuration *config)
@@ -58,8 +82,19 @@ static gdouble parse_double(
 	GKeyFile *kf, const gchar *key,
 	struct vysmaw_configuration *config)
 	__attribute__((nonnull));
-static GSList *all_consumers(vysmaw_handle handle)
-	__attribute__((nonnull,returns_nonnull,malloc));
+static void parse_string(
+	GKeyFile *kf, const gchar *key, gchar *str, gsize size,
+	struct vysmaw_configuration *config)
+	__attribute__((nonnull));
+static bool parse_index_item(
+	const char *item, const char **end, unsigned *min, unsigned *max)
+	__attribute__((nonnull));
+static bool parse_index_set(uint64_t *set, const char *spec)
+	__attribute__((nonnull));
+static bool parse_baseline_set(uint64_t *set, const char *spec)
+	__attribute__((nonnull));
+static consumer_mask_t all_consumers(vysmaw_handle handle)
+	__attribute__((nonnull));
 
 static gchar *
 default_config_vysmaw()
@@ -68,15 +103,33 @@ default_config_vysmaw()
 	g_key_file_set_uint64(kf, VYSMAW_CONFIG_GROUP_NAME,
 	                      SPECTRUM_BUFFER_POOL_SIZE_KEY,
 	                      DEFAULT_SPECTRUM_BUFFER_POOL_SIZE);
+	g_key_file_set_uint64(kf, VYSMAW_CONFIG_GROUP_NAME,
+	                      SPECTRUM_BUFFER_POOL_MAX_SIZE_KEY,
+	                      DEFAULT_SPECTRUM_BUFFER_POOL_MAX_SIZE);
+	g_key_file_set_double(kf, VYSMAW_CONFIG_GROUP_NAME,
+	                      SPECTRUM_BUFFER_POOL_IDLE_RELEASE_SEC_KEY,
+	                      DEFAULT_SPECTRUM_BUFFER_POOL_IDLE_RELEASE_SEC);
 	g_key_file_set_boolean(kf, VYSMAW_CONFIG_GROUP_NAME,
 	                       SINGLE_SPECTRUM_BUFFER_POOL_KEY,
 	                       DEFAULT_SINGLE_SPECTRUM_BUFFER_POOL);
 	g_key_file_set_uint64(kf, VYSMAW_CONFIG_GROUP_NAME,
 	                      MAX_SPECTRUM_BUFFER_SIZE_KEY,
 	                      DEFAULT_MAX_SPECTRUM_BUFFER_SIZE);
+	g_key_file_set_uint64(kf, VYSMAW_CONFIG_GROUP_NAME,
+	                      SPECTRUM_BUFFER_MAGAZINE_SIZE_KEY,
+	                      DEFAULT_SPECTRUM_BUFFER_MAGAZINE_SIZE);
+	g_key_file_set_uint64(kf, VYSMAW_CONFIG_GROUP_NAME,
+	                      SPECTRUM_BUFFER_ALIGNMENT_KEY,
+	                      DEFAULT_SPECTRUM_BUFFER_ALIGNMENT);
 	g_key_file_set_uint64(kf, VYSMAW_CONFIG_GROUP_NAME,
 	                      SIGNAL_MESSAGE_POOL_SIZE_KEY,
 	                      DEFAULT_SIGNAL_MESSAGE_POOL_SIZE);
+	g_key_file_set_uint64(kf, VYSMAW_CONFIG_GROUP_NAME,
+	                      BUFFER_POOL_HUGE_PAGE_SIZE_KEY,
+	                      DEFAULT_BUFFER_POOL_HUGE_PAGE_SIZE);
+	g_key_file_set_integer(kf, VYSMAW_CONFIG_GROUP_NAME,
+	                       NUMA_NODE_KEY,
+	                       DEFAULT_NUMA_NODE);
 	g_key_file_set_boolean(kf, VYSMAW_CONFIG_GROUP_NAME,
 	                       EAGER_CONNECT_KEY,
 	                       DEFAULT_EAGER_CONNECT);
@@ -95,6 +148,12 @@ default_config_vysmaw()
 	g_key_file_set_uint64(kf, VYSMAW_CONFIG_GROUP_NAME,
 	                      MAX_STARVATION_LATENCY_KEY,
 	                      DEFAULT_MAX_STARVATION_LATENCY);
+	g_key_file_set_double(kf, VYSMAW_CONFIG_GROUP_NAME,
+	                      SPECTRUM_BUFFER_POOL_PRESSURE_THRESHOLD_KEY,
+	                      DEFAULT_SPECTRUM_BUFFER_POOL_PRESSURE_THRESHOLD);
+	g_key_file_set_double(kf, VYSMAW_CONFIG_GROUP_NAME,
+	                      SPECTRUM_BUFFER_POOL_PRESSURE_HYSTERESIS_KEY,
+	                      DEFAULT_SPECTRUM_BUFFER_POOL_PRESSURE_HYSTERESIS);
 	g_key_file_set_uint64(kf, VYSMAW_CONFIG_GROUP_NAME,
 	                      RESOLVE_ROUTE_TIMEOUT_MS_KEY,
 	                      DEFAULT_RESOLVE_ROUTE_TIMEOUT_MS);
@@ -119,6 +178,33 @@ default_config_vysmaw()
 	g_key_file_set_uint64(kf, VYSMAW_CONFIG_GROUP_NAME,
 	                      RDMA_READ_MIN_ACK_PART_KEY,
 	                      DEFAULT_RDMA_READ_MIN_ACK_PART);
+	g_key_file_set_string(kf, VYSMAW_CONFIG_GROUP_NAME,
+	                      SHM_NAME_KEY,
+	                      DEFAULT_SHM_NAME);
+	g_key_file_set_uint64(kf, VYSMAW_CONFIG_GROUP_NAME,
+	                      SHM_BUFFER_POOL_SIZE_KEY,
+	                      DEFAULT_SHM_BUFFER_POOL_SIZE);
+	g_key_file_set_uint64(kf, VYSMAW_CONFIG_GROUP_NAME,
+	                      SHM_MAX_CLIENTS_KEY,
+	                      DEFAULT_SHM_MAX_CLIENTS);
+	g_key_file_set_uint64(kf, VYSMAW_CONFIG_GROUP_NAME,
+	                      SHM_CLIENT_QUEUE_LENGTH_KEY,
+	                      DEFAULT_SHM_CLIENT_QUEUE_LENGTH);
+	g_key_file_set_string(kf, VYSMAW_CONFIG_GROUP_NAME,
+	                      SELECTION_BASELINES_KEY,
+	                      DEFAULT_SELECTION_BASELINES);
+	g_key_file_set_string(kf, VYSMAW_CONFIG_GROUP_NAME,
+	                      SELECTION_SPECTRAL_WINDOWS_KEY,
+	                      DEFAULT_SELECTION_SPECTRAL_WINDOWS);
+	g_key_file_set_string(kf, VYSMAW_CONFIG_GROUP_NAME,
+	                      SELECTION_STOKES_KEY,
+	                      DEFAULT_SELECTION_STOKES);
+	g_key_file_set_uint64(kf, VYSMAW_CONFIG_GROUP_NAME,
+	                      SELECTION_START_TIME_KEY,
+	                      DEFAULT_SELECTION_START_TIME);
+	g_key_file_set_uint64(kf, VYSMAW_CONFIG_GROUP_NAME,
+	                      SELECTION_END_TIME_KEY,
+	                      DEFAULT_SELECTION_END_TIME);
 	gchar *result = g_key_file_to_data(kf, NULL, NULL);
 	g_key_file_free(kf);
 	return result;
@@ -151,6 +237,22 @@ parse_uint64(GKeyFile *kf, const gchar *key,
 	return result;
 }
 
+static gint
+parse_integer(GKeyFile *kf, const gchar *key,
+              struct vysmaw_configuration *config)
+{
+	GError *err = NULL;
+	gint result =
+		g_key_file_get_integer(kf, VYSMAW_CONFIG_GROUP_NAME, key, &err);
+	if (err != NULL) {
+		MSG_ERROR(&(config->error_record), -1,
+		          "Failed to parse '%s' field: %s",
+		          key, err->message);
+		g_error_free(err);
+	}
+	return result;
+}
+
 static gboolean
 parse_boolean(GKeyFile *kf, const gchar *key,
               struct vysmaw_configuration *config)
@@ -183,6 +285,26 @@ parse_double(GKeyFile *kf, const gchar *key,
 	return result;
 }
 
+static void
+parse_string(GKeyFile *kf, const gchar *key, gchar *str, gsize size,
+             struct vysmaw_configuration *config)
+{
+	GError *err = NULL;
+	gchar *result =
+		g_key_file_get_string(kf, VYSMAW_CONFIG_GROUP_NAME, key, &err);
+	if (err != NULL) {
+		MSG_ERROR(&(config->error_record), -1,
+		          "Failed to parse '%s' field: %s",
+		          key, err->message);
+		g_error_free(err);
+	} else {
+		if (g_strlcpy(str, result, size) >= size)
+			MSG_ERROR(&(config->error_record), -1,
+			          "'%s' field value is too long", key);
+		g_free(result);
+	}
+}
+
 void
 init_from_key_file_vysmaw(GKeyFile *kf, struct vysmaw_configuration *config)
 {
@@ -202,12 +324,24 @@ init_from_key_file_vysmaw(GKeyFile *kf, struct vysmaw_configuration *config)
 	/* vysmaw group configuration */
 	config->spectrum_buffer_pool_size =
 		parse_uint64(kf, SPECTRUM_BUFFER_POOL_SIZE_KEY, config);
+	config->spectrum_buffer_pool_max_size =
+		parse_uint64(kf, SPECTRUM_BUFFER_POOL_MAX_SIZE_KEY, config);
+	config->spectrum_buffer_pool_idle_release_sec =
+		parse_double(kf, SPECTRUM_BUFFER_POOL_IDLE_RELEASE_SEC_KEY, config);
 	config->single_spectrum_buffer_pool =
 		parse_boolean(kf, SINGLE_SPECTRUM_BUFFER_POOL_KEY, config);
 	config->max_spectrum_buffer_size =
 		parse_uint64(kf, MAX_SPECTRUM_BUFFER_SIZE_KEY, config);
+	config->spectrum_buffer_magazine_size =
+		parse_uint64(kf, SPECTRUM_BUFFER_MAGAZINE_SIZE_KEY, config);
+	config->spectrum_buffer_alignment =
+		parse_uint64(kf, SPECTRUM_BUFFER_ALIGNMENT_KEY, config);
 	config->signal_message_pool_size =
 		parse_uint64(kf, SIGNAL_MESSAGE_POOL_SIZE_KEY, config);
+	config->buffer_pool_huge_page_size =
+		parse_uint64(kf, BUFFER_POOL_HUGE_PAGE_SIZE_KEY, config);
+	config->numa_node =
+		parse_integer(kf, NUMA_NODE_KEY, config);
 	config->eager_connect =
 		parse_boolean(kf, EAGER_CONNECT_KEY, config);
 	config->eager_connect_idle_sec =
@@ -220,6 +354,10 @@ init_from_key_file_vysmaw(GKeyFile *kf, struct vysmaw_configuration *config)
 		parse_uint64(kf, QUEUE_RESUME_OVERHEAD_KEY, config);
 	config->max_starvation_latency =
 		parse_uint64(kf, MAX_STARVATION_LATENCY_KEY, config);
+	config->spectrum_buffer_pool_pressure_threshold =
+		parse_double(kf, SPECTRUM_BUFFER_POOL_PRESSURE_THRESHOLD_KEY, config);
+	config->spectrum_buffer_pool_pressure_hysteresis =
+		parse_double(kf, SPECTRUM_BUFFER_POOL_PRESSURE_HYSTERESIS_KEY, config);
 	config->resolve_route_timeout_ms =
 		parse_uint64(kf, RESOLVE_ROUTE_TIMEOUT_MS_KEY, config);
 	config->resolve_addr_timeout_ms =
@@ -236,6 +374,154 @@ init_from_key_file_vysmaw(GKeyFile *kf, struct vysmaw_configuration *config)
 		parse_uint64(kf, RDMA_READ_MAX_POSTED_KEY, config);
 	config->rdma_read_min_ack_part =
 		parse_uint64(kf, RDMA_READ_MIN_ACK_PART_KEY, config);
+	parse_string(kf, SHM_NAME_KEY, config->shm_name, sizeof(config->shm_name),
+	             config);
+	config->shm_buffer_pool_size =
+		parse_uint64(kf, SHM_BUFFER_POOL_SIZE_KEY, config);
+	config->shm_max_clients =
+		parse_uint64(kf, SHM_MAX_CLIENTS_KEY, config);
+	config->shm_client_queue_length =
+		parse_uint64(kf, SHM_CLIENT_QUEUE_LENGTH_KEY, config);
+	parse_string(kf, SELECTION_BASELINES_KEY, config->selection_baselines,
+	             sizeof(config->selection_baselines), config);
+	parse_string(kf, SELECTION_SPECTRAL_WINDOWS_KEY,
+	             config->selection_spectral_windows,
+	             sizeof(config->selection_spectral_windows), config);
+	parse_string(kf, SELECTION_STOKES_KEY, config->selection_stokes,
+	             sizeof(config->selection_stokes), config);
+	config->selection_start_time =
+		parse_uint64(kf, SELECTION_START_TIME_KEY, config);
+	config->selection_end_time =
+		parse_uint64(kf, SELECTION_END_TIME_KEY, config);
+
+	struct vysmaw_spectrum_selection *selection =
+		g_slice_new(struct vysmaw_spectrum_selection);
+	if (!parse_baseline_set(selection->baselines, config->selection_baselines))
+		MSG_ERROR(&(config->error_record), -1,
+		          "Invalid '%s' field value", SELECTION_BASELINES_KEY);
+	if (!parse_index_set(selection->spectral_windows,
+	                     config->selection_spectral_windows))
+		MSG_ERROR(&(config->error_record), -1,
+		          "Invalid '%s' field value", SELECTION_SPECTRAL_WINDOWS_KEY);
+	if (!parse_index_set(selection->stokes, config->selection_stokes))
+		MSG_ERROR(&(config->error_record), -1,
+		          "Invalid '%s' field value", SELECTION_STOKES_KEY);
+	g_slice_free(struct vysmaw_spectrum_selection, selection);
+}
+
+/* Parse an index list element, "*", "N" or "M:N", setting '*end' to the first
+ * character after it. */
+static bool
+parse_index_item(const char *item, const char **end, unsigned *min,
+                 unsigned *max)
+{
+	if (*item == '*') {
+		*min = 0;
+		*max = UINT8_MAX;
+		*end = item + 1;
+		return true;
+	}
+	if (!g_ascii_isdigit(*item)) return false;
+	char *e;
+	guint64 val = g_ascii_strtoull(item, &e, 10);
+	if (val > UINT8_MAX) return false;
+	*min = *max = val;
+	if (*e == ':') {
+		const char *hi = e + 1;
+		if (!g_ascii_isdigit(*hi)) return false;
+		val = g_ascii_strtoull(hi, &e, 10);
+		if (val > UINT8_MAX || val < *min) return false;
+		*max = val;
+	}
+	*end = e;
+	return true;
+}
+
+#define SET_BIT(set, i) ((set)[(i) / 64] |= (uint64_t)1 << ((i) % 64))
+
+static bool
+parse_index_set(uint64_t *set, const char *spec)
+{
+	gchar **items = g_strsplit_set(spec, ", \t", -1);
+	bool result = true;
+	bool empty = true;
+	memset(set, 0, (UINT8_MAX + 1) / 8);
+	for (gchar **item = items; result && *item != NULL; ++item) {
+		if (**item == '\0') continue;
+		const char *end;
+		unsigned min, max;
+		result = parse_index_item(*item, &end, &min, &max) && *end == '\0';
+		if (result) {
+			for (unsigned i = min; i <= max; ++i) SET_BIT(set, i);
+			empty = false;
+		}
+	}
+	g_strfreev(items);
+	if (result && empty) memset(set, 0xff, (UINT8_MAX + 1) / 8);
+	return result;
+}
+
+static bool
+parse_baseline_set(uint64_t *set, const char *spec)
+{
+	gchar **items = g_strsplit_set(spec, ", \t", -1);
+	bool result = true;
+	bool empty = true;
+	memset(set, 0, (UINT8_MAX + 1) * (UINT8_MAX + 1) / 8);
+	for (gchar **item = items; result && *item != NULL; ++item) {
+		if (**item == '\0') continue;
+		const char *end;
+		unsigned min0, max0, min1, max1;
+		result = parse_index_item(*item, &end, &min0, &max0)
+			&& *end == '-'
+			&& parse_index_item(end + 1, &end, &min1, &max1)
+			&& *end == '\0';
+		if (result) {
+			for (unsigned s0 = min0; s0 <= max0; ++s0)
+				for (unsigned s1 = min1; s1 <= max1; ++s1) {
+					SET_BIT(set, (UINT8_MAX + 1) * s0 + s1);
+					SET_BIT(set, (UINT8_MAX + 1) * s1 + s0);
+				}
+			empty = false;
+		}
+	}
+	g_strfreev(items);
+	if (result && empty)
+		memset(set, 0xff, (UINT8_MAX + 1) * (UINT8_MAX + 1) / 8);
+	return result;
+}
+
+bool
+spectrum_selection_init(struct vysmaw_spectrum_selection *selection,
+                        const struct vysmaw_configuration *config)
+{
+	selection->start_time = config->selection_start_time;
+	selection->end_time = config->selection_end_time;
+	return (parse_baseline_set(selection->baselines,
+	                           config->selection_baselines)
+	        && parse_index_set(selection->spectral_windows,
+	                           config->selection_spectral_windows)
+	        && parse_index_set(selection->stokes, config->selection_stokes));
+}
+
+void
+spectrum_selection_set_indexes(uint64_t *set, const uint8_t *indexes,
+                               unsigned num_indexes)
+{
+	memset(set, 0, (UINT8_MAX + 1) / 8);
+	for (unsigned i = 0; i < num_indexes; ++i)
+		SET_BIT(set, indexes[i]);
+}
+
+void
+spectrum_selection_set_baselines(uint64_t *set, const uint8_t (*stations)[2],
+                                 unsigned num_baselines)
+{
+	memset(set, 0, (UINT8_MAX + 1) * (UINT8_MAX + 1) / 8);
+	for (unsigned i = 0; i < num_baselines; ++i) {
+		SET_BIT(set, (UINT8_MAX + 1) * stations[i][0] + stations[i][1]);
+		SET_BIT(set, (UINT8_MAX + 1) * stations[i][1] + stations[i][0]);
+	}
 }
 
 vysmaw_handle
@@ -248,13 +534,21 @@ handle_ref(vysmaw_handle handle)
 void
 handle_unref(vysmaw_handle handle)
 {
-	if (g_atomic_int_dec_and_test(&handle->refcount)) {
+	handle_unref_n(handle, 1);
+}
+
+void
+handle_unref_n(vysmaw_handle handle, unsigned n)
+{
+	if (__atomic_sub_fetch(&handle->refcount, n, __ATOMIC_ACQ_REL) == 0) {
 		if (handle->signal_receiver_thread != NULL)
 			g_thread_join(handle->signal_receiver_thread);
 		if (handle->spectrum_selector_thread != NULL)
 			g_thread_join(handle->spectrum_selector_thread);
 		if (handle->spectrum_reader_thread != NULL)
 			g_thread_join(handle->spectrum_reader_thread);
+		if (handle->shm_client_thread != NULL)
+			g_thread_join(handle->shm_client_thread);
 
 		MUTEX_CLEAR(handle->gate.mtx);
 		COND_CLEAR(handle->gate.cond);
@@ -262,41 +556,76 @@ handle_unref(vysmaw_handle handle)
 		struct consumer *c = handle->consumers;
 		for (unsigned i = 0; i < handle->num_consumers; ++i) {
 			message_queue_unref(&c->queue);
-			g_array_free(c->pass_filter_array, TRUE);
+			if (c->pass_filter_array != NULL)
+				g_array_free(c->pass_filter_array, TRUE);
+			if (c->selection != NULL)
+				g_slice_free(struct vysmaw_spectrum_selection, c->selection);
 			++c;
 		}
 		g_free(handle->consumers);
 
+		if (handle->shm != NULL)
+			shm_detach(handle->shm);
+
 		if (handle->config.single_spectrum_buffer_pool) {
-			spectrum_buffer_pool_unref(handle->pool);
+			spectrum_buffer_pool_retire(handle->pool);
 		} else {
 			spectrum_buffer_pool_collection_free(handle->pool_collection);
 			MUTEX_CLEAR(handle->pool_collection_mtx);
 		}
 
+		buffer_pool_free(handle->message_slab);
+		if (handle->signal_msg_buffers != NULL)
+			buffer_pool_free(handle->signal_msg_buffers);
 		MUTEX_CLEAR(handle->mtx);
 		g_free(handle);
 	}
 }
 
-static GSList *
+static consumer_mask_t
 all_consumers(vysmaw_handle handle)
 {
-	MUTEX_LOCK(handle->mtx);
-	GSList *result = NULL;
-	struct consumer *consumer = handle->consumers;
-	for (unsigned i = handle->num_consumers; i > 0; --i) {
-		result = g_slist_prepend(result, consumer);
-		++consumer;
+	return ((handle->num_consumers < 8 * sizeof(consumer_mask_t))
+	        ? ((consumer_mask_t)1 << handle->num_consumers) - 1
+	        : ~(consumer_mask_t)0);
+}
+
+/* serializes the growth of all hot-path slabs, which is rare */
+G_LOCK_DEFINE_STATIC(hot_path_slab_growth);
+
+struct buffer_pool *
+hot_path_slab_new(const struct vysmaw_configuration *config,
+                  size_t object_size)
+{
+	size_t chunk_num_objects = hot_path_slab_chunk_size(config);
+	size_t capacity = hot_path_slab_capacity(config);
+	return buffer_pool_new_elastic(
+		chunk_num_objects, object_size, 0,
+		(capacity + chunk_num_objects - 1) / chunk_num_objects, 0);
+}
+
+void *
+hot_path_slab_pop(struct buffer_pool *slab)
+{
+	void *result = buffer_pool_pop(slab);
+	if (G_UNLIKELY(result == NULL)) {
+		G_LOCK(hot_path_slab_growth);
+		while ((result = buffer_pool_pop(slab)) == NULL) {
+			int chunk = buffer_pool_commit_chunk(slab);
+			if (chunk < 0) break;
+			buffer_pool_publish_chunk(slab, chunk);
+		}
+		G_UNLOCK(hot_path_slab_growth);
 	}
-	MUTEX_UNLOCK(handle->mtx);
 	return result;
 }
 
 struct vysmaw_message *
 message_new(vysmaw_handle handle, enum vysmaw_message_type typ)
 {
-	struct vysmaw_message *result = g_slice_new(struct vysmaw_message);
+	struct vysmaw_message *result = hot_path_slab_pop(handle->message_slab);
+	if (G_UNLIKELY(result == NULL))
+		result = g_slice_new(struct vysmaw_message);
 	result->refcount = 1;
 	result->handle = handle_ref(handle);
 	result->typ = typ;
@@ -335,6 +664,16 @@ digest_failure_message_new(vysmaw_handle handle,
 	return result;
 }
 
+struct vysmaw_message *
+rdma_read_failure_message_new(vysmaw_handle handle, enum ibv_wc_status status)
+{
+	struct vysmaw_message *result =
+		message_new(handle, VYSMAW_MESSAGE_RDMA_READ_FAILURE);
+	g_strlcpy(result->content.rdma_read_status, ibv_wc_status_str(status),
+	          sizeof(result->content.rdma_read_status));
+	return result;
+}
+
 struct vysmaw_message *
 end_message_new(vysmaw_handle handle, struct vysmaw_result *rc)
 {
@@ -345,6 +684,15 @@ end_message_new(vysmaw_handle handle, struct vysmaw_result *rc)
 	return result;
 }
 
+struct vysmaw_message *
+expired_message_new(vysmaw_handle handle, unsigned num_expired)
+{
+	struct vysmaw_message *result =
+		message_new(handle, VYSMAW_MESSAGE_EXPIRED);
+	result->content.num_expired = num_expired;
+	return result;
+}
+
 struct vysmaw_message *
 queue_overflow_message_new(vysmaw_handle handle, unsigned num_overflow)
 {
@@ -354,6 +702,29 @@ queue_overflow_message_new(vysmaw_handle handle, unsigned num_overflow)
 	return result;
 }
 
+void
+buffer_pool_get_status(struct buffer_pool *buffer_pool,
+                       struct vysmaw_buffer_pool_status *status)
+{
+	status->buffer_size = buffer_pool->buffer_size;
+	status->num_in_use = buffer_pool_num_in_use(buffer_pool);
+	status->num_free = buffer_pool_num_free(buffer_pool);
+	status->num_buffers = status->num_in_use + status->num_free;
+	status->max_in_use = buffer_pool_max_in_use(buffer_pool);
+}
+
+struct vysmaw_message *
+pool_pressure_message_new(vysmaw_handle handle,
+                          struct spectrum_buffer_pool *buffer_pool, bool high)
+{
+	struct vysmaw_message *result =
+		message_new(handle, VYSMAW_MESSAGE_BUFFER_POOL_PRESSURE);
+	result->content.pool_pressure.high = high;
+	buffer_pool_get_status(
+		buffer_pool->pool, &result->content.pool_pressure.status);
+	return result;
+}
+
 struct vysmaw_message *
 signal_receive_failure_message_new(vysmaw_handle handle,
                                    enum ibv_wc_status status)
@@ -368,9 +739,7 @@ signal_receive_failure_message_new(vysmaw_handle handle,
 void
 post_msg(vysmaw_handle handle, struct vysmaw_message *msg)
 {
-	GSList *consumers = all_consumers(handle);
-	message_queues_push(msg, consumers);
-	g_slist_free(consumers);
+	message_queues_push(msg, all_consumers(handle));
 }
 
 void
@@ -404,26 +773,77 @@ post_signal_receive_failure(vysmaw_handle handle, enum ibv_wc_status status)
 vysmaw_message_queue
 message_queue_ref(vysmaw_message_queue queue)
 {
-	g_async_queue_ref(queue->q);
+	g_atomic_int_inc(&queue->refcount);
 	return queue;
 }
 
 void
 message_queue_unref(vysmaw_message_queue queue)
 {
-	g_async_queue_unref(queue->q);
+	message_queue_unref_n(queue, 1);
+}
+
+void
+message_queue_unref_n(vysmaw_message_queue queue, unsigned n)
+{
+	if (__atomic_sub_fetch(&queue->refcount, n, __ATOMIC_ACQ_REL) == 0) {
+		if (queue->fd >= 0) close(queue->fd);
+		g_free(queue->ring);
+		g_free(queue->age_times);
+		MUTEX_CLEAR(queue->mtx);
+		COND_CLEAR(queue->cond);
+	}
 }
 
 struct spectrum_buffer_pool *
-spectrum_buffer_pool_new(size_t buffer_size, size_t num_buffers)
+spectrum_buffer_pool_new(size_t buffer_size, size_t alignment,
+                         size_t num_buffers, unsigned max_chunks,
+                         unsigned magazine_size, size_t huge_page_size)
 {
 	struct spectrum_buffer_pool *result =
 		g_new(struct spectrum_buffer_pool, 1);
 	result->refcount = 1;
-	result->pool = buffer_pool_new(num_buffers, buffer_size);
+	result->magazine_size = magazine_size;
+	result->pool = buffer_pool_new_elastic(
+		num_buffers, buffer_size, alignment, max_chunks, huge_page_size);
+	result->grow_requested = false;
+	result->grow_failed = false;
+	result->last_starvation_time = g_get_monotonic_time();
+	result->shrink_request = 0;
+	result->under_pressure = false;
+	result->chunk_job_pending = false;
 	return result;
 }
 
+/* Record that a spectrum buffer pool was found empty. Elastic pools are grown
+ * by the spectrum_reader thread, which has the connections on which new
+ * chunks must be registered, so growth is only requested here. The request is
+ * made even when growth has failed, as it is also what keeps the
+ * spectrum_reader from releasing chunks of a starved pool. */
+static void
+spectrum_buffer_pool_starved(vysmaw_handle handle,
+                             struct spectrum_buffer_pool *buffer_pool)
+{
+	if (buffer_pool->pool->max_chunks > 1) {
+		__atomic_store_n(&buffer_pool->grow_requested, true, __ATOMIC_RELAXED);
+		__atomic_store_n(&handle->spectrum_buffer_pool_grow_requested, true,
+		                 __ATOMIC_RELEASE);
+	}
+}
+
+/* Set in the refcount of a retired spectrum_buffer_pool. From then on, every
+ * reference to the pool is released under the spectrum_buffer_caches lock, by
+ * which the last reference held outside of the magazines (see below) is
+ * recognized, and the pool's memory freed. */
+#define SPECTRUM_BUFFER_POOL_RETIRED (1 << 30)
+
+static inline bool
+spectrum_buffer_pool_is_retired(struct spectrum_buffer_pool *buffer_pool)
+{
+	return (__atomic_load_n(&buffer_pool->refcount, __ATOMIC_SEQ_CST)
+	        & SPECTRUM_BUFFER_POOL_RETIRED) != 0;
+}
+
 struct spectrum_buffer_pool *
 spectrum_buffer_pool_ref(struct spectrum_buffer_pool *pool)
 {
@@ -431,118 +851,413 @@ spectrum_buffer_pool_ref(struct spectrum_buffer_pool *pool)
 	return pool;
 }
 
+/* Per-thread spectrum buffer caches. Each thread has a small, fixed number of
+ * magazines, each of which holds buffers from a single spectrum_buffer_pool. A
+ * magazine is bound to a pool only while it is non-empty, and it holds one
+ * pool reference per buffer, so that a pool is never freed while any of its
+ * buffers are cached. When all magazines are bound to other pools, buffers are
+ * taken from, and returned to, the pool directly.
+ *
+ * Cached buffers do not, however, keep a retired pool's memory alive: a
+ * retired pool's memory is freed as soon as its only remaining references are
+ * those of cached buffers, which are then simply dropped when their magazine
+ * is next flushed. Every retirement advances spectrum_buffer_pool_retire_epoch,
+ * on seeing which a thread flushes all of its magazines bound to retired pools
+ * at its next use of any pool. To count the cached buffers of a pool, all
+ * caches are linked in the spectrum_buffer_caches list, and magazine bindings
+ * are numbered, so that a magazine's pool and number of buffers can be read
+ * consistently from another thread. */
+#define SPECTRUM_BUFFER_CACHE_NUM_MAGAZINES 4
+
+struct spectrum_buffer_magazine {
+	struct spectrum_buffer_pool *pool; // NULL iff magazine is empty
+	unsigned num_buffers;
+	unsigned capacity;
+	unsigned binding;
+	unsigned shrink_request; // of pool, when magazine was last flushed for it
+	void **buffers;
+};
+
+struct spectrum_buffer_cache {
+	struct spectrum_buffer_magazine
+	magazines[SPECTRUM_BUFFER_CACHE_NUM_MAGAZINES];
+	unsigned retire_epoch;
+	struct spectrum_buffer_cache *next;
+};
+
+G_LOCK_DEFINE_STATIC(spectrum_buffer_caches);
+static struct spectrum_buffer_cache *spectrum_buffer_caches = NULL;
+static unsigned spectrum_buffer_pool_retire_epoch = 0;
+
+static void spectrum_buffer_cache_free(struct spectrum_buffer_cache *cache);
+
+static Private spectrum_buffer_cache_key =
+	PRIVATE_INIT((GDestroyNotify)spectrum_buffer_cache_free);
+
+/* number of buffers of a pool cached in all magazines; requires the
+ * spectrum_buffer_caches lock */
+static unsigned
+spectrum_buffer_caches_count(struct spectrum_buffer_pool *buffer_pool)
+{
+	unsigned result = 0;
+	for (struct spectrum_buffer_cache *cache = spectrum_buffer_caches;
+	     cache != NULL;
+	     cache = cache->next) {
+		for (unsigned i = 0; i < SPECTRUM_BUFFER_CACHE_NUM_MAGAZINES; ++i) {
+			struct spectrum_buffer_magazine *magazine = &cache->magazines[i];
+			unsigned binding;
+			struct spectrum_buffer_pool *pool;
+			unsigned num_buffers;
+			do {
+				binding = __atomic_load_n(&magazine->binding, __ATOMIC_SEQ_CST);
+				pool = __atomic_load_n(&magazine->pool, __ATOMIC_SEQ_CST);
+				num_buffers =
+					__atomic_load_n(&magazine->num_buffers, __ATOMIC_SEQ_CST);
+			} while (binding
+			         != __atomic_load_n(&magazine->binding, __ATOMIC_SEQ_CST));
+			if (pool == buffer_pool) result += num_buffers;
+		}
+	}
+	return result;
+}
+
+static void
+spectrum_buffer_pool_unref_n(struct spectrum_buffer_pool *buffer_pool,
+                             unsigned n)
+{
+	/* a pool's owner holds a reference until it retires the pool, so no
+	 * reference released before then is the last */
+	int refcount = __atomic_load_n(&buffer_pool->refcount, __ATOMIC_RELAXED);
+	while (G_LIKELY(!(refcount & SPECTRUM_BUFFER_POOL_RETIRED))) {
+		if (__atomic_compare_exchange_n(
+			    &buffer_pool->refcount, &refcount, refcount - n, true,
+			    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			return;
+	}
+
+	G_LOCK(spectrum_buffer_caches);
+	refcount = __atomic_sub_fetch(&buffer_pool->refcount, n, __ATOMIC_SEQ_CST)
+		& ~SPECTRUM_BUFFER_POOL_RETIRED;
+	if (buffer_pool->pool != NULL
+	    && refcount == spectrum_buffer_caches_count(buffer_pool)) {
+		buffer_pool_free(buffer_pool->pool);
+		buffer_pool->pool = NULL;
+	}
+	G_UNLOCK(spectrum_buffer_caches);
+	if (refcount == 0) g_free(buffer_pool);
+}
+
 void
 spectrum_buffer_pool_unref(struct spectrum_buffer_pool *buffer_pool)
 {
-	if (g_atomic_int_dec_and_test(&buffer_pool->refcount)) {
-		buffer_pool_free(buffer_pool->pool);
-		g_free(buffer_pool);
+	spectrum_buffer_pool_unref_n(buffer_pool, 1);
+}
+
+static void
+spectrum_buffer_magazine_unbind(struct spectrum_buffer_magazine *magazine)
+{
+	__atomic_store_n(&magazine->pool, NULL, __ATOMIC_RELAXED);
+}
+
+static void
+spectrum_buffer_magazine_flush(struct spectrum_buffer_magazine *magazine,
+                               unsigned n)
+{
+	struct spectrum_buffer_pool *buffer_pool = magazine->pool;
+	unsigned num_buffers = magazine->num_buffers - n;
+	/* the buffers must no longer be counted as cached by the time the pool is
+	 * found not to be retired, as the pool's memory may be freed as soon as
+	 * only cached buffers remain; those of a retired pool are simply
+	 * dropped */
+	__atomic_store_n(&magazine->num_buffers, num_buffers, __ATOMIC_SEQ_CST);
+	if (G_LIKELY(!spectrum_buffer_pool_is_retired(buffer_pool))) {
+		buffer_pool_count_pushed(buffer_pool->pool, n);
+		buffer_pool_push_n(buffer_pool->pool, magazine->buffers + num_buffers,
+		                   n);
 	}
+	if (num_buffers == 0) spectrum_buffer_magazine_unbind(magazine);
+	spectrum_buffer_pool_unref_n(buffer_pool, n);
 }
 
-void *
-spectrum_buffer_pool_pop(struct spectrum_buffer_pool *buffer_pool)
+static void
+spectrum_buffer_cache_flush_retired(struct spectrum_buffer_cache *cache)
 {
-	spectrum_buffer_pool_ref(buffer_pool);
-	void *result = buffer_pool_pop(buffer_pool->pool);
-	if (result == NULL) spectrum_buffer_pool_unref(buffer_pool);
+	for (unsigned i = 0; i < SPECTRUM_BUFFER_CACHE_NUM_MAGAZINES; ++i) {
+		struct spectrum_buffer_magazine *magazine = &cache->magazines[i];
+		if (magazine->pool != NULL
+		    && spectrum_buffer_pool_is_retired(magazine->pool))
+			spectrum_buffer_magazine_flush(magazine, magazine->num_buffers);
+	}
+}
+
+static struct spectrum_buffer_cache *
+spectrum_buffer_cache_new(void)
+{
+	struct spectrum_buffer_cache *result =
+		g_new0(struct spectrum_buffer_cache, 1);
+	result->retire_epoch = __atomic_load_n(&spectrum_buffer_pool_retire_epoch,
+	                                       __ATOMIC_ACQUIRE);
+	G_LOCK(spectrum_buffer_caches);
+	result->next = spectrum_buffer_caches;
+	spectrum_buffer_caches = result;
+	G_UNLOCK(spectrum_buffer_caches);
+	PRIVATE_SET(spectrum_buffer_cache_key, result,
+	            (GDestroyNotify)spectrum_buffer_cache_free);
+	return result;
+}
+
+static void
+spectrum_buffer_cache_free(struct spectrum_buffer_cache *cache)
+{
+	for (unsigned i = 0; i < SPECTRUM_BUFFER_CACHE_NUM_MAGAZINES; ++i) {
+		struct spectrum_buffer_magazine *magazine = &cache->magazines[i];
+		if (magazine->pool != NULL)
+			spectrum_buffer_magazine_flush(magazine, magazine->num_buffers);
+	}
+	G_LOCK(spectrum_buffer_caches);
+	struct spectrum_buffer_cache **link = &spectrum_buffer_caches;
+	while (*link != cache) link = &(*link)->next;
+	*link = cache->next;
+	G_UNLOCK(spectrum_buffer_caches);
+	for (unsigned i = 0; i < SPECTRUM_BUFFER_CACHE_NUM_MAGAZINES; ++i)
+		g_free(cache->magazines[i].buffers);
+	g_free(cache);
+}
+
+static struct spectrum_buffer_magazine *
+spectrum_buffer_magazine_get(struct spectrum_buffer_pool *buffer_pool,
+                             bool bind)
+{
+	struct spectrum_buffer_cache *cache =
+		PRIVATE_GET(spectrum_buffer_cache_key);
+	if (G_UNLIKELY(cache == NULL)) {
+		if (!bind) return NULL;
+		cache = spectrum_buffer_cache_new();
+	}
+	unsigned retire_epoch =
+		__atomic_load_n(&spectrum_buffer_pool_retire_epoch, __ATOMIC_ACQUIRE);
+	if (G_UNLIKELY(cache->retire_epoch != retire_epoch)) {
+		cache->retire_epoch = retire_epoch;
+		spectrum_buffer_cache_flush_retired(cache);
+	}
+	struct spectrum_buffer_magazine *empty = NULL;
+	for (unsigned i = 0; i < SPECTRUM_BUFFER_CACHE_NUM_MAGAZINES; ++i) {
+		struct spectrum_buffer_magazine *magazine = &cache->magazines[i];
+		if (magazine->pool == buffer_pool)
+			return magazine;
+		if (empty == NULL && magazine->pool == NULL)
+			empty = magazine;
+	}
+	if (!bind || empty == NULL) return NULL;
+	if (G_UNLIKELY(empty->capacity != buffer_pool->magazine_size)) {
+		empty->capacity = buffer_pool->magazine_size;
+		empty->buffers = g_renew(void *, empty->buffers, empty->capacity);
+	}
+	__atomic_store_n(&empty->binding, empty->binding + 1, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&empty->num_buffers, 0, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&empty->pool, buffer_pool, __ATOMIC_SEQ_CST);
+	empty->shrink_request = 0;
+	return empty;
+}
+
+/* While the spectrum_reader thread is waiting to release the last chunk of a
+ * pool, buffers in that chunk are returned to the pool directly, and each
+ * magazine bound to the pool is flushed once for every attempt to release the
+ * chunk, so that no buffer of the chunk stays cached in a thread that only
+ * returns buffers. */
+static struct spectrum_buffer_magazine *
+spectrum_buffer_magazine_get_shrinking(
+	struct spectrum_buffer_pool *buffer_pool, void *buffer,
+	unsigned shrink_request)
+{
+	struct spectrum_buffer_magazine *result =
+		spectrum_buffer_magazine_get(buffer_pool, false);
+	if (result != NULL && result->shrink_request != shrink_request)
+		spectrum_buffer_magazine_flush(result, result->num_buffers);
+	struct buffer_pool *pool = buffer_pool->pool;
+	if (buffer_pool_chunk_index(pool, buffer) + 1
+	    >= __atomic_load_n(&pool->num_chunks, __ATOMIC_RELAXED))
+		return NULL;
+	result = spectrum_buffer_magazine_get(buffer_pool, true);
+	if (result != NULL) result->shrink_request = shrink_request;
 	return result;
 }
 
 void
-spectrum_buffer_pool_push(struct spectrum_buffer_pool *buffer_pool,
-                          void *buffer)
+spectrum_buffer_cache_flush(struct spectrum_buffer_pool *buffer_pool)
 {
-	buffer_pool_push(buffer_pool->pool, buffer);
+	struct spectrum_buffer_magazine *magazine =
+		spectrum_buffer_magazine_get(buffer_pool, false);
+	if (magazine != NULL)
+		spectrum_buffer_magazine_flush(magazine, magazine->num_buffers);
+}
+
+void
+spectrum_buffer_pool_retire(struct spectrum_buffer_pool *buffer_pool)
+{
+	/* buffers cached by the calling thread are dropped immediately; those
+	 * cached by other threads are dropped when those threads next use any
+	 * spectrum buffer pool, or exit, but the pool's memory is freed as soon as
+	 * no other buffers remain in use */
+	__atomic_fetch_or(&buffer_pool->refcount, SPECTRUM_BUFFER_POOL_RETIRED,
+	                  __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&spectrum_buffer_pool_retire_epoch, 1,
+	                   __ATOMIC_RELEASE);
+	spectrum_buffer_cache_flush(buffer_pool);
 	spectrum_buffer_pool_unref(buffer_pool);
 }
 
-int
-compare_pool_buffer_sizes(const void *a, const void *b, void *unused)
+void *
+spectrum_buffer_pool_pop(struct spectrum_buffer_pool *buffer_pool)
+{
+	struct spectrum_buffer_magazine *magazine =
+		((buffer_pool->magazine_size > 0)
+		 ? spectrum_buffer_magazine_get(buffer_pool, true)
+		 : NULL);
+	if (G_UNLIKELY(magazine == NULL)) {
+		spectrum_buffer_pool_ref(buffer_pool);
+		void *result = buffer_pool_pop(buffer_pool->pool);
+		if (result != NULL)
+			buffer_pool_count_popped(buffer_pool->pool, 1);
+		else
+			spectrum_buffer_pool_unref(buffer_pool);
+		return result;
+	}
+
+	if (magazine->num_buffers == 0) {
+		unsigned n = buffer_pool_pop_n(
+			buffer_pool->pool, magazine->buffers, (magazine->capacity + 1) / 2);
+		if (G_UNLIKELY(n == 0)) {
+			spectrum_buffer_magazine_unbind(magazine);
+			return NULL;
+		}
+		buffer_pool_count_popped(buffer_pool->pool, n);
+		__atomic_add_fetch(&buffer_pool->refcount, n, __ATOMIC_RELAXED);
+		__atomic_store_n(&magazine->num_buffers, n, __ATOMIC_RELAXED);
+	}
+	unsigned num_buffers = magazine->num_buffers - 1;
+	__atomic_store_n(&magazine->num_buffers, num_buffers, __ATOMIC_RELAXED);
+	if (num_buffers == 0) spectrum_buffer_magazine_unbind(magazine);
+	return magazine->buffers[num_buffers];
+}
+
+void
+spectrum_buffer_pool_push(struct spectrum_buffer_pool *buffer_pool,
+                          void *buffer)
 {
-	const struct spectrum_buffer_pool *pa = a;
-	const struct spectrum_buffer_pool *pb = b;
-	return ((pa->pool->buffer_size < pb->pool->buffer_size)
-	        ? -1
-	        : ((pa->pool->buffer_size > pb->pool->buffer_size) ? 1 : 0));
+	struct spectrum_buffer_magazine *magazine = NULL;
+	if (buffer_pool->magazine_size > 0) {
+		unsigned shrink_request =
+			__atomic_load_n(&buffer_pool->shrink_request, __ATOMIC_RELAXED);
+		if (G_UNLIKELY(spectrum_buffer_pool_is_retired(buffer_pool)))
+			spectrum_buffer_cache_flush(buffer_pool);
+		else if (G_UNLIKELY(shrink_request != 0))
+			magazine = spectrum_buffer_magazine_get_shrinking(
+				buffer_pool, buffer, shrink_request);
+		else
+			magazine = spectrum_buffer_magazine_get(buffer_pool, true);
+	}
+	if (G_UNLIKELY(magazine == NULL)) {
+		buffer_pool_count_pushed(buffer_pool->pool, 1);
+		buffer_pool_push(buffer_pool->pool, buffer);
+		spectrum_buffer_pool_unref(buffer_pool);
+		return;
+	}
+
+	/* the buffer's pool reference is transferred to the magazine */
+	if (magazine->num_buffers == magazine->capacity)
+		spectrum_buffer_magazine_flush(magazine, (magazine->capacity + 1) / 2);
+	magazine->buffers[magazine->num_buffers] = buffer;
+	__atomic_store_n(&magazine->num_buffers, magazine->num_buffers + 1,
+	                 __ATOMIC_RELAXED);
 }
 
 spectrum_buffer_pool_collection
 spectrum_buffer_pool_collection_new(void)
 {
-	return g_sequence_new((GDestroyNotify)spectrum_buffer_pool_unref);
+	return g_new0(struct spectrum_buffer_pool *,
+	              SPECTRUM_BUFFER_NUM_SIZE_CLASSES);
 }
 
 void
 spectrum_buffer_pool_collection_free(
 	spectrum_buffer_pool_collection collection)
 {
-	g_sequence_free(collection);
+	for (unsigned i = 0; i < SPECTRUM_BUFFER_NUM_SIZE_CLASSES; ++i)
+		if (collection[i] != NULL)
+			spectrum_buffer_pool_retire(collection[i]);
+	g_free(collection);
 }
 
 struct spectrum_buffer_pool *
 spectrum_buffer_pool_collection_add(
 	spectrum_buffer_pool_collection collection,
 	size_t buffer_size,
-	size_t num_buffers)
-{
+	size_t alignment,
+	size_t pool_size,
+	unsigned max_chunks,
+	unsigned magazine_size,
+	size_t huge_page_size)
+{
+	int size_class = spectrum_buffer_size_class(buffer_size);
+	g_assert(size_class >= 0 && collection[size_class] == NULL);
+	size_t class_buffer_size =
+		1 << (size_class + SPECTRUM_BUFFER_MIN_SIZE_CLASS_LOG2);
 	struct spectrum_buffer_pool *pool =
-		spectrum_buffer_pool_new(buffer_size, num_buffers);
-	g_sequence_insert_sorted(collection, pool, compare_pool_buffer_sizes, NULL);
+		spectrum_buffer_pool_new(
+			class_buffer_size, alignment,
+			MAX(pool_size / MAX(class_buffer_size, alignment), 1),
+			max_chunks, magazine_size, huge_page_size);
+	/* pool must be complete before it is visible to lock-free lookups */
+	__atomic_store_n(&collection[size_class], pool, __ATOMIC_RELEASE);
 	return pool;
 }
 
-GSequenceIter *
-spectrum_buffer_pool_collection_lookup_iter(
-	spectrum_buffer_pool_collection collection, size_t buffer_size)
-{
-	struct buffer_pool b = {
-		.buffer_size = buffer_size
-	};
-	struct spectrum_buffer_pool s = {
-		.pool = &b
-	};
-	return g_sequence_lookup(
-		collection, &s, (GCompareDataFunc)compare_pool_buffer_sizes, NULL);
-}
-
 struct spectrum_buffer_pool *
 spectrum_buffer_pool_collection_lookup(
 	spectrum_buffer_pool_collection collection, size_t buffer_size)
 {
-	GSequenceIter *iter =
-		spectrum_buffer_pool_collection_lookup_iter(
-			collection, buffer_size);
-	return ((iter == NULL) ? NULL : g_sequence_get(iter));
-}
-
-void
-spectrum_buffer_pool_collection_remove(
-	spectrum_buffer_pool_collection collection, size_t buffer_size)
-{
-	GSequenceIter *iter =
-		spectrum_buffer_pool_collection_lookup_iter(
-			collection, buffer_size);
-	if (iter != NULL) g_sequence_remove(iter);
+	int size_class = spectrum_buffer_size_class(buffer_size);
+	return ((size_class >= 0)
+	        ? __atomic_load_n(&collection[size_class], __ATOMIC_ACQUIRE)
+	        : NULL);
 }
 
 void *
 new_valid_buffer_from_collection(vysmaw_handle handle, size_t buffer_size,
                                  pool_id_t *pool_id)
 {
-	MUTEX_LOCK(handle->pool_collection_mtx);
 	struct spectrum_buffer_pool *pool =
 		spectrum_buffer_pool_collection_lookup(
 			handle->pool_collection, buffer_size);
 	if (G_UNLIKELY(pool == NULL)) {
-		size_t num_buffers =
-			handle->config.spectrum_buffer_pool_size / buffer_size;
-		pool = spectrum_buffer_pool_collection_add(
-			handle->pool_collection, buffer_size, num_buffers);
+		if (spectrum_buffer_size_class(buffer_size) < 0) {
+			*pool_id = NULL;
+			return NULL;
+		}
+		MUTEX_LOCK(handle->pool_collection_mtx);
+		pool = spectrum_buffer_pool_collection_lookup(
+			handle->pool_collection, buffer_size);
+		if (pool == NULL) {
+			pool = spectrum_buffer_pool_collection_add(
+				handle->pool_collection, buffer_size,
+				handle->config.spectrum_buffer_alignment,
+				handle->config.spectrum_buffer_pool_size,
+				spectrum_buffer_pool_max_chunks(&handle->config),
+				handle->config.spectrum_buffer_magazine_size,
+				handle->config.buffer_pool_huge_page_size);
+			if (handle->numa_node >= 0)
+				numa_bind_memory(
+					pool->pool->pool,
+					pool->pool->num_buffers * pool->pool->buffer_size,
+					handle->numa_node);
+		}
+		MUTEX_UNLOCK(handle->pool_collection_mtx);
 	}
-	void *result = spectrum_buffer_pool_pop(pool);
-	MUTEX_UNLOCK(handle->pool_collection_mtx);
 	*pool_id = pool;
+	void *result = spectrum_buffer_pool_pop(pool);
+	if (G_UNLIKELY(result == NULL))
+		spectrum_buffer_pool_starved(handle, pool);
 	return result;
 }
 
@@ -552,50 +1267,434 @@ new_valid_buffer_from_pool(vysmaw_handle handle, size_t buffer_size,
 {
 	void *buffer = NULL;
 	struct spectrum_buffer_pool *pool = handle->pool;
-	if (buffer_size <= pool->pool->buffer_size)
+	if (buffer_size <= handle->config.max_spectrum_buffer_size) {
 		buffer = spectrum_buffer_pool_pop(pool);
+		if (G_UNLIKELY(buffer == NULL))
+			spectrum_buffer_pool_starved(handle, pool);
+	}
 	*pool_id = pool;
 	return buffer;
 }
 
+/* ring capacity needed to hold a full queue, plus an overflow message and the
+ * end message */
+unsigned
+message_queue_capacity(const struct vysmaw_configuration *config)
+{
+	unsigned result = 2;
+	while (result < config->max_depth_message_queue + 2
+	       && result < (1U << 31))
+		result <<= 1;
+	return result;
+}
+
 void
-message_queue_force_push_one_unlocked(struct vysmaw_message *msg,
-                                      vysmaw_message_queue queue)
+message_queue_force_push_one(struct vysmaw_message *msg,
+                             vysmaw_message_queue queue)
 {
 	/* messages on the queue maintain a reference to the queue to facilitate
 	 * automatic queue reclamation */
 	message_queue_ref(queue);
-	queue->depth++;
-	g_async_queue_push_unlocked(queue->q, msg);
+	g_assert(queue->pending_tail
+	         - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)
+	         <= queue->mask);
+	queue->ring[queue->pending_tail & queue->mask] = msg;
+	if (queue->age_times != NULL) {
+		/* only valid buffer messages expire */
+		gint64 t = G_MAXINT64;
+		if (msg->typ == VYSMAW_MESSAGE_VALID_BUFFER)
+			t = ((queue->message_age_reference == VYSMAW_AGE_FROM_TIMESTAMP)
+			     ? (gint64)(msg->content.valid_buffer.info.timestamp / 1000)
+			     : g_get_monotonic_time());
+		__atomic_store_n(&queue->age_times[queue->pending_tail & queue->mask],
+		                 t, __ATOMIC_RELAXED);
+	}
+	queue->pending_tail++;
+}
+
+/* Wake the consumer, if it is parked. Must follow a sequentially consistent
+ * fence, which pairs with the fence in message_queue_park(): either the
+ * consumer sees the producer's updates after parking, or the producer sees
+ * that it has parked. */
+static void
+message_queue_wake(vysmaw_message_queue queue)
+{
+	if (__atomic_load_n(&queue->parked, __ATOMIC_RELAXED)
+	    && __atomic_exchange_n(&queue->parked, false, __ATOMIC_ACQ_REL)) {
+		int fd = __atomic_load_n(&queue->fd, __ATOMIC_ACQUIRE);
+		if (fd >= 0) {
+			eventfd_t u = 1;
+			while (write(fd, &u, sizeof(u)) < 0 && errno == EINTR);
+		}
+		MUTEX_LOCK(queue->mtx);
+		COND_SIGNAL(queue->cond);
+		MUTEX_UNLOCK(queue->mtx);
+	}
 }
 
 void
-message_queue_push_one_unlocked(struct vysmaw_message *msg,
-                                struct consumer *consumer)
+message_queue_publish(vysmaw_message_queue queue)
 {
-	/* adjust max depth to accommodate overhead */
-	unsigned max_depth;
-	if (G_LIKELY(msg->typ != VYSMAW_MESSAGE_END)) {
-		max_depth = msg->handle->config.max_depth_message_queue;
-		if (consumer->queue.num_overflow > 0)
-			max_depth -= msg->handle->config.queue_resume_overhead + 1;
+	if (queue->pending_tail == queue->tail) return;
+	__atomic_store_n(&queue->tail, queue->pending_tail, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	message_queue_wake(queue);
+}
+
+/* Current time in the clock of a queue's message age reference, in
+ * microseconds. */
+static gint64
+message_age_now(vysmaw_message_queue queue)
+{
+	return ((queue->message_age_reference == VYSMAW_AGE_FROM_TIMESTAMP)
+	        ? g_get_real_time()
+	        : g_get_monotonic_time());
+}
+
+/* Test whether the message at ring position 'pos' is older than the queue's
+ * maximum message age at time 'now'. As both sides of a queue with a maximum
+ * message age may remove messages, the message itself is not read, since
+ * until the caller has claimed the position, the other side may have released
+ * it; should that happen, the result is meaningless, but the caller's claim
+ * then fails. */
+static inline bool
+message_expired(vysmaw_message_queue queue, guint64 pos, gint64 now)
+{
+	gint64 t =
+		__atomic_load_n(&queue->age_times[pos & queue->mask], __ATOMIC_RELAXED);
+	return now - t > queue->max_message_age;
+}
+
+/* Release expired messages that have been removed from a queue, and record
+ * them for the next VYSMAW_MESSAGE_EXPIRED message. */
+static void
+message_queue_discard_expired(vysmaw_message_queue queue,
+                              struct vysmaw_message **msgs, unsigned n)
+{
+	if (n == 0) return;
+	for (unsigned i = 0; i < n; ++i)
+		vysmaw_message_unref(msgs[i]);
+	__atomic_add_fetch(&queue->num_expired, n, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&queue->num_expired_unreported, n, __ATOMIC_RELEASE);
+	message_queue_unref_n(queue, n);
+}
+
+/* Remove the run of expired messages at the head of a queue on behalf of the
+ * producer, returning the number removed. Like
+ * message_queue_drop_oldest(), this races with the consumer. */
+static unsigned
+message_queue_expire(vysmaw_message_queue queue)
+{
+	gint64 now = message_age_now(queue);
+	unsigned result = 0;
+	guint64 head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+	while (head != queue->tail) {
+		if (!message_expired(queue, head, now)) break;
+		struct vysmaw_message *msg = queue->ring[head & queue->mask];
+		if (__atomic_compare_exchange_n(
+			    &queue->head, &head, head + 1, false,
+			    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			message_queue_discard_expired(queue, &msg, 1);
+			++head;
+			++result;
+		}
+	}
+	if (result > 0) {
+		/* the consumer may be parked on a queue emptied by expiry, and must
+		 * be woken to report it */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		message_queue_wake(queue);
+	}
+	return result;
+}
+
+/* Remove the oldest published message from a queue on behalf of the producer,
+ * returning false if there is none. This races with the consumer, which is
+ * why a queue with the VYSMAW_OVERFLOW_DROP_OLDEST policy (or a maximum
+ * message age) is popped with a compare-and-swap. */
+static bool
+message_queue_drop_oldest(vysmaw_message_queue queue)
+{
+	struct vysmaw_message *oldest;
+	guint64 head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+	do {
+		if (head == queue->tail) return false;
+		oldest = queue->ring[head & queue->mask];
+	} while (!__atomic_compare_exchange_n(
+		         &queue->head, &head, head + 1, false,
+		         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	/* don't lose the count of an overflow message */
+	if (oldest->typ == VYSMAW_MESSAGE_QUEUE_OVERFLOW) {
+		queue->num_overflow += oldest->content.num_overflow;
 	} else {
-		max_depth = UINT_MAX;
+		queue->num_overflow++;
+		__atomic_add_fetch(&queue->num_dropped_oldest, 1, __ATOMIC_RELAXED);
+	}
+	vysmaw_message_unref(oldest);
+	message_queue_unref(queue);
+	return true;
+}
+
+static void
+message_queue_drop(vysmaw_message_queue queue, struct vysmaw_message *msg,
+                   guint64 *counter)
+{
+	queue->num_overflow++;
+	__atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+	vysmaw_message_unref(msg);
+}
+
+/* Pass a spectrum message to a consumer's callback, timing the call. */
+static void
+message_queue_call(vysmaw_message_queue queue, struct vysmaw_message *msg)
+{
+	gint64 start = g_get_monotonic_time();
+	queue->callback(msg, queue->callback_data);
+	guint64 elapsed = g_get_monotonic_time() - start;
+	if (G_UNLIKELY(elapsed > queue->max_callback_time))
+		__atomic_store_n(&queue->max_callback_time, elapsed, __ATOMIC_RELAXED);
+	if (G_UNLIKELY(queue->callback_time_limit > 0
+	               && elapsed > (guint64)queue->callback_time_limit))
+		__atomic_add_fetch(&queue->num_callback_overruns, 1,
+		                   __ATOMIC_RELAXED);
+}
+
+void
+message_queue_push_one(struct vysmaw_message *msg, struct consumer *consumer)
+{
+	vysmaw_message_queue queue = &consumer->queue;
+	if (queue->callback != NULL
+	    && (msg->typ == VYSMAW_MESSAGE_VALID_BUFFER
+	        || msg->typ == VYSMAW_MESSAGE_SPECTRA_BATCH
+	        || msg->typ == VYSMAW_MESSAGE_DIGEST_FAILURE
+	        || msg->typ == VYSMAW_MESSAGE_RDMA_READ_FAILURE)) {
+		message_queue_call(queue, msg);
+		return;
+	}
+	const struct vysmaw_configuration *config = &msg->handle->config;
+
+	/* after an overflow, messages are again queued, and the overflow is
+	 * reported, only once the queue has room for the resumption overhead */
+	unsigned max_depth = config->max_depth_message_queue;
+	unsigned overhead = MIN(config->queue_resume_overhead + 1, max_depth);
+
+	guint64 depth = queue->pending_tail
+		- __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+	if (G_LIKELY(msg->typ != VYSMAW_MESSAGE_END)) {
+		/* make room by discarding expired messages before any message is
+		 * dropped */
+		if (queue->max_message_age > 0 && depth + overhead >= max_depth)
+			depth -= message_queue_expire(queue);
+		if (depth >= max_depth) {
+			if (queue->overflow_policy != VYSMAW_OVERFLOW_DROP_OLDEST
+			    || !message_queue_drop_oldest(queue)) {
+				message_queue_drop(queue, msg, &queue->num_dropped_newest);
+				return;
+			}
+			--depth;
+		} else if (depth + overhead >= max_depth) {
+			switch (queue->overflow_policy) {
+			case VYSMAW_OVERFLOW_SAMPLE:
+				if (++queue->sample_count < queue->sample_interval) {
+					message_queue_drop(queue, msg, &queue->num_sampled_out);
+					return;
+				}
+				queue->sample_count = 0;
+				break;
+
+			case VYSMAW_OVERFLOW_DROP_OLDEST:
+				break;
+
+			default:
+				if (queue->num_overflow > 0) {
+					message_queue_drop(queue, msg, &queue->num_dropped_newest);
+					return;
+				}
+				break;
+			}
+		}
 	}
 
-	if (consumer->queue.depth < max_depth) {
-		if (consumer->queue.num_overflow > 0) {
-			struct vysmaw_message *overflow_msg =
-				queue_overflow_message_new(
-					msg->handle, consumer->queue.num_overflow);
-			message_queue_force_push_one_unlocked(
-				overflow_msg, &consumer->queue);
-			consumer->queue.num_overflow = 0;
+	if (queue->num_overflow > 0
+	    && (msg->typ == VYSMAW_MESSAGE_END || depth + overhead < max_depth)) {
+		struct vysmaw_message *overflow_msg =
+			queue_overflow_message_new(msg->handle, queue->num_overflow);
+		message_queue_force_push_one(overflow_msg, queue);
+		queue->num_overflow = 0;
+	}
+	message_queue_force_push_one(msg, queue);
+}
+
+/* Test whether a queue has neither messages nor unreported expiries. */
+static bool
+message_queue_is_empty(vysmaw_message_queue queue)
+{
+	return __atomic_load_n(&queue->head, __ATOMIC_RELAXED)
+		== __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE)
+		&& __atomic_load_n(&queue->num_expired_unreported,
+		                   __ATOMIC_ACQUIRE) == 0;
+}
+
+/* Request a wakeup from the producer, and return true iff the queue is
+ * empty. */
+static bool
+message_queue_park(vysmaw_message_queue queue)
+{
+	__atomic_store_n(&queue->parked, true, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return message_queue_is_empty(queue);
+}
+
+/* Take up to 'max' messages from the head of a queue. Unexpired messages are
+ * returned at the front of 'msgs', with their number as the result; the
+ * '*num_expired' expired messages follow them. */
+static unsigned
+take_batch(vysmaw_message_queue queue, struct vysmaw_message **msgs,
+           unsigned max, unsigned *num_expired)
+{
+	gint64 now = (queue->max_message_age > 0) ? message_age_now(queue) : 0;
+	guint64 head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+	unsigned n, result;
+	for (;;) {
+		n = MIN(__atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) - head, max);
+		result = 0;
+		for (unsigned i = 0; i < n; ++i) {
+			struct vysmaw_message *msg = queue->ring[(head + i) & queue->mask];
+			if (now > 0 && message_expired(queue, head + i, now))
+				msgs[n - 1 - (i - result)] = msg;
+			else
+				msgs[result++] = msg;
 		}
-		message_queue_force_push_one_unlocked(msg, &consumer->queue);
-	} else {
-		consumer->queue.num_overflow++;
+		if (!queue->shared_head) {
+			__atomic_store_n(&queue->head, head + n, __ATOMIC_RELEASE);
+			break;
+		}
+		/* the producer may have dropped or expired the oldest message */
+		if (n == 0
+		    || __atomic_compare_exchange_n(
+			    &queue->head, &head, head + n, false,
+			    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			break;
+	}
+	*num_expired = n - result;
+	return result;
+}
+
+/* Take up to 'max' unexpired messages from the head of a queue, discarding
+ * expired messages. Any expiries not yet reported are reported by a
+ * VYSMAW_MESSAGE_EXPIRED message, which precedes the unexpired messages when
+ * there is room for both. */
+static unsigned
+take_unexpired_batch(vysmaw_message_queue queue, struct vysmaw_message **msgs,
+                     unsigned max)
+{
+	unsigned result, num_expired;
+	if (queue->max_message_age == 0 || max == 0)
+		return take_batch(queue, msgs, max, &num_expired);
+
+	/* reserve the first slot for the report, unless that leaves no room */
+	unsigned reserve = (max > 1) ? 1 : 0;
+	do {
+		result =
+			take_batch(queue, msgs + reserve, max - reserve, &num_expired);
+		message_queue_discard_expired(
+			queue, msgs + reserve + result, num_expired);
+	} while (result == 0 && num_expired > 0 && reserve > 0);
+
+	if ((reserve > 0 || result == 0)
+	    && __atomic_load_n(&queue->num_expired_unreported,
+	                       __ATOMIC_ACQUIRE) > 0) {
+		unsigned num_unreported = __atomic_exchange_n(
+			&queue->num_expired_unreported, 0, __ATOMIC_ACQ_REL);
+		/* like every queued message, the report holds a queue reference */
+		msgs[0] = expired_message_new(queue->handle, num_unreported);
+		message_queue_ref(queue);
+		++result;
+	} else if (reserve > 0 && result > 0) {
+		memmove(msgs, msgs + 1, result * sizeof(*msgs));
+	}
+	return result;
+}
+
+void
+message_queue_get_status(vysmaw_message_queue queue,
+                         struct vysmaw_message_queue_status *status)
+{
+	guint64 head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+	status->depth = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) - head;
+	status->num_dropped_newest =
+		__atomic_load_n(&queue->num_dropped_newest, __ATOMIC_RELAXED);
+	status->num_dropped_oldest =
+		__atomic_load_n(&queue->num_dropped_oldest, __ATOMIC_RELAXED);
+	status->num_sampled_out =
+		__atomic_load_n(&queue->num_sampled_out, __ATOMIC_RELAXED);
+	status->num_expired =
+		__atomic_load_n(&queue->num_expired, __ATOMIC_RELAXED);
+	status->num_callback_overruns =
+		__atomic_load_n(&queue->num_callback_overruns, __ATOMIC_RELAXED);
+	status->max_callback_time =
+		__atomic_load_n(&queue->max_callback_time, __ATOMIC_RELAXED);
+}
+
+unsigned
+message_queue_try_pop_batch(vysmaw_message_queue queue,
+                            struct vysmaw_message **msgs, unsigned max)
+{
+	unsigned result = take_unexpired_batch(queue, msgs, max);
+	if (result == 0 && max > 0 && queue->fd >= 0) {
+		/* queue is empty: reset the eventfd, and park, so that the producer
+		 * signals the eventfd when it next publishes messages */
+		eventfd_t u;
+		while (read(queue->fd, &u, sizeof(u)) < 0 && errno == EINTR);
+		if (!message_queue_park(queue))
+			result = take_unexpired_batch(queue, msgs, max);
+	}
+	return result;
+}
+
+int
+message_queue_fd(vysmaw_message_queue queue)
+{
+	if (queue->fd < 0) {
+		/* the eventfd starts out readable, since messages may already be
+		 * queued; it is reset when the consumer finds the queue empty */
+		int fd = eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (fd >= 0)
+			__atomic_store_n(&queue->fd, fd, __ATOMIC_RELEASE);
 	}
+	return queue->fd;
+}
+
+struct vysmaw_message *
+message_queue_try_pop(vysmaw_message_queue queue)
+{
+	struct vysmaw_message *result;
+	return ((message_queue_try_pop_batch(queue, &result, 1) > 0)
+	        ? result
+	        : NULL);
+}
+
+/* Wait until queue is not empty, or until monotonic time 'end_time' (in
+ * microseconds) if that is non-negative. Returns true iff queue is not
+ * empty. */
+bool
+message_queue_wait(vysmaw_message_queue queue, gint64 end_time)
+{
+	bool result;
+	MUTEX_LOCK(queue->mtx);
+	for (;;) {
+		result = !message_queue_park(queue);
+		if (result) break;
+		if (end_time < 0) {
+			COND_WAIT(queue->cond, queue->mtx);
+		} else if (!COND_WAIT_UNTIL(queue->cond, queue->mtx, end_time)) {
+			result = !message_queue_is_empty(queue);
+			break;
+		}
+	}
+	__atomic_store_n(&queue->parked, false, __ATOMIC_RELAXED);
+	MUTEX_UNLOCK(queue->mtx);
+	return result;
 }
 
 void
@@ -617,20 +1716,28 @@ get_shutdown_parameters(vysmaw_handle handle, bool *in_shutdown,
 	MUTEX_UNLOCK(handle->mtx);
 }
 
+/* size requested from the pool for the spectrum buffer of a message */
+static size_t
+message_buffer_size(const struct vysmaw_message *message)
+{
+	g_assert(message->typ == VYSMAW_MESSAGE_VALID_BUFFER
+	         || message->typ == VYSMAW_MESSAGE_SPECTRA_BATCH);
+	return ((message->typ == VYSMAW_MESSAGE_VALID_BUFFER)
+	        ? spectrum_size(&message->content.valid_buffer.info)
+	        : message->content.spectra_batch.buffer_size);
+}
+
 struct spectrum_buffer_pool *
 lookup_buffer_pool_from_collection(struct vysmaw_message *message)
 {
-	g_assert(message->typ == VYSMAW_MESSAGE_VALID_BUFFER);
 	return spectrum_buffer_pool_collection_lookup(
-		message->handle->pool_collection,
-		spectrum_size(&message->content.valid_buffer.info));
+		message->handle->pool_collection, message_buffer_size(message));
 }
 
 struct spectrum_buffer_pool *
 lookup_buffer_pool_from_pool(struct vysmaw_message *message)
 {
-	g_assert(message->typ == VYSMAW_MESSAGE_VALID_BUFFER);
-	size_t buffer_size = spectrum_size(&message->content.valid_buffer.info);
+	size_t buffer_size = message_buffer_size(message);
 	return ((buffer_size <= message->handle->pool->pool->buffer_size)
 	        ? message->handle->pool
 	        : NULL);
@@ -639,14 +1746,12 @@ lookup_buffer_pool_from_pool(struct vysmaw_message *message)
 GSList *
 buffer_pool_list_from_collection(vysmaw_handle handle)
 {
-	MUTEX_LOCK(handle->pool_collection_mtx);
-	GSequenceIter *iter = g_sequence_get_begin_iter(handle->pool_collection);
 	GSList *result = NULL;
-	while (!g_sequence_iter_is_end(iter)) {
-		result = g_slist_prepend(result, g_sequence_get(iter));
-		iter = g_sequence_iter_next(iter);
+	for (unsigned i = SPECTRUM_BUFFER_NUM_SIZE_CLASSES; i > 0; --i) {
+		struct spectrum_buffer_pool *pool =
+			__atomic_load_n(&handle->pool_collection[i - 1], __ATOMIC_ACQUIRE);
+		if (pool != NULL) result = g_slist_prepend(result, pool);
 	}
-	MUTEX_UNLOCK(handle->pool_collection_mtx);
 	return result;
 }
 
@@ -657,45 +1762,86 @@ buffer_pool_list_from_pool(vysmaw_handle handle)
 }
 
 void
-init_consumer(vysmaw_spectrum_filter filter, void *user_data,
-              vysmaw_message_queue *queue, GArray *consumers)
-{
-	struct consumer consumer = {
-		.queue = {
-			.q = g_async_queue_new(),
-			.depth = 0,
-			.num_overflow = 0
-		},
-		.spectrum_filter_fn = filter,
-		.pass_filter_array = g_array_new(FALSE, FALSE, sizeof(bool)),
-		.user_data = user_data
-	};
-	g_array_append_val(consumers, consumer);
-	*queue =
-		&((&g_array_index(consumers, struct consumer, consumers->len - 1))
-		  ->queue);
+init_consumer(vysmaw_handle handle, struct vysmaw_consumer *consumer,
+              GArray *consumers)
+{
+	unsigned queue_capacity = message_queue_capacity(&handle->config);
+	unsigned num_shards = MAX(consumer->num_shards, 1);
+	for (unsigned i = 0; i < num_shards; ++i) {
+		/* only the first shard has a filter; the others are selected by
+		 * distribution of the spectra that pass the first shard's filter */
+		struct consumer shard = {
+			.spectrum_filter_fn = (i == 0) ? consumer->filter : NULL,
+			.spectrum_batch_filter_fn =
+			    (i == 0) ? consumer->batch_filter : NULL,
+			.selection =
+			    ((i == 0 && consumer->selection != NULL)
+			     ? g_slice_dup(struct vysmaw_spectrum_selection,
+			                   consumer->selection)
+			     : NULL),
+			.pass_filter_array =
+			    ((i == 0)
+			     ? g_array_new(FALSE, FALSE, sizeof(bool))
+			     : NULL),
+			.user_data = consumer->filter_data,
+			.num_shards = (i == 0) ? num_shards : 0,
+			.shard_distribution = consumer->shard_distribution,
+			.batch_spectra = consumer->batch_spectra
+		};
+		g_array_append_val(consumers, shard);
+		struct consumer *c =
+			&g_array_index(consumers, struct consumer, consumers->len - 1);
+		/* the queue is initialized in place, as its mutex and condition
+		 * variable may not be moved */
+		c->queue.refcount = 1;
+		c->queue.fd = -1;
+		c->queue.handle = handle;
+		c->queue.overflow_policy = consumer->overflow_policy;
+		c->queue.sample_interval = MAX(consumer->overflow_sample_interval, 2);
+		c->queue.max_message_age = MIN(consumer->max_message_age, G_MAXINT64);
+		c->queue.message_age_reference = consumer->message_age_reference;
+		c->queue.callback = consumer->callback;
+		c->queue.callback_data = consumer->callback_data;
+		c->queue.callback_time_limit =
+			MIN(consumer->callback_time_limit, G_MAXINT64);
+		c->queue.shared_head =
+			(c->queue.overflow_policy == VYSMAW_OVERFLOW_DROP_OLDEST
+			 || c->queue.max_message_age > 0);
+		c->queue.mask = queue_capacity - 1;
+		c->queue.ring = g_new(struct vysmaw_message *, queue_capacity);
+		if (c->queue.max_message_age > 0)
+			c->queue.age_times = g_new(gint64, queue_capacity);
+		MUTEX_INIT(c->queue.mtx);
+		COND_INIT(c->queue.cond);
+		if (i == 0) consumer->queue = &c->queue;
+		if (num_shards > 1) consumer->shard_queues[i] = &c->queue;
+	}
 }
 
 void
-init_signal_receiver(vysmaw_handle handle, GAsyncQueue *signal_msg_queue,
+init_signal_receiver(vysmaw_handle handle,
+                     struct async_queue **signal_msg_queue,
                      struct buffer_pool **signal_msg_buffers,
+                     struct data_path_message_ring **data_path_msgs,
                      unsigned *signal_msg_num_spectra, int loop_fd)
 {
 	struct signal_receiver_context *context =
 		g_new0(struct signal_receiver_context, 1);
 	context->handle = handle;
 	context->loop_fd = loop_fd;
-	context->signal_msg_queue = g_async_queue_ref(signal_msg_queue);
 	handle->signal_receiver_thread =
 		THREAD_NEW("signal_receiver", (GThreadFunc)signal_receiver, context);
 	while (!handle->gate.signal_receiver_ready)
 		COND_WAIT(handle->gate.cond, handle->gate.mtx);
+	*signal_msg_queue = context->signal_msg_queue;
 	*signal_msg_buffers = context->signal_msg_buffers;
+	*data_path_msgs = context->data_path_msgs;
 	*signal_msg_num_spectra = context->signal_msg_num_spectra;
 }
 
 void
-init_spectrum_selector(vysmaw_handle handle, GAsyncQueue *signal_msg_queue,
+init_spectrum_selector(vysmaw_handle handle,
+                       struct async_queue *signal_msg_queue,
                        struct async_queue *read_request_queue,
                        struct buffer_pool *signal_msg_buffers,
                        unsigned signal_msg_num_spectra)
@@ -703,7 +1849,7 @@ init_spectrum_selector(vysmaw_handle handle, GAsyncQueue *signal_msg_queue,
 	struct spectrum_selector_context *context =
 		g_new(struct spectrum_selector_context, 1);
 	context->handle = handle;
-	context->signal_msg_queue = g_async_queue_ref(signal_msg_queue);
+	context->signal_msg_queue = async_queue_ref(signal_msg_queue);
 	context->read_request_queue = async_queue_ref(read_request_queue);
 	context->signal_msg_buffers = signal_msg_buffers;
 	context->signal_msg_num_spectra = signal_msg_num_spectra;
@@ -716,6 +1862,7 @@ void
 init_spectrum_reader(vysmaw_handle handle,
                      struct async_queue *read_request_queue,
                      struct buffer_pool *signal_msg_buffers,
+                     struct data_path_message_ring *data_path_msgs,
                      unsigned signal_msg_num_spectra, int loop_fd)
 {
 	struct spectrum_reader_context *context =
@@ -723,6 +1870,7 @@ init_spectrum_reader(vysmaw_handle handle,
 	context->handle = handle;
 	context->loop_fd = loop_fd;
 	context->signal_msg_buffers = signal_msg_buffers;
+	context->data_path_msgs = data_path_msgs;
 	context->signal_msg_num_spectra = signal_msg_num_spectra;
 	context->read_request_queue = async_queue_ref(read_request_queue);
 	handle->spectrum_reader_thread =
@@ -754,26 +1902,83 @@ init_service_threads(vysmaw_handle handle)
 	}
 
 	struct buffer_pool *signal_msg_buffers;
+	struct data_path_message_ring *data_path_msgs;
 	unsigned signal_msg_num_spectra;
-	GAsyncQueue *signal_msg_queue = g_async_queue_new();
-	init_signal_receiver(handle, signal_msg_queue, &signal_msg_buffers,
-	                     &signal_msg_num_spectra, loop_fds[0]);
-
-	struct async_queue *read_request_queue = async_queue_new();
+	struct async_queue *signal_msg_queue;
+	init_signal_receiver(handle, &signal_msg_queue, &signal_msg_buffers,
+	                     &data_path_msgs, &signal_msg_num_spectra, loop_fds[0]);
+	/* the signal message pool is freed with the handle, so that its status
+	 * remains available to clients until then */
+	__atomic_store_n(&handle->signal_msg_buffers, signal_msg_buffers,
+	                 __ATOMIC_RELEASE);
+
+	/* the read request queue has room for a message from every slot of the
+	 * data path message ring, plus the quit and end messages; messages
+	 * allocated from the heap when the ring is exhausted may find it full, in
+	 * which case the spectrum selector blocks until the reader makes room.
+	 * There is no ring when the signal receiver failed to start, and then
+	 * only control messages are queued. */
+	unsigned read_request_queue_capacity =
+		((data_path_msgs != NULL) ? data_path_msgs->num_slots : 0) + 2;
+	struct async_queue *read_request_queue =
+		async_queue_new_sized(read_request_queue_capacity);
 	init_spectrum_selector(handle, signal_msg_queue, read_request_queue,
 	                       signal_msg_buffers, signal_msg_num_spectra);
 
 	init_spectrum_reader(handle, read_request_queue, signal_msg_buffers,
-	                     signal_msg_num_spectra, loop_fds[1]);
+	                     data_path_msgs, signal_msg_num_spectra, loop_fds[1]);
 
 	MUTEX_UNLOCK(handle->gate.mtx);
 
-	g_async_queue_unref(signal_msg_queue);
+	async_queue_unref(signal_msg_queue);
 	async_queue_unref(read_request_queue);
 
 	return 0;
 }
 
+void
+init_shm_client(vysmaw_handle handle)
+{
+	handle->shm = shm_attach(
+		&handle->config,
+		(struct vys_error_record **)&(handle->config.error_record));
+	if (handle->shm != NULL)
+		handle->shm_client_thread =
+			THREAD_NEW("shm_client", (GThreadFunc)shm_client, handle);
+}
+
+void
+init_numa_placement(vysmaw_handle handle, struct ibv_context *verbs)
+{
+	int node = handle->config.numa_node;
+	if (node == -1)
+		node = numa_node_of_rdma_device(verbs);
+	handle->numa_node = MAX(node, -1);
+	if (handle->numa_node < 0) return;
+
+	/* pools that already exist were allocated by the thread that started the
+	 * library, and their pages must be moved; the caller is expected to be a
+	 * service thread */
+	numa_bind_thread(handle->numa_node);
+	GSList *sb_pool_node = handle->list_buffer_pools_fn(handle);
+	while (sb_pool_node != NULL) {
+		struct spectrum_buffer_pool *sb_pool = sb_pool_node->data;
+		/* elastic pools are bound over their entire reservation, so that
+		 * chunks committed later are also placed */
+		numa_bind_memory(sb_pool->pool->pool,
+		                 sb_pool->pool->num_buffers * sb_pool->pool->buffer_size,
+		                 handle->numa_node);
+		sb_pool_node = g_slist_delete_link(sb_pool_node, sb_pool_node);
+	}
+}
+
+void
+numa_bind_service_thread(vysmaw_handle handle)
+{
+	if (handle->numa_node >= 0)
+		numa_bind_thread(handle->numa_node);
+}
+
 struct vysmaw_message *
 message_ref(struct vysmaw_message *message)
 {
@@ -786,7 +1991,7 @@ data_path_message_new(unsigned max_spectra_per_signal)
 {
 	size_t message_size =
 		sizeof(struct data_path_message)
-		+ max_spectra_per_signal * sizeof(GSList *);
+		+ max_spectra_per_signal * sizeof(consumer_mask_t);
 	struct data_path_message *result = g_slice_alloc0(message_size);
 	result->message_size = message_size;
 	return result;
@@ -795,18 +2000,85 @@ data_path_message_new(unsigned max_spectra_per_signal)
 void
 data_path_message_free(struct data_path_message *msg)
 {
-	if (msg->typ == DATA_PATH_SIGNAL_MSG) {
-		size_t consumer_offset = offsetof(struct data_path_message, consumers);
-		GSList **l = (GSList **)((void *)msg + consumer_offset);
-		while (consumer_offset < msg->message_size) {
-			if (*l != NULL) g_slist_free(*l);
-			++l;
-			consumer_offset += sizeof(GSList *);
-		}
-	} else if (msg->typ == DATA_PATH_END) {
+	if (msg->typ == DATA_PATH_END)
 		vys_error_record_free(msg->error_record);
+	if (msg->ring != NULL)
+		__atomic_store_n(&msg->in_use, false, __ATOMIC_RELEASE);
+	else
+		g_slice_free1(msg->message_size, msg);
+}
+
+struct data_path_message_ring *
+data_path_message_ring_new(unsigned num_slots, unsigned max_spectra_per_signal)
+{
+	struct data_path_message_ring *result =
+		g_new(struct data_path_message_ring, 1);
+	/* slots are a whole number of cache lines, so that threads working on
+	 * adjacent messages don't share lines */
+	size_t message_size =
+		sizeof(struct data_path_message)
+		+ max_spectra_per_signal * sizeof(consumer_mask_t);
+	result->slot_size = (message_size + 63) & ~(size_t)63;
+	result->num_slots = MAX(num_slots, 1);
+	result->next = 0;
+	result->max_spectra_per_signal = max_spectra_per_signal;
+	result->slots = g_malloc0_n(result->num_slots, result->slot_size);
+	for (unsigned i = 0; i < result->num_slots; ++i) {
+		struct data_path_message *msg =
+			result->slots + i * result->slot_size;
+		msg->message_size = message_size;
+		msg->ring = result;
+	}
+	return result;
+}
+
+void
+data_path_message_ring_free(struct data_path_message_ring *ring)
+{
+	g_free(ring->slots);
+	g_free(ring);
+}
+
+struct data_path_message *
+data_path_message_ring_next(struct data_path_message_ring *ring)
+{
+	struct data_path_message *result =
+		ring->slots + ring->next * ring->slot_size;
+	if (G_LIKELY(!__atomic_load_n(&result->in_use, __ATOMIC_ACQUIRE))) {
+		result->in_use = true;
+		if (++ring->next == ring->num_slots) ring->next = 0;
+	} else {
+		result = data_path_message_new(ring->max_spectra_per_signal);
+	}
+	return result;
+}
+
+/* Post a VYSMAW_MESSAGE_BUFFER_POOL_PRESSURE message when the fraction of a
+ * pool's buffers in use crosses the configured threshold. This is called by the
+ * spectrum_reader thread every time it takes a buffer, so it only reads the
+ * pool's counters until a message must be posted. */
+static void
+check_spectrum_buffer_pool_pressure(vysmaw_handle handle,
+                                    struct spectrum_buffer_pool *buffer_pool)
+{
+	double threshold = handle->config.spectrum_buffer_pool_pressure_threshold;
+	if (threshold <= 0) return;
+	size_t num_in_use = buffer_pool_num_in_use(buffer_pool->pool);
+	size_t num_buffers = num_in_use + buffer_pool_num_free(buffer_pool->pool);
+	double occupancy = (double)num_in_use / MAX(num_buffers, 1);
+	bool post;
+	if (!buffer_pool->under_pressure)
+		post = (occupancy > threshold);
+	else
+		post = (occupancy
+		        < threshold
+		        - handle->config.spectrum_buffer_pool_pressure_hysteresis);
+	if (G_UNLIKELY(post)) {
+		buffer_pool->under_pressure = !buffer_pool->under_pressure;
+		post_msg(handle,
+		         pool_pressure_message_new(
+			         handle, buffer_pool, buffer_pool->under_pressure));
 	}
-	g_slice_free1(msg->message_size, msg);
 }
 
 struct vysmaw_message *
@@ -816,6 +2088,8 @@ valid_buffer_message_new(vysmaw_handle handle,
 {
 	size_t buffer_size = spectrum_size(info);
 	void *buffer = handle->new_valid_buffer_fn(handle, buffer_size, pool_id);
+	if (*pool_id != NULL)
+		check_spectrum_buffer_pool_pressure(handle, *pool_id);
 	struct vysmaw_message *result = NULL;
 	if (buffer != NULL) {
 		if (handle->num_data_buffers_unavailable > 0)
@@ -830,19 +2104,72 @@ valid_buffer_message_new(vysmaw_handle handle,
 	return result;
 }
 
+struct vysmaw_message *
+spectra_batch_message_new(vysmaw_handle handle, unsigned max_spectra,
+                          size_t stride, pool_id_t *pool_id)
+{
+	size_t buffer_size = spectra_batch_buffer_size(max_spectra, stride);
+	void *buffer = handle->new_valid_buffer_fn(handle, buffer_size, pool_id);
+	if (*pool_id != NULL)
+		check_spectrum_buffer_pool_pressure(handle, *pool_id);
+	struct vysmaw_message *result = NULL;
+	if (buffer != NULL) {
+		if (handle->num_data_buffers_unavailable > 0)
+			post_data_buffer_starvation(handle);
+		result = message_new(handle, VYSMAW_MESSAGE_SPECTRA_BATCH);
+		result->content.spectra_batch.num_spectra = 0;
+		result->content.spectra_batch.infos = buffer + max_spectra * stride;
+		result->content.spectra_batch.offsets =
+			buffer + buffer_size - max_spectra * sizeof(size_t);
+		result->content.spectra_batch.buffer_size = buffer_size;
+		result->content.spectra_batch.buffer = buffer;
+	} else {
+		mark_data_buffer_starvation(handle);
+	}
+	return result;
+}
+
+/* Add a spectrum, already at 'offset' in the buffer, to a batch. */
 void
-message_queues_push(struct vysmaw_message *msg, GSList *consumers)
+spectra_batch_message_append(struct vysmaw_message *message,
+                             const struct vysmaw_data_info *info, size_t offset)
 {
-	MUTEX_LOCK(msg->handle->mtx);
-	while (consumers != NULL) {
-		struct consumer *c = consumers->data;
-		g_async_queue_lock(c->queue.q);
-		message_queue_push_one_unlocked(message_ref(msg), c);
-		g_async_queue_unlock(c->queue.q);
-		consumers = g_slist_next(consumers);
+	unsigned n = message->content.spectra_batch.num_spectra++;
+	((struct vysmaw_data_info *)message->content.spectra_batch.infos)[n] =
+		*info;
+	((size_t *)message->content.spectra_batch.offsets)[n] = offset;
+}
+
+void
+message_queues_stage(struct vysmaw_message *msg, consumer_mask_t consumers,
+                     consumer_mask_t *staged)
+{
+	*staged |= consumers;
+	while (consumers != 0) {
+		unsigned i = __builtin_ctzll(consumers);
+		message_queue_push_one(message_ref(msg), &msg->handle->consumers[i]);
+		consumers &= consumers - 1;
 	}
 	vysmaw_message_unref(msg);
-	MUTEX_UNLOCK(msg->handle->mtx);
+}
+
+void
+message_queues_publish(vysmaw_handle handle, consumer_mask_t staged)
+{
+	while (staged != 0) {
+		unsigned i = __builtin_ctzll(staged);
+		message_queue_publish(&handle->consumers[i].queue);
+		staged &= staged - 1;
+	}
+}
+
+void
+message_queues_push(struct vysmaw_message *msg, consumer_mask_t consumers)
+{
+	vysmaw_handle handle = msg->handle;
+	consumer_mask_t staged = 0;
+	message_queues_stage(msg, consumers, &staged);
+	message_queues_publish(handle, staged);
 }
 
 void
@@ -869,23 +2196,26 @@ mark_signal_receive_failure(vysmaw_handle handle, enum ibv_wc_status status)
 	post_signal_receive_failure(handle, status);
 }
 
+void
+release_valid_buffer_to_pool(struct vysmaw_message *message)
+{
+	struct spectrum_buffer_pool *pool =
+		message->handle->lookup_buffer_pool_fn(message);
+	if (G_LIKELY(pool != NULL)) {
+		spectrum_buffer_pool_push(pool, message_spectrum_buffer(message));
+	} else {
+		struct vysmaw_result *rc = g_new(struct vysmaw_result, 1);
+		rc->code = VYSMAW_ERROR_BUFFPOOL;
+		rc->syserr_desc = g_strdup("");
+		begin_shutdown(message->handle, rc);
+	}
+}
+
 static void
 vysmaw_message_release_buffer(struct vysmaw_message *message)
 {
-	if (message->typ == VYSMAW_MESSAGE_VALID_BUFFER
-	    && message->content.valid_buffer.buffer != NULL) {
-		struct spectrum_buffer_pool *pool =
-			message->handle->lookup_buffer_pool_fn(message);
-		if (G_LIKELY(pool != NULL)) {
-			spectrum_buffer_pool_push(
-				pool, message->content.valid_buffer.buffer);
-		} else {
-			struct vysmaw_result *rc = g_new(struct vysmaw_result, 1);
-			rc->code = VYSMAW_ERROR_BUFFPOOL;
-			rc->syserr_desc = g_strdup("");
-			begin_shutdown(message->handle, rc);
-		}
-	}
+	if (message_spectrum_buffer(message) != NULL)
+		message->handle->release_valid_buffer_fn(message);
 }
 
 static void
@@ -897,11 +2227,152 @@ vysmaw_message_free_syserr_desc(struct vysmaw_message *message)
 }
 
 void
-vysmaw_message_free_resources(struct vysmaw_message *message)
+message_free(struct vysmaw_message *message)
 {
 	vysmaw_message_release_buffer(message);
 	vysmaw_message_free_syserr_desc(message);
-	handle_unref(message->handle);
+	/* the message must be returned to the slab before the handle, which owns
+	 * the slab, is released */
+	vysmaw_handle handle = message->handle;
+	if (G_LIKELY(buffer_pool_contains(handle->message_slab, message)))
+		buffer_pool_push(handle->message_slab, message);
+	else
+		g_slice_free(struct vysmaw_message, message);
+	handle_unref(handle);
+}
+
+/* Move the values whose key equals the first entry's key from 'values' to
+ * 'group', and compact the remaining entries of 'keys' and 'values', returning
+ * the number of values moved. */
+static unsigned
+take_group(void **keys, void **values, unsigned *n, void **group)
+{
+	void *key = keys[0];
+	unsigned result = 0;
+	unsigned m = 0;
+	for (unsigned i = 0; i < *n; ++i) {
+		if (keys[i] == key) {
+			group[result++] = values[i];
+		} else {
+			keys[m] = keys[i];
+			values[m++] = values[i];
+		}
+	}
+	*n = m;
+	return result;
+}
+
+/* Free up to MESSAGE_FREE_BATCH_SIZE messages, as message_free() does, but
+ * return the spectrum buffers of each pool, and the messages of each handle's
+ * slab, in a single push, and release the references to each handle with a
+ * single decrement. Messages normally come from only a few pools and handles,
+ * so that grouping by linear search is adequate. */
+void
+message_free_n(struct vysmaw_message **messages, unsigned n)
+{
+	g_assert(n <= MESSAGE_FREE_BATCH_SIZE);
+	void *keys[MESSAGE_FREE_BATCH_SIZE];
+	void *values[MESSAGE_FREE_BATCH_SIZE];
+	void *group[MESSAGE_FREE_BATCH_SIZE];
+
+	/* spectrum buffers */
+	unsigned num_buffers = 0;
+	for (unsigned i = 0; i < n; ++i) {
+		struct vysmaw_message *message = messages[i];
+		vysmaw_message_free_syserr_desc(message);
+		void *buffer = message_spectrum_buffer(message);
+		if (buffer == NULL) continue;
+		vysmaw_handle handle = message->handle;
+		struct spectrum_buffer_pool *pool = NULL;
+		if (handle->release_valid_buffer_fn == release_valid_buffer_to_pool)
+			pool = handle->lookup_buffer_pool_fn(message);
+		if (G_LIKELY(pool != NULL)) {
+			keys[num_buffers] = pool;
+			values[num_buffers++] = buffer;
+		} else {
+			handle->release_valid_buffer_fn(message);
+		}
+	}
+	while (num_buffers > 0) {
+		struct spectrum_buffer_pool *pool = keys[0];
+		unsigned k = take_group(keys, values, &num_buffers, group);
+		buffer_pool_count_pushed(pool->pool, k);
+		buffer_pool_push_n(pool->pool, group, k);
+		spectrum_buffer_pool_unref_n(pool, k);
+	}
+
+	/* messages, which must be returned to the slab before the handle, which
+	 * owns the slab, is released */
+	for (unsigned i = 0; i < n; ++i) {
+		keys[i] = messages[i]->handle;
+		values[i] = messages[i];
+	}
+	unsigned num_messages = n;
+	while (num_messages > 0) {
+		vysmaw_handle handle = keys[0];
+		unsigned k = take_group(keys, values, &num_messages, group);
+		unsigned num_slab = 0;
+		for (unsigned i = 0; i < k; ++i) {
+			if (G_LIKELY(buffer_pool_contains(handle->message_slab, group[i])))
+				group[num_slab++] = group[i];
+			else
+				g_slice_free(struct vysmaw_message, group[i]);
+		}
+		buffer_pool_push_n(handle->message_slab, group, num_slab);
+		handle_unref_n(handle, k);
+	}
+}
+
+struct ibv_mr *
+register_spectrum_buffer_pool_chunk(struct spectrum_buffer_pool *sb_pool,
+                                    unsigned chunk, struct rdma_cm_id *id,
+                                    struct vys_error_record **error_record)
+{
+	struct ibv_mr *result =
+		rdma_reg_msgs(id, buffer_pool_chunk(sb_pool->pool, chunk),
+		              sb_pool->pool->chunk_size);
+	if (G_UNLIKELY(result == NULL))
+		VERB_ERR(error_record, errno, "rdma_reg_msgs");
+	return result;
+}
+
+void
+deregister_spectrum_buffer_pool(struct spectrum_buffer_pool *sb_pool,
+                                struct ibv_mr **mrs,
+                                struct vys_error_record **error_record)
+{
+	for (unsigned i = 0; i < sb_pool->pool->max_chunks; ++i) {
+		if (mrs[i] != NULL) {
+			int rc = rdma_dereg_mr(mrs[i]);
+			if (G_UNLIKELY(rc != 0))
+				VERB_ERR(error_record, errno, "rdma_dereg_mr");
+		}
+	}
+	g_free(mrs);
+}
+
+/* Register all committed chunks of a spectrum buffer pool, and record the
+ * memory regions, indexed by chunk, in 'mrs'. Only the spectrum_reader thread
+ * commits chunks after a pool is created, so the set of chunks is stable for
+ * the duration of this call when made from that thread. */
+struct ibv_mr **
+register_spectrum_buffer_pool(GHashTable *mrs,
+                              struct spectrum_buffer_pool *sb_pool,
+                              struct rdma_cm_id *id,
+                              struct vys_error_record **error_record)
+{
+	struct ibv_mr **result =
+		g_new0(struct ibv_mr *, sb_pool->pool->max_chunks);
+	for (unsigned i = 0; i < sb_pool->pool->num_chunks; ++i) {
+		result[i] =
+			register_spectrum_buffer_pool_chunk(sb_pool, i, id, error_record);
+		if (G_UNLIKELY(result[i] == NULL)) {
+			deregister_spectrum_buffer_pool(sb_pool, result, error_record);
+			return NULL;
+		}
+	}
+	g_hash_table_insert(mrs, sb_pool, result);
+	return result;
 }
 
 GHashTable *
@@ -911,25 +2382,17 @@ register_spectrum_buffer_pools(vysmaw_handle handle, struct rdma_cm_id *id,
 	GHashTable *result =
 		g_hash_table_new(g_direct_hash, g_direct_equal);
 	GSList *sb_pool_node = handle->list_buffer_pools_fn(handle);
-	int rc = 0;
-	while (result != NULL && sb_pool_node != NULL) {
-		if (G_LIKELY(rc == 0)) {
-			struct spectrum_buffer_pool *sb_pool = sb_pool_node->data;
-			struct ibv_mr *mr = rdma_reg_msgs(
-				id, sb_pool->pool->pool, sb_pool->pool->pool_size);
-			if (G_LIKELY(mr != NULL)) {
-				g_hash_table_insert(result, sb_pool, mr);
-			} else {
-				VERB_ERR(error_record, errno, "rdma_reg_msgs");
-				rc = -1;
+	while (sb_pool_node != NULL) {
+		if (G_LIKELY(result != NULL)) {
+			struct ibv_mr **mrs = register_spectrum_buffer_pool(
+				result, sb_pool_node->data, id, error_record);
+			if (G_UNLIKELY(mrs == NULL)) {
 				GList *keys = g_hash_table_get_keys(result);
 				while (keys != NULL) {
-					int rc1 =
-						rdma_dereg_mr(
-							(struct ibv_mr *)g_hash_table_lookup(
-								result, keys->data));
-					if (G_UNLIKELY(rc1 != 0))
-						VERB_ERR(error_record, errno, "rdma_dereg_mr");
+					deregister_spectrum_buffer_pool(
+						keys->data, g_hash_table_lookup(result, keys->data),
+						error_record);
+					keys = g_list_delete_link(keys, keys);
 				}
 				g_hash_table_destroy(result);
 				result = NULL;
@@ -46,6 +46,11 @@
 # define COND_CLEAR(c) g_cond_clear(&(c))
 # define COND_WAIT(c, m) g_cond_wait(&(c), &(m))
 # define COND_SIGNAL(c) g_cond_signal(&(c))
+# define COND_WAIT_UNTIL(c, m, t) g_cond_wait_until(&(c), &(m), (t))
+# define Private GPrivate
+# define PRIVATE_INIT(notify) G_PRIVATE_INIT(notify)
+# define PRIVATE_GET(p) g_private_get(&(p))
+# define PRIVATE_SET(p, v, notify) g_private_set(&(p), (v))
 #else
 # define THREAD_INIT g_thread_init(NULL)
 # define THREAD_NEW(name, func, data) ({                                \
@@ -71,20 +76,40 @@
 # define COND_CLEAR(c) { if ((c) != NULL) g_cond_free(c); }
 # define COND_WAIT(c, m) { if ((c) != NULL && (m) != NULL) g_cond_wait(c, m); }
 # define COND_SIGNAL(c) { if ((c) != NULL) g_cond_signal(c); }
+# define COND_WAIT_UNTIL(c, m, t) ({                                     \
+			GTimeVal _tv; \
+			g_get_current_time(&_tv); \
+			g_time_val_add(&_tv, (t) - g_get_monotonic_time()); \
+			g_cond_timed_wait((c), (m), &_tv); })
+# define Private GStaticPrivate
+# define PRIVATE_INIT(notify) G_STATIC_PRIVATE_INIT
+# define PRIVATE_GET(p) g_static_private_get(&(p))
+# define PRIVATE_SET(p, v, notify) g_static_private_set(&(p), (v), (notify))
 #endif
 
 /* vysmaw configuration file keys */
 #define VYSMAW_CONFIG_GROUP_NAME "vysmaw"
 #define SPECTRUM_BUFFER_POOL_SIZE_KEY "spectrum_buffer_pool_size"
+#define SPECTRUM_BUFFER_POOL_MAX_SIZE_KEY "spectrum_buffer_pool_max_size"
+#define SPECTRUM_BUFFER_POOL_IDLE_RELEASE_SEC_KEY \
+	"spectrum_buffer_pool_idle_release_sec"
 #define SINGLE_SPECTRUM_BUFFER_POOL_KEY "single_spectrum_buffer_pool"
 #define MAX_SPECTRUM_BUFFER_SIZE_KEY "max_spectrum_buffer_size"
+#define SPECTRUM_BUFFER_MAGAZINE_SIZE_KEY "spectrum_buffer_magazine_size"
+#define SPECTRUM_BUFFER_ALIGNMENT_KEY "spectrum_buffer_alignment"
 #define SIGNAL_MESSAGE_POOL_SIZE_KEY "signal_message_pool_size"
+#define BUFFER_POOL_HUGE_PAGE_SIZE_KEY "buffer_pool_huge_page_size"
+#define NUMA_NODE_KEY "numa_node"
 #define EAGER_CONNECT_KEY "eager_connect"
 #define EAGER_CONNECT_IDLE_SEC_KEY "eager_connect_idle_sec"
 #define PRECONNECT_BACKLOG_KEY "preconnect_backlog"
 #define MAX_DEPTH_MESSAGE_QUEUE_KEY "max_depth_message_queue"
 #define QUEUE_RESUME_OVERHEAD_KEY "queue_resume_overhead"
 #define MAX_STARVATION_LATENCY_KEY "max_starvation_latency"
+#define SPECTRUM_BUFFER_POOL_PRESSURE_THRESHOLD_KEY \
+	"spectrum_buffer_pool_pressure_threshold"
+#define SPECTRUM_BUFFER_POOL_PRESSURE_HYSTERESIS_KEY \
+	"spectrum_buffer_pool_pressure_hysteresis"
 #define RESOLVE_ROUTE_TIMEOUT_MS_KEY "resolve_route_timeout_ms"
 #define RESOLVE_ADDR_TIMEOUT_MS_KEY "resolve_addr_timeout_ms"
 #define INACTIVE_SERVER_TIMEOUT_SEC_KEY "inactive_server_timeout_sec"
@@ -93,19 +118,110 @@
 #define SIGNAL_RECEIVE_MIN_ACK_PART_KEY "signal_receive_min_ack_part"
 #define RDMA_READ_MAX_POSTED_KEY "rdma_read_max_posted"
 #define RDMA_READ_MIN_ACK_PART_KEY "rdma_read_min_ack_part"
+#define SHM_NAME_KEY "shm_name"
+#define SHM_BUFFER_POOL_SIZE_KEY "shm_buffer_pool_size"
+#define SHM_MAX_CLIENTS_KEY "shm_max_clients"
+#define SHM_CLIENT_QUEUE_LENGTH_KEY "shm_client_queue_length"
+#define SELECTION_BASELINES_KEY "selection_baselines"
+#define SELECTION_SPECTRAL_WINDOWS_KEY "selection_spectral_windows"
+#define SELECTION_STOKES_KEY "selection_stokes"
+#define SELECTION_START_TIME_KEY "selection_start_time"
+#define SELECTION_END_TIME_KEY "selection_end_time"
 
+/* A message queue is a single-producer/single-consumer ring of message
+ * pointers. The producer is the spectrum_reader thread (or, should the
+ * service threads fail to start, the thread calling vysmaw_start()), the
+ * consumer the client thread popping the queue. Queue depth is the difference
+ * of the producer's 'pending_tail' and the consumer's 'head' positions. The
+ * producer stages messages, and makes them visible to the consumer in batches
+ * with message_queue_publish(). A consumer that must block sets 'parked'
+ * before waiting on 'cond', or before polling 'fd'; the producer signals the
+ * consumer, taking 'mtx', only when it finds the consumer parked. Under the
+ * VYSMAW_OVERFLOW_DROP_OLDEST policy, or with a maximum message age, the
+ * producer may also advance 'head', so then ('shared_head') both sides update
+ * it with a compare-and-swap. */
 struct _vysmaw_message_queue {
-	GAsyncQueue *q;
-	unsigned depth;
+	int refcount;
+	unsigned mask;
+	struct vysmaw_message **ring;
+	int parked;
+	Mutex mtx;
+	Cond cond;
+	int fd; // eventfd, created on demand by message_queue_fd()
+	vysmaw_handle handle;
+	enum vysmaw_overflow_policy overflow_policy;
+	unsigned sample_interval;
+	gint64 max_message_age;
+	enum vysmaw_message_age_reference message_age_reference;
+	/* by ring position, the time from which the age of the message is
+	 * measured, or G_MAXINT64 if it does not expire; written only by the
+	 * producer, so that expiry may be tested without dereferencing a message
+	 * that the other side may already have removed and released */
+	gint64 *age_times;
+	bool shared_head;
+	unsigned num_expired_unreported; // expired by producer, not yet reported
+	guint64 num_expired;
+	vysmaw_message_callback callback; // for spectrum messages, if not NULL
+	void *callback_data;
+	gint64 callback_time_limit;
+	guint64 num_callback_overruns;
+	guint64 max_callback_time;
+
+	/* producer state; messages at positions from 'tail' up to 'pending_tail'
+	 * are staged, but not yet visible to the consumer */
+	guint64 tail __attribute__((aligned(64)));
+	guint64 pending_tail;
 	unsigned num_overflow;
+	unsigned sample_count;
+	guint64 num_dropped_newest;
+	guint64 num_dropped_oldest;
+	guint64 num_sampled_out;
+
+	/* consumer state */
+	guint64 head __attribute__((aligned(64)));
 };
 
+/* Buffers in a spectrum_buffer_pool may be held in per-thread caches
+ * ("magazines") of up to 'magazine_size' buffers. Every buffer that is not on
+ * the shared pool stack, whether in use or held in a magazine, holds a
+ * reference to the spectrum_buffer_pool. Once the pool is retired (no new
+ * buffers are expected to be taken from it), 'pool' is freed, and set to NULL,
+ * as soon as only buffers held in magazines remain. */
 struct spectrum_buffer_pool {
 	int refcount;
+	unsigned magazine_size;
 	struct buffer_pool *pool;
+
+	/* elastic pool state; growth is requested by any thread that finds the
+	 * pool empty, but chunks are committed and released only by the
+	 * spectrum_reader thread (which leaves their memory registration to a
+	 * helper thread) */
+	bool grow_requested;
+	bool grow_failed;
+	gint64 last_starvation_time; // monotonic time of last starvation or growth
+
+	/* non-zero while the spectrum_reader thread is waiting for all buffers of
+	 * the last chunk to be returned, so that it can release the chunk;
+	 * changed on every attempt to release the chunk */
+	unsigned shrink_request;
+
+	bool under_pressure; // accessed only by the spectrum_reader thread
+	bool chunk_job_pending; // accessed only by the spectrum_reader thread
 };
 
-typedef GSequence *spectrum_buffer_pool_collection;
+/* A spectrum buffer pool collection is a fixed table of pools, one for every
+ * power-of-two size class of spectrum buffers between
+ * 2^SPECTRUM_BUFFER_MIN_SIZE_CLASS_LOG2 and
+ * 2^SPECTRUM_BUFFER_MAX_SIZE_CLASS_LOG2 bytes (the latter accommodating the
+ * largest possible spectrum). Pools are created on demand; lookups are
+ * lock-free, while creation requires the handle's pool_collection_mtx. A pool,
+ * once in the table, remains there for the lifetime of the collection. */
+#define SPECTRUM_BUFFER_MIN_SIZE_CLASS_LOG2 6
+#define SPECTRUM_BUFFER_MAX_SIZE_CLASS_LOG2 19
+#define SPECTRUM_BUFFER_NUM_SIZE_CLASSES                                \
+	(SPECTRUM_BUFFER_MAX_SIZE_CLASS_LOG2 - SPECTRUM_BUFFER_MIN_SIZE_CLASS_LOG2 + 1)
+
+typedef struct spectrum_buffer_pool **spectrum_buffer_pool_collection;
 typedef void *pool_id_t;
 
 typedef void *(*new_valid_buffer)(vysmaw_handle handle, size_t buffer_size,
@@ -113,12 +229,22 @@ typedef void *(*new_valid_buffer)(vysmaw_handle handle, size_t buffer_size,
 typedef struct spectrum_buffer_pool *(*lookup_buffer_pool)(
 	struct vysmaw_message *message);
 typedef GSList *(*list_buffer_pools)(vysmaw_handle handle);
+typedef void (*release_valid_buffer)(struct vysmaw_message *message);
 
+/* The shards of a sharded consumer occupy consecutive elements of the handle's
+ * consumers array. Only the first shard has a filter, and its 'num_shards' is
+ * the number of shards; for every other shard, 'num_shards' is zero. */
 struct consumer {
 	struct _vysmaw_message_queue queue;
 	vysmaw_spectrum_filter spectrum_filter_fn;
+	vysmaw_spectrum_batch_filter spectrum_batch_filter_fn;
+	struct vysmaw_spectrum_selection *selection;
 	GArray *pass_filter_array;
 	void *user_data;
+	unsigned num_shards;
+	enum vysmaw_shard_distribution shard_distribution;
+	unsigned next_shard; // for round-robin distribution, by spectrum_selector
+	bool batch_spectra;
 };
 
 struct service_gate {
@@ -143,6 +269,7 @@ struct _vysmaw_handle {
 	new_valid_buffer new_valid_buffer_fn;
 	lookup_buffer_pool lookup_buffer_pool_fn;
 	list_buffer_pools list_buffer_pools_fn;
+	release_valid_buffer release_valid_buffer_fn;
 	union {
 		struct {
 			Mutex pool_collection_mtx;
@@ -152,18 +279,52 @@ struct _vysmaw_handle {
 	};
 	unsigned num_data_buffers_unavailable;
 	unsigned num_signal_buffers_unavailable;
+	bool spectrum_buffer_pool_grow_requested; // for spectrum_reader thread
+
+	/* preallocated vysmaw_message instances */
+	struct buffer_pool *message_slab;
+
+	/* signal message buffer pool, created by the signal_receiver thread */
+	struct buffer_pool *signal_msg_buffers;
+
+	/* NUMA node of buffer pools and service threads, or -1 if none; set by
+	 * signal_receiver thread before it signals readiness */
+	int numa_node;
 
 	/* message consumers */
 	unsigned num_consumers;
 	struct consumer *consumers;
 
+	/* attachment to an exporting instance, or NULL (see vysmaw_attach()) */
+	struct shm_attachment *shm;
+
 	/* service threads */
 	struct service_gate gate;
 	GThread *signal_receiver_thread;
 	GThread *spectrum_selector_thread;
 	GThread *spectrum_reader_thread;
+	GThread *shm_client_thread;
 };
 
+/* set of consumers, as a bit mask indexed by position in the handle's consumers
+ * array */
+typedef guint64 consumer_mask_t;
+
+G_STATIC_ASSERT(VYSMAW_MAX_CONSUMERS <= 8 * sizeof(consumer_mask_t));
+
+/* set of consumers with 'batch_spectra' set */
+static inline consumer_mask_t
+batch_spectra_consumers(vysmaw_handle handle)
+{
+	consumer_mask_t result = 0;
+	for (unsigned i = 0; i < handle->num_consumers; ++i)
+		if (handle->consumers[i].batch_spectra)
+			result |= (consumer_mask_t)1 << i;
+	return result;
+}
+
+struct data_path_message_ring;
+
 struct data_path_message {
 	enum {
 		DATA_PATH_SIGNAL_MSG,
@@ -173,45 +334,77 @@ struct data_path_message {
 		DATA_PATH_END
 	} typ;
 	size_t message_size;
+	struct data_path_message_ring *ring; // NULL if not allocated from a ring
+	int in_use; // ring slots only
 	union {
 		enum ibv_wc_status wc_status;
 		struct vys_error_record *error_record;
 		struct {
 			struct vys_signal_msg *signal_msg;
-			GSList *consumers[];
+			consumer_mask_t consumers[]; // per spectrum
 		};
 	};
 };
 
+/* Preallocated data_path_message slots. Slots are taken in order, only by the
+ * signal_receiver thread, but may be released by any thread, in any order; when
+ * the next slot is still in use, the message is allocated from the heap. Since
+ * messages mostly flow through the pipeline in order, nearly all messages are
+ * taken from the ring. */
+struct data_path_message_ring {
+	unsigned num_slots;
+	unsigned next;
+	size_t slot_size;
+	unsigned max_spectra_per_signal;
+	void *slots;
+};
+
 extern char *config_vysmaw_base(void)
 	__attribute__((malloc,returns_nonnull));
 extern void init_from_key_file_vysmaw(
 	GKeyFile *kf, struct vysmaw_configuration *config)
 	__attribute__((nonnull));
+extern bool spectrum_selection_init(
+	struct vysmaw_spectrum_selection *selection,
+	const struct vysmaw_configuration *config)
+	__attribute__((nonnull));
+extern void spectrum_selection_set_indexes(
+	uint64_t *set, const uint8_t *indexes, unsigned num_indexes)
+	__attribute__((nonnull(1)));
+extern void spectrum_selection_set_baselines(
+	uint64_t *set, const uint8_t (*stations)[2], unsigned num_baselines)
+	__attribute__((nonnull(1)));
 
 extern vysmaw_handle handle_ref(vysmaw_handle handle)
 	__attribute__((nonnull,returns_nonnull));
 extern void handle_unref(vysmaw_handle handle)
 	__attribute__((nonnull));
+extern void handle_unref_n(vysmaw_handle handle, unsigned n)
+	__attribute__((nonnull));
 extern vysmaw_message_queue message_queue_ref(vysmaw_message_queue queue)
 	__attribute__((nonnull,returns_nonnull));
 extern void message_queue_unref(vysmaw_message_queue queue)
 	__attribute__((nonnull));
+extern void message_queue_unref_n(vysmaw_message_queue queue, unsigned n)
+	__attribute__((nonnull));
 extern struct spectrum_buffer_pool *spectrum_buffer_pool_new(
-	size_t buffer_size, size_t num_buffers)
+	size_t buffer_size, size_t alignment, size_t num_buffers,
+	unsigned max_chunks, unsigned magazine_size, size_t huge_page_size)
 	__attribute__((malloc,returns_nonnull));
 extern struct spectrum_buffer_pool *spectrum_buffer_pool_ref(
 	struct spectrum_buffer_pool *pool)
 	__attribute__((nonnull,returns_nonnull));
 extern void spectrum_buffer_pool_unref(struct spectrum_buffer_pool *buffer_pool)
 	__attribute__((nonnull));
+extern void spectrum_buffer_pool_retire(struct spectrum_buffer_pool *buffer_pool)
+	__attribute__((nonnull));
+extern void spectrum_buffer_cache_flush(struct spectrum_buffer_pool *buffer_pool)
+	__attribute__((nonnull));
 extern void *spectrum_buffer_pool_pop(struct spectrum_buffer_pool *buffer_pool)
 	__attribute__((nonnull));
 extern void spectrum_buffer_pool_push(
 	struct spectrum_buffer_pool *buffer_pool, void *buffer)
 	__attribute__((nonnull));
-extern int compare_pool_buffer_sizes(
-	const void *a, const void *b, void *unused __attribute__((unused)));
 extern spectrum_buffer_pool_collection spectrum_buffer_pool_collection_new(
 	void)
 	__attribute__((returns_nonnull,malloc));
@@ -220,29 +413,42 @@ extern void spectrum_buffer_pool_collection_free(
 	__attribute__((nonnull));
 extern struct spectrum_buffer_pool *spectrum_buffer_pool_collection_add(
 	spectrum_buffer_pool_collection collection, size_t buffer_size,
-	size_t num_buffers)
-	__attribute__((nonnull,returns_nonnull,malloc));
-extern GSequenceIter *spectrum_buffer_pool_collection_lookup_iter(
-	spectrum_buffer_pool_collection collection, size_t buffer_size)
-	__attribute__((nonnull));
+	size_t alignment, size_t pool_size, unsigned max_chunks,
+	unsigned magazine_size, size_t huge_page_size)
+	__attribute__((nonnull,returns_nonnull));
 extern struct spectrum_buffer_pool *spectrum_buffer_pool_collection_lookup(
 	spectrum_buffer_pool_collection collection, size_t buffer_size)
 	__attribute__((nonnull));
-extern void spectrum_buffer_pool_collection_remove(
-	spectrum_buffer_pool_collection collection, size_t buffer_size)
-	__attribute__((nonnull));
 extern void *new_valid_buffer_from_collection(
 	vysmaw_handle handle, size_t buffer_size, pool_id_t *pool_id)
 	__attribute__((nonnull));
 extern void *new_valid_buffer_from_pool(
 	vysmaw_handle handle, size_t buffer_size, pool_id_t *pool_id)
 	__attribute__((nonnull));
-extern void message_queue_force_push_one_unlocked(
+extern unsigned message_queue_capacity(
+	const struct vysmaw_configuration *config)
+	__attribute__((nonnull,pure));
+extern void message_queue_force_push_one(
 	struct vysmaw_message *msg, vysmaw_message_queue queue)
 	__attribute__((nonnull));
-extern void message_queue_push_one_unlocked(
+extern void message_queue_push_one(
 	struct vysmaw_message *msg, struct consumer *consumer)
 	__attribute__((nonnull));
+extern void message_queue_publish(vysmaw_message_queue queue)
+	__attribute__((nonnull));
+extern unsigned message_queue_try_pop_batch(
+	vysmaw_message_queue queue, struct vysmaw_message **msgs, unsigned max)
+	__attribute__((nonnull));
+extern struct vysmaw_message *message_queue_try_pop(
+	vysmaw_message_queue queue)
+	__attribute__((nonnull));
+extern bool message_queue_wait(vysmaw_message_queue queue, gint64 end_time)
+	__attribute__((nonnull));
+extern int message_queue_fd(vysmaw_message_queue queue)
+	__attribute__((nonnull));
+extern void message_queue_get_status(
+	vysmaw_message_queue queue, struct vysmaw_message_queue_status *status)
+	__attribute__((nonnull));
 extern void begin_shutdown(vysmaw_handle handle, struct vysmaw_result *rc)
 	__attribute__((nonnull(1)));
 extern void get_shutdown_parameters(
@@ -258,31 +464,48 @@ extern struct spectrum_buffer_pool *lookup_buffer_pool_from_pool(
 	struct vysmaw_message *message)
 	__attribute__((nonnull));
 extern GSList *buffer_pool_list_from_collection(vysmaw_handle handle)
-	__attribute__((nonnull,returns_nonnull,malloc));
+	__attribute__((nonnull,malloc));
 extern GSList *buffer_pool_list_from_pool(vysmaw_handle handle)
 	__attribute__((nonnull,returns_nonnull,malloc));
+extern void release_valid_buffer_to_pool(struct vysmaw_message *message)
+	__attribute__((nonnull));
 extern void init_consumer(
-	vysmaw_spectrum_filter filter, void *user_data,
-	vysmaw_message_queue *queue, GArray *consumers)
+	vysmaw_handle handle, struct vysmaw_consumer *consumer, GArray *consumers)
 	__attribute__((nonnull));
 extern void init_signal_receiver(
-	vysmaw_handle handle, GAsyncQueue *signal_msg_queue,
+	vysmaw_handle handle, struct async_queue **signal_msg_queue,
 	struct buffer_pool **signal_msg_buffers,
+	struct data_path_message_ring **data_path_msgs,
 	unsigned *signal_msg_num_spectra, int loop_fd)
 	__attribute__((nonnull));
 extern void init_spectrum_selector(
-	vysmaw_handle handle, GAsyncQueue *signal_msg_queue,
+	vysmaw_handle handle, struct async_queue *signal_msg_queue,
 	struct async_queue *read_request_queue,
 	struct buffer_pool *signal_msg_buffers,
 	unsigned signal_msg_num_spectra)
 	__attribute__((nonnull));
 extern void init_spectrum_reader(
 	vysmaw_handle handle, struct async_queue *read_request_queue,
-	struct buffer_pool *signal_msg_buffers, unsigned signal_msg_num_spectra,
-	int loop_fd)
-	__attribute__((nonnull));
+	struct buffer_pool *signal_msg_buffers,
+	struct data_path_message_ring *data_path_msgs,
+	unsigned signal_msg_num_spectra, int loop_fd)
+	__attribute__((nonnull(1,2)));
 extern int init_service_threads(vysmaw_handle handle)
 	__attribute__((nonnull));
+extern void init_shm_client(vysmaw_handle handle)
+	__attribute__((nonnull));
+extern void init_numa_placement(
+	vysmaw_handle handle, struct ibv_context *verbs)
+	__attribute__((nonnull));
+extern void numa_bind_service_thread(vysmaw_handle handle)
+	__attribute__((nonnull));
+extern struct buffer_pool *hot_path_slab_new(
+	const struct vysmaw_configuration *config, size_t object_size)
+	__attribute__((nonnull,returns_nonnull,malloc));
+/* Take an object from a hot-path slab, adding a chunk to the slab if it is
+ * empty, and returning NULL only if the slab has reached its capacity. */
+extern void *hot_path_slab_pop(struct buffer_pool *slab)
+	__attribute__((nonnull));
 extern struct vysmaw_message *message_new(
 	vysmaw_handle handle, enum vysmaw_message_type typ)
 	__attribute__((malloc,nonnull,returns_nonnull));
@@ -295,15 +518,27 @@ extern struct vysmaw_message *signal_buffer_starvation_message_new(
 extern struct vysmaw_message *digest_failure_message_new(
 	vysmaw_handle handle, const struct vysmaw_data_info *info)
 	__attribute__((malloc,returns_nonnull,nonnull));
+extern struct vysmaw_message *rdma_read_failure_message_new(
+	vysmaw_handle handle, enum ibv_wc_status status)
+	__attribute__((malloc,returns_nonnull,nonnull));
 extern struct vysmaw_message *end_message_new(
 	vysmaw_handle handle, struct vysmaw_result *rc)
 	__attribute__((malloc,returns_nonnull,nonnull));
+extern struct vysmaw_message *expired_message_new(
+	vysmaw_handle handle, unsigned num_expired)
+	__attribute__((nonnull,returns_nonnull,malloc));
 extern struct vysmaw_message *queue_overflow_message_new(
 	vysmaw_handle handle, unsigned num_overflow)
 	__attribute__((nonnull,returns_nonnull,malloc));
 extern struct vysmaw_message *signal_receive_failure_message_new(
 	vysmaw_handle handle, enum ibv_wc_status status)
 	__attribute__((nonnull,returns_nonnull,malloc));
+extern struct vysmaw_message *pool_pressure_message_new(
+	vysmaw_handle handle, struct spectrum_buffer_pool *buffer_pool, bool high)
+	__attribute__((nonnull,returns_nonnull,malloc));
+extern void buffer_pool_get_status(
+	struct buffer_pool *buffer_pool, struct vysmaw_buffer_pool_status *status)
+	__attribute__((nonnull));
 extern void post_msg(vysmaw_handle handle, struct vysmaw_message *message)
 	__attribute__((nonnull));
 extern void post_data_buffer_starvation(vysmaw_handle handle)
@@ -313,12 +548,26 @@ extern void post_signal_buffer_starvation(vysmaw_handle handle)
 extern void post_signal_receive_failure(
 	vysmaw_handle handle, enum ibv_wc_status status)
 	__attribute__((nonnull));
-extern void vysmaw_message_free_resources(struct vysmaw_message *message)
+extern void message_free(struct vysmaw_message *message)
+	__attribute__((nonnull));
+
+/* maximum number of messages freed by a single call to message_free_n() */
+#define MESSAGE_FREE_BATCH_SIZE 256
+
+extern void message_free_n(struct vysmaw_message **messages, unsigned n)
 	__attribute__((nonnull));
 
 extern struct data_path_message *data_path_message_new(
 	unsigned max_spectra_per_signal)
 	__attribute__((malloc,returns_nonnull));
+extern struct data_path_message_ring *data_path_message_ring_new(
+	unsigned num_slots, unsigned max_spectra_per_signal)
+	__attribute__((malloc,returns_nonnull));
+extern void data_path_message_ring_free(struct data_path_message_ring *ring)
+	__attribute__((nonnull));
+extern struct data_path_message *data_path_message_ring_next(
+	struct data_path_message_ring *ring)
+	__attribute__((nonnull,returns_nonnull));
 extern void data_path_message_free(struct data_path_message *msg)
 	__attribute__((nonnull));
 
@@ -326,13 +575,25 @@ extern struct vysmaw_message *valid_buffer_message_new(
 	vysmaw_handle handle, const struct vysmaw_data_info *info,
 	pool_id_t *pool_id)
 	__attribute__((nonnull,malloc));
+extern struct vysmaw_message *spectra_batch_message_new(
+	vysmaw_handle handle, unsigned max_spectra, size_t stride,
+	pool_id_t *pool_id)
+	__attribute__((nonnull,malloc));
+extern void spectra_batch_message_append(
+	struct vysmaw_message *message, const struct vysmaw_data_info *info,
+	size_t offset)
+	__attribute__((nonnull));
 
-extern void message_queues_push_unlocked(
-	struct vysmaw_message *msg, GSList *consumers)
-	__attribute__((nonnull(1)));
 extern void message_queues_push(
-	struct vysmaw_message *msg, GSList *consumers)
-	__attribute__((nonnull(1)));
+	struct vysmaw_message *msg, consumer_mask_t consumers)
+	__attribute__((nonnull));
+extern void message_queues_stage(
+	struct vysmaw_message *msg, consumer_mask_t consumers,
+	consumer_mask_t *staged)
+	__attribute__((nonnull));
+extern void message_queues_publish(
+	vysmaw_handle handle, consumer_mask_t staged)
+	__attribute__((nonnull));
 
 extern void mark_data_buffer_starvation(vysmaw_handle handle)
 	__attribute__((nonnull));
@@ -347,10 +608,122 @@ static inline size_t spectrum_size(const struct vysmaw_data_info *info)
 	return 2 * info->num_channels * sizeof(float);
 }
 
+/* Size of the buffer of a VYSMAW_MESSAGE_SPECTRA_BATCH message for up to
+ * 'max_spectra' spectra at intervals of 'stride' bytes: the spectra are
+ * followed by their vysmaw_data_info values and their offsets. */
+static inline size_t
+spectra_batch_buffer_size(unsigned max_spectra, size_t stride)
+{
+	size_t infos_size = max_spectra * sizeof(struct vysmaw_data_info);
+	infos_size = (infos_size + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+	return max_spectra * stride + infos_size + max_spectra * sizeof(size_t);
+}
+
+/* Spectrum buffer held by a message, or NULL */
+static inline void *
+message_spectrum_buffer(const struct vysmaw_message *message)
+{
+	switch (message->typ) {
+	case VYSMAW_MESSAGE_VALID_BUFFER:
+		return message->content.valid_buffer.buffer;
+	case VYSMAW_MESSAGE_SPECTRA_BATCH:
+		return message->content.spectra_batch.buffer;
+	default:
+		return NULL;
+	}
+}
+
+/* Largest spectrum buffer that a handle can provide */
+static inline size_t
+max_spectrum_buffer_size(vysmaw_handle handle)
+{
+	return (handle->config.single_spectrum_buffer_pool
+	        ? handle->config.max_spectrum_buffer_size
+	        : ((size_t)1 << SPECTRUM_BUFFER_MAX_SIZE_CLASS_LOG2));
+}
+
+/* maximum number of chunks, each of size spectrum_buffer_pool_size, in an
+ * elastic spectrum buffer pool */
+static inline unsigned
+spectrum_buffer_pool_max_chunks(const struct vysmaw_configuration *config)
+{
+	return ((config->spectrum_buffer_pool_size > 0)
+	        ? MAX(config->spectrum_buffer_pool_max_size
+	              / config->spectrum_buffer_pool_size, 1)
+	        : 1);
+}
+
+/* number of buffers in one chunk of every spectrum buffer pool of a handle: the
+ * single pool, or the pools of all size classes */
+static inline size_t
+spectrum_buffer_pools_chunk_num_buffers(
+	const struct vysmaw_configuration *config)
+{
+	size_t alignment = MAX(config->spectrum_buffer_alignment, 1);
+	if (config->single_spectrum_buffer_pool)
+		return (config->spectrum_buffer_pool_size
+		        / ((MAX(config->max_spectrum_buffer_size, 1) + alignment - 1)
+		           & ~(alignment - 1)));
+	size_t result = 0;
+	for (unsigned i = SPECTRUM_BUFFER_MIN_SIZE_CLASS_LOG2;
+	     i <= SPECTRUM_BUFFER_MAX_SIZE_CLASS_LOG2;
+	     ++i)
+		result += MAX(config->spectrum_buffer_pool_size
+		              / MAX((size_t)1 << i, alignment), 1);
+	return result;
+}
+
+/* Each of the per-spectrum object slabs (vysmaw_message and rdma_req) grows, a
+ * chunk at a time, as it is exhausted (see hot_path_slab_pop()), up to a
+ * capacity sufficient for every buffer of every spectrum buffer pool grown to
+ * its maximum size, plus the posted reads of HOT_PATH_SLAB_MAX_CONNECTIONS
+ * connections. Only address space is reserved for the chunks that are not yet
+ * needed. */
+#define HOT_PATH_SLAB_MAX_CONNECTIONS 64
+
+static inline size_t
+hot_path_slab_chunk_size(const struct vysmaw_configuration *config)
+{
+	return MAX(config->spectrum_buffer_pool_size
+	           / MAX(config->max_spectrum_buffer_size, 1)
+	           + config->rdma_read_max_posted, 1);
+}
+
+static inline size_t
+hot_path_slab_capacity(const struct vysmaw_configuration *config)
+{
+	return (spectrum_buffer_pools_chunk_num_buffers(config)
+	        * spectrum_buffer_pool_max_chunks(config)
+	        + (size_t)config->rdma_read_max_posted
+	        * HOT_PATH_SLAB_MAX_CONNECTIONS);
+}
+
+static inline int
+spectrum_buffer_size_class(size_t buffer_size)
+{
+	int result =
+		MAX((int)g_bit_storage(buffer_size - 1),
+		    SPECTRUM_BUFFER_MIN_SIZE_CLASS_LOG2)
+		- SPECTRUM_BUFFER_MIN_SIZE_CLASS_LOG2;
+	return ((result < SPECTRUM_BUFFER_NUM_SIZE_CLASSES) ? result : -1);
+}
+
 extern GHashTable *register_spectrum_buffer_pools(
 	vysmaw_handle handle, struct rdma_cm_id *id,
 	struct vys_error_record **error_record)
 	__attribute__((nonnull));
+extern struct ibv_mr **register_spectrum_buffer_pool(
+	GHashTable *mrs, struct spectrum_buffer_pool *sb_pool,
+	struct rdma_cm_id *id, struct vys_error_record **error_record)
+	__attribute__((nonnull));
+extern struct ibv_mr *register_spectrum_buffer_pool_chunk(
+	struct spectrum_buffer_pool *sb_pool, unsigned chunk,
+	struct rdma_cm_id *id, struct vys_error_record **error_record)
+	__attribute__((nonnull));
+extern void deregister_spectrum_buffer_pool(
+	struct spectrum_buffer_pool *sb_pool, struct ibv_mr **mrs,
+	struct vys_error_record **error_record)
+	__attribute__((nonnull));
 
 extern unsigned sockaddr_hash(
 	const struct sockaddr_in *sockaddr)